@@ -0,0 +1,53 @@
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+bool parse_cpu_list(const char* text, std::vector<int>* cpus) {
+    cpus->clear();
+    const char* p = text;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus->push_back((int)cpu);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p) {
+            return false;
+        }
+    }
+    return !cpus->empty();
+}
+
+bool pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int current_numa_node() {
+    unsigned cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+    return (int)node;
+}
@@ -0,0 +1,22 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <vector>
+
+// 线程绑定 CPU 和 NUMA 节点相关的辅助函数
+//
+// 内存在第一次被访问时才分配物理页, 并且分配在访问它的 CPU 所在的 NUMA 节点上 (first touch)
+// 所以只要线程先绑定到 CPU 再分配和初始化自己的数据 (连接对象, 缓冲区, arena), 这些内存就在本地节点上,
+// 不需要 libnuma; 跨节点的访问只剩下线程之间交接连接时不可避免的那一部分
+
+// 解析 "0-3,8,10-11" 形式的 CPU 列表, 格式错误时返回 false
+bool parse_cpu_list(const char* text, std::vector<int>* cpus);
+
+// 把当前线程绑定到 cpu 上, 失败时 (例如 CPU 不存在或者不在允许的范围内) 返回 false
+bool pin_thread(int cpu);
+
+// 当前线程正在运行的 CPU 所在的 NUMA 节点, 没有 NUMA 的机器上总是 0
+// 没有绑定 CPU 的线程随时可能被调度到其他节点, 结果只是一个提示
+int current_numa_node();
+
+#endif
@@ -0,0 +1,136 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "locker.h"
+
+// 所有线程的 arena, 只有创建, 销毁和输出统计信息时访问
+struct ArenaRegistry {
+    Locker locker;
+    std::vector<Arena*> arenas;
+};
+
+static ArenaRegistry& registry() {
+    static ArenaRegistry instance;
+    return instance;
+}
+
+static thread_local Arena t_arena;
+
+// 内存块的头部之后就是数据, 头部的大小向上取整, 保证数据按 MAX_ALIGN 对齐
+static const size_t BLOCK_HEADER = 32;
+
+Arena::Arena(): m_head(NULL), m_current(NULL), m_offset(0), m_used_before(0),
+    m_reserved(0), m_high_water(0), m_blocks(0) {
+    ArenaRegistry& reg = registry();
+    reg.locker.lock();
+    reg.arenas.push_back(this);
+    reg.locker.unlock();
+}
+
+Arena::~Arena() {
+    ArenaRegistry& reg = registry();
+    reg.locker.lock();
+    reg.arenas.erase(std::find(reg.arenas.begin(), reg.arenas.end(), this));
+    reg.locker.unlock();
+
+    while (m_head) {
+        Block* block = m_head;
+        m_head = block->next;
+        free(block);
+    }
+}
+
+Arena* Arena::local() {
+    return &t_arena;
+}
+
+void* Arena::alloc_slow(size_t size, size_t align) {
+    // 当前内存块放不下: 后面有上一轮申请过的足够大的内存块就直接用它, 否则申请一个新的插在当前内存块后面
+    Block* next = m_current ? m_current->next : m_head;
+    if (!next || next->size < size + align) {
+        size_t block_size = size + align > BLOCK_SIZE ? size + align : BLOCK_SIZE;
+        Block* block = (Block*)malloc(BLOCK_HEADER + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->data = (char*)block + BLOCK_HEADER;
+        if (m_current) {
+            block->next = m_current->next;
+            m_current->next = block;
+        } else {
+            block->next = m_head;
+            m_head = block;
+        }
+        next = block;
+        m_reserved.store(m_reserved.load(std::memory_order_relaxed) + block_size, std::memory_order_relaxed);
+        m_blocks.store(m_blocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    if (m_current) {
+        m_used_before += m_offset;
+    }
+    m_current = next;
+    m_offset = 0;
+    return alloc(size, align);
+}
+
+char* Arena::dup(const char* text, size_t len) {
+    char* copy = (char*)alloc(len + 1, 1);
+    if (copy) {
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void Arena::reset() {
+    size_t bytes = used();
+    if (bytes > m_high_water.load(std::memory_order_relaxed)) {
+        m_high_water.store(bytes, std::memory_order_relaxed);
+    }
+    m_current = m_head;
+    m_offset = 0;
+    m_used_before = 0;
+}
+
+size_t Arena::used() const {
+    return m_used_before + m_offset;
+}
+
+size_t Arena::total_reserved() {
+    ArenaRegistry& reg = registry();
+    size_t total = 0;
+    reg.locker.lock();
+    for (Arena* arena : reg.arenas) {
+        total += arena->m_reserved.load(std::memory_order_relaxed);
+    }
+    reg.locker.unlock();
+    return total;
+}
+
+size_t Arena::max_high_water() {
+    ArenaRegistry& reg = registry();
+    size_t high_water = 0;
+    reg.locker.lock();
+    for (Arena* arena : reg.arenas) {
+        high_water = std::max(high_water, arena->m_high_water.load(std::memory_order_relaxed));
+    }
+    reg.locker.unlock();
+    return high_water;
+}
+
+uint64_t Arena::total_blocks() {
+    ArenaRegistry& reg = registry();
+    uint64_t total = 0;
+    reg.locker.lock();
+    for (Arena* arena : reg.arenas) {
+        total += arena->m_blocks.load(std::memory_order_relaxed);
+    }
+    reg.locker.unlock();
+    return total;
+}
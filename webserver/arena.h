@@ -0,0 +1,100 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// 每个线程一个的线性分配器 (bump allocator), 用于只在处理一个任务期间有效的临时内存
+// 例如解码之后的请求路径, 拼接出来的文件路径, 组装响应时的临时数据
+//
+// 分配只是把当前内存块中的偏移量向后移动, 不加锁也不调用 malloc; 内存不单独释放,
+// 工作线程处理完一个任务之后调用 reset() 一次性归还, reset() 只是回到第一个内存块的开头, 是 O(1) 的
+// 内存块用完之后才向后申请新的内存块, 申请过的内存块一直保留到线程退出, 所以稳定运行时不会再调用 malloc
+//
+// 从 arena 中分配的内存在 reset() 之后就失效了, 不能保存在连接对象中跨任务使用
+// (一个请求可能分几次由不同的工作线程处理, 跨任务的状态仍然要放在连接对象自己的缓冲区中)
+class Arena {
+public:
+ static const size_t BLOCK_SIZE = 64 * 1024;      // 普通内存块的大小, 超过它的分配单独申请一个刚好够用的内存块
+ static const size_t MAX_ALIGN = alignof(max_align_t);
+
+ Arena();
+ ~Arena();
+
+ // 当前线程的 arena, 第一次使用时创建, 线程退出时释放
+ static Arena* local();
+
+ void* alloc(size_t size, size_t align = MAX_ALIGN) {
+     size_t offset = (m_offset + align - 1) & ~(align - 1);
+     if (m_current && offset + size <= m_current->size) {
+         m_offset = offset + size;
+         return m_current->data + offset;
+     }
+     return alloc_slow(size, align);
+ }
+
+ // 拷贝 len 字节并在末尾加上 '\0'
+ char* dup(const char* text, size_t len);
+
+ // 归还所有分配出去的内存, 同时更新高水位
+ void reset();
+
+ size_t used() const;   // 上一次 reset() 之后分配出去的字节数 (包括对齐和内存块末尾浪费的部分)
+
+ // 所有线程的 arena 的统计信息, 供 /metrics 使用
+ static size_t total_reserved();    // 所有 arena 持有的内存块的总字节数
+ static size_t max_high_water();    // 单个任务用掉的最多字节数
+ static uint64_t total_blocks();    // 申请内存块 (调用 malloc) 的总次数, 稳定运行时不再增长
+
+private:
+ Arena(const Arena&);
+ Arena& operator=(const Arena&);
+
+ struct Block {
+     Block* next;
+     size_t size;        // data 的字节数
+     char* data;
+ };
+
+ void* alloc_slow(size_t size, size_t align);
+
+private:
+ Block* m_head;          // 第一个内存块, reset() 之后从这里重新开始
+ Block* m_current;       // 正在分配的内存块
+ size_t m_offset;        // 当前内存块中已经分配的字节数
+ size_t m_used_before;   // 当前内存块之前的内存块用掉的字节数
+
+ // 其他线程 (输出指标时) 会读取, 所以是原子变量, 只有所属的线程修改
+ std::atomic<size_t> m_reserved;
+ std::atomic<size_t> m_high_water;
+ std::atomic<uint64_t> m_blocks;
+};
+
+// 从 arena 分配内存的 STL 分配器, 例如 std::vector<HttpSlice, ArenaAllocator<HttpSlice> >
+// deallocate 什么也不做, 内存在 arena reset() 时统一归还, 所以容器不能活得比当前任务更久
+template <typename T>
+class ArenaAllocator {
+public:
+ typedef T value_type;
+
+ ArenaAllocator(): m_arena(Arena::local()) {}
+ explicit ArenaAllocator(Arena* arena): m_arena(arena) {}
+ template <typename U>
+ ArenaAllocator(const ArenaAllocator<U>& other): m_arena(other.arena()) {}
+
+ T* allocate(size_t n) { return (T*)m_arena->alloc(n * sizeof(T), alignof(T)); }
+ void deallocate(T*, size_t) {}
+
+ Arena* arena() const { return m_arena; }
+
+private:
+ Arena* m_arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() == b.arena(); }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() != b.arena(); }
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// HDR 风格的延迟直方图 (单位: 微秒)
+// 按最高有效位分成若干段, 每段再线性地分成 SUB_BUCKETS 个桶, 任何值的相对误差都不超过 1 / SUB_BUCKETS
+// 记录一个值只是一次数组自增, 多个线程各自记录, 最后用 merge() 合并
+class Histogram {
+public:
+ static const int SUB_BITS = 7;                        // 每段 128 个桶, 相对误差 < 1%
+ static const int SUB_BUCKETS = 1 << SUB_BITS;
+ static const int MAGNITUDES = 64 - SUB_BITS;          // 覆盖全部 64 位的值
+ static const int BUCKETS = (MAGNITUDES + 1) * SUB_BUCKETS;
+
+ Histogram() { reset(); }
+
+ void reset() {
+     memset(m_counts, 0, sizeof(m_counts));
+     m_total = 0;
+     m_sum = 0;
+     m_max = 0;
+     m_min = UINT64_MAX;
+ }
+
+ void record(uint64_t value) {
+     ++m_counts[index_of(value)];
+     ++m_total;
+     m_sum += value;
+     if (value > m_max) {
+         m_max = value;
+     }
+     if (value < m_min) {
+         m_min = value;
+     }
+ }
+
+ void merge(const Histogram& other) {
+     for (int i = 0; i < BUCKETS; ++i) {
+         m_counts[i] += other.m_counts[i];
+     }
+     m_total += other.m_total;
+     m_sum += other.m_sum;
+     if (other.m_max > m_max) {
+         m_max = other.m_max;
+     }
+     if (other.m_min < m_min) {
+         m_min = other.m_min;
+     }
+ }
+
+ // 第 q 分位数 (0 < q <= 1), 返回所在桶的上界
+ uint64_t percentile(double q) const {
+     if (m_total == 0) {
+         return 0;
+     }
+     uint64_t rank = (uint64_t)(q * m_total + 0.5);
+     if (rank == 0) {
+         rank = 1;
+     }
+     uint64_t seen = 0;
+     for (int i = 0; i < BUCKETS; ++i) {
+         seen += m_counts[i];
+         if (seen >= rank) {
+             uint64_t upper = upper_bound(i);
+             return upper < m_max ? upper : m_max;
+         }
+     }
+     return m_max;
+ }
+
+ uint64_t total() const { return m_total; }
+ uint64_t max() const { return m_max; }
+ uint64_t min() const { return m_total ? m_min : 0; }
+ double mean() const { return m_total ? (double)m_sum / m_total : 0; }
+
+private:
+ // 小于 SUB_BUCKETS 的值每个值一个桶, 更大的值按最高位所在的段分桶
+ static int index_of(uint64_t value) {
+     if (value < (uint64_t)SUB_BUCKETS) {
+         return (int)value;
+     }
+     int msb = 63 - __builtin_clzll(value);
+     int shift = msb - SUB_BITS + 1;
+     int magnitude = shift;                                   // 第几段, 从 1 开始
+     int sub = (int)(value >> shift) - SUB_BUCKETS / 2;       // 段内的位置
+     return SUB_BUCKETS + (magnitude - 1) * (SUB_BUCKETS / 2) + sub;
+ }
+
+ static uint64_t upper_bound(int index) {
+     if (index < SUB_BUCKETS) {
+         return index;
+     }
+     int magnitude = (index - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+     int sub = (index - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+     return (((uint64_t)sub + 1) << magnitude) - 1;
+ }
+
+private:
+ uint64_t m_counts[BUCKETS];
+ uint64_t m_total;
+ uint64_t m_sum;
+ uint64_t m_max;
+ uint64_t m_min;
+};
+
+#endif
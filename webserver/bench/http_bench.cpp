@@ -0,0 +1,607 @@
+// HTTP 压测工具: 同时打开大量的连接, 按照给定的请求组合不断发送请求, 统计吞吐量和延迟分布
+//
+// 编译: make http_bench (或者 g++ -O2 -std=c++17 -o http_bench bench/http_bench.cpp -lpthread)
+// 例子: ./http_bench -p 10000 -c 2000 -t 4 -d 30 -u "/index.html:8,/big.bin:1" -o result.json
+//       ./http_bench -p 10000 -S "./server 10000 -r ./resources" -K
+//
+// 每个线程有自己的 epoll 对象, 负责一部分连接, 每个连接上同一时间只有一个请求 (没有流水线)
+// 延迟从请求的第一个字节发出开始计算, 到响应的最后一个字节收到为止; 短连接模式下包含建立连接的时间
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+#define MAX_EVENT_NUMBER 4096
+#define RESPONSE_HEADER_MAX 8192
+
+// 压测的参数
+struct BenchConfig {
+    const char* host;
+    int port;
+    int connections;            // 并发连接数
+    int threads;                // 压测线程数
+    int duration;               // 压测时长 (秒)
+    int warmup;                 // 预热时长 (秒), 这段时间内的结果不统计
+    bool keep_alive;            // true: 保持连接; false: 每个请求一个新连接
+    std::vector<std::string> paths;   // 请求组合中的路径, 例如 "/a:3,/b:1" 中的 /a 和 /b
+    std::vector<int> weights;         // 累计权重, 例如 "/a:3,/b:1" 对应 3 4
+    const char* output;         // JSON 结果输出到这个文件, NULL 表示输出到标准输出
+    const char* server_cmd;     // 压测开始前启动的服务器命令
+};
+
+// 每个路径的统计
+struct PathStats {
+    uint64_t requests;
+    uint64_t errors;
+    Histogram latency;
+};
+
+// 连接的状态
+enum CONN_STATE {
+    CONN_CONNECTING = 0,   // 非阻塞 connect 还没有完成
+    CONN_SENDING,          // 正在发送请求
+    CONN_RECEIVING         // 正在接收响应
+};
+
+struct BenchConn {
+    int fd;
+    CONN_STATE state;
+    int path;                      // 当前请求的路径在 paths 中的下标
+    std::string request;           // 当前请求的报文
+    size_t sent;                   // 已经发送的字节数
+    char header[RESPONSE_HEADER_MAX];
+    int header_len;                // 已经收到的响应头字节数
+    bool header_done;              // 响应头是否已经收完
+    long long body_left;           // 响应体还剩多少字节
+    bool server_close;             // 服务器要求关闭连接
+    int status;                    // 响应的状态码
+    uint64_t start_us;             // 请求开始的时间
+};
+
+// 每个压测线程的结果
+struct ThreadResult {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];            // 1xx ~ 5xx, [0] 表示没有解析出状态码
+    Histogram latency;
+    std::vector<PathStats*> per_path;
+};
+
+static BenchConfig g_config;
+static struct sockaddr_in g_address;
+static volatile bool g_recording = false;   // 预热结束之后为 true
+static volatile bool g_stop = false;         // 压测结束之后为 true
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void setnonblocking(int fd) {
+    int old_flag = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, old_flag | O_NONBLOCK);
+}
+
+// 解析请求组合 "/a:3,/b:1", 权重省略时为 1
+static bool parse_paths(const char* spec, std::vector<std::string>& paths, std::vector<int>& weights) {
+    std::string s(spec);
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        std::string item = s.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        if (!item.empty()) {
+            int weight = 1;
+            size_t colon = item.rfind(':');
+            if (colon != std::string::npos) {
+                weight = atoi(item.c_str() + colon + 1);
+                item = item.substr(0, colon);
+            }
+            if (item.empty() || item[0] != '/' || weight <= 0) {
+                return false;
+            }
+            paths.push_back(item);
+            weights.push_back((weights.empty() ? 0 : weights.back()) + weight);
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return !paths.empty();
+}
+
+class BenchWorker {
+public:
+ BenchWorker(int id, int connections);
+ ~BenchWorker();
+ bool start();
+ void join();
+ ThreadResult& result() { return m_result; }
+
+private:
+ static void* worker(void* arg);
+ void run();
+ bool open_conn(BenchConn* conn);        // 建立连接并准备发送请求
+ void close_conn(BenchConn* conn);
+ void next_request(BenchConn* conn);     // 选择下一个请求
+ bool on_writable(BenchConn* conn);
+ bool on_readable(BenchConn* conn);
+ bool parse_header(BenchConn* conn);     // 解析响应头, 得到状态码和响应体长度
+ void finish(BenchConn* conn, bool ok);  // 一个请求结束, 记录结果并开始下一个
+
+private:
+ int m_id;
+ int m_connections;
+ int m_epollfd;
+ BenchConn* m_conns;
+ unsigned m_seed;                        // 选择路径用的随机数种子
+ char m_buf[65536];                      // 接收响应体用的缓冲区, 内容直接丢弃
+ ThreadResult m_result;
+ pthread_t m_thread;
+};
+
+BenchWorker::BenchWorker(int id, int connections):
+    m_id(id), m_connections(connections), m_epollfd(-1), m_conns(NULL), m_seed(id * 7919 + 1) {
+    m_result.requests = m_result.errors = m_result.connects = m_result.bytes = 0;
+    memset(m_result.status, 0, sizeof(m_result.status));
+    for (size_t i = 0; i < g_config.paths.size(); ++i) {
+        PathStats* stats = new PathStats;
+        stats->requests = stats->errors = 0;
+        m_result.per_path.push_back(stats);
+    }
+}
+
+BenchWorker::~BenchWorker() {
+    for (size_t i = 0; i < m_result.per_path.size(); ++i) {
+        delete m_result.per_path[i];
+    }
+    delete[] m_conns;
+}
+
+bool BenchWorker::start() {
+    return pthread_create(&m_thread, NULL, worker, this) == 0;
+}
+
+void BenchWorker::join() {
+    pthread_join(m_thread, NULL);
+}
+
+void* BenchWorker::worker(void* arg) {
+    BenchWorker* bench = (BenchWorker*)arg;
+    bench->run();
+    return bench;
+}
+
+void BenchWorker::next_request(BenchConn* conn) {
+    int r = rand_r(&m_seed) % g_config.weights.back();
+    conn->path = 0;
+    while (g_config.weights[conn->path] <= r) {
+        ++conn->path;
+    }
+    conn->request = "GET " + g_config.paths[conn->path] + " HTTP/1.1\r\nHost: " + g_config.host + "\r\n";
+    if (!g_config.keep_alive) {
+        conn->request += "Connection: close\r\n";
+    }
+    conn->request += "\r\n";
+    conn->sent = 0;
+    conn->header_len = 0;
+    conn->header_done = false;
+    conn->body_left = 0;
+    conn->server_close = false;
+    conn->status = 0;
+}
+
+bool BenchWorker::open_conn(BenchConn* conn) {
+    conn->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        return false;
+    }
+    setnonblocking(conn->fd);
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    next_request(conn);
+    conn->start_us = now_us();
+    int ret = connect(conn->fd, (struct sockaddr*)&g_address, sizeof(g_address));
+    if (ret < 0 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    conn->state = (ret == 0) ? CONN_SENDING : CONN_CONNECTING;
+    ++m_result.connects;
+
+    epoll_event event;
+    event.data.ptr = conn;
+    event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, conn->fd, &event);
+    return true;
+}
+
+void BenchWorker::close_conn(BenchConn* conn) {
+    if (conn->fd != -1) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+void BenchWorker::finish(BenchConn* conn, bool ok) {
+    uint64_t latency = now_us() - conn->start_us;
+    if (g_recording) {
+        PathStats* stats = m_result.per_path[conn->path];
+        if (ok) {
+            ++m_result.requests;
+            ++stats->requests;
+            m_result.latency.record(latency);
+            stats->latency.record(latency);
+            int klass = conn->status / 100;
+            ++m_result.status[(klass >= 1 && klass <= 5) ? klass : 0];
+        } else {
+            ++m_result.errors;
+            ++stats->errors;
+        }
+    }
+
+    if (g_stop) {
+        close_conn(conn);
+        return;
+    }
+
+    if (ok && g_config.keep_alive && !conn->server_close) {
+        // 保持连接: 在同一个连接上发送下一个请求
+        next_request(conn);
+        conn->start_us = now_us();
+        conn->state = CONN_SENDING;
+        epoll_event event;
+        event.data.ptr = conn;
+        event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+        return;
+    }
+
+    // 短连接或者出错: 关闭之后重新建立连接
+    close_conn(conn);
+    open_conn(conn);
+}
+
+bool BenchWorker::on_writable(BenchConn* conn) {
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            return false;
+        }
+        conn->state = CONN_SENDING;
+    }
+    if (conn->state != CONN_SENDING) {
+        return true;
+    }
+
+    while (conn->sent < conn->request.size()) {
+        ssize_t n = send(conn->fd, conn->request.data() + conn->sent, conn->request.size() - conn->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return false;
+        }
+        conn->sent += n;
+    }
+
+    // 请求发送完毕, 只关心可读事件
+    conn->state = CONN_RECEIVING;
+    epoll_event event;
+    event.data.ptr = conn;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+    return true;
+}
+
+bool BenchWorker::parse_header(BenchConn* conn) {
+    conn->header[conn->header_len] = '\0';
+    char* end = strstr(conn->header, "\r\n\r\n");
+    if (!end) {
+        return conn->header_len < RESPONSE_HEADER_MAX - 1;   // 响应头还没有收完
+    }
+
+    int header_size = end + 4 - conn->header;
+    conn->header_done = true;
+    if (sscanf(conn->header, "HTTP/%*d.%*d %d", &conn->status) != 1) {
+        return false;
+    }
+
+    conn->body_left = 0;
+    for (char* line = strstr(conn->header, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        char* field = line + 2;
+        if (strncasecmp(field, "Content-Length:", 15) == 0) {
+            conn->body_left = atoll(field + 15);
+        } else if (strncasecmp(field, "Connection:", 11) == 0 && strcasestr(field, "close") &&
+                   strcasestr(field, "close") < strstr(field, "\r\n")) {
+            conn->server_close = true;
+        }
+    }
+    // 和响应头一起收到的响应体
+    conn->body_left -= conn->header_len - header_size;
+    return true;
+}
+
+bool BenchWorker::on_readable(BenchConn* conn) {
+    while (true) {
+        ssize_t n;
+        if (!conn->header_done) {
+            n = recv(conn->fd, conn->header + conn->header_len, RESPONSE_HEADER_MAX - 1 - conn->header_len, 0);
+        } else {
+            n = recv(conn->fd, m_buf, sizeof(m_buf), 0);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return false;    // 响应还没有收完服务器就关闭了连接
+        }
+        m_result.bytes += n;
+
+        if (!conn->header_done) {
+            conn->header_len += n;
+            if (!parse_header(conn)) {
+                return false;
+            }
+            if (!conn->header_done) {
+                continue;
+            }
+        } else {
+            conn->body_left -= n;
+        }
+
+        if (conn->header_done && conn->body_left <= 0) {
+            finish(conn, conn->body_left == 0);
+            return true;
+        }
+    }
+}
+
+void BenchWorker::run() {
+    m_epollfd = epoll_create(5);
+    m_conns = new BenchConn[m_connections];
+    for (int i = 0; i < m_connections; ++i) {
+        m_conns[i].fd = -1;
+        if (!open_conn(&m_conns[i])) {
+            ++m_result.errors;
+        }
+    }
+
+    epoll_event events[MAX_EVENT_NUMBER];
+    while (!g_stop) {
+        int num = epoll_wait(m_epollfd, events, MAX_EVENT_NUMBER, 100);
+        if (num < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < num; ++i) {
+            BenchConn* conn = (BenchConn*)events[i].data.ptr;
+            if (conn->fd == -1) {
+                continue;
+            }
+            bool ok = true;
+            if (events[i].events & EPOLLIN) {
+                ok = on_readable(conn);
+            }
+            if (ok && conn->fd != -1 && (events[i].events & EPOLLOUT)) {
+                ok = on_writable(conn);
+            }
+            if (ok && conn->fd != -1 && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                ok = false;
+            }
+            if (!ok && conn->fd != -1) {
+                finish(conn, false);
+            }
+        }
+    }
+
+    for (int i = 0; i < m_connections; ++i) {
+        close_conn(&m_conns[i]);
+    }
+    close(m_epollfd);
+}
+
+// 启动服务器并等待端口可以连接
+static pid_t start_server(const char* cmd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; ++i) {
+        int fd = socket(PF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&g_address, sizeof(g_address)) == 0) {
+            close(fd);
+            return pid;
+        }
+        close(fd);
+        usleep(100 * 1000);
+    }
+    fprintf(stderr, "server did not start listening on port %d\n", g_config.port);
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+static void write_latency(FILE* out, const Histogram& h, const char* indent) {
+    fprintf(out, "{\n");
+    fprintf(out, "%s  \"min\": %llu,\n", indent, (unsigned long long)h.min());
+    fprintf(out, "%s  \"mean\": %.1f,\n", indent, h.mean());
+    fprintf(out, "%s  \"p50\": %llu,\n", indent, (unsigned long long)h.percentile(0.50));
+    fprintf(out, "%s  \"p90\": %llu,\n", indent, (unsigned long long)h.percentile(0.90));
+    fprintf(out, "%s  \"p99\": %llu,\n", indent, (unsigned long long)h.percentile(0.99));
+    fprintf(out, "%s  \"p999\": %llu,\n", indent, (unsigned long long)h.percentile(0.999));
+    fprintf(out, "%s  \"max\": %llu\n", indent, (unsigned long long)h.max());
+    fprintf(out, "%s}", indent);
+}
+
+static void usage(const char* name) {
+    printf("usage: %s -p port [-h host] [-c connections] [-t threads] [-d seconds] [-w warmup_seconds]\n"
+           "          [-u \"/path:weight,...\"] [-K] [-o result.json] [-S \"server command\"]\n"
+           "  -K  short-lived connections (one request per connection)\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    g_config.host = "127.0.0.1";
+    g_config.port = 0;
+    g_config.connections = 1000;
+    g_config.threads = 1;
+    g_config.duration = 10;
+    g_config.warmup = 1;
+    g_config.keep_alive = true;
+    g_config.output = NULL;
+    g_config.server_cmd = NULL;
+    const char* paths = "/";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:w:u:Ko:S:")) != -1) {
+        switch (opt) {
+            case 'h': g_config.host = optarg; break;
+            case 'p': g_config.port = atoi(optarg); break;
+            case 'c': g_config.connections = atoi(optarg); break;
+            case 't': g_config.threads = atoi(optarg); break;
+            case 'd': g_config.duration = atoi(optarg); break;
+            case 'w': g_config.warmup = atoi(optarg); break;
+            case 'u': paths = optarg; break;
+            case 'K': g_config.keep_alive = false; break;
+            case 'o': g_config.output = optarg; break;
+            case 'S': g_config.server_cmd = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (g_config.port <= 0 || g_config.connections <= 0 || g_config.threads <= 0 ||
+        g_config.duration <= 0 || !parse_paths(paths, g_config.paths, g_config.weights)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (g_config.threads > g_config.connections) {
+        g_config.threads = g_config.connections;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&g_address, 0, sizeof(g_address));
+    g_address.sin_family = AF_INET;
+    g_address.sin_port = htons(g_config.port);
+    if (inet_pton(AF_INET, g_config.host, &g_address.sin_addr) != 1) {
+        fprintf(stderr, "invalid host %s\n", g_config.host);
+        return 1;
+    }
+
+    pid_t server = -1;
+    if (g_config.server_cmd) {
+        server = start_server(g_config.server_cmd);
+        if (server < 0) {
+            return 1;
+        }
+    }
+
+    // 连接平均分给各个线程
+    std::vector<BenchWorker*> workers;
+    for (int i = 0; i < g_config.threads; ++i) {
+        int count = g_config.connections / g_config.threads + (i < g_config.connections % g_config.threads ? 1 : 0);
+        BenchWorker* worker = new BenchWorker(i, count);
+        if (!worker->start()) {
+            perror("pthread_create");
+            return 1;
+        }
+        workers.push_back(worker);
+    }
+
+    sleep(g_config.warmup);
+    g_recording = true;
+    uint64_t begin = now_us();
+    sleep(g_config.duration);
+    g_recording = false;
+    double elapsed = (now_us() - begin) / 1e6;
+    g_stop = true;
+
+    ThreadResult total;
+    total.requests = total.errors = total.connects = total.bytes = 0;
+    memset(total.status, 0, sizeof(total.status));
+    std::vector<PathStats> per_path(g_config.paths.size(), PathStats());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->join();
+        ThreadResult& r = workers[i]->result();
+        total.requests += r.requests;
+        total.errors += r.errors;
+        total.connects += r.connects;
+        total.bytes += r.bytes;
+        for (int k = 0; k < 6; ++k) {
+            total.status[k] += r.status[k];
+        }
+        total.latency.merge(r.latency);
+        for (size_t p = 0; p < per_path.size(); ++p) {
+            per_path[p].requests += r.per_path[p]->requests;
+            per_path[p].errors += r.per_path[p]->errors;
+            per_path[p].latency.merge(r.per_path[p]->latency);
+        }
+        delete workers[i];
+    }
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    FILE* out = g_config.output ? fopen(g_config.output, "w") : stdout;
+    if (!out) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"connections\": %d,\n", g_config.connections);
+    fprintf(out, "  \"threads\": %d,\n", g_config.threads);
+    fprintf(out, "  \"keep_alive\": %s,\n", g_config.keep_alive ? "true" : "false");
+    fprintf(out, "  \"duration_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"requests\": %llu,\n", (unsigned long long)total.requests);
+    fprintf(out, "  \"errors\": %llu,\n", (unsigned long long)total.errors);
+    fprintf(out, "  \"connects\": %llu,\n", (unsigned long long)total.connects);
+    fprintf(out, "  \"throughput_rps\": %.1f,\n", total.requests / elapsed);
+    fprintf(out, "  \"throughput_mbps\": %.2f,\n", total.bytes * 8 / elapsed / 1e6);
+    fprintf(out, "  \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"unknown\": %llu},\n",
+            (unsigned long long)total.status[1], (unsigned long long)total.status[2], (unsigned long long)total.status[3],
+            (unsigned long long)total.status[4], (unsigned long long)total.status[5], (unsigned long long)total.status[0]);
+    fprintf(out, "  \"latency_us\": ");
+    write_latency(out, total.latency, "  ");
+    fprintf(out, ",\n  \"paths\": [");
+
+    bool first = true;
+    for (size_t p = 0; p < per_path.size(); ++p) {
+        fprintf(out, "%s\n    {\"path\": \"%s\", \"requests\": %llu, \"errors\": %llu, \"latency_us\": ",
+                first ? "" : ",", g_config.paths[p].c_str(),
+                (unsigned long long)per_path[p].requests, (unsigned long long)per_path[p].errors);
+        write_latency(out, per_path[p].latency, "    ");
+        fprintf(out, "}");
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "body_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+FileSink::FileSink(): m_fd(-1), m_size(0) {
+    m_path[0] = '\0';
+    m_temp[0] = '\0';
+}
+
+FileSink::~FileSink() {
+    abort();
+}
+
+bool FileSink::open(const char* path, int id) {
+    abort();
+    int len = snprintf(m_path, sizeof(m_path), "%s", path);
+    if (len < 0 || len >= (int)sizeof(m_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    snprintf(m_temp, sizeof(m_temp), "%s.%d.part", path, id);
+    m_fd = ::open(m_temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    m_size = 0;
+    return m_fd != -1;
+}
+
+bool FileSink::write(const char* data, int len) {
+    while (len > 0) {
+        ssize_t n = ::write(m_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+        m_size += n;
+    }
+    return true;
+}
+
+bool FileSink::finish() {
+    int ret = close(m_fd);
+    m_fd = -1;
+    if (ret < 0 || rename(m_temp, m_path) < 0) {
+        unlink(m_temp);
+        return false;
+    }
+    return true;
+}
+
+void FileSink::abort() {
+    if (m_fd != -1) {
+        close(m_fd);
+        m_fd = -1;
+        unlink(m_temp);
+    }
+}
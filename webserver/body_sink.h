@@ -0,0 +1,58 @@
+#ifndef BODYSINK_H
+#define BODYSINK_H
+
+#include <sys/types.h>
+#include <string>
+
+// 请求体的接收者: 请求体由工作线程边接收边解码 (Content-Length 或者 chunked), 每解码出一段就交给它
+// 读缓冲区中只保留请求头和还没有解码的数据, 所以再大的请求体也只占用一个读缓冲区的内存
+class BodySink {
+public:
+ virtual ~BodySink() {}
+ virtual bool write(const char* data, int len) = 0; // 一段请求体, 返回 false 表示出错
+ virtual bool finish() = 0;                         // 请求体已经完整地收到了, 返回 false 表示出错
+ virtual void abort() = 0;                          // 请求体没有收完就放弃了 (出错或者连接关闭)
+};
+
+// 把请求体保存到文件中
+// 先写到同一个目录下的临时文件 "路径.连接号.part", 完整收到之后再改名, 不会让别人看到写了一半的文件
+class FileSink : public BodySink {
+public:
+ FileSink();
+ virtual ~FileSink();
+
+ // 创建临时文件, 失败时返回 false, errno 是失败的原因
+ bool open(const char* path, int id);
+ bool opened() const { return m_fd != -1; }
+ off_t size() const { return m_size; }
+ const char* path() const { return m_path; }
+
+ virtual bool write(const char* data, int len);
+ virtual bool finish();
+ virtual void abort();
+
+private:
+ static const int PATH_LEN = 256;
+
+ int m_fd;
+ off_t m_size;               // 已经写入的字节数
+ char m_path[PATH_LEN];      // 最终的路径
+ char m_temp[PATH_LEN + 32]; // 临时文件的路径
+};
+
+// 把请求体保存在内存中, 交给内置的处理函数 (Router), 长度由调用者限制
+class StringSink : public BodySink {
+public:
+ void open() { m_data.clear(); }
+ const std::string& data() const { return m_data; }
+
+ virtual bool write(const char* data, int len) { m_data.append(data, len); return true; }
+ virtual bool finish() { return true; }
+ // 处理完之后也调用它, 内存还给系统, 不让空闲的连接一直占着
+ virtual void abort() { std::string().swap(m_data); }
+
+private:
+ std::string m_data;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "locker.h"
+#include "affinity.h"
+
+// 空闲的内存块用它自己的前几个字节串成单向链表
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct FreeList {
+    FreeBlock* head;
+    int count;
+};
+
+// 全局链表, 每一级一把锁, 只有批量转移时才会访问
+struct GlobalPool {
+    Locker locker[BufferPool::CLASS_COUNT];
+    FreeList lists[BufferPool::CLASS_COUNT];
+
+    GlobalPool() {
+        memset(lists, 0, sizeof(lists));
+    }
+};
+
+// 每个 NUMA 节点一组全局链表, 线程只和自己所在节点的全局链表交换内存块,
+// 所以内存块 (由节点上的线程第一次写入, 物理页也在这个节点上) 不会流到其他节点
+static const int MAX_NODES = 8;
+
+static GlobalPool& global_pool() {
+    static GlobalPool instances[MAX_NODES];
+    return instances[current_numa_node() % MAX_NODES];
+}
+
+// 线程本地的链表, 线程退出时把内存块交还给全局链表
+struct LocalPool {
+    FreeList lists[BufferPool::CLASS_COUNT];
+
+    LocalPool() {
+        memset(lists, 0, sizeof(lists));
+    }
+
+    ~LocalPool() {
+        GlobalPool& global = global_pool();
+        for (int i = 0; i < BufferPool::CLASS_COUNT; ++i) {
+            // 全局链表满了之后剩下的直接释放
+            global.locker[i].lock();
+            FreeList& shared = global.lists[i];
+            while (lists[i].head) {
+                FreeBlock* block = lists[i].head;
+                lists[i].head = block->next;
+                if (shared.count < BufferPool::GLOBAL_LIMIT) {
+                    block->next = shared.head;
+                    shared.head = block;
+                    ++shared.count;
+                } else {
+                    ::free(block);
+                }
+            }
+            lists[i].count = 0;
+            global.locker[i].unlock();
+        }
+    }
+};
+
+static thread_local LocalPool t_local_pool;
+
+char* BufferPool::alloc(int size_class) {
+    FreeList& local = t_local_pool.lists[size_class];
+    if (!local.head) {
+        // 本地链表空了, 从全局链表取一批
+        GlobalPool& global = global_pool();
+        global.locker[size_class].lock();
+        FreeList& shared = global.lists[size_class];
+        for (int i = 0; i < BATCH && shared.head; ++i) {
+            FreeBlock* block = shared.head;
+            shared.head = block->next;
+            --shared.count;
+            block->next = local.head;
+            local.head = block;
+            ++local.count;
+        }
+        global.locker[size_class].unlock();
+    }
+
+    if (local.head) {
+        FreeBlock* block = local.head;
+        local.head = block->next;
+        --local.count;
+        return (char*)block;
+    }
+    return (char*)malloc(class_size(size_class));
+}
+
+void BufferPool::free(char* p, int size_class) {
+    FreeList& local = t_local_pool.lists[size_class];
+    FreeBlock* block = (FreeBlock*)p;
+    block->next = local.head;
+    local.head = block;
+    ++local.count;
+
+    if (local.count > LOCAL_LIMIT) {
+        // 本地链表太长, 把一批交给全局链表, 全局链表也满了就直接释放
+        GlobalPool& global = global_pool();
+        global.locker[size_class].lock();
+        FreeList& shared = global.lists[size_class];
+        for (int i = 0; i < BATCH; ++i) {
+            block = local.head;
+            local.head = block->next;
+            --local.count;
+            if (shared.count < GLOBAL_LIMIT) {
+                block->next = shared.head;
+                shared.head = block;
+                ++shared.count;
+            } else {
+                ::free(block);
+            }
+        }
+        global.locker[size_class].unlock();
+    }
+}
+
+bool Buffer::reserve(int size, int used) {
+    if (size <= m_capacity) {
+        return true;
+    }
+    if (size > MAX_SIZE) {
+        return false;
+    }
+
+    int size_class = 0;
+    while (BufferPool::class_size(size_class) < size) {
+        ++size_class;
+    }
+
+    char* data = BufferPool::alloc(size_class);
+    if (!data) {
+        return false;
+    }
+    if (m_data) {
+        memcpy(data, m_data, used);
+        BufferPool::free(m_data, m_class);
+    }
+    m_data = data;
+    m_capacity = BufferPool::class_size(size_class);
+    m_class = size_class;
+    return true;
+}
+
+void Buffer::release() {
+    if (m_data) {
+        BufferPool::free(m_data, m_class);
+        m_data = 0;
+        m_capacity = 0;
+        m_class = -1;
+    }
+}
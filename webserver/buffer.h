@@ -0,0 +1,50 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+// 连接使用的读写缓冲区
+// 缓冲区的内存按大小分级 (2KB, 4KB, ... 64KB) 从内存池中取得, 只有连接活跃时才持有, 空闲时归还
+// 数据不够放时换成大一级的内存块, 已有的数据会被拷贝过去, 所以使用者应该用偏移量而不是指针记录位置
+
+// 内存池: 每个线程一个本地的空闲链表, 本地链表太长时把一半交给全局链表, 本地链表空了再从全局链表取一批
+// 读缓冲区在事件循环中分配, 写缓冲区在工作线程中分配, 归还时放进当前线程的链表, 全局链表负责让内存在线程之间流动
+// 全局链表按 NUMA 节点分开, 内存只在同一个节点的线程之间流动
+class BufferPool {
+public:
+ static const int MIN_SHIFT = 11;                 // 最小的内存块 2KB
+ static const int CLASS_COUNT = 6;                // 2KB, 4KB, 8KB, 16KB, 32KB, 64KB
+ static const int LOCAL_LIMIT = 64;               // 每个线程每一级最多缓存的内存块数量
+ static const int BATCH = 16;                     // 本地链表和全局链表之间一次转移的数量
+ static const int GLOBAL_LIMIT = 4096;            // 全局链表每一级最多缓存的内存块数量
+
+ static char* alloc(int size_class);              // 取得一个 size_class 级的内存块
+ static void free(char* block, int size_class);   // 归还内存块
+ static int class_size(int size_class) { return 1 << (MIN_SHIFT + size_class); }
+};
+
+class Buffer {
+public:
+ static const int MIN_SIZE = 1 << BufferPool::MIN_SHIFT;
+ static const int MAX_SIZE = MIN_SIZE << (BufferPool::CLASS_COUNT - 1);
+
+ Buffer(): m_data(0), m_capacity(0), m_class(-1) {}
+ ~Buffer() { release(); }
+
+ char* data() const { return m_data; }
+ int capacity() const { return m_capacity; }
+ bool empty() const { return m_data == 0; }
+
+ // 保证容量至少为 size, 需要换更大的内存块时保留前 used 字节的数据
+ // size 超过 MAX_SIZE 时返回 false, 原来的数据不变
+ bool reserve(int size, int used);
+ void release();                  // 把内存块归还给内存池
+
+private:
+ Buffer(const Buffer&);
+ Buffer& operator=(const Buffer&);
+
+ char* m_data;
+ int m_capacity;
+ int m_class;                     // 内存块的级别, 没有内存块时为 -1
+};
+
+#endif
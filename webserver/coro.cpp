@@ -0,0 +1,61 @@
+#include "coro.h"
+
+#ifdef HAVE_COROUTINES
+
+#include <new>
+
+static thread_local FramePool t_frame_pool;
+
+FramePool::FramePool() {
+    for (int i = 0; i < CLASSES; ++i) {
+        m_free[i] = NULL;
+        m_cached[i] = 0;
+    }
+}
+
+FramePool::~FramePool() {
+    for (int i = 0; i < CLASSES; ++i) {
+        while (m_free[i]) {
+            FreeFrame* frame = m_free[i];
+            m_free[i] = frame->next;
+            ::operator delete(frame);
+        }
+    }
+}
+
+FramePool* FramePool::local() {
+    return &t_frame_pool;
+}
+
+void* FramePool::alloc(size_t size) {
+    if (size > MAX_FRAME) {
+        return ::operator new(size);
+    }
+    int index = (size - 1) / FRAME_ALIGN;
+    FreeFrame* frame = m_free[index];
+    if (frame) {
+        m_free[index] = frame->next;
+        --m_cached[index];
+        return frame;
+    }
+    // 按这一级的大小申请, 释放之后才能给这一级的其他协程使用
+    return ::operator new((index + 1) * FRAME_ALIGN);
+}
+
+void FramePool::free(void* frame, size_t size) {
+    if (size > MAX_FRAME) {
+        ::operator delete(frame);
+        return;
+    }
+    int index = (size - 1) / FRAME_ALIGN;
+    if (m_cached[index] >= MAX_CACHED) {
+        ::operator delete(frame);
+        return;
+    }
+    FreeFrame* node = (FreeFrame*)frame;
+    node->next = m_free[index];
+    m_free[index] = node;
+    ++m_cached[index];
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef CORO_H
+#define CORO_H
+
+// 协程的基础设施, 需要 C++20 (例如 g++ -std=c++20), 更早的标准下这个文件是空的, 协程事件循环不可用
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#define HAVE_COROUTINES 1
+
+#include <stddef.h>
+#include <coroutine>
+#include <exception>
+
+// 每个线程一个的协程帧分配器
+// 帧的大小按 FRAME_ALIGN 向上取整分成若干级, 释放的帧挂在对应级别的空闲链表上, 下一次同样大小的协程直接复用
+// 协程只在事件循环的线程中创建和销毁, 稳定运行时创建连接的协程和每次收发数据的协程都不会调用 malloc
+// 超过 MAX_FRAME 的帧直接使用 operator new, 每一级最多保留 MAX_CACHED 个空闲的帧
+class FramePool {
+public:
+ static const size_t FRAME_ALIGN = 64;
+ static const size_t MAX_FRAME = 2048;
+ static const int MAX_CACHED = 4096;
+
+ FramePool();
+ ~FramePool();
+
+ static FramePool* local();   // 当前线程的分配器
+
+ void* alloc(size_t size);
+ void free(void* frame, size_t size);
+
+private:
+ FramePool(const FramePool&);
+ FramePool& operator=(const FramePool&);
+
+ struct FreeFrame {
+     FreeFrame* next;
+ };
+ static const int CLASSES = MAX_FRAME / FRAME_ALIGN;
+
+ FreeFrame* m_free[CLASSES];  // 第 i 级的帧大小是 (i + 1) * FRAME_ALIGN
+ int m_cached[CLASSES];
+};
+
+// 协程帧都从 FramePool 分配
+struct PooledFrame {
+ static void* operator new(size_t size) { return FramePool::local()->alloc(size); }
+ static void operator delete(void* frame, size_t size) { FramePool::local()->free(frame, size); }
+};
+
+// 返回一个值的子协程, 被 co_await 时才开始执行, 结束之后直接切换回等待它的协程 (对称转移, 不会加深调用栈)
+// Task 对象拥有协程帧, 析构时销毁它; 父协程被销毁时, 挂起在其中的子协程也随之销毁
+template <typename T>
+class Task {
+public:
+ struct promise_type : PooledFrame {
+     T value;
+     std::coroutine_handle<> continuation;  // 等待这个协程的父协程
+
+     struct FinalAwaiter {
+         bool await_ready() noexcept { return false; }
+         std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept {
+             return self.promise().continuation;
+         }
+         void await_resume() noexcept {}
+     };
+
+     Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+     std::suspend_always initial_suspend() noexcept { return {}; }
+     FinalAwaiter final_suspend() noexcept { return {}; }
+     void return_value(T v) { value = v; }
+     void unhandled_exception() { std::terminate(); }
+ };
+
+ Task(Task&& other) noexcept: m_handle(other.m_handle) { other.m_handle = nullptr; }
+ ~Task() {
+     if (m_handle) {
+         m_handle.destroy();
+     }
+ }
+
+ bool await_ready() const noexcept { return false; }
+ std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) noexcept {
+     m_handle.promise().continuation = parent;
+     return m_handle;
+ }
+ T await_resume() { return m_handle.promise().value; }
+
+private:
+ explicit Task(std::coroutine_handle<promise_type> handle): m_handle(handle) {}
+ Task(const Task&);
+ Task& operator=(const Task&);
+
+ std::coroutine_handle<promise_type> m_handle;
+};
+
+// 最外层的协程, 没有父协程: 创建之后挂起, 由事件循环调用 start() 开始执行
+// 结束之后停在 final_suspend, 事件循环通过 done() 发现并用 destroy() 销毁它
+class RootTask {
+public:
+ struct promise_type : PooledFrame {
+     RootTask get_return_object() { return RootTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+     std::suspend_always initial_suspend() noexcept { return {}; }
+     std::suspend_always final_suspend() noexcept { return {}; }
+     void return_void() {}
+     void unhandled_exception() { std::terminate(); }
+ };
+
+ std::coroutine_handle<> handle() const { return m_handle; }
+
+private:
+ explicit RootTask(std::coroutine_handle<> handle): m_handle(handle) {}
+
+ std::coroutine_handle<> m_handle;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+#include "coro_reactor.h"
+
+#ifdef HAVE_COROUTINES
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "metrics.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+
+CoroReactor::CoroReactor(int id, int port, ConnPool* pool):
+    Reactor(id, port, pool),
+    m_states(NULL),
+    m_eventfd(-1),
+    m_wakeup_pending(false) {
+
+}
+
+CoroReactor::~CoroReactor() {
+    if (m_states) {
+        for (int i = 0; i < MAX_FD; ++i) {
+            if (m_states[i]) {
+                if (m_states[i]->root) {
+                    m_states[i]->root.destroy();
+                }
+                delete m_states[i];
+            }
+        }
+        delete[] m_states;
+    }
+    if (m_eventfd != -1) {
+        close(m_eventfd);
+    }
+}
+
+bool CoroReactor::init(bool reuse_port) {
+    if (!Reactor::init(reuse_port)) {
+      return false;
+    }
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd == -1) {
+      perror("Eventfd");
+      return false;
+    }
+    addfd(m_epollfd, m_eventfd, false);
+
+    m_states = new ConnState*[MAX_FD]();
+    return true;
+}
+
+// 由工作线程调用: 把连接放进交还队列, 事件循环没有被叫醒过时写 eventfd 叫醒它
+void CoroReactor::resume(http_conn* conn, int events) {
+    Resumed resumed = { conn, events };
+    m_resumed_locker.lock();
+    m_resumed.push_back(resumed);
+    m_resumed_locker.unlock();
+    if (!m_wakeup_pending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t ret = ::write(m_eventfd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void CoroReactor::run() {
+    pin();
+    while (!m_drained) {
+      int num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+      if ((num < 0) && (errno != EINTR)) {
+        LOG_ERROR("epoll_wait failed in reactor %d: %s", m_id, strerror(errno));
+        break;
+      }
+
+      for (int i = 0; i < num; ++i) {
+        int fd = m_events[i].data.fd;
+        if (fd < 0) {
+          handle_upstream(upstream_event_client(fd));
+        } else if (fd == m_listenfd) {
+          handle_accept();
+        } else if (fd == m_wheel.fd()) {
+          // 时间轮前进, 关闭所有超时的连接
+          m_wheel.advance(on_timeout, this);
+          if (m_deadline.load(std::memory_order_relaxed) != 0) {
+            drain();
+          } else if (m_accept_paused && can_resume_accept()) {
+            resume_accept();
+          }
+        } else if (fd == m_eventfd) {
+          uint64_t value;
+          ssize_t ret = ::read(m_eventfd, &value, sizeof(value));
+          (void)ret;
+          handle_resumed();
+        } else {
+          handle_event(fd, m_events[i].events);
+        }
+      }
+    }
+}
+
+// 连接只注册这一次, 边沿触发: 之后每次 socket 变成可读或者可写时收到一个事件
+void CoroReactor::add_conn(int sockfd, const sockaddr_in& addr) {
+    http_conn* conn = conn_object(sockfd);
+    if (!m_states[sockfd]) {
+      m_states[sockfd] = new ConnState;
+    }
+    ConnState* st = m_states[sockfd];
+    st->ready = 0;
+    st->waiting = 0;
+    st->events = 0;
+
+    conn->init(sockfd, addr, this, m_id);
+    epoll_event event;
+    event.data.fd = sockfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    if (epoll_ctl(m_epollfd, EPOLL_CTL_ADD, sockfd, &event) == -1) {
+      LOG_WARN("failed to watch fd %d in reactor %d: %s", sockfd, m_id, strerror(errno));
+      conn->close_conn();
+      return;
+    }
+
+    // 客户端必须在 m_header_timeout 秒之内发送完第一个请求
+    m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+
+    // 协程先运行到等待第一个请求的数据为止
+    st->root = serve(sockfd).handle();
+    st->waiter = st->root;
+    wake(sockfd);
+}
+
+// 关闭连接的 socket 时它也自动从 epoll 中删除
+// 只在协程挂起时调用, 销毁最外层的协程帧时, 挂起在其中的子协程的帧也一起销毁
+void CoroReactor::close_conn(int sockfd) {
+    ConnState* st = m_states[sockfd];
+    if (!st || !st->root) {
+      return;
+    }
+    st->root.destroy();
+    st->root = nullptr;
+    st->waiter = nullptr;
+    Reactor::close_conn(sockfd);
+}
+
+void CoroReactor::wake(int fd) {
+    ConnState* st = m_states[fd];
+    st->waiter.resume();
+    if (st->root.done()) {
+      close_conn(fd);
+    }
+}
+
+// 挂断和出错时读写都会马上失败, 所以同时当作可读和可写, 让等待中的协程发现并结束
+void CoroReactor::handle_event(int fd, int events) {
+    ConnState* st = m_states[fd];
+    if (!st || !st->root) {
+      // 已经关闭的连接在这一轮中残留的事件
+      return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      st->ready |= EPOLLIN;
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      st->ready |= EPOLLOUT;
+    }
+    if (st->waiting & st->ready) {
+      wake(fd);
+    }
+}
+
+// 上游连接只注册了一次性的读事件, 每次等待之前由 relay() 重新注册
+void CoroReactor::handle_upstream(int fd) {
+    ConnState* st = m_states[fd];
+    if (!st || !st->root || !upstream_ready(fd)) {
+      return;
+    }
+    st->ready |= ConnState::UPSTREAM;
+    if (st->waiting & st->ready) {
+      wake(fd);
+    }
+}
+
+void CoroReactor::handle_resumed() {
+    // 先清除标记再取队列, 之后交还的连接一定会再写一次 eventfd
+    m_wakeup_pending.exchange(false);
+    m_resumed_locker.lock();
+    m_resumed.swap(m_resumed_swap);
+    m_resumed_locker.unlock();
+
+    for (size_t i = 0; i < m_resumed_swap.size(); ++i) {
+      http_conn* conn = m_resumed_swap[i].conn;
+      int fd = conn->sockfd();
+      m_states[fd]->events = m_resumed_swap[i].events;
+      conn->m_busy.store(false, std::memory_order_release);
+      wake(fd);
+    }
+    m_resumed_swap.clear();
+}
+
+void CoroReactor::on_timeout(TimerNode* node, void* arg) {
+    CoroReactor *reactor = (CoroReactor *)arg;
+    http_conn *conn = (http_conn *)node->data;
+    if (conn->m_busy.load(std::memory_order_acquire)) {
+      // 连接正在被工作线程处理, 稍后再检查
+      reactor->m_wheel.add(node, 1000);
+      return;
+    }
+    // 超时: 请求头太慢, 响应发送停滞, 或者保持连接时空闲太久
+    reactor->close_conn(conn->sockfd());
+}
+
+bool CoroReactor::Offload::await_suspend(std::coroutine_handle<> h) {
+    ConnState* st = loop->m_states[fd];
+    http_conn* conn = loop->m_users[fd];
+    st->waiter = h;
+    st->waiting = 0;
+    // 工作线程交还之前, 到期的定时器不会关闭这个连接
+    conn->m_busy.store(true, std::memory_order_relaxed);
+    if (!loop->m_pool->append(conn, loop->m_id)) {
+      conn->m_busy.store(false, std::memory_order_relaxed);
+      st->events = -1;
+      return false;
+    }
+    return true;
+}
+
+// 一个连接的完整生命周期, 协程返回之后由 wake() 关闭连接
+RootTask CoroReactor::serve(int fd) {
+    http_conn* conn = m_users[fd];
+    while (true) {
+      bool idle = conn->idle();
+      if (!co_await read(fd)) {
+        co_return;
+      }
+      if (idle && !conn->idle()) {
+        // 新请求的第一个字节到达, 整个请求必须在 m_header_timeout 秒之内收完
+        m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+      } else if (conn->receiving_body()) {
+        // 请求体可能很大, 每次有进展就刷新定时器
+        m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+      }
+
+      // 处理读缓冲区中的请求并发送响应, 直到需要更多的数据
+      while (true) {
+        int events = m_run_to_completion ? conn->process_inline() : 0;
+        if (events == 0) {
+          events = co_await Offload{this, fd};
+        }
+        if (events < 0) {
+          // 请求队列满了, 回复 503 而不是让连接一直等到超时
+          metric_requests_shed.add();
+          http_conn::send_overload(fd);
+          pause_accept();
+          co_return;
+        }
+        if (!(events & EPOLLOUT)) {
+          // 请求还不完整 (或者出错之后关闭了 socket 的读写)
+          break;
+        }
+        if (!co_await write(fd) || !co_await sendfile(fd) || !co_await relay(fd) || !conn->finish_write()) {
+          co_return;
+        }
+        if (!conn->has_pending()) {
+          // 响应发送完毕, 保持连接等待下一个请求
+          m_wheel.add(conn->timer(), conn->keep_alive_timeout() * 1000);
+          break;
+        }
+        // 读缓冲区中还有流水线请求, 继续处理
+        m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+      }
+    }
+}
+
+Task<bool> CoroReactor::read(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    co_await Ready{st, EPOLLIN};
+    if (!conn->read()) {
+      co_return false;
+    }
+    if (!conn->input_full()) {
+      // 已经读到了 EAGAIN, 之后到达的数据会产生新的事件
+      st->ready &= ~EPOLLIN;
+    }
+    co_return true;
+}
+
+Task<bool> CoroReactor::write(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    struct iovec* iov;
+    while (conn->send_iov(&iov) > 0) {
+      co_await Ready{st, EPOLLOUT};
+      int count = conn->send_iov(&iov);
+      ssize_t sent = writev(fd, iov, count);
+      if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          co_return false;
+        }
+        // 发送缓冲区满了, 等待 socket 重新可写, 每次有进展就刷新定时器
+        st->ready &= ~EPOLLOUT;
+        m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+        continue;
+      }
+      conn->consume_sent(sent);
+    }
+    co_return true;
+}
+
+Task<bool> CoroReactor::sendfile(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    int file_fd;
+    off_t offset, len;
+    while (conn->file_pending(&file_fd, &offset, &len)) {
+      co_await Ready{st, EPOLLOUT};
+      // 缓存中的描述符被多个连接共享, 总是显式地传入偏移量
+      ssize_t sent = ::sendfile(fd, file_fd, &offset, len);
+      if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          co_return false;
+        }
+        st->ready &= ~EPOLLOUT;
+        m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+        continue;
+      }
+      if (sent == 0) {
+        // 文件在发送过程中被截断了
+        co_return false;
+      }
+      conn->consume_file(sent);
+    }
+    co_return true;
+}
+
+// 上游 -> 管道 -> socket 由连接自己用非阻塞的 splice 完成, 这里只在某一端没有就绪时挂起
+Task<bool> CoroReactor::relay(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    while (conn->relaying()) {
+      int wait = conn->relay();
+      if (wait < 0) {
+        co_return false;
+      }
+      if (wait == EPOLLOUT) {
+        st->ready &= ~EPOLLOUT;
+        co_await Ready{st, EPOLLOUT};
+      } else if (wait == EPOLLIN) {
+        st->ready &= ~ConnState::UPSTREAM;
+        if (!conn->watch_upstream(m_epollfd)) {
+          co_return false;
+        }
+        co_await Ready{st, ConnState::UPSTREAM};
+      }
+      // 每次有进展就刷新定时器
+      m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+    }
+    co_return true;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef CORO_REACTOR_H
+#define CORO_REACTOR_H
+
+#include "coro.h"
+
+#ifdef HAVE_COROUTINES
+
+#include <vector>
+
+#include "reactor.h"
+#include "locker.h"
+
+// 基于协程的事件循环: 每个连接由一个协程按顺序描述 "读请求 -> 处理 -> 发送响应 -> 读下一个请求",
+// 等待数据, 等待 socket 可写和等待工作线程时挂起, 不需要 Reactor 中分散在各个事件分支里的状态判断
+//
+// 和 epoll 事件循环的区别:
+// 1. 连接只在接受时注册一次 EPOLLIN | EPOLLOUT | EPOLLET, 之后不再调用 epoll_ctl (没有 EPOLLONESHOT 的重新注册)
+//    事件只用来记录 socket 的就绪状态 (ready), 读写返回 EAGAIN 时才清除, 挂起的协程等的事件到达时被恢复
+// 2. 请求不完整时协程在原地等待更多的数据, 解析状态一直保留在连接对象中, 也不需要交给线程池再交还
+// 3. 快速路径处理不了的请求通过 offload 交给线程池, 协程挂起到工作线程通过 eventfd 交还连接为止
+// 协程帧从 FramePool 分配, 连接的协程和每次收发数据的子协程在稳定运行时都不调用 malloc
+// 准入控制, 时间轮和平滑退出都和 Reactor 相同
+class CoroReactor : public Reactor, public ConnLoop {
+public:
+ CoroReactor(int id, int port, ConnPool* pool);
+ virtual ~CoroReactor();
+ virtual bool init(bool reuse_port);
+ virtual void run();
+ virtual void resume(http_conn* conn, int events);  // 由工作线程调用
+
+private:
+ // 每个 socket 在这个事件循环中的状态, 以 socket 为下标
+ struct ConnState {
+     static const int UPSTREAM = 1 << 16;  // 反向代理的上游连接可读, 和 EPOLLIN / EPOLLOUT 一起记录在 ready 中
+
+     std::coroutine_handle<> root;   // 连接的协程, 没有打开的连接为空
+     std::coroutine_handle<> waiter; // 正在挂起等待的 (子) 协程
+     int ready;                      // 就绪的事件, EPOLLIN / EPOLLOUT / UPSTREAM
+     int waiting;                    // waiter 等待的事件, 等待工作线程时为 0
+     int events;                     // 工作线程交还连接时的 events, 小于 0 表示线程池的队列满了
+
+     ConnState(): ready(0), waiting(0), events(0) {}
+ };
+
+ // co_await 它等待 socket 就绪, 已经就绪时不挂起
+ struct Ready {
+     ConnState* st;
+     int events;
+     bool await_ready() const noexcept { return st->ready & events; }
+     void await_suspend(std::coroutine_handle<> h) noexcept { st->waiter = h; st->waiting = events; }
+     void await_resume() noexcept { st->waiting = 0; }
+ };
+
+ // co_await 它把连接交给线程池, 返回工作线程交还连接时的 events, 队列满了时不挂起并返回 -1
+ struct Offload {
+     CoroReactor* loop;
+     int fd;
+     bool await_ready() const noexcept { return false; }
+     bool await_suspend(std::coroutine_handle<> h);
+     int await_resume() const noexcept { return loop->m_states[fd]->events; }
+ };
+
+ RootTask serve(int fd);       // 连接的协程, 返回时连接由事件循环关闭
+ Task<bool> read(int fd);      // 读取更多的请求数据, 对方关闭连接或者出错时返回 false
+ Task<bool> write(int fd);     // 发送这一批响应中 writev 的部分
+ Task<bool> sendfile(int fd);  // 发送这一批响应中 sendfile 的文件体
+ Task<bool> relay(int fd);     // 转发这一批响应最后的反向代理响应体
+
+ static void on_timeout(TimerNode* node, void* arg);
+ virtual void add_conn(int sockfd, const sockaddr_in& addr);
+ virtual void close_conn(int sockfd);  // 销毁连接的协程之后关闭连接
+ void wake(int fd);                    // 恢复连接挂起的协程, 协程结束时关闭连接
+ void handle_event(int fd, int events);
+ void handle_upstream(int fd);         // 连接等待的上游连接可读
+ void handle_resumed();                // 处理工作线程交还的连接
+
+private:
+ ConnState** m_states;           // 第一次使用某个 socket 时才创建它的状态
+ int m_eventfd;                  // 工作线程用来叫醒事件循环
+
+ // 工作线程交还的连接
+ struct Resumed {
+     http_conn* conn;
+     int events;
+ };
+ std::vector<Resumed> m_resumed;
+ std::vector<Resumed> m_resumed_swap;
+ Locker m_resumed_locker;
+ std::atomic<bool> m_wakeup_pending;  // 已经写过 eventfd, 事件循环还没有处理
+};
+
+#endif
+
+#endif
@@ -0,0 +1,270 @@
+#include "file_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "http_response.h"
+
+FileVersion::FileVersion(): dev(0), ino(0), size(0) {
+    mtime.tv_sec = 0;
+    mtime.tv_nsec = 0;
+}
+
+FileVersion::FileVersion(const struct stat& st): dev(st.st_dev), ino(st.st_ino), size(st.st_size), mtime(st.st_mtim) {}
+
+bool FileVersion::operator==(const FileVersion& other) const {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+}
+
+FileEntry::FileEntry(): fd(-1), address(NULL), size(0), mtime(0), checked(0), mime(NULL), compressible(false), etag_len(0), header_len(0), type_offset(0), type_len(0) {
+    etag[0] = '\0';
+    header[0] = '\0';
+}
+
+FileEntry::~FileEntry() {
+    if (address) {
+        munmap(address, size);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void FileEntry::make_header(const char* encoding) {
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    char date[64];
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    // inode-修改时间 (纳秒)-大小, 压缩的版本再加上编码
+    unsigned long long mtime_ns = (unsigned long long)version.mtime.tv_sec * 1000000000ULL + version.mtime.tv_nsec;
+    etag_len = snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx%s%s\"", (unsigned long long)version.ino, mtime_ns,
+                        (unsigned long long)version.size, encoding ? "-" : "", encoding ? encoding : "");
+    header_len = snprintf(header, sizeof(header), "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n", etag, date);
+    type_offset = header_len;
+    if (mime) {
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "Content-Type: %s\r\n", mime);
+    }
+    type_len = header_len - type_offset;
+    if (encoding) {
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "Content-Encoding: %s\r\n", encoding);
+    }
+    // 同一个路径的响应随 Accept-Encoding 变化, 中间的缓存需要区分
+    if (compressible) {
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "Vary: Accept-Encoding\r\n");
+    }
+}
+
+FileCache::FileCache(): m_max_entries(512), m_max_bytes(64 * 1024 * 1024), m_revalidate_interval(1), m_map_files(true), m_entries(0), m_bytes(0) {
+
+}
+
+FileCache::~FileCache() {
+
+}
+
+FileCache* FileCache::get_instance() {
+    static FileCache instance;
+    return &instance;
+}
+
+void FileCache::init(size_t max_entries, size_t max_bytes, bool map_files, int revalidate_interval) {
+    m_max_entries = max_entries;
+    m_max_bytes = max_bytes;
+    m_map_files = map_files;
+    m_revalidate_interval = revalidate_interval;
+}
+
+FileCache::Shard& FileCache::shard_of(const std::string& path) {
+    return m_shards[std::hash<std::string>()(path) % SHARD_COUNT];
+}
+
+FileEntryPtr FileCache::acquire(const char* path, int* err) {
+    time_t now = time(NULL);
+    // 每个线程复用同一个字符串作为查找的键, 容量够用之后就不会再分配内存
+    static thread_local std::string key;
+    key.assign(path);
+    Shard& shard = shard_of(key);
+
+    shard.locker.lock();
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        // 命中: 移到 LRU 表头
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        FileEntryPtr entry = *it->second;
+        if (now - entry->checked < m_revalidate_interval) {
+            shard.locker.unlock();
+            *err = 0;
+            return entry;
+        }
+        shard.locker.unlock();
+
+        // 距离上一次检查已经超过了间隔, 在锁外重新 stat 一次
+        struct stat st;
+        if (stat(path, &st) == 0 && FileVersion(st) == entry->version) {
+            shard.locker.lock();
+            entry->checked = now;
+            shard.locker.unlock();
+            *err = 0;
+            return entry;
+        }
+
+        // 文件被修改或者删除了, 丢弃旧的条目 (正在使用它的连接仍然持有原来的映射)
+        shard.locker.lock();
+        it = shard.index.find(key);
+        if (it != shard.index.end() && *it->second == entry) {
+            erase(shard, key);
+        }
+        shard.locker.unlock();
+    } else {
+        shard.locker.unlock();
+    }
+
+    // 未命中: 在锁外打开和映射文件, 避免阻塞其他线程
+    FileEntryPtr entry = load(path, err);
+    if (entry && (size_t)entry->size <= max_file_size()) {
+        shard.locker.lock();
+        insert(shard, entry);
+        shard.locker.unlock();
+        evict(shard);
+    }
+    return entry;
+}
+
+FileEntryPtr FileCache::lookup(const char* path) {
+    time_t now = time(NULL);
+    static thread_local std::string key;
+    key.assign(path);
+    Shard& shard = shard_of(key);
+
+    FileEntryPtr entry;
+    shard.locker.lock();
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && now - (*it->second)->checked < m_revalidate_interval) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        entry = *it->second;
+    }
+    shard.locker.unlock();
+    return entry;
+}
+
+std::vector<std::string> FileCache::hot_paths(size_t limit) {
+    // 每个分片内部按最近使用排序, 分片之间轮流取, 得到近似的全局顺序
+    std::vector<std::string> lists[SHARD_COUNT];
+    for (int i = 0; i < SHARD_COUNT; ++i) {
+        Shard& shard = m_shards[i];
+        shard.locker.lock();
+        for (LruList::iterator it = shard.lru.begin(); it != shard.lru.end() && lists[i].size() < limit; ++it) {
+            lists[i].push_back((*it)->path);
+        }
+        shard.locker.unlock();
+    }
+
+    std::vector<std::string> paths;
+    for (size_t rank = 0; paths.size() < limit; ++rank) {
+        bool more = false;
+        for (int i = 0; i < SHARD_COUNT && paths.size() < limit; ++i) {
+            if (rank < lists[i].size()) {
+                paths.push_back(lists[i][rank]);
+                more = true;
+            }
+        }
+        if (!more) {
+            break;
+        }
+    }
+    return paths;
+}
+
+FileEntryPtr FileCache::load(const char* path, int* err) {
+    // 先打开再对文件描述符 fstat, 检查的和之后发送的一定是同一个文件 (路径可能在两步之间被替换)
+    FileEntryPtr entry = std::make_shared<FileEntry>();
+    entry->fd = open(path, O_RDONLY);
+    if (entry->fd < 0) {
+        *err = errno;
+        return FileEntryPtr();
+    }
+    struct stat st;
+    if (fstat(entry->fd, &st) < 0) {
+        *err = errno;
+        return FileEntryPtr();
+    }
+    // 对所有用户可读的文件才允许访问
+    if (!(st.st_mode & S_IROTH)) {
+        *err = EACCES;
+        return FileEntryPtr();
+    }
+    if (S_ISDIR(st.st_mode)) {
+        *err = EISDIR;
+        return FileEntryPtr();
+    }
+
+    if (st.st_size > 0 && m_map_files) {
+        void* address = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, entry->fd, 0);
+        if (address == MAP_FAILED) {
+            *err = errno;
+            return FileEntryPtr();
+        }
+        entry->address = (char*)address;
+    }
+
+    entry->path = path;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->version = FileVersion(st);
+    entry->checked = time(NULL);
+    entry->mime = mime_type(path, &entry->compressible);
+
+    // 预先生成缓存相关的响应头, 每次响应直接拷贝
+    entry->make_header(NULL);
+
+    *err = 0;
+    return entry;
+}
+
+void FileCache::insert(Shard& shard, const FileEntryPtr& entry) {
+    // 其他线程可能已经放入了同一个文件, 用新的条目替换掉
+    if (shard.index.count(entry->path)) {
+        erase(shard, entry->path);
+    }
+
+    shard.lru.push_front(entry);
+    shard.index[entry->path] = shard.lru.begin();
+    m_entries.fetch_add(1, std::memory_order_relaxed);
+    m_bytes.fetch_add(entry->size, std::memory_order_relaxed);
+}
+
+void FileCache::erase(Shard& shard, const std::string& path) {
+    auto it = shard.index.find(path);
+    if (it == shard.index.end()) {
+        return;
+    }
+    m_entries.fetch_sub(1, std::memory_order_relaxed);
+    m_bytes.fetch_sub((*it->second)->size, std::memory_order_relaxed);
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+}
+
+void FileCache::evict(Shard& from) {
+    // 从 from 后面的分片开始, 每个分片从表尾淘汰, 直到条目数和字节数都回到上限之内
+    // 刚刚加入的条目所在的分片放在最后, 一次只持有一个分片的锁
+    int start = &from - m_shards;
+    for (int i = 1; i <= SHARD_COUNT; ++i) {
+        if (m_entries.load(std::memory_order_relaxed) <= m_max_entries &&
+            m_bytes.load(std::memory_order_relaxed) <= m_max_bytes) {
+            return;
+        }
+        Shard& shard = m_shards[(start + i) % SHARD_COUNT];
+        shard.locker.lock();
+        while (!shard.lru.empty() && (m_entries.load(std::memory_order_relaxed) > m_max_entries ||
+                                      m_bytes.load(std::memory_order_relaxed) > m_max_bytes)) {
+            std::string victim = shard.lru.back()->path;
+            erase(shard, victim);
+        }
+        shard.locker.unlock();
+    }
+}
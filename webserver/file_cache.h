@@ -0,0 +1,116 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "locker.h"
+#include "workqueue.h"
+
+// 文件的版本: 设备号和 inode (文件被 rename 替换时会变), 大小, 纳秒精度的修改时间
+// 同一秒之内被替换成同样大小的文件也能区分出来
+struct FileVersion {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    FileVersion();
+    explicit FileVersion(const struct stat& st);
+    bool operator==(const FileVersion& other) const;
+    bool operator!=(const FileVersion& other) const { return !(*this == other); }
+};
+
+// 被缓存的文件: 打开的文件描述符, 内存映射, 以及预先生成好的 ETag / Last-Modified / Content-Type 响应头
+// 多个 http_conn 可以通过 shared_ptr 共享同一个映射, 被淘汰的条目在最后一个使用者释放之后才会 munmap
+struct FileEntry {
+    std::string path;     // 文件的完整路径, 也就是缓存的键
+    int fd;               // 只读打开的文件描述符, sendfile 使用 (带偏移量调用, 不会改变文件的读写位置)
+    char* address;        // 文件的内存映射, 空文件或者不映射文件 (sendfile 模式) 时为 NULL
+    off_t size;           // 文件大小
+    time_t mtime;         // 文件的修改时间 (秒), 用于 Last-Modified 和 If-Modified-Since
+    FileVersion version;  // 文件的版本, 用来判断缓存是否过期和生成 ETag (压缩的版本使用原文件的版本)
+    time_t checked;       // 上一次 stat 检查的时间
+    const char* mime;     // Content-Type, 未知的类型为 NULL
+    bool compressible;    // 是否值得 gzip 压缩
+    char etag[80];        // 带引号的 ETag, 用来处理 If-None-Match 和 If-Range
+    int etag_len;
+    char header[320];     // "ETag: ...\r\nLast-Modified: ...\r\nAccept-Ranges: bytes\r\nContent-Type: ...\r\n"
+    int header_len;
+    int type_offset;      // header 中 "Content-Type: ...\r\n" 这一行的位置和长度 (没有时长度为 0),
+    int type_len;         // multipart/byteranges 响应把它从响应头移到每个部分的头部
+
+    FileEntry();
+    ~FileEntry();
+
+    // 根据 version, mtime 和 mime 生成 ETag 和预先拼好的响应头
+    // encoding 不为 NULL 时这是压缩过的版本: ETag 加上后缀, 响应头加上 Content-Encoding
+    void make_header(const char* encoding);
+};
+
+typedef std::shared_ptr<FileEntry> FileEntryPtr;
+
+// 进程内共享的文件缓存, 以文件路径为键, 按 LRU 淘汰, 同时限制条目数和映射的总字节数
+// 命中的条目在 m_revalidate_interval 秒之内不会再调用 stat, 超过之后按文件的版本重新验证
+// 按路径的哈希值分成 SHARD_COUNT 个分片, 每个分片有自己的锁和 LRU 链表, 各个事件循环的快速路径不会在同一把锁上排队
+// 条目数和字节数的上限是所有分片共享的, 超过时从其他分片开始淘汰, 所以 LRU 只是近似的
+class FileCache {
+public:
+ static const int SHARD_COUNT = 16;
+
+ static FileCache* get_instance();
+
+ // 设置缓存的上限, 需要在工作线程启动之前调用
+ // map_files 为 false 时 (文件体总是用 sendfile 发送) 只打开文件, 不建立内存映射
+ void init(size_t max_entries, size_t max_bytes, bool map_files = true, int revalidate_interval = 1);
+
+ // 获取 path 对应的文件, 失败时返回空指针, 并把原因写入 err:
+ // ENOENT 文件不存在, EACCES 没有读权限, EISDIR 是目录, 其他值表示内部错误
+ FileEntryPtr acquire(const char* path, int* err);
+
+ // 只在缓存中查找, 条目存在并且不需要重新验证时才返回它, 不会调用 stat 或者打开文件
+ // 事件循环的线程用它处理缓存命中的请求, 返回空指针时交给工作线程调用 acquire
+ FileEntryPtr lookup(const char* path);
+
+ // 单个文件超过这个大小就不放入缓存, 只返回给调用者临时使用
+ size_t max_file_size() const { return m_max_bytes / 4; }
+
+ // 最近使用的最多 limit 个文件的路径, 最近使用的在前面; reload 时交给新进程预热它的缓存
+ std::vector<std::string> hot_paths(size_t limit);
+
+private:
+ FileCache();
+ ~FileCache();
+
+ typedef std::list<FileEntryPtr> LruList;
+
+ struct alignas(CACHE_LINE_SIZE) Shard {
+     LruList lru;               // 表头是最近使用的条目
+     std::unordered_map<std::string, LruList::iterator> index;
+     Locker locker;             // 保护这个分片的 lru 和 index
+ };
+
+ FileEntryPtr load(const char* path, int* err);            // 打开并映射文件
+ Shard& shard_of(const std::string& path);
+ void insert(Shard& shard, const FileEntryPtr& entry);     // 加入缓存, 调用者持有 shard 的锁
+ void erase(Shard& shard, const std::string& path);        // 从缓存中移除一个条目, 调用者持有 shard 的锁
+ void evict(Shard& from);                                  // 超过上限时淘汰, 最后才淘汰 from 分片 (调用者不能持有任何分片的锁)
+
+private:
+ size_t m_max_entries;          // 最多缓存的文件数量
+ size_t m_max_bytes;            // 最多缓存的映射字节数
+ int m_revalidate_interval;     // 两次 stat 之间的最小间隔 (秒)
+ bool m_map_files;              // 新加载的文件是否 mmap
+ std::atomic<size_t> m_entries; // 当前缓存的文件数量
+ std::atomic<size_t> m_bytes;   // 当前缓存的映射字节数
+ Shard m_shards[SHARD_COUNT];
+};
+
+#endif
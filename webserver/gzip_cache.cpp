@@ -0,0 +1,209 @@
+#include "gzip_cache.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "metrics.h"
+#include "log.h"
+
+GzipCache::GzipCache(): m_max_entries(512), m_max_bytes(32 * 1024 * 1024), m_level(6), m_bytes(0) {
+
+}
+
+GzipCache::~GzipCache() {
+
+}
+
+GzipCache* GzipCache::get_instance() {
+    static GzipCache instance;
+    return &instance;
+}
+
+void GzipCache::init(size_t max_entries, size_t max_bytes, int level) {
+    m_locker.lock();
+    m_max_entries = max_entries;
+    m_max_bytes = max_bytes;
+    m_level = level;
+    m_locker.unlock();
+}
+
+FileEntryPtr GzipCache::acquire(const FileEntryPtr& file) {
+    m_locker.lock();
+    auto it = m_index.find(file->path);
+    if (it != m_index.end()) {
+        if (it->second->version == file->version) {
+            // 命中: 移到 LRU 表头
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            FileEntryPtr entry = it->second->entry;
+            m_locker.unlock();
+            return entry;
+        }
+        // 原文件已经被修改, 丢弃旧的版本
+        erase(file->path);
+    }
+    if (m_pending.count(file->path)) {
+        // 另一个线程正在压缩, 这个请求先发送原文件
+        m_locker.unlock();
+        return FileEntryPtr();
+    }
+    m_pending.insert(file->path);
+    m_locker.unlock();
+
+    // 在锁外映射或者压缩, 避免阻塞其他线程
+    FileEntryPtr entry = load_sibling(file);
+    if (!entry) {
+        entry = compress(file);
+    }
+
+    Variant variant = { file->path, file->version, entry };
+    m_locker.lock();
+    m_pending.erase(file->path);
+    if (!entry || (size_t)entry->size <= m_max_bytes / 4) {
+        insert(variant);
+    }
+    m_locker.unlock();
+    return entry;
+}
+
+bool GzipCache::lookup(const FileEntryPtr& file, FileEntryPtr* variant) {
+    bool found = false;
+    variant->reset();
+    m_locker.lock();
+    auto it = m_index.find(file->path);
+    if (it != m_index.end() && it->second->version == file->version) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        *variant = it->second->entry;
+        found = true;
+    } else if (m_pending.count(file->path)) {
+        // 和 acquire 一样, 另一个线程正在压缩时先发送原文件
+        found = true;
+    }
+    m_locker.unlock();
+    return found;
+}
+
+// 原文件旁边的 "路径.gz", 必须不比原文件旧, 否则内容可能已经过期
+FileEntryPtr GzipCache::load_sibling(const FileEntryPtr& file) {
+    // 和 FileCache::load 一样先打开再 fstat, 映射的长度和检查过的一定是同一个文件的
+    std::string path = file->path + ".gz";
+    FileEntryPtr entry = std::make_shared<FileEntry>();
+    entry->fd = open(path.c_str(), O_RDONLY);
+    if (entry->fd < 0) {
+        return FileEntryPtr();
+    }
+    struct stat st;
+    if (fstat(entry->fd, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH) ||
+        st.st_mtime < file->mtime || st.st_size == 0) {
+        return FileEntryPtr();
+    }
+    void* address = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, entry->fd, 0);
+    if (address == MAP_FAILED) {
+        return FileEntryPtr();
+    }
+    entry->address = (char*)address;
+    entry->path = path;
+    entry->size = st.st_size;
+    entry->mtime = file->mtime;  // Last-Modified 和条件请求仍然以原文件为准
+    entry->version = file->version;
+    entry->checked = time(NULL);
+    entry->mime = file->mime;
+    entry->compressible = true;
+    entry->make_header("gzip");
+    return entry;
+}
+
+// 压缩到一块匿名映射中, 压缩完再缩小到实际的大小, FileEntry 析构时和文件映射一样 munmap
+FileEntryPtr GzipCache::compress(const FileEntryPtr& file) {
+    if (file->size < MIN_SIZE || (size_t)file->size > m_max_bytes / 4) {
+        return FileEntryPtr();
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 加 16 表示输出 gzip 格式 (而不是 zlib 格式)
+    if (deflateInit2(&zs, m_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return FileEntryPtr();
+    }
+    size_t bound = deflateBound(&zs, file->size);
+    void* out = mmap(NULL, bound, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (out == MAP_FAILED) {
+        deflateEnd(&zs);
+        return FileEntryPtr();
+    }
+    // sendfile 模式下文件缓存没有映射文件, 压缩时临时映射一下
+    char* in = file->address;
+    if (!in) {
+        void* mapped = mmap(0, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        in = mapped == MAP_FAILED ? NULL : (char*)mapped;
+    }
+    if (!in) {
+        munmap(out, bound);
+        deflateEnd(&zs);
+        return FileEntryPtr();
+    }
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = file->size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+    if (in != file->address) {
+        munmap(in, file->size);
+    }
+
+    // 至少要省下 10% 才值得发送压缩的版本
+    if (ret != Z_STREAM_END || len >= (size_t)(file->size - file->size / 10)) {
+        munmap(out, bound);
+        return FileEntryPtr();
+    }
+    void* address = mremap(out, bound, len, 0);
+    if (address == MAP_FAILED) {
+        munmap(out, bound);
+        return FileEntryPtr();
+    }
+    mprotect(address, len, PROT_READ);
+    metric_gzip_compressions.add();
+    LOG_DEBUG("compressed %s: %lld -> %lld bytes", file->path.c_str(), (long long)file->size, (long long)len);
+
+    FileEntryPtr entry = std::make_shared<FileEntry>();
+    entry->address = (char*)address;
+    entry->path = file->path;
+    entry->size = len;
+    entry->mtime = file->mtime;
+    entry->version = file->version;
+    entry->checked = time(NULL);
+    entry->mime = file->mime;
+    entry->compressible = true;
+    entry->make_header("gzip");
+    return entry;
+}
+
+void GzipCache::insert(const Variant& variant) {
+    if (m_index.count(variant.path)) {
+        erase(variant.path);
+    }
+
+    m_lru.push_front(variant);
+    m_index[variant.path] = m_lru.begin();
+    m_bytes += variant.entry ? variant.entry->size : 0;
+
+    while (m_lru.size() > m_max_entries || m_bytes > m_max_bytes) {
+        std::string victim = m_lru.back().path;
+        erase(victim);
+    }
+}
+
+void GzipCache::erase(const std::string& path) {
+    auto it = m_index.find(path);
+    if (it == m_index.end()) {
+        return;
+    }
+    m_bytes -= it->second->entry ? it->second->entry->size : 0;
+    m_lru.erase(it->second);
+    m_index.erase(it);
+}
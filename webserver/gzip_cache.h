@@ -0,0 +1,66 @@
+#ifndef GZIPCACHE_H
+#define GZIPCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "locker.h"
+#include "file_cache.h"
+
+// 文件的 gzip 版本的缓存, 以原文件的路径为键, 按 LRU 淘汰, 同时限制条目数和压缩后的总字节数
+//
+// 原文件旁边有更新的 "路径.gz" 时直接映射它 (预先压缩好的版本, 也可以用 sendfile 发送),
+// 否则由第一个请求它的工作线程压缩一次, 结果放在匿名映射中, 之后的请求和原文件一样零拷贝发送
+// 条目记录了生成它时原文件的 mtime 和大小, 原文件被修改之后重新生成; 单独修改 .gz 文件要等条目被淘汰才会生效
+// 压缩之后没有明显变小的文件也会记录下来 (没有 gzip 版本), 避免每次请求都重新压缩
+class GzipCache {
+public:
+ static const off_t MIN_SIZE = 256;  // 小于这个大小的文件不值得压缩
+
+ static GzipCache* get_instance();
+
+ // 设置缓存的上限和压缩级别, max_bytes 为 0 表示关闭 gzip, 需要在工作线程启动之前调用
+ void init(size_t max_entries, size_t max_bytes, int level = 6);
+ bool enabled() const { return m_max_bytes > 0; }
+
+ // 获取 file 的 gzip 版本, 没有 (不值得压缩, 或者另一个线程正在压缩) 时返回空指针, 调用者发送原文件
+ FileEntryPtr acquire(const FileEntryPtr& file);
+
+ // 只在缓存中查找, 不会映射或者压缩: 已经有结论 (包括不值得压缩和正在压缩) 时返回 true, gzip 版本写入 variant (可能为空)
+ // 返回 false 表示需要由工作线程调用 acquire 生成
+ bool lookup(const FileEntryPtr& file, FileEntryPtr* variant);
+
+private:
+ GzipCache();
+ ~GzipCache();
+
+ FileEntryPtr load_sibling(const FileEntryPtr& file); // 映射预先压缩好的 .gz 文件
+ FileEntryPtr compress(const FileEntryPtr& file);     // 在当前线程中压缩
+
+ // 一个原文件的 gzip 版本, entry 为空表示不值得压缩
+ struct Variant {
+     std::string path;
+     FileVersion version; // 生成时原文件的版本
+     FileEntryPtr entry;
+ };
+ typedef std::list<Variant> LruList;
+
+ void insert(const Variant& variant);
+ void erase(const std::string& path);
+
+private:
+ size_t m_max_entries;
+ size_t m_max_bytes;
+ int m_level;                   // zlib 的压缩级别
+ size_t m_bytes;                // 当前缓存的压缩后的字节数
+ LruList m_lru;                 // 表头是最近使用的条目
+ std::unordered_map<std::string, LruList::iterator> m_index;
+ std::unordered_set<std::string> m_pending; // 正在被某个线程压缩的文件
+ Locker m_locker;               // 保护上面的所有成员
+};
+
+#endif
@@ -1,7 +1,16 @@
 #include "http_conn.h"
 
-int http_conn::m_epollfd = -1;
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<bool> http_conn::m_draining(false);
+const char* http_conn::m_doc_root = "./resources";
+http_conn::SEND_MODE http_conn::m_send_mode = http_conn::SEND_AUTO;
+off_t http_conn::m_sendfile_threshold = 256 * 1024;
+int http_conn::m_keep_alive_max_timeout = 15;
+int http_conn::m_keep_alive_max = 100;
+int http_conn::m_header_timeout = 10;
+int http_conn::m_idle_timeout = 60;
+const char* http_conn::m_upload_dir = "";
+off_t http_conn::m_max_body = 1024LL * 1024 * 1024;
 
 // 设置文件描述符非阻塞
 void setnonblocking(int fd) {
@@ -18,7 +27,7 @@ void addfd(int epollfd, int fd, bool one_shot) {
 
     // 使用 one shot 之后， 每次事件被触发都需要重新注册
     if (one_shot) {
-        event.events | EPOLLONESHOT;
+        event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
 
@@ -26,9 +35,11 @@ void addfd(int epollfd, int fd, bool one_shot) {
     setnonblocking(fd);
 }
 
-// 从 epoll 中删除文件描述符
+// 从 epoll 中删除文件描述符, epollfd 为 -1 时只关闭它
 void removefd(int epollfd, int fd) {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+    if (epollfd != -1) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+    }
     close(fd);
 }
 
@@ -42,9 +53,12 @@ void modfd(int epollfd, int fd, int ev) {
 }
 
 // 初始化连接
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, int loop_id) {
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_loop = NULL;
+    m_loop_id = loop_id;
 
     // 设置端口复用
     int reuse = 1;
@@ -57,43 +71,140 @@ void http_conn::init(int sockfd, const sockaddr_in& addr) {
     init();
 }
 
-// 初始化解析 HTTP 报文所需要的变量
-// 这里分开来写是因为这个初始化的函数会被调用多次    
+// 初始化由 io_uring 事件循环驱动的连接, 数据的收发都由事件循环提交给内核, 这里不需要注册任何事件
+void http_conn::init(int sockfd, const sockaddr_in& addr, ConnLoop* loop, int loop_id) {
+    m_sockfd = sockfd;
+    m_address = addr;
+    m_epollfd = -1;
+    m_loop = loop;
+    m_loop_id = loop_id;
+    setnonblocking(sockfd);
+    m_user_count++;
+
+    init();
+}
+
+// 初始化连接其余的信息, 只在新连接建立时调用一次
+// 读缓冲区不需要清空, 解析只会访问 [0, m_read_idx) 之间的数据
 void http_conn::init() {
-    m_check_state = CHECK_STATE_REQUESTLINE;  // 初始化状态为解析请求首行
-    m_checked_index = 0;
-    m_start_line = 0;
     m_read_idx = 0;
+    m_checked_index = 0;
+    m_requests = 0;
+    m_keep_alive_timeout = m_keep_alive_max_timeout;
+    m_keep_conn = false;
+    m_pipelined = false;
+    m_status = 0;
+    m_body_bytes = 0;
+
+    init_write();
+    init_request();
+}
+
+// 初始化解析一个 HTTP 请求所需要的变量, 每个请求处理完之后都会调用
+// 读缓冲区中 m_checked_index 之后的数据属于下一个 (流水线上的) 请求, 保留下来继续解析
+void http_conn::init_request() {
+    m_check_state = CHECK_STATE_REQUESTLINE;  // 初始化状态为解析请求首行
+    m_start_line = m_checked_index;
+    m_request_start = m_checked_index;
 
     m_method = GET;
-    m_url = 0;
-    m_version = 0;
+    m_url.off = m_url.len = 0;
+    m_version.off = m_version.len = 0;
+    m_host.off = m_host.len = 0;
+    m_line_len = 0;
+    m_header_count = 0;
     m_linger = false;
+    m_range_count = 0;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE); // 清空读缓冲区的数据 
+    m_content_length = -1;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_body_state = BODY_DATA;
+    m_body_remaining = 0;
+    m_body_received = 0;
+    m_body_limit = m_max_body;
+    m_route = NULL;
+    m_allowed = 0;
+    if (m_body_sink) {
+        // 请求出错时请求体没有收完, 删除已经写了一部分的文件
+        m_body_sink->abort();
+        m_body_sink = NULL;
+    }
+}
+
+// 初始化发送响应所需要的变量, 一批响应全部发送完之后调用
+void http_conn::init_write() {
+    m_write_idx = 0;
+    m_iv_count = 0;
+    m_iv_index = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+    m_file_offset = 0;
+    m_file_size = 0;
+}
+
+// 把已经处理完的请求从读缓冲区中移除, 当前请求没有解析完的数据移动到缓冲区的开头
+// 解析出来的位置都是相对于请求起始位置的偏移量, 移动之后不需要修改
+void http_conn::compact() {
+    int shift = m_request_start;
+    if (shift <= 0) {
+        return;
+    }
+    memmove(m_read_buf.data(), m_read_buf.data() + shift, m_read_idx - shift);
+    m_read_idx -= shift;
+    m_checked_index -= shift;
+    m_start_line -= shift;
+    m_request_start = 0;
 }
 
 // 关闭连接
 void http_conn::close_conn() {
     if (m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        unmap();
+        if (m_body_sink) {
+            m_body_sink->abort();
+            m_body_sink = NULL;
+        }
+        m_relay.abort();
+        m_read_buf.release();
+        m_write_buf.release();
+        // 最后才关闭 socket: 关闭之后这个编号马上就可能分配给新的连接
+        int sockfd = m_sockfd;
         m_sockfd = -1;
         m_user_count--; // 客户数量 - 1 
+        removefd(m_epollfd, sockfd);
     }
 }
 
-bool http_conn::read() {
-    // printf("read data all at once...\n");
-
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
+// 非阻塞地发送一次, 发送缓冲区满了也不再等待, 过载时不值得为这个响应占用更多资源
+void http_conn::send_overload(int sockfd) {
+    ssize_t n = send(sockfd, overload_response.data, overload_response.size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) {
+        metric_bytes_out.add(n);
     }
+    metrics_count_response(503);
+}
+
+bool http_conn::read() {
+    // 先腾出前面已经处理完的请求所占用的空间
+    compact();
 
     // 读取到的字节
     int bytes_read = 0;
     while (true) {
+        if (m_read_idx == m_read_buf.capacity()) {
+            // 缓冲区满了 (或者空闲的连接还没有缓冲区), 从内存池换一个大一级的内存块
+            // 已经达到最大的内存块时说明请求太大了
+            // 正在接收请求体时则先停止读取, 工作线程把缓冲区中的请求体交出去之后再继续, socket 中剩下的数据会再次触发 EPOLLIN
+            // 请求头和请求体 (或者后面的流水线请求) 一起到达, 工作线程还没有解析时, 缓冲区中已经有完整的请求头, 也是一样
+            // 否则是请求头太大, 也交给工作线程, 由它回复 431 之后关闭连接
+            if (!m_read_buf.reserve(m_read_idx + 1, m_read_idx)) {
+                return true;
+            }
+        }
+
         // 把 m_read_idx 之后的数据一次读取出来
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        bytes_read = recv(m_sockfd, m_read_buf.data() + m_read_idx, m_read_buf.capacity() - m_read_idx, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据
@@ -104,12 +215,29 @@ bool http_conn::read() {
             // 对方关闭连接
             return false;
         }
-        printf("Data read: %s\n", m_read_buf);
+        LOG_DEBUG("fd %d read %d bytes: %.*s", m_sockfd, bytes_read, bytes_read, m_read_buf.data() + m_read_idx);
         m_read_idx += bytes_read;
+        metric_bytes_in.add(bytes_read);
     }
     return true;
 }
 
+// 事件循环已经收到的数据, 追加到读缓冲区中, 空间不够时和 read() 一样换一个大一级的内存块
+// 最大的内存块也放不下时只追加能放下的部分, 剩下的由事件循环保留, 等工作线程处理完缓冲区中的数据之后再追加
+int http_conn::append_input(const char* data, int len) {
+    compact();
+    if (len > Buffer::MAX_SIZE - m_read_idx) {
+        len = Buffer::MAX_SIZE - m_read_idx;
+    }
+    if (m_read_idx + len > m_read_buf.capacity() && !m_read_buf.reserve(m_read_idx + len, m_read_idx)) {
+        return 0;
+    }
+    memcpy(m_read_buf.data() + m_read_idx, data, len);
+    m_read_idx += len;
+    metric_bytes_in.add(len);
+    return len;
+}
+
 // 解析 HTTP 请求
 http_conn::HTTP_CODE http_conn::process_read() {
     LINE_STATUS line_status = LINE_OK;
@@ -121,13 +249,14 @@ http_conn::HTTP_CODE http_conn::process_read() {
         || (line_status = parse_line()) == LINE_OK) {
             // 解析到了完整的一行, 或者解析到了请求主体 (同时也是完整数据)
 
-            // 获取一行数据
+            // 获取一行数据, 行不再以 '\0' 结尾, 长度是 m_line_len
         text = get_line();
-        printf("receive 1 http line: %s\n", text);
+        m_start_line = m_checked_index; // 下一行的起始位置
+        LOG_DEBUG("fd %d line: %.*s", m_sockfd, m_line_len, text);
 
         switch (m_check_state) {
             case CHECK_STATE_REQUESTLINE: {
-                ret = parse_request_line(text);
+                ret = parse_request_line(text, m_line_len);
                 if (ret == BAD_REQUEST) {
                   return BAD_REQUEST;
                 }
@@ -135,19 +264,24 @@ http_conn::HTTP_CODE http_conn::process_read() {
             }
 
             case CHECK_STATE_HEADER: {
-                ret = parse_headers(text);
-                if (ret == BAD_REQUEST) {
-                  return BAD_REQUEST;
-                } else if (ret == GET_REQUEST) {
-                  // 成功扫描完成请求头部的数据
+                ret = parse_headers(text, m_line_len);
+                if (ret == GET_REQUEST) {
+                  // 成功扫描完成请求头部的数据, 并且没有请求体
                   return do_request();
+                } else if (ret != NO_REQUEST) {
+                  // 请求错误, 或者需要先回复 100 Continue
+                  return ret;
                 }
+                break;
             }
 
             case CHECK_STATE_CONTENT: {
-                ret = parse_content(text);
+                ret = parse_content();
                 if (ret == GET_REQUEST) {
+                  // 请求体接收完毕
                   return do_request();
+                } else if (ret != NO_REQUEST) {
+                  return ret;
                 }
 
                 line_status = LINE_OPEN;
@@ -160,122 +294,1640 @@ http_conn::HTTP_CODE http_conn::process_read() {
         }
     }
 
+    if (line_status == LINE_BAD) {
+        return BAD_REQUEST;
+    }
+    if (m_check_state != CHECK_STATE_CONTENT && m_request_start == 0 && m_read_idx == Buffer::MAX_SIZE) {
+        // 读缓冲区已经是最大的内存块, 而且全部是这个请求的请求头, 再等下去也收不完
+        return HEADER_TOO_LARGE;
+    }
     return NO_REQUEST;
 }
 
 // 先从缓冲区中提取一行出来, 然后交给解析函数解析
+// 用向量指令一次扫描 16/32 字节查找 '\n', 行的内容是 [m_start_line, '\r'), 长度记录在 m_line_len 中
+// 不修改读缓冲区, 之后的解析都使用 (偏移量, 长度) 来表示其中的数据
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-
-    for (; m_checked_index < m_read_idx; ++m_checked_index) {
-        temp = m_read_buf[m_checked_index];
-        if (temp == '\r') { // 扫描到了倒数第二位
-            if (m_checked_index + 1 == m_read_idx) { // 没有扫描到完整的行
-                return LINE_OPEN;
-            } else if (m_read_buf[m_checked_index + 1] == '\n') { // 扫描到了完整的行
-                m_read_buf[m_checked_index++] = '\0'; // 设置结束的位置
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        } else if (temp == '\n') {
-            // 出现这种情况: “\nHost: ...\r\n"
-            if (m_checked_index > 1 && m_read_buf[m_checked_index - 1] == '\r') {
-                // 把 “\r\n" 换成 “\0\0"
-                m_read_buf[m_checked_index - 1] = '\0'; 
-                m_read_buf[m_checked_index++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        }
+    const char* line = m_read_buf.data() + m_start_line;
+    const char* end = m_read_buf.data() + m_read_idx;
+    const char* nl = find_byte(m_read_buf.data() + m_checked_index, end, '\n');
+    if (nl == end) {
+        // 没有扫描到完整的行, 下次从这里继续扫描
+        m_checked_index = m_read_idx;
+        return LINE_OPEN;
     }
-    return LINE_OPEN;
 
-    /*
-        解析这里没看懂的话去看游双的书第 9 章
-    */
+    // 行必须以 "\r\n" 结尾
+    if (nl == line || nl[-1] != '\r') {
+        return LINE_BAD;
+    }
+    m_line_len = nl - 1 - line;
+    m_checked_index = nl + 1 - m_read_buf.data();
+    return LINE_OK;
 }
 
 // 解析 HTTP 请求首行, 获得请求方法, 目标 URL, HTTP 版本
-http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
+http_conn::HTTP_CODE http_conn::parse_request_line(char* text, int len) {
     // GET /index.html HTTP/1.1
-    // The function returns a pointer to the first occurence of any character from the second arg
-    m_url = strpbrk(text, " \t");
-
-    // GET\0/index.html HTTP/1.1
-    *m_url++ = '\0';
+    const char* end = text + len;
+    const char* sp = find_any(text, end, " \t", 2);
+    if (sp == end) {
+        return BAD_REQUEST;
+    }
 
-    char *method = text; 
-    if (strcasecmp(method, "GET") == 0) {
-        m_method = GET;
-    } else {
+    // 请求方法: [text, sp), 在编译期生成的完美哈希表中查找, 这个路径是否支持它在请求头收完之后再检查
+    int method = http_methods.find(text, sp - text);
+    if (method < 0) {
         return BAD_REQUEST;
     }
+    m_method = (METHOD)method;
 
     // /index.html HTTP/1.1
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version) {
+    const char* url = sp;
+    while (url < end && (*url == ' ' || *url == '\t')) {
+        ++url;
+    }
+    const char* url_end = find_any(url, end, " \t", 2);
+    if (url_end == end) {
         return BAD_REQUEST;
     }
-    // /index.html\0HTTP/1.1
-    *m_version++ = '\0';
-    if (strcasecmp(m_version, "HTTP/1,1") != 0) {
+
+    // HTTP/1.1
+    const char* version = url_end;
+    while (version < end && (*version == ' ' || *version == '\t')) {
+        ++version;
+    }
+    int version_len = end - version;
+
+    // HTTP/1.1 默认保持连接, HTTP/1.0 默认关闭连接, 之后可以被 Connection 头部字段修改
+    if (version_len == 8 && strncasecmp(version, "HTTP/1.1", 8) == 0) {
+        m_linger = true;
+    } else if (version_len == 8 && strncasecmp(version, "HTTP/1.0", 8) == 0) {
+        m_linger = false;
+    } else {
         return BAD_REQUEST;
     }
+    m_version = make_slice(version, version_len);
 
     // http://192.168.1.1:10000/index.html
-    if (strcasecmp(m_url, "http://", 7) == 0) {
-        m_url += 7; // 跳过前面的http://
-        m_url = strchr(m_url, '/');  // /index.html
+    if (url_end - url >= 7 && strncasecmp(url, "http://", 7) == 0) {
+        url += 7; // 跳过前面的http://
+        url = find_byte(url, url_end, '/');  // /index.html
     }
 
-    if (!m_url || m_url[0] != '/') {
+    if (url == url_end || url[0] != '/') {
         return BAD_REQUEST;
     }
+    m_url = make_slice(url, url_end - url);
 
     m_check_state = CHECK_STATE_HEADER; // 主状态机检查状态: 检查请求头
     return NO_REQUEST;
 }
 
 // 解析请求头
-http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
+// 每个头部字段的名字和值都记录到头部索引 m_headers 中, 常用的字段在这里直接处理
+http_conn::HTTP_CODE http_conn::parse_headers(char* text, int len) {
+    if (len == 0) {
+        // 遇到空行, 表示头部字段解析完毕
+        // 如果有请求体, 状态机转移到 CHECK_STATE_CONTENT, 否则说明已经得到了一个完整的 HTTP 请求
+        return begin_body();
+    }
+
+    // 字段名: 字段值
+    const char* end = text + len;
+    const char* colon = find_byte(text, end, ':');
+    if (colon == end || colon == text) {
+        return BAD_REQUEST;
+    }
+    if (m_header_count >= MAX_HEADERS) {
+        return BAD_REQUEST;
+    }
+
+    // 去掉字段值前后的空白
+    const char* value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    const char* value_end = end;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        --value_end;
+    }
+
+    // 字段名在编译期生成的完美哈希表中查找一次, 之后都按编号处理
+    HttpHeader& header = m_headers[m_header_count++];
+    header.name = make_slice(text, colon - text);
+    header.value = make_slice(value, value_end - value);
+    header.id = http_headers.find(text, colon - text);
+
+    switch (header.id) {
+        case HEADER_CONTENT_LENGTH: {
+            // 处理 Content-Length 头部字段, 只能是十进制数字, 出现多次时必须相同
+            off_t length = 0;
+            const char* p = value;
+            for (; p < value_end && *p >= '0' && *p <= '9' && p - value < 18; ++p) {
+                length = length * 10 + (*p - '0');
+            }
+            if (p == value || p != value_end || (m_content_length >= 0 && m_content_length != length)) {
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            break;
+        }
+        case HEADER_TRANSFER_ENCODING:
+            // 只支持 chunked, 其他的编码无法知道请求体在哪里结束, 只能关闭连接
+            if (value_end - value != 7 || strncasecmp(value, "chunked", 7) != 0) {
+                m_linger = false;
+                return NOT_IMPLEMENTED;
+            }
+            m_chunked = true;
+            break;
+        case HEADER_EXPECT:
+            m_expect_continue = has_token(value, value_end - value, "100-continue");
+            break;
+        case HEADER_CONNECTION:
+            // 处理 Connection 头部字段, 它的值是一个用逗号分隔的列表, 例如 "keep-alive, Upgrade"
+            if (has_token(value, value_end - value, "close")) {
+                m_linger = false;
+            } else if (has_token(value, value_end - value, "keep-alive")) {
+                m_linger = true;
+            }
+            break;
+        case HEADER_KEEP_ALIVE: {
+            // 处理 Keep-Alive 头部字段, 例如 "timeout=5, max=100"
+            // 客户端希望的超时时间比服务器的短时就采用客户端的
+            const char* timeout = (const char*)memmem(value, value_end - value, "timeout=", 8);
+            if (timeout) {
+                int timeout_value = atoi(timeout + 8);
+                if (timeout_value > 0 && timeout_value < m_keep_alive_timeout) {
+                    m_keep_alive_timeout = timeout_value;
+                }
+            }
+            break;
+        }
+        case HEADER_HOST:
+            // 处理 Host 头部字段
+            m_host = header.value;
+            break;
+        default:
+            // 其他的头部字段只记录在索引中
+            break;
+    }
+    return NO_REQUEST;
+}
+
+// 请求头解析完毕: 检查请求体的长度和编码, 决定请求体交给谁
+// 返回错误时请求体还没有读取, 连接上之后的数据已经无法解析, 回复之后关闭连接
+http_conn::HTTP_CODE http_conn::begin_body() {
+    if (m_inline && ((m_method != GET && m_method != HEAD) || m_chunked || m_content_length > 0)) {
+        // 上传要创建和写入文件, 请求体也可能很大, 都交给线程池
+        return DEFER_REQUEST;
+    }
+    HTTP_CODE ret = match_route();
+    if (ret != NO_REQUEST) {
+        // 这个路径不支持这个方法
+    } else if (m_chunked && m_content_length >= 0) {
+        // 同时有两种长度, 可能是请求走私, 直接拒绝
+        ret = BAD_REQUEST;
+    } else if (!m_chunked && m_content_length > m_body_limit) {
+        ret = PAYLOAD_TOO_LARGE;
+    } else if (m_checked_index - m_request_start > Buffer::MAX_SIZE / 2) {
+        // 请求头要一直保留到请求体收完, 太大的请求头会让读缓冲区没有空间接收请求体
+        ret = PAYLOAD_TOO_LARGE;
+    } else if (m_route) {
+        // 处理函数在请求体收完之后才被调用, 请求体先保存在内存中
+        m_route_body.open();
+        m_body_sink = &m_route_body;
+    } else if (m_method == POST || m_method == PUT) {
+        ret = open_upload();
+    }
+    if (ret != NO_REQUEST) {
+        m_linger = false;
+        return ret;
+    }
+
+    if (!m_chunked && m_content_length <= 0) {
+        return GET_REQUEST;
+    }
+    // 静态文件的 GET 请求的请求体没有接收者, 解码之后直接丢弃
+    m_check_state = CHECK_STATE_CONTENT;
+    m_body_state = m_chunked ? BODY_CHUNK_SIZE : BODY_DATA;
+    m_body_remaining = m_chunked ? 0 : m_content_length;
+    if (m_expect_continue && m_checked_index == m_read_idx) {
+        return CONTINUE_REQUEST;
+    }
+    return NO_REQUEST;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// 解码读缓冲区中已经收到的请求体, 解码出来的数据交给 m_body_sink
+// 处理过的数据 (包括 chunk 的分隔) 马上从读缓冲区中删除, 请求头和之后的流水线请求留在原来的位置
+http_conn::HTTP_CODE http_conn::parse_content() {
+    char* start = m_read_buf.data() + m_checked_index;
+    char* end = m_read_buf.data() + m_read_idx;
+    char* p = start;
+    HTTP_CODE ret = NO_REQUEST;
+    while (p < end && ret == NO_REQUEST) {
+        if (m_body_state == BODY_DATA) {
+            off_t n = end - p < m_body_remaining ? end - p : m_body_remaining;
+            if (m_body_received + n > m_body_limit) {
+                m_linger = false;
+                ret = PAYLOAD_TOO_LARGE;
+                break;
+            }
+            if (m_body_sink && !m_body_sink->write(p, n)) {
+                ret = INTERNAL_ERROR;
+                break;
+            }
+            p += n;
+            m_body_remaining -= n;
+            m_body_received += n;
+            if (m_body_remaining == 0) {
+                if (m_chunked) {
+                    m_body_state = BODY_CHUNK_END;
+                } else {
+                    ret = GET_REQUEST;
+                }
+            }
+            continue;
+        }
+
+        // 其他状态都以行为单位, 行必须以 "\r\n" 结尾
+        char* nl = (char*)find_byte(p, end, '\n');
+        if (nl == end) {
+            if (end - p > MAX_CHUNK_LINE) {
+                ret = BAD_REQUEST;
+            }
+            break;
+        }
+        if (nl == p || nl[-1] != '\r' || nl - p > MAX_CHUNK_LINE) {
+            ret = BAD_REQUEST;
+            break;
+        }
+        char* line_end = nl - 1;
+        if (m_body_state == BODY_CHUNK_SIZE) {
+            // "1a2b;name=value": 十六进制的 chunk 大小, 后面的扩展忽略
+            off_t size = 0;
+            char* q = p;
+            for (; q < line_end && hex_value(*q) >= 0 && q - p < 15; ++q) {
+                size = size * 16 + hex_value(*q);
+            }
+            if (q == p || (q < line_end && *q != ';' && *q != ' ' && *q != '\t')) {
+                ret = BAD_REQUEST;
+                break;
+            }
+            if (size == 0) {
+                m_body_state = BODY_TRAILER;
+            } else {
+                m_body_state = BODY_DATA;
+                m_body_remaining = size;
+            }
+        } else if (m_body_state == BODY_CHUNK_END) {
+            if (line_end != p) {
+                ret = BAD_REQUEST;
+                break;
+            }
+            m_body_state = BODY_CHUNK_SIZE;
+        } else if (line_end == p) {
+            // 尾部字段 (忽略) 之后的空行, 请求体结束
+            ret = GET_REQUEST;
+        }
+        p = nl + 1;
+    }
+
+    if (p > start) {
+        memmove(start, p, end - p);
+        m_read_idx -= p - start;
+    }
+    m_start_line = m_checked_index;
+    return ret;
+}
 
+// 在头部索引中查找编号为 id 的字段, 找到时返回它的值
+bool http_conn::get_header(HttpHeaderId id, const char** value, int* len) const {
+    for (int i = 0; i < m_header_count; ++i) {
+        const HttpHeader& header = m_headers[i];
+        if (header.id == id) {
+            *value = slice_ptr(header.value);
+            *len = header.value.len;
+            return true;
+        }
+    }
+    return false;
 }
 
-// 解析请求体
-http_conn::HTTP_CODE http_conn::parse_content(char* text) {
+// 判断用逗号分隔的头部字段值 [value, value + value_len) 中是否包含 token (不区分大小写)
+bool http_conn::has_token(const char* value, int value_len, const char* token) {
+    int len = strlen(token);
+    const char* end = value + value_len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            ++value;
+        }
+        const char* comma = find_byte(value, end, ',');
+        const char* item_end = comma;
+        while (item_end > value && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+            --item_end;
+        }
+        if (item_end - value == len && strncasecmp(value, token, len) == 0) {
+            return true;
+        }
+        value = comma;
+    }
+    return false;
+}
 
+// 把 URL 转换成 root 下的文件路径: 去掉查询字符串, 解码 %XX
+// 路径在当前线程的 arena 中, 只在这一次 process() 中有效
+// 解码之后含有 "/.." 时返回 FORBIDDEN_REQUEST (不允许访问 root 之外的文件), 编码错误或者含有 %00 时返回 BAD_REQUEST
+http_conn::HTTP_CODE http_conn::map_url(const char* root, const char* url, int url_len, char** path) {
+    const char* end = find_byte(url, url + url_len, '?');
+    int root_len = strlen(root);
+    if (root_len + (end - url) >= FILENAME_LEN) {
+        return BAD_REQUEST;
+    }
+
+    char* real_path = (char*)Arena::local()->alloc(root_len + (end - url) + 1, 1);
+    memcpy(real_path, root, root_len);
+    char* out = real_path + root_len;
+    for (const char* p = url; p < end; ++p) {
+        if (*p != '%') {
+            *out++ = *p;
+            continue;
+        }
+        int high, low;
+        if (end - p < 3 || (high = hex_value(p[1])) < 0 || (low = hex_value(p[2])) < 0 || (high | low) == 0) {
+            return BAD_REQUEST;
+        }
+        *out++ = (char)(high << 4 | low);
+        p += 2;
+    }
+    *out = '\0';
+
+    if (strstr(real_path + root_len, "/..")) {
+        return FORBIDDEN_REQUEST;
+    }
+    *path = real_path;
+    return NO_REQUEST;
 }
 
+// 在路由表中查找请求的路径 (不含查询字符串), 没有匹配任何路由的路径按静态文件处理
+http_conn::HTTP_CODE http_conn::match_route() {
+    const char* url = slice_ptr(m_url);
+    const char* path_end = find_byte(url, url + m_url.len, '?');
+    m_route = Router::get_instance()->match(m_method, url, path_end - url, NULL, &m_allowed);
+    if (m_route) {
+        m_body_limit = Router::MAX_BODY;
+        return NO_REQUEST;
+    }
+    if (!m_allowed) {
+        // 静态文件支持 GET 和 HEAD, 开启了上传时还支持 POST 和 PUT
+        m_allowed = 1 << GET | 1 << HEAD;
+        if (m_upload_dir[0]) {
+            m_allowed |= 1 << POST | 1 << PUT;
+        }
+    }
+    return (m_allowed & (1 << m_method)) ? NO_REQUEST : METHOD_NOT_ALLOWED;
+}
+
+// 当得到一个完整, 正确的 HTTP 请求时, 就从文件缓存中取得目标文件
+// 如果目标文件存在, 对所有用户可读, 且不是目录, 就决定文件体的发送方式:
+// mmap 模式使用缓存中的映射 m_file_address, sendfile 模式则使用缓存中的文件描述符 m_file_fd
+// 两种方式都不会把文件内容拷贝到用户空间的缓冲区中, 缓存命中时也不需要任何系统调用
 http_conn::HTTP_CODE http_conn::do_request() {
+    if (m_route) {
+        // 处理函数在生成响应时才调用, 快速路径上只调用不会阻塞的处理函数
+        if (m_body_sink) {
+            m_body_sink->finish();
+            m_body_sink = NULL;
+        }
+        if (m_route->upstream) {
+            // 和上游服务器交换数据要等待网络, 只在工作线程中进行
+            return m_inline ? DEFER_REQUEST : forward_request();
+        }
+        return m_inline && !m_route->fast ? DEFER_REQUEST : ROUTE_REQUEST;
+    }
+    if (m_method != GET && m_method != HEAD) {
+        return finish_upload();
+    }
+
+    // "/" 默认访问 index.html
+    const char* url = slice_ptr(m_url);
+    int url_len = m_url.len;
+    if (url_len == 1 && url[0] == '/') {
+        url = "/index.html";
+        url_len = 11;
+    }
+
+    char* real_file;
+    HTTP_CODE ret = map_url(m_doc_root, url, url_len, &real_file);
+    if (ret != NO_REQUEST) {
+        return ret;
+    }
+
+    // 快速路径只使用缓存中不需要重新验证的文件, 需要 stat 或者打开文件时交给线程池
+    int err = 0;
+    m_file = m_inline ? FileCache::get_instance()->lookup(real_file) : FileCache::get_instance()->acquire(real_file, &err);
+    if (!m_file && m_inline) {
+        return DEFER_REQUEST;
+    }
+    if (!m_file) {
+        if (err == ENOENT || err == ENOTDIR) {
+            return NO_RESOURCE;
+        } else if (err == EACCES) {
+            return FORBIDDEN_REQUEST;
+        } else if (err == EISDIR) {
+            return BAD_REQUEST;
+        }
+        return INTERNAL_ERROR;
+    }
+
+    // 内容协商: 客户端接受 gzip 时换成文件的 gzip 版本, 之后的条件请求和 Range 都针对这个版本
+    GzipCache* gzip = GzipCache::get_instance();
+    if (m_file->compressible && gzip->enabled() && accepts_gzip()) {
+        FileEntryPtr variant;
+        if (!m_inline) {
+            variant = gzip->acquire(m_file);
+        } else if (!gzip->lookup(m_file, &variant)) {
+            // 还没有决定过这个文件的 gzip 版本, 第一次需要映射 .gz 文件或者压缩
+            m_file.reset();
+            return DEFER_REQUEST;
+        }
+        if (variant) {
+            m_file = variant;
+            metric_gzip_responses.add();
+        }
+    }
+
+    // 条件请求: 客户端缓存的版本仍然有效时只回复 304, 不需要发送文件体
+    if (not_modified()) {
+        return NOT_MODIFIED;
+    }
+    m_range_count = parse_range();
+    if (m_range_count < 0) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    if (m_range_count > 1 && !m_file->address) {
+        // 多个区间需要文件的映射, sendfile 模式下没有映射, 忽略 Range 发送整个文件
+        m_range_count = 0;
+    }
+
+    // 多个区间的响应由多段响应头和文件体交替组成, 只能用 mmap 发送
+    // 在内存中压缩出来的 gzip 版本没有文件描述符, 也只能用 mmap 发送
+    bool use_sendfile = m_range_count <= 1 && m_file->fd != -1 && ((m_send_mode == SEND_SENDFILE) ||
+        (m_send_mode == SEND_AUTO && m_file->size >= m_sendfile_threshold));
+
+    if (m_file->size == 0) {
+        // 空文件只需要发送响应头
+        m_file_fd = -1;
+        m_file_address = NULL;
+    } else if (use_sendfile) {
+        // sendfile 模式下文件体在 write() 中由内核直接发送
+        m_file_fd = m_file->fd;
+        m_file_address = NULL;
+    } else {
+        m_file_fd = -1;
+        m_file_address = m_file->address;
+    }
+    return FILE_REQUEST;
+}
+
+// 反向代理: 选择一台上游服务器, 发送请求头和请求体, 读取响应头, 响应体留在上游连接中, 发送响应时由 m_relay 转发
+// 连接失败时换一台服务器; 复用的连接在空闲期间被上游关闭了 (请求没有被处理) 时换一个连接重试
+// 请求发出之后的错误不再重试, 上游可能已经处理了这个请求
+http_conn::HTTP_CODE http_conn::forward_request() {
+    UpstreamGroup* group = m_route->upstream;
+    const std::string& body = m_route_body.data();
+    ArenaString request;
+    build_upstream_request(&request);
+    char* head = (char*)Arena::local()->alloc(MAX_UPSTREAM_HEAD, 1);
+    int timeout = m_idle_timeout * 1000;
+    metric_upstream_requests.add();
+
+    unsigned failed = 0;   // 连接失败的服务器
+    int index;
+    while ((index = group->pick(m_address.sin_addr.s_addr, failed)) >= 0) {
+        Backend* backend = group->backend(index);
+        bool reused;
+        int fd = backend->acquire(m_loop_id, &reused);
+        if (fd == -1) {
+            LOG_WARN("failed to connect to upstream %s: %s", backend->name().c_str(), strerror(errno));
+            backend->report(false);
+            metric_upstream_errors.add();
+            failed |= 1u << index;
+            continue;
+        }
+
+        struct iovec iov[2];
+        iov[0].iov_base = (void*)request.data();
+        iov[0].iov_len = request.size();
+        iov[1].iov_base = (void*)body.data();
+        iov[1].iov_len = body.size();
+        int ret = upstream_send(fd, iov, 2, timeout);
+        if (ret == 0) {
+            // 1xx 的中间响应 (例如 103 Early Hints) 不转发, 继续读取最终的响应
+            do {
+                ret = upstream_read_head(fd, head, MAX_UPSTREAM_HEAD, timeout);
+                if (ret > 0 && !parse_upstream_head(head, ret, &m_upstream)) {
+                    ret = -EPROTO;
+                }
+            } while (ret > 0 && m_upstream.status < 200);
+        }
+        if (ret > 0) {
+            backend->report(true);
+            m_backend = backend;
+            m_upstream_fd = fd;
+            m_upstream_head = head;
+            m_upstream_head_len = ret;
+            return PROXY_REQUEST;
+        }
+
+        backend->release(m_loop_id, fd, false);
+        if (reused && (ret == 0 || ret == -EPIPE || ret == -ECONNRESET)) {
+            continue;
+        }
+        LOG_WARN("upstream %s failed: %s", backend->name().c_str(), ret == 0 ? "connection closed" : strerror(-ret));
+        backend->report(false);
+        metric_upstream_errors.add();
+        return ret == -ETIMEDOUT ? GATEWAY_TIMEOUT : BAD_GATEWAY;
+    }
+    LOG_WARN("no live upstream for %.*s", m_url.len, slice_ptr(m_url));
+    return BAD_GATEWAY;
+}
 
+// 转发给上游的请求头: 请求行和客户端的头部字段原样转发, 去掉逐跳的字段, 在 X-Forwarded-For 中加上客户端的地址
+// 请求体已经完整地收到 (chunked 已经解码), 长度总是由 Content-Length 给出
+// HTTP/1.0 的客户端也要求上游保持连接, 给客户端的响应是否保持连接由 m_linger 单独决定
+void http_conn::build_upstream_request(ArenaString* request) const {
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, client, sizeof(client));
+    ArenaString forwarded;
+    request->append(http_method_names[m_method]).append(" ", 1).append(slice_ptr(m_url), m_url.len);
+    request->append(" ", 1).append(slice_ptr(m_version), m_version.len).append("\r\n", 2);
+    for (int i = 0; i < m_header_count; ++i) {
+        const HttpHeader& header = m_headers[i];
+        switch (header.id) {
+            case HEADER_CONNECTION:
+            case HEADER_KEEP_ALIVE:
+            case HEADER_PROXY_CONNECTION:
+            case HEADER_TE:
+            case HEADER_UPGRADE:
+            case HEADER_TRANSFER_ENCODING:
+            case HEADER_CONTENT_LENGTH:
+            case HEADER_EXPECT:
+                break;
+            case HEADER_X_FORWARDED_FOR:
+                forwarded.append(slice_ptr(header.value), header.value.len).append(", ", 2);
+                break;
+            default:
+                request->append(slice_ptr(header.name), header.name.len).append(": ", 2);
+                request->append(slice_ptr(header.value), header.value.len).append("\r\n", 2);
+                break;
+        }
+    }
+    request->append("X-Forwarded-For: ").append(forwarded).append(client).append("\r\n", 2);
+    size_t body_len = m_route_body.data().size();
+    if (body_len > 0 || m_chunked || m_content_length >= 0) {
+        char length[32];
+        request->append(length, snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body_len));
+    }
+    if (m_version.len == 8 && slice_ptr(m_version)[7] == '0') {
+        request->append("Connection: keep-alive\r\n");
+    }
+    request->append("\r\n", 2);
 }
 
+// "HTTP/1.1 200 OK" 之后的头部字段中只关心决定响应体长度和连接能否复用的几个
+// 101 (协议升级) 不支持, 请求中的 Upgrade 已经去掉了, 上游不应该返回它
+bool http_conn::parse_upstream_head(const char* head, int len, UpstreamHead* result) {
+    if (len < 16 || memcmp(head, "HTTP/1.", 7) != 0 || (head[7] != '0' && head[7] != '1') || head[8] != ' ' ||
+        head[9] < '1' || head[9] > '9' || head[10] < '0' || head[10] > '9' || head[11] < '0' || head[11] > '9' ||
+        (head[12] != ' ' && head[12] != '\r')) {
+        return false;
+    }
+    result->status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+    if (result->status == 101) {
+        return false;
+    }
+    result->keep_alive = head[7] == '1';
+    bool chunked = false;
+    off_t length = -1;
+
+    const char* end = head + len - 2;   // 不含最后的空行
+    const char* p = find_byte(head, end, '\n') + 1;
+    while (p < end) {
+        const char* line_end = find_byte(p, end, '\n');
+        const char* colon = find_byte(p, line_end, ':');
+        if (line_end == end || colon == line_end || colon == p) {
+            return false;
+        }
+        const char* value = colon + 1;
+        const char* value_end = line_end;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            --value_end;
+        }
+        switch (http_headers.find(p, colon - p)) {
+            case HEADER_CONNECTION:
+                if (has_token(value, value_end - value, "close")) {
+                    result->keep_alive = false;
+                } else if (has_token(value, value_end - value, "keep-alive")) {
+                    result->keep_alive = true;
+                }
+                break;
+            case HEADER_CONTENT_LENGTH: {
+                off_t value_length = 0;
+                const char* q = value;
+                for (; q < value_end && *q >= '0' && *q <= '9' && q - value < 18; ++q) {
+                    value_length = value_length * 10 + (*q - '0');
+                }
+                if (q == value || q != value_end || (length >= 0 && length != value_length)) {
+                    return false;
+                }
+                length = value_length;
+                break;
+            }
+            case HEADER_TRANSFER_ENCODING:
+                chunked = has_token(value, value_end - value, "chunked");
+                break;
+            default:
+                break;
+        }
+        p = line_end + 1;
+    }
+
+    // chunked 优先于 Content-Length, 两者都没有时响应体到上游关闭连接为止
+    result->length = 0;
+    if (chunked) {
+        result->mode = UpstreamRelay::RELAY_CHUNKED;
+    } else if (length >= 0) {
+        result->mode = UpstreamRelay::RELAY_LENGTH;
+        result->length = length;
+    } else {
+        result->mode = UpstreamRelay::RELAY_CLOSE;
+    }
+    return true;
+}
+
+// 解析 HTTP 日期 (只支持 RFC 7231 推荐的 IMF-fixdate 格式), 失败时返回 -1
+static time_t parse_http_date(const char* value, int len) {
+    char text[64];
+    if (len <= 0 || len >= (int)sizeof(text)) {
+        return -1;
+    }
+    memcpy(text, value, len);
+    text[len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// 解析一个非负的十进制数, 没有数字或者数字太长时返回 NULL
+static const char* parse_offset(const char* p, const char* end, off_t* value) {
+    const char* start = p;
+    off_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - start >= 18) {
+            return NULL;
+        }
+        v = v * 10 + (*p - '0');
+        ++p;
+    }
+    *value = v;
+    return p == start ? NULL : p;
+}
+
+// If-None-Match 优先于 If-Modified-Since, 有 If-None-Match 时忽略 If-Modified-Since
+bool http_conn::not_modified() const {
+    const char* value;
+    int len;
+    if (get_header(HEADER_IF_NONE_MATCH, &value, &len)) {
+        return etag_matches(value, len);
+    }
+    if (get_header(HEADER_IF_MODIFIED_SINCE, &value, &len)) {
+        time_t since = parse_http_date(value, len);
+        return since != -1 && m_file->mtime <= since;
+    }
+    return false;
+}
+
+// If-None-Match 使用弱比较: 忽略 "W/" 前缀, "*" 匹配任何存在的文件
+bool http_conn::etag_matches(const char* value, int len) const {
+    const char* end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            ++value;
+        }
+        const char* comma = find_byte(value, end, ',');
+        const char* item_end = comma;
+        while (item_end > value && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+            --item_end;
+        }
+        const char* item = value;
+        if (item_end - item == 1 && *item == '*') {
+            return true;
+        }
+        if (item_end - item > 2 && item[0] == 'W' && item[1] == '/') {
+            item += 2;
+        }
+        if (item_end - item == m_file->etag_len && memcmp(item, m_file->etag, m_file->etag_len) == 0) {
+            return true;
+        }
+        value = comma;
+    }
+    return false;
+}
+
+// Accept-Encoding 中 gzip 的 q 值不为 0; 没有单独列出 gzip 时看 "*"
+bool http_conn::accepts_gzip() const {
+    const char* value;
+    int len;
+    if (!get_header(HEADER_ACCEPT_ENCODING, &value, &len)) {
+        return false;
+    }
+    int gzip = -1;  // -1 没有出现, 0 q=0 (明确拒绝), 1 接受
+    int any = -1;
+    const char* end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            ++value;
+        }
+        const char* comma = find_byte(value, end, ',');
+        const char* name_end = find_byte(value, comma, ';');
+        const char* params = name_end;
+        while (name_end > value && (name_end[-1] == ' ' || name_end[-1] == '\t')) {
+            --name_end;
+        }
+        // "q=0", "q=0.0" 或者 "q=0.000" 表示不接受
+        int accepted = 1;
+        const char* q = params < comma ? (const char*)memmem(params, comma - params, "q=", 2) : NULL;
+        if (q) {
+            q += 2;
+            if (q < comma && *q == '0') {
+                accepted = 0;
+                for (++q; q < comma && (*q == '.' || *q == '0'); ++q) {}
+                if (q < comma && *q >= '1' && *q <= '9') {
+                    accepted = 1;
+                }
+            }
+        }
+        int name_len = name_end - value;
+        if ((name_len == 4 && strncasecmp(value, "gzip", 4) == 0) || (name_len == 6 && strncasecmp(value, "x-gzip", 6) == 0)) {
+            gzip = accepted;
+        } else if (name_len == 1 && *value == '*') {
+            any = accepted;
+        }
+        value = comma;
+    }
+    return gzip != -1 ? gzip == 1 : any == 1;
+}
+
+// 解析 "Range: bytes=0-99,200-,-500" 这样的字节区间
+// 语法错误, 区间太多, 或者 If-Range 表明客户端手里的部分内容已经过期时忽略 Range, 返回整个文件
+// 在文件之外的区间被丢弃, 一个区间都不剩时返回 -1 (416)
+int http_conn::parse_range() {
+    const char* value;
+    int len;
+    off_t size = m_file->size;
+    if (size == 0 || !get_header(HEADER_RANGE, &value, &len)) {
+        return 0;
+    }
+    const char* cond;
+    int cond_len;
+    if (get_header(HEADER_IF_RANGE, &cond, &cond_len)) {
+        // If-Range 中的 ETag 使用强比较, 日期必须和 Last-Modified 完全相同
+        if (cond_len > 0 && cond[0] == '"') {
+            if (cond_len != m_file->etag_len || memcmp(cond, m_file->etag, cond_len) != 0) {
+                return 0;
+            }
+        } else if (parse_http_date(cond, cond_len) != m_file->mtime) {
+            return 0;
+        }
+    }
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return 0;
+    }
+
+    const char* p = value + 6;
+    const char* end = value + len;
+    int count = 0;
+    while (true) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        off_t first, last;
+        bool satisfiable = true;
+        if (p < end && *p == '-') {
+            // "-500": 最后 500 个字节
+            off_t suffix;
+            if (!(p = parse_offset(p + 1, end, &suffix))) {
+                return 0;
+            }
+            satisfiable = suffix > 0;
+            first = suffix < size ? size - suffix : 0;
+            last = size - 1;
+        } else {
+            if (!(p = parse_offset(p, end, &first)) || p == end || *p != '-') {
+                return 0;
+            }
+            ++p;
+            last = size - 1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                if (!(p = parse_offset(p, end, &last)) || last < first) {
+                    return 0;
+                }
+            }
+            satisfiable = first < size;
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+        if (satisfiable) {
+            if (count == MAX_RANGES) {
+                return 0;
+            }
+            m_ranges[count].first = first;
+            m_ranges[count].last = last;
+            ++count;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        if (p == end) {
+            break;
+        }
+        if (*p != ',') {
+            return 0;
+        }
+        ++p;
+    }
+    return count > 0 ? count : -1;
+}
+
+// 上传的文件保存在 m_upload_dir 下和 URL 相同的路径, 目录必须已经存在, 已有的文件会被替换
+http_conn::HTTP_CODE http_conn::open_upload() {
+    if (!m_upload_dir[0]) {
+        return METHOD_NOT_ALLOWED;
+    }
+    char* real_file;
+    HTTP_CODE ret = map_url(m_upload_dir, slice_ptr(m_url), m_url.len, &real_file);
+    if (ret != NO_REQUEST) {
+        return ret;
+    }
+    int len = strlen(real_file);
+    if (real_file[len - 1] == '/') {
+        return BAD_REQUEST;
+    }
+    // FileSink 保存了一份路径, 之后的请求体可能由其他工作线程处理
+    if (!m_upload.open(real_file, m_sockfd)) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return NO_RESOURCE;
+        } else if (errno == EACCES || errno == EISDIR) {
+            return FORBIDDEN_REQUEST;
+        }
+        return INTERNAL_ERROR;
+    }
+    m_body_sink = &m_upload;
+    return NO_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::finish_upload() {
+    BodySink* sink = m_body_sink;
+    m_body_sink = NULL;
+    if (!sink->finish()) {
+        LOG_ERROR("failed to save upload %s: %s", m_upload.path(), strerror(errno));
+        return INTERNAL_ERROR;
+    }
+    LOG_INFO("saved upload %s (%lld bytes)", m_upload.path(), (long long)m_body_received);
+    return FILE_CREATED;
+}
+
+// 释放这一批响应对缓存文件的引用, 如果文件已经被缓存淘汰, 最后一个引用释放时才会 munmap 和 close
+void http_conn::unmap() {
+    m_file_address = NULL;
+    m_file_fd = -1;
+    m_file.reset();
+    for (int i = 0; i < m_file_count; ++i) {
+        m_files[i].reset();
+    }
+    m_file_count = 0;
+}
+
+// 访问日志, 每个请求一行 "key=value" 格式的字段, 方便用工具解析
+void http_conn::log_access(uint64_t start) {
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, client, sizeof(client));
+    const char* url = m_url.len ? slice_ptr(m_url) : "-";
+    const char* version = m_version.len ? slice_ptr(m_version) : "-";
+    Logger::get_instance()->access("client=%s:%d method=%s path=\"%.*s\" version=%.*s status=%d bytes=%lld "
+                                   "duration_us=%llu conn_requests=%d keep_alive=%d",
+                                   client, ntohs(m_address.sin_port), http_method_names[m_method], m_url.len ? m_url.len : 1, url,
+                                   m_version.len ? m_version.len : 1, version, m_status, (long long)m_body_bytes,
+                                   (unsigned long long)(metrics_now() - start) / 1000, m_requests + 1, m_linger ? 1 : 0);
+}
+
+// 写 HTTP 响应
+// 一批 (流水线上的) 响应的响应头和 mmap 的文件体通过一次 writev 发出
+// 最后一个响应使用 sendfile 模式时, 在 writev 部分发送完之后再用 sendfile 发送它的文件体
+// 如果 socket 的发送缓冲区满了 (EAGAIN), 就记录下已经发送的位置, 等待下一次 EPOLLOUT 事件从这里继续
 bool http_conn::write() {
-    printf("write data all at once...\n");
+    while (true) {
+        if (bytes_to_send > 0) {
+            // 分散写, 从第一个还没有发送完的内存块开始
+            int temp = writev(m_sockfd, m_iv + m_iv_index, m_iv_count - m_iv_index);
+            if (temp <= -1) {
+                // 如果 TCP 写缓冲没有空间, 则等待下一轮 EPOLLOUT 事件
+                // 虽然在此期间, 服务器无法立即接收到同一客户的下一个请求, 但可以保证连接的完整性
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                    return true;
+                }
+                unmap();
+                return false;
+            }
+            consume_sent(temp);
+            continue;
+        }
+
+        if (m_file_fd != -1 && m_file_offset < m_file_size) {
+            // 文件体直接在内核中从页缓存拷贝到 socket, sendfile 会自动推进 m_file_offset
+            // 缓存中的描述符被多个连接共享, 这里总是显式地传入偏移量, 不会改变文件的读写位置
+            ssize_t temp = sendfile(m_sockfd, m_file_fd, &m_file_offset, m_file_size - m_file_offset);
+            if (temp <= -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                    return true;
+                }
+                unmap();
+                return false;
+            }
+            if (temp == 0) {
+                // 文件在发送过程中被截断了
+                unmap();
+                return false;
+            }
+            metric_bytes_out.add(temp);
+            continue;
+        }
+
+        if (m_relay.active()) {
+            // 反向代理的响应体, 上游 -> 管道 -> socket, 转发完之后上游连接放回连接池
+            int wait = m_relay.pump(m_sockfd);
+            if (wait == EPOLLOUT) {
+                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                return true;
+            }
+            if (wait == EPOLLIN) {
+                // 等待上游的数据, 事件到达时事件循环再调用 write()
+                return m_relay.watch(m_epollfd, m_sockfd);
+            }
+            if (wait < 0) {
+                unmap();
+                return false;
+            }
+            continue;
+        }
+
+        if (!finish_write()) {
+            return false;
+        }
+        if (!m_pipelined) {
+            // 读缓冲区中还有没有处理的流水线请求时不重新注册 EPOLLIN, 由调用者通过 has_pending() 交给线程池
+            modfd(m_epollfd, m_sockfd, EPOLLIN);
+        }
+        return true;
+    }
+}
+
+// 调整 iovec, 跳过已经发送完的内存块, 下一次从没有发送的位置开始
+void http_conn::consume_sent(size_t bytes) {
+    bytes_have_send += bytes;
+    bytes_to_send -= bytes;
+    metric_bytes_out.add(bytes);
+
+    while (m_iv_index < m_iv_count && bytes >= m_iv[m_iv_index].iov_len) {
+        bytes -= m_iv[m_iv_index].iov_len;
+        ++m_iv_index;
+    }
+    if (bytes > 0) {
+        m_iv[m_iv_index].iov_base = (char*)m_iv[m_iv_index].iov_base + bytes;
+        m_iv[m_iv_index].iov_len -= bytes;
+    }
+}
+
+int http_conn::send_iov(struct iovec** iov) {
+    if (bytes_to_send <= 0) {
+        return 0;
+    }
+    *iov = m_iv + m_iv_index;
+    return m_iv_count - m_iv_index;
+}
+
+bool http_conn::file_pending(int* fd, off_t* offset, off_t* len) const {
+    if (m_file_fd == -1 || m_file_offset >= m_file_size) {
+        return false;
+    }
+    *fd = m_file_fd;
+    *offset = m_file_offset;
+    *len = m_file_size - m_file_offset;
     return true;
 }
 
-http_conn::http_conn() {
+void http_conn::consume_file(off_t bytes) {
+    m_file_offset += bytes;
+    metric_bytes_out.add(bytes);
+}
 
+// 这一批响应全部发送完毕, 写缓冲区还给内存池
+// 返回 false 表示需要关闭连接; 返回 true 时如果 m_pipelined 为 true, 读缓冲区中还有没有处理的流水线请求
+bool http_conn::finish_write() {
+    unmap();
+    init_write();
+    m_write_buf.release();
+    if (!m_keep_conn) {
+        return false;
+    }
+    if (!m_pipelined && idle()) {
+        // 连接进入空闲状态, 读缓冲区中没有任何未处理的数据, 也还给内存池
+        m_read_idx = m_checked_index = m_start_line = m_request_start = 0;
+        m_read_buf.release();
+    }
+    return true;
 }
 
-http_conn::~http_conn() {
+// 保证写缓冲区还有 len 字节的空间, 空间不够时从内存池换一个更大的写缓冲区
+bool http_conn::reserve_write(int len) {
+    if (m_write_buf.empty()) {
+        return m_write_buf.reserve(len > Buffer::MIN_SIZE ? len : Buffer::MIN_SIZE, 0);
+    }
+    if (len <= m_write_buf.capacity() - m_write_idx) {
+        return true;
+    }
+    // 写缓冲区换到了新的位置, 已经放进 m_iv 的响应头也要跟着移动
+    char* old = m_write_buf.data();
+    if (!m_write_buf.reserve(m_write_idx + len, m_write_idx)) {
+        return false;
+    }
+    for (int i = 0; i < m_iv_count; ++i) {
+        char* base = (char*)m_iv[i].iov_base;
+        if (base >= old && base < old + m_write_idx) {
+            m_iv[i].iov_base = m_write_buf.data() + (base - old);
+        }
+    }
+    return true;
+}
+
+// 往写缓冲中写入待发送的数据
+bool http_conn::add_text(const char* text, int len) {
+    if (!reserve_write(len)) {
+        return false;
+    }
+    memcpy(m_write_buf.data() + m_write_idx, text, len);
+    m_write_idx += len;
+    return true;
+}
+
+bool http_conn::add_number(long long value) {
+    char digits[20];
+    int n = sizeof(digits);
+    unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) {
+        digits[--n] = '-';
+    }
+    return add_text(digits + n, sizeof(digits) - n);
+}
+
+bool http_conn::add_status_line(int status) {
+    const HttpStatus& entry = http_status(status);
+    return add_text(entry.line.data, entry.line.size);
+}
+
+bool http_conn::add_headers(off_t content_length) {
+    return add_content_length(content_length) && add_date() && add_linger() && add_blank_line();
+}
+
+bool http_conn::add_content_length(off_t content_length) {
+    static const char name[] = "Content-Length: ";
+    return add_text(name, sizeof(name) - 1) && add_number(content_length) && add_text("\r\n", 2);
+}
+
+bool http_conn::add_date() {
+    if (!reserve_write(HTTP_DATE_LEN)) {
+        return false;
+    }
+    http_date(m_write_buf.data() + m_write_idx);
+    m_write_idx += HTTP_DATE_LEN;
+    return true;
+}
 
+bool http_conn::add_linger() {
+    static const char keep_alive[] = "Connection: keep-alive\r\nKeep-Alive: timeout=";
+    static const char close[] = "Connection: close\r\n";
+    if (m_linger) {
+        return add_text(keep_alive, sizeof(keep_alive) - 1) && add_number(m_keep_alive_timeout) &&
+               add_text(", max=", 6) && add_number(m_keep_alive_max - m_requests) && add_text("\r\n", 2);
+    }
+    return add_text(close, sizeof(close) - 1);
+}
+
+bool http_conn::add_blank_line() {
+    return add_text("\r\n", 2);
+}
+
+bool http_conn::add_error(int status, const char* extra, int extra_len) {
+    const HttpStatus& entry = http_status(status);
+    return add_text(entry.error_head.data, entry.error_head.size) && (!extra || add_text(extra, extra_len)) &&
+           add_date() && add_linger() && add_blank_line() && (m_method == HEAD || add_text(entry.body, entry.body_len));
+}
+
+bool http_conn::add_content_range(off_t first, off_t last) {
+    static const char name[] = "Content-Range: bytes ";
+    return add_text(name, sizeof(name) - 1) && add_number(first) && add_text("-", 1) && add_number(last) &&
+           add_text("/", 1) && add_number(m_file->size) && add_text("\r\n", 2);
+}
+
+void http_conn::add_iov(char* base, size_t len) {
+    m_iv[m_iv_count].iov_base = base;
+    m_iv[m_iv_count].iov_len = len;
+    bytes_to_send += len;
+    ++m_iv_count;
+}
+
+// 十进制数的位数, 用来预先算出 multipart 响应体的长度
+static int decimal_length(off_t value) {
+    int n = 1;
+    while (value >= 10) {
+        value /= 10;
+        ++n;
+    }
+    return n;
+}
+
+// multipart/byteranges 的分隔符, 每个区间前面是 "\r\n--分隔符\r\nContent-Type: ...\r\nContent-Range: ...\r\n\r\n",
+// 最后是 "\r\n--分隔符--\r\n"; 文件的 Content-Type 只出现在每个部分的头部中 (RFC 9110 14.6)
+#define BYTERANGES_BOUNDARY "3d6b6a416f9b5c2e"
+static const char byteranges_type[] = "Content-Type: multipart/byteranges; boundary=" BYTERANGES_BOUNDARY "\r\n";
+static const char byteranges_part[] = "\r\n--" BYTERANGES_BOUNDARY "\r\n";
+static const char byteranges_end[] = "\r\n--" BYTERANGES_BOUNDARY "--\r\n";
+
+// 文件响应, ETag, Last-Modified 和 Accept-Ranges 在文件进入缓存时已经生成好了
+// 文件体不经过写缓冲区: mmap 模式下是指向映射的内存块, sendfile 模式下在 writev 部分之后由内核发送
+bool http_conn::add_file(int header_start) {
+    int status = m_range_count > 0 ? 206 : 200;
+    off_t body_bytes = 0;
+    if (!add_status_line(status)) {
+        return false;
+    }
+
+    if (m_range_count <= 1) {
+        if (!add_text(m_file->header, m_file->header_len)) {
+            return false;
+        }
+        // 整个文件或者一个区间
+        off_t first = 0;
+        off_t last = m_file->size - 1;
+        if (m_range_count == 1) {
+            first = m_ranges[0].first;
+            last = m_ranges[0].last;
+            if (!add_content_range(first, last)) {
+                return false;
+            }
+        }
+        body_bytes = last - first + 1;
+        if (!add_headers(body_bytes)) {
+            return false;
+        }
+        add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+        if (m_method == HEAD) {
+            // 只发送响应头, Content-Length 仍然是 GET 时响应体的长度
+        } else if (m_file_address) {
+            // mmap 模式: 文件体作为一个内存块, 和响应头一起由 writev 发出
+            add_iov(m_file_address + first, body_bytes);
+        } else if (m_file_fd != -1) {
+            // sendfile 模式: 文件体在 writev 部分之后发送, 所以它只能是这一批中的最后一个响应
+            m_file_offset = first;
+            m_file_size = last + 1;
+        }
+    } else {
+        // 多个区间: 每个区间的小响应头放在写缓冲区中, 区间的内容直接指向文件的映射
+        const char* type = m_file->header + m_file->type_offset;
+        int type_len = m_file->type_len;
+        int size_len = decimal_length(m_file->size);
+        for (int i = 0; i < m_range_count; ++i) {
+            const ByteRange& range = m_ranges[i];
+            body_bytes += sizeof(byteranges_part) - 1 + type_len + sizeof("Content-Range: bytes -/\r\n\r\n") - 1 +
+                          decimal_length(range.first) + decimal_length(range.last) + size_len +
+                          range.last - range.first + 1;
+        }
+        body_bytes += sizeof(byteranges_end) - 1;
+        if (!add_text(m_file->header, m_file->type_offset) ||
+            !add_text(type + type_len, m_file->header_len - m_file->type_offset - type_len) ||
+            !add_text(byteranges_type, sizeof(byteranges_type) - 1) || !add_headers(body_bytes)) {
+            return false;
+        }
+        add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+        for (int i = 0; i < m_range_count && m_method != HEAD; ++i) {
+            const ByteRange& range = m_ranges[i];
+            int part_start = m_write_idx;
+            if (!add_text(byteranges_part, sizeof(byteranges_part) - 1) || !add_text(type, type_len) ||
+                !add_content_range(range.first, range.last) || !add_blank_line()) {
+                return false;
+            }
+            add_iov(m_write_buf.data() + part_start, m_write_idx - part_start);
+            add_iov(m_file_address + range.first, range.last - range.first + 1);
+        }
+        int end_start = m_write_idx;
+        if (m_method != HEAD) {
+            if (!add_text(byteranges_end, sizeof(byteranges_end) - 1)) {
+                return false;
+            }
+            add_iov(m_write_buf.data() + end_start, m_write_idx - end_start);
+        }
+    }
+
+    // 持有文件的引用直到这一批响应发送完毕
+    m_files[m_file_count++] = m_file;
+    m_status = status;
+    m_body_bytes = m_method == HEAD ? 0 : body_bytes;
+    m_file.reset();
+    m_file_address = NULL;
+    metrics_count_response(status);
+    return true;
+}
+
+// 路由的响应: 状态码, Content-Type 和额外的头部字段由处理函数决定, 响应体和响应头一起放在写缓冲区中
+bool http_conn::add_route_response(int header_start) {
+    RouteRequest request;
+    const char* url = slice_ptr(m_url);
+    const char* url_end = url + m_url.len;
+    const char* path_end = find_byte(url, url_end, '?');
+    request.method = m_method;
+    request.path = url;
+    request.path_len = path_end - url;
+    request.query = path_end < url_end ? path_end + 1 : url_end;
+    request.query_len = url_end - request.query;
+    request.body = m_route_body.data().data();
+    request.body_len = m_route_body.data().size();
+    request.headers = m_headers;
+    request.header_count = m_header_count;
+    request.base = m_read_buf.data() + m_request_start;
+    // 解析请求头时只需要知道有没有匹配的路由, 这里再匹配一次取得参数
+    int allowed;
+    Router::get_instance()->match(m_method, request.path, request.path_len, &request, &allowed);
+
+    RouteResponse response;
+    m_route->handler(request, &response, m_route->arg);
+    m_route_body.abort();
+
+    static const char content_type[] = "Content-Type: ";
+    int status = http_status(response.status).code;
+    const ArenaString& body = response.body;
+    if (!add_status_line(status) ||
+        (response.content_type && (!add_text(content_type, sizeof(content_type) - 1) ||
+                                   !add_text(response.content_type, strlen(response.content_type)) ||
+                                   !add_text("\r\n", 2))) ||
+        !add_text(response.headers.data(), response.headers.size()) || !add_headers(body.size()) ||
+        !(m_method == HEAD || add_text(body.data(), body.size()))) {
+        return false;
+    }
+    add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+    m_status = status;
+    m_body_bytes = m_method == HEAD ? 0 : body.size();
+    metrics_count_response(status);
+    return true;
+}
+
+// 反向代理的响应: 状态码和原因短语原样转发 (版本总是 HTTP/1.1), 头部字段去掉逐跳的字段之后放进写缓冲区
+// 响应体留在上游连接中, 由 m_relay 在这一批响应的最后直接转发给客户端; 没有响应体时上游连接马上放回连接池
+bool http_conn::add_proxy_response(int header_start) {
+    const UpstreamHead& upstream = m_upstream;
+    bool has_body = m_method != HEAD && upstream.status != 204 && upstream.status != 304 &&
+                    !(upstream.mode == UpstreamRelay::RELAY_LENGTH && upstream.length == 0);
+    if (has_body && upstream.mode == UpstreamRelay::RELAY_CLOSE) {
+        // 响应体到上游关闭连接为止, 客户端也只能由连接关闭知道它结束了
+        m_linger = false;
+    }
+
+    const char* p = m_upstream_head;
+    const char* end = p + m_upstream_head_len - 2;
+    const char* line_end = find_byte(p, end, '\n') + 1;
+    bool ok = add_text("HTTP/1.1", 8) && add_text(p + 8, line_end - (p + 8));
+    for (p = line_end; ok && p < end; p = line_end) {
+        line_end = find_byte(p, end, '\n') + 1;
+        switch (http_headers.find(p, find_byte(p, line_end, ':') - p)) {
+            case HEADER_CONNECTION:
+            case HEADER_KEEP_ALIVE:
+            case HEADER_PROXY_CONNECTION:
+            case HEADER_TE:
+            case HEADER_UPGRADE:
+                break;
+            case HEADER_CONTENT_LENGTH:
+                // 同时有 chunked 时 Content-Length 没有意义, 不能让客户端误解
+                if (upstream.mode != UpstreamRelay::RELAY_CHUNKED) {
+                    ok = add_text(p, line_end - p);
+                }
+                break;
+            default:
+                ok = add_text(p, line_end - p);
+                break;
+        }
+    }
+    if (!ok || !add_linger() || !add_blank_line()) {
+        m_backend->release(m_loop_id, m_upstream_fd, false);
+        m_upstream_fd = -1;
+        return false;
+    }
+    add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+
+    if (has_body) {
+        m_relay.start(m_backend, m_loop_id, m_upstream_fd, upstream.mode, upstream.length, upstream.keep_alive);
+    } else {
+        m_backend->release(m_loop_id, m_upstream_fd, upstream.keep_alive);
+    }
+    m_upstream_fd = -1;
+    m_status = upstream.status;
+    m_body_bytes = has_body && upstream.mode == UpstreamRelay::RELAY_LENGTH ? upstream.length : 0;
+    metrics_count_response(upstream.status);
+    return true;
+}
+
+// "Allow: GET, POST\r\n", allowed 是方法的位掩码, 返回长度
+static int format_allow(int allowed, char* buf) {
+    int len = 0;
+    memcpy(buf, "Allow: ", 7);
+    len += 7;
+    for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        if (allowed & (1 << i)) {
+            if (len > 7) {
+                memcpy(buf + len, ", ", 2);
+                len += 2;
+            }
+            memcpy(buf + len, http_method_names[i], http_methods.lens[i]);
+            len += http_methods.lens[i];
+        }
+    }
+    memcpy(buf + len, "\r\n", 2);
+    return len + 2;
+}
+
+// 根据服务器处理 HTTP 请求的结果, 决定返回给客户端的内容
+// 响应追加在这一批响应的后面: 响应头追加到写缓冲区, 文件体作为一个新的内存块追加到 m_iv 中
+bool http_conn::process_write(HTTP_CODE ret) {
+    int status = 0;
+    int header_start = m_write_idx;
+
+    // 每个连接最多处理 m_keep_alive_max 个请求, 平滑退出时发送完这个响应就关闭连接
+    if (m_requests + 1 >= m_keep_alive_max || m_draining.load(std::memory_order_relaxed)) {
+        m_linger = false;
+    }
+
+    switch (ret) {
+        case INTERNAL_ERROR:
+            status = 500;
+            break;
+        case BAD_GATEWAY:
+            status = 502;
+            break;
+        case GATEWAY_TIMEOUT:
+            status = 504;
+            break;
+        case BAD_REQUEST:
+            status = 400;
+            break;
+        case NO_RESOURCE:
+            status = 404;
+            break;
+        case FORBIDDEN_REQUEST:
+            status = 403;
+            break;
+        case METHOD_NOT_ALLOWED:
+            status = 405;
+            break;
+        case PAYLOAD_TOO_LARGE:
+            status = 413;
+            break;
+        case HEADER_TOO_LARGE:
+            status = 431;
+            break;
+        case NOT_IMPLEMENTED:
+            status = 501;
+            break;
+        case FILE_CREATED:
+            if (!add_status_line(201) || !add_headers(0)) {
+                return false;
+            }
+            add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+            m_status = 201;
+            m_body_bytes = 0;
+            metrics_count_response(201);
+            return true;
+        case FILE_REQUEST:
+            return add_file(header_start);
+        case NOT_MODIFIED:
+            // 304 没有响应体, 只带上 ETag 和 Last-Modified 让客户端刷新它的缓存
+            if (!add_status_line(304) || !add_text(m_file->header, m_file->header_len) || !add_date() ||
+                !add_linger() || !add_blank_line()) {
+                return false;
+            }
+            add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+            m_file.reset();
+            m_status = 304;
+            m_body_bytes = 0;
+            metrics_count_response(304);
+            return true;
+        case RANGE_NOT_SATISFIABLE: {
+            // 错误页面的响应头之后补上 "Content-Range: bytes */文件大小"
+            const HttpStatus& entry = http_status(416);
+            static const char unsatisfied[] = "Content-Range: bytes */";
+            if (!add_text(entry.error_head.data, entry.error_head.size) ||
+                !add_text(unsatisfied, sizeof(unsatisfied) - 1) || !add_number(m_file->size) ||
+                !add_text("\r\n", 2) || !add_date() || !add_linger() || !add_blank_line() ||
+                !(m_method == HEAD || add_text(entry.body, entry.body_len))) {
+                return false;
+            }
+            add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+            m_file.reset();
+            m_status = 416;
+            m_body_bytes = m_method == HEAD ? 0 : entry.body_len;
+            metrics_count_response(416);
+            return true;
+        }
+        case ROUTE_REQUEST:
+            return add_route_response(header_start);
+        case PROXY_REQUEST:
+            return add_proxy_response(header_start);
+        default:
+            return false;
+    }
+
+    // 请求的语法错误或者服务器出错时, 解析状态已经不可信, 发送完响应之后关闭连接
+    if (ret == BAD_REQUEST || ret == HEADER_TOO_LARGE || ret == INTERNAL_ERROR) {
+        m_linger = false;
+    }
+
+    // 错误响应: 只有写缓冲区中的响应头和错误页面, 405 还要告诉客户端这个路径允许哪些方法
+    char allow[128];
+    if (!(status == 405 ? add_error(status, allow, format_allow(m_allowed, allow)) : add_error(status))) {
+        return false;
+    }
+    add_iov(m_write_buf.data() + header_start, m_write_idx - header_start);
+    m_status = status;
+    m_body_bytes = m_method == HEAD ? 0 : http_status(status).body_len;
+    metrics_count_response(status);
+    return true;
+}
+
+http_conn::http_conn(): m_busy(false), m_enqueue_time(0), m_sockfd(-1), m_epollfd(-1), m_loop(NULL), m_loop_id(0), m_inline(false), m_body_sink(NULL), m_backend(NULL), m_upstream_fd(-1), m_file_address(NULL), m_file_fd(-1), m_file_count(0) {
+    m_timer.data = this;
+
+}
+
+http_conn::~http_conn() {
+    unmap();
 }
 
 // 由线程池的工作线程调用, 这是处理 HTTP 请求的入口函数
 void http_conn::process() {
-    // 解析 HTTP 请求
+    resume(handle_requests());
+}
+
+// 在事件循环的线程中调用, 调用者根据返回值自己决定接下来等待的事件, 连接一直由它持有
+int http_conn::process_inline() {
+    if (receiving_body()) {
+        // 请求体由开始接收它的工作线程继续处理, 不能从请求的开头重新解析
+        return 0;
+    }
+    m_inline = true;
+    int events = handle_requests();
+    m_inline = false;
+    Arena::local()->reset();
+    return events;
+}
+
+// 放弃当前请求: 交给工作线程时它从请求的第一个字节重新解析, 解析过程不会修改读缓冲区
+void http_conn::rewind_request() {
+    m_checked_index = m_request_start;
+    init_request();
+}
+
+// 读缓冲区中可能有多个流水线请求, 依次解析并把它们的响应放进同一批, 最后由一次 writev 发送
+int http_conn::handle_requests() {
+    m_pipelined = false;
+    int batched = 0;
+
+    while (true) {
+        // 解析 HTTP 请求
+        uint64_t parse_start = metrics_now();
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST) { //  请求不完整, 客户端还需要继续读取数据
+            break;
+        }
+        if (read_ret == CONTINUE_REQUEST) {
+            // 客户端等到 100 Continue 之后才发送请求体: 把它放在这一批响应的最后, 发送完之后继续接收请求体
+            static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            int start = m_write_idx;
+            if (!add_text(continue_line, sizeof(continue_line) - 1)) {
+                shutdown(m_sockfd, SHUT_RDWR);
+                return EPOLLIN;
+            }
+            add_iov(m_write_buf.data() + start, m_write_idx - start);
+            ++batched;
+            m_keep_conn = true;
+            m_pipelined = true;
+            break;
+        }
+        if (read_ret == DEFER_REQUEST) {
+            // 快速路径遇到了慢操作: 这个请求和之后的请求都交给工作线程, 已经生成的响应先发送出去
+            rewind_request();
+            if (batched == 0) {
+                return 0;
+            }
+            m_pipelined = true;
+            break;
+        }
+        metric_parse_time.observe(metrics_now() - parse_start);
+        metric_requests.add();
+        if (m_inline) {
+            metric_inline_requests.add();
+        }
+
+        // 生成响应 (将数据放入响应报文中)
+        bool write_ret = process_write(read_ret);
+        if (!write_ret) {
+            // 连接只能由事件循环关闭 (它还要删除连接的定时器), 这里关闭 socket 的读写
+            // 事件循环随后会收到 EPOLLHUP 事件并关闭连接
+            shutdown(m_sockfd, SHUT_RDWR);
+            return EPOLLIN;
+        }
+        if (Logger::get_instance()->access_enabled()) {
+            log_access(parse_start);
+        }
+        ++m_requests;
+        ++batched;
+        m_keep_conn = m_linger;
 
-    // 检测处理完这个业务逻辑之后返回来的状态
-    HTTP_CODE read_ret = process_read(); 
-    if (read_ret == NO_REQUEST) { //  请求不完整, 客户端还需要继续读取数据
+        // 准备解析下一个请求, 读缓冲区中剩下的数据保留下来
+        init_request();
+
+        // 这一批到此为止: 需要关闭连接, 最后一个响应使用 sendfile 或者转发上游的响应体, 或者 iovec / 写缓冲区快用完了
+        // 剩下的请求等这一批发送完之后再处理
+        if (!m_keep_conn || m_file_fd != -1 || m_relay.active() || batched >= MAX_PIPELINE ||
+            m_iv_count + 2 * MAX_RANGES + 1 > IOV_COUNT ||
+            m_write_idx + PIPELINE_RESERVE > m_write_buf.capacity()) {
+            m_pipelined = m_keep_conn && (m_checked_index < m_read_idx);
+            break;
+        }
+    }
+
+    if (batched == 0) {
         // 这个时候要把 EPOLLONESHOT 重新加回来
-        modfd(e_epollfd, m_sockfd, EPOLLIN);
+        return EPOLLIN;
+    }
+    LOG_DEBUG("fd %d parsed %d request(s)", m_sockfd, batched);
+    // 注册 EPOLLOUT 事件, 由事件循环把响应发送出去
+    return EPOLLOUT;
+}
+
+// 把连接交还给事件循环
+// epoll: 重新注册事件之后才能清除 m_busy, 之后这个连接只会被事件循环访问
+// 其他事件循环在自己的线程中处理交还的连接时清除 m_busy, 这里调用 resume 之后不能再访问这个连接
+void http_conn::resume(int events) {
+    if (m_loop) {
+        m_loop->resume(this, events);
         return;
     }
+    modfd(m_epollfd, m_sockfd, events);
+    m_busy.store(false, std::memory_order_release);
+}
+
+// 当前没有正在接收的请求: 上一个请求已经处理完, 下一个请求还没有收到任何数据
+bool http_conn::idle() const {
+    return m_check_state == CHECK_STATE_REQUESTLINE && m_read_idx == m_request_start;
+}
+
+// 这一批响应还没有发送完
+bool http_conn::response_pending() const {
+    return bytes_to_send > 0 || (m_file_fd != -1 && m_file_offset < m_file_size) || m_relay.active();
+}
 
-    printf("parse request, create response\n");
-    // 生成响应 (将数据放入响应报文中)
+// 这一批响应已经全部发送完, 并且读缓冲区中还有没有处理的流水线请求
+bool http_conn::has_pending() const {
+    return m_pipelined && bytes_to_send == 0 && m_file_fd == -1 && !m_relay.active() && m_sockfd != -1;
 }
@@ -3,6 +3,7 @@
 
 #include <sys/epoll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -13,16 +14,71 @@
 #include <errno.h>
 #include <sys/uio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <atomic>
+#include <sys/sendfile.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "gzip_cache.h"
+#include "timer_wheel.h"
+#include "http_parser.h"
+#include "http_response.h"
+#include "http_names.h"
+#include "router.h"
+#include "proxy.h"
+#include "buffer.h"
+#include "body_sink.h"
+#include "arena.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "log.h"
+
+class http_conn;
+
+// 连接所属的事件循环 (epoll 之外的实现), 工作线程处理完请求之后通过它把连接交还给事件循环
+// events 是 EPOLLIN (需要继续接收请求) 或者 EPOLLOUT (响应已经准备好), 和 epoll 事件循环中 modfd 的参数一致
+class ConnLoop {
+public:
+ virtual ~ConnLoop() {}
+ virtual void resume(http_conn* conn, int events) = 0;
+};
 
 class http_conn {
 public:
-    static int m_epollfd;     // 所有的 socket 上的事件都被注册到同一个 epollfd 中
-    static int m_user_count;  // 统计用户的数量
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 2048; // 写缓冲区的大小
+    static std::atomic<int> m_user_count;  // 统计用户的数量, 会被多个事件循环和工作线程同时修改
+    static std::atomic<bool> m_draining;   // 服务器正在平滑退出, 之后的响应都不再保持连接
+    static const int FILENAME_LEN = 200;       // 文件完整路径的最大长度
+    static const int MAX_PIPELINE = 8;         // 一批 (一次 writev) 最多合并的流水线响应数量
+    static const int PIPELINE_RESERVE = 512;   // 写缓冲区剩余空间少于这个值时不再往这一批中追加响应
+    static const int MAX_HEADERS = 32;         // 一个请求最多的头部字段数量
+    static const int MAX_RANGES = 8;           // 一个 Range 请求最多的区间数量, 超过时返回整个文件
+    static const int MAX_CHUNK_LINE = 256;     // chunked 请求体中 chunk 大小所在的行和尾部字段的最大长度
+    static const int MAX_UPSTREAM_HEAD = 16384; // 反向代理时上游响应头的最大长度
+    // writev 的内存块数量: 每个流水线响应最多两块, 再留出一个 multipart/byteranges 响应需要的块数
+    static const int IOV_COUNT = 2 * MAX_PIPELINE + 2 * MAX_RANGES + 1;
+
+    // 文件体的发送方式
+    // SEND_MMAP: 把文件 mmap 到内存中, 和响应头一起用 writev 发送
+    // SEND_SENDFILE: 响应头用 writev 发送, 文件体用 sendfile 直接在内核中拷贝
+    // SEND_AUTO: 文件大小超过 m_sendfile_threshold 时使用 sendfile, 否则使用 mmap
+    enum SEND_MODE {
+      SEND_MMAP = 0,
+      SEND_SENDFILE,
+      SEND_AUTO
+    };
+
+    static const char* m_doc_root;     // 网站的根目录
+    static SEND_MODE m_send_mode;      // 文件体的发送方式
+    static off_t m_sendfile_threshold; // SEND_AUTO 模式下切换到 sendfile 的文件大小
+    static int m_keep_alive_max_timeout; // 保持连接时空闲连接的超时时间 (秒)
+    static int m_keep_alive_max;         // 一个连接上最多处理的请求数量
+    static int m_header_timeout;         // 从收到请求的第一个字节开始, 必须在这个时间 (秒) 内收完整个请求, 防止 slowloris 攻击
+    static int m_idle_timeout;           // 发送响应时, 这个时间 (秒) 内没有任何进展就关闭连接
+    static const char* m_upload_dir;     // POST / PUT 上传的文件保存的目录, 空字符串表示不允许上传
+    static off_t m_max_body;             // 请求体的最大长度
 
-    // HTTP 请求方法, 现在只支持 GET
+    // HTTP 请求方法, 顺序和 http_method_names 一致
+    // 静态文件支持 GET, 以及开启了上传时的 POST 和 PUT, 其他方法只能交给注册了它的路由
     enum METHOD {
       GET = 0,
       POST,
@@ -32,19 +88,19 @@ public:
       TRACE,
       OPTIONS,
       CONNECT
-    }
+    };
 
     /*
         解析客户端请求时, 主状态机的状态
         CHECK_STATE_REQUESTLINE: 当前正在分析请求行
         CHECK_STATE_HEADER: 当前正在分析头部字段
-        CHECK_STATE_CONTENT: 当前正在分析请求体
+        CHECK_STATE_CONTENT: 当前正在接收请求体
     */ 
     enum CHECK_STATE {
     CHECK_STATE_REQUESTLINE = 0,
     CHECK_STATE_HEADER,
     CHECK_STATE_CONTENT
-    }
+    };
 
    /*
         服务器处理 HTTP 请求的可能结果, 报文解析的结果
@@ -53,9 +109,22 @@ public:
         BAD_REQUEST: 表示客户请求的语法错误
         NO_RESOURCE: 表示客户端没有资源
         FORBIDDEN_REQUEST: 表示客户对请求的资源没有足够的权限
-        FILE_REQUEST: 文件请求, 获取文件成功
+        FILE_REQUEST: 文件请求, 获取文件成功 (可能只请求文件的一部分)
+        NOT_MODIFIED: 条件请求, 客户端缓存的文件仍然有效
+        RANGE_NOT_SATISFIABLE: Range 中的区间都在文件之外
+        ROUTE_REQUEST: 请求匹配了一个路由, 由它的处理函数生成响应
+        PROXY_REQUEST: 请求匹配了一个反向代理的路由, 已经从上游服务器取得了响应头
+        CONTINUE_REQUEST: 客户端在等待 100 Continue, 之后才会发送请求体
+        FILE_CREATED: 上传的文件保存成功
+        METHOD_NOT_ALLOWED: 这个路径不支持的请求方法 (例如没有开启上传时的 POST 和 PUT), 允许的方法在 m_allowed 中
+        PAYLOAD_TOO_LARGE: 请求体超过了 m_max_body (交给路由时是 Router::MAX_BODY)
+        HEADER_TOO_LARGE: 最大的读缓冲区也放不下请求行和请求头
+        NOT_IMPLEMENTED: 不支持的 Transfer-Encoding
         INTERNAL_ERROR: 表示服务器内部错误
+        BAD_GATEWAY: 没有可用的上游服务器, 或者上游服务器出错
+        GATEWAY_TIMEOUT: 上游服务器没有及时响应
         CLOSE_CONNECTION: 表示客户端已经关闭连接了
+        DEFER_REQUEST: 在事件循环上处理时遇到了慢操作 (打开文件, 压缩, 请求体, 不在快速路径上的路由, 反向代理), 这个请求交给线程池重新处理
    */
     enum HTTP_CODE {
     NO_REQUEST,
@@ -64,9 +133,22 @@ public:
     NO_RESOURCE,
     FORBIDDEN_REQUEST,
     FILE_REQUEST,
+    NOT_MODIFIED,
+    RANGE_NOT_SATISFIABLE,
+    ROUTE_REQUEST,
+    PROXY_REQUEST,
+    CONTINUE_REQUEST,
+    FILE_CREATED,
+    METHOD_NOT_ALLOWED,
+    PAYLOAD_TOO_LARGE,
+    HEADER_TOO_LARGE,
+    NOT_IMPLEMENTED,
     INTERNAL_ERROR,
-    CLOSE_CONNECTION
-    }
+    BAD_GATEWAY,
+    GATEWAY_TIMEOUT,
+    CLOSE_CONNECTION,
+    DEFER_REQUEST
+    };
 
     // 从状态机的三种可能状态, 即行的读取状态
     // 1. 读取到一个完整的行
@@ -76,42 +158,203 @@ public:
         LINE_OK = 0,
         LINE_BAD,
         LINE_OPEN
-    }
+    };
+
+    // 请求体解码器的状态
+    // BODY_DATA: 正在接收请求体 (Content-Length) 或者一个 chunk 的数据, 还剩 m_body_remaining 字节
+    // BODY_CHUNK_SIZE: 正在等待 chunk 大小所在的行
+    // BODY_CHUNK_END: 正在等待 chunk 数据之后的 "\r\n"
+    // BODY_TRAILER: 最后一个 chunk 之后的尾部字段, 直到空行
+    enum BODY_STATE {
+        BODY_DATA = 0,
+        BODY_CHUNK_SIZE,
+        BODY_CHUNK_END,
+        BODY_TRAILER
+    };
     
     http_conn();
     ~http_conn(); 
 
     void process(); // 解析请求报文, 并且处理客户端请求, 最后封装客户端响应
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新的连接
+    // 在事件循环的线程中直接处理读缓冲区中的请求 (快速路径), 只处理不需要慢操作的请求, 例如缓存命中和 304
+    // 返回 0 表示第一个请求就需要交给线程池 (这时什么都没有处理), 否则返回接下来等待的事件, 和工作线程交还连接时一样
+    int process_inline();
+    // 初始化新的连接, epollfd 是接受这个连接的事件循环, loop_id 是它的编号 (选择上游连接池的分片)
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, int loop_id);
+    // 初始化由 io_uring 事件循环驱动的连接, 不注册到 epoll
+    void init(int sockfd, const sockaddr_in& addr, ConnLoop* loop, int loop_id);
     void close_conn(); // 关闭连接
     bool read();  // 非阻塞读 (因为你需要把所有的数据都读出来)
     bool write(); // 非阻塞写    
+    bool has_pending() const; // 响应发送完之后读缓冲区中是否还有流水线请求需要交给线程池
+    bool idle() const;             // 当前是否没有正在接收的请求
+    bool receiving_body() const { return m_check_state == CHECK_STATE_CONTENT; } // 请求头已经收完, 正在接收请求体
+    // 读缓冲区满了: read() 在 socket 中的数据读完之前就停止了, 连接上可能还有数据
+    bool input_full() const { return m_read_idx == m_read_buf.capacity(); }
+    bool response_pending() const; // 这一批响应是否还没有发送完
+    int keep_alive_timeout() const { return m_keep_alive_timeout; }
+    TimerNode* timer() { return &m_timer; }
+    int sockfd() const { return m_sockfd; }
+    int loop_id() const { return m_loop_id; }
+
+    // 服务器过载时由事件循环直接发送预先构造好的 503 响应, 不经过线程池, 调用者随后关闭连接
+    static void send_overload(int sockfd);
+
+    // 下面这组函数给自己收发数据的事件循环 (io_uring) 使用, 只能在连接没有交给线程池时调用
+    int append_input(const char* data, int len);   // 把收到的数据追加到读缓冲区, 返回放下的字节数, 读缓冲区满了时少于 len
+    int send_iov(struct iovec** iov);              // writev 部分还没有发送的内存块, 返回数量, 0 表示已经发送完
+    void consume_sent(size_t bytes);               // writev 部分又发送了 bytes 字节
+    bool file_pending(int* fd, off_t* offset, off_t* len) const; // sendfile 部分还没有发送的文件体
+    void consume_file(off_t bytes);                // sendfile 部分又发送了 bytes 字节
+    bool finish_write();                           // 这一批响应发送完毕, 返回 false 表示需要关闭连接
+    // 反向代理的响应体, 在 writev 和 sendfile 部分之后由上游连接转发 (UpstreamRelay)
+    bool relaying() const { return m_relay.active(); }
+    int relay() { return m_relay.pump(m_sockfd); }      // 返回值和 UpstreamRelay::pump 相同
+    int upstream_fd() const { return m_relay.fd(); }
+    bool watch_upstream(int epollfd) { return m_relay.watch(epollfd, m_sockfd); }
+    bool watching_upstream(int epollfd) const { return m_relay.watching(epollfd); }
+    void cancel_relay() { m_relay.shutdown(); }         // 让事件循环等待上游的操作马上结束
+
+    // 连接被交给线程池之后到工作线程重新注册事件之前为 true
+    // 这段时间内事件循环不能关闭这个连接, 到期的定时器会被推迟
+    std::atomic<bool> m_busy;
+    uint64_t m_enqueue_time; // 交给线程池的时间, 用来统计在队列中等待的时间
 
 private:
     int m_sockfd;                       // 该 HTTP 连接的 socket
+    int m_epollfd;                      // 该连接所属的事件循环的 epoll 对象, 连接的事件只注册在这里
+    ConnLoop* m_loop;                   // 不使用 epoll 的事件循环, 这时 m_epollfd 为 -1
+    int m_loop_id;                      // 所属的事件循环的编号
     sockaddr_in m_address;              // 通信的 socket 地址
+    TimerNode m_timer;                  // 连接的超时定时器, 由所属的事件循环的时间轮管理
+    bool m_inline;                      // 正在事件循环的线程中处理, 遇到慢操作时返回 DEFER_REQUEST
 
-    char m_read_buf[READ_BUFFER_SIZE];  // 读缓冲区
+    Buffer m_read_buf;                  // 读缓冲区, 从内存池取得, 连接空闲时归还, 请求太大时换成更大的内存块
     int m_read_idx;                     // 标识读缓冲区中读入的客户数据的最后一个字节的下一位
     int m_checked_index;                // 当前正在分析的字符在读缓冲区的位置
     int m_start_line;                   // 当前正在解析的行的起始位置
+    int m_request_start;                // 当前正在解析的请求的起始位置, 之前的数据都已经处理完了
+    int m_line_len;                     // parse_line 提取出来的行的长度 (不包含 "\r\n")
     CHECK_STATE m_check_state;          // 主状态机当前所处的状态
 
-    //  将获取到的 HTTP 报头的信息存在这里
-    char* m_url;     // 请求目标文件的文件名
-    char* m_version; // 协议版本, 只支持 HTTP 1.1
-    METHOD m_method; // 请求方法
-    char *m_host;    // 主机名
-    bool m_linger;   // HTTP 请求是否要保持连接
+    //  将获取到的 HTTP 报头的信息存在这里, 字符串都是读缓冲区中的 (偏移量, 长度)
+    HttpSlice m_url;      // 请求目标文件的文件名
+    HttpSlice m_version;  // 协议版本, 支持 HTTP/1.1 和 HTTP/1.0
+    METHOD m_method;      // 请求方法
+    HttpSlice m_host;     // 主机名
+    HttpHeader m_headers[MAX_HEADERS]; // 头部字段的索引
+    int m_header_count;
+    bool m_linger;        // HTTP 请求是否要保持连接
+
+    // 请求体: 请求头解析完之后边接收边解码, 解码出来的数据交给 m_body_sink (为 NULL 时丢弃), 然后从读缓冲区中删除
+    off_t m_content_length;   // Content-Length 的值
+    bool m_chunked;           // Transfer-Encoding: chunked
+    bool m_expect_continue;   // Expect: 100-continue
+    BODY_STATE m_body_state;
+    off_t m_body_remaining;   // 当前的请求体或者 chunk 还没有收到的字节数
+    off_t m_body_received;    // 已经收到的请求体的字节数
+    off_t m_body_limit;       // 请求体的最大长度
+    BodySink* m_body_sink;
+    FileSink m_upload;        // POST / PUT 上传的文件
+    StringSink m_route_body;  // 交给路由的请求体
+
+    const Route* m_route;     // 请求匹配的路由, NULL 表示按静态文件处理
+    int m_allowed;            // 这个路径允许的方法 (1 << METHOD 的位掩码), 回复 405 时用
+
+    // 反向代理: do_request 和上游服务器交换请求头和响应头, process_write 转发响应头, 响应体由 m_relay 转发
+    Backend* m_backend;          // 处理当前请求的上游服务器
+    int m_upstream_fd;           // 和它的连接, 交给 m_relay 或者放回连接池之后为 -1
+    const char* m_upstream_head; // 上游的响应头, 在当前线程的 arena 中
+    int m_upstream_head_len;
+    UpstreamHead m_upstream;
+    UpstreamRelay m_relay;
+
+    // Range 请求的区间 (闭区间, 已经截断到文件大小之内), m_range_count 为 0 表示返回整个文件
+    struct ByteRange {
+        off_t first;
+        off_t last;
+    };
+    ByteRange m_ranges[MAX_RANGES];
+    int m_range_count;
+
+    int m_requests;            // 这个连接上已经处理的请求数量
+    int m_keep_alive_timeout;  // 这个连接空闲的超时时间 (秒), 可以被客户端的 Keep-Alive 头部字段缩短
+    bool m_keep_conn;          // 这一批响应发送完之后是否保持连接
+    bool m_pipelined;          // 这一批响应之后读缓冲区中还有没有处理的流水线请求
+    int m_status;              // 最近一个响应的状态码, 写访问日志用
+    off_t m_body_bytes;        // 最近一个响应的响应体长度, 写访问日志用
+
+    FileEntryPtr m_file;                // 当前请求从文件缓存中取得的目标文件, 持有它就保证映射和描述符有效
+    char* m_file_address;               // mmap 模式下文件体的起始位置 (sendfile 模式下为 NULL)
+    int m_file_fd;                      // sendfile 模式下使用的文件描述符 (mmap 模式下为 -1)
+    off_t m_file_offset;                // sendfile 模式下文件体已经发送到的位置
+    off_t m_file_size;                  // sendfile 模式下文件体的大小
+    FileEntryPtr m_files[MAX_PIPELINE]; // 这一批响应引用的文件, 全部发送完之后才释放
+    int m_file_count;
+
+    Buffer m_write_buf;                  // 写缓冲区, 只存放响应头 (和错误页面), 文件体不经过这里, 发送完就归还
+    int m_write_idx;                     // 写缓冲区中待发送的字节数
+    struct iovec m_iv[IOV_COUNT];        // writev 使用的内存块: 每个响应一个响应头, mmap 模式下再加一个文件体
+    int m_iv_count;                      // 被写内存块的数量
+    int m_iv_index;                      // 第一个还没有发送完的内存块
+    int bytes_to_send;                   // writev 还需要发送的字节数 (不包含 sendfile 部分)
+    int bytes_have_send;                 // writev 已经发送的字节数
 
     void init();                        // 初始化连接其余的信息
+    void init_request();                // 初始化解析下一个请求的状态, 保留读缓冲区中的数据
+    void init_write();                  // 初始化发送响应的状态
+    void compact();                     // 把处理完的请求从读缓冲区中移除
+    int handle_requests();              // 依次处理读缓冲区中的请求, 返回接下来等待的事件, 快速路径上第一个请求就被推迟时返回 0
+    void rewind_request();              // 放弃当前请求已经解析的部分, 之后从它的第一个字节重新解析
     HTTP_CODE process_read();           // 解析 HTTP 请求
+    bool process_write(HTTP_CODE ret);  // 根据解析结果填充 HTTP 响应
     LINE_STATUS parse_line();           // 先从缓冲区中提取一行出来, 然后交给下面的函数解析
-    HTTP_CODE parse_request_line();     // 解析请求首行
-    HTTP_CODE parse_headers();          // 解析请求头
-    HTTP_CODE parse_content();          // 解析请求体
-    char *get_line() { return m_read_buf + m_start_line; };
-    HTTP_CODE do_request();
+    HTTP_CODE parse_request_line(char* text, int len); // 解析请求首行
+    HTTP_CODE parse_headers(char* text, int len);      // 解析请求头
+    HTTP_CODE begin_body();                            // 请求头解析完毕, 准备接收请求体
+    HTTP_CODE parse_content();                         // 解码读缓冲区中已经收到的请求体
+    bool get_header(HttpHeaderId id, const char** value, int* len) const;  // 在头部索引中查找字段
+    static bool has_token(const char* value, int value_len, const char* token); // 逗号分隔的字段值中是否包含 token
+    char *get_line() { return m_read_buf.data() + m_start_line; };
+    // 当前请求中 (偏移量, 长度) 表示的数据和读缓冲区中位置的相互转换
+    const char* slice_ptr(HttpSlice slice) const { return m_read_buf.data() + m_request_start + slice.off; }
+    HttpSlice make_slice(const char* p, int len) const {
+        HttpSlice slice = { (int)(p - m_read_buf.data()) - m_request_start, len };
+        return slice;
+    }
+    HTTP_CODE map_url(const char* root, const char* url, int url_len, char** path); // URL 解码成 root 下的路径
+    HTTP_CODE match_route();            // 在路由表中查找请求的路径, 决定请求交给处理函数还是按静态文件处理
+    HTTP_CODE do_request();             // 找到目标文件, 并决定用 mmap 还是 sendfile 发送
+    HTTP_CODE open_upload();            // 为 POST / PUT 创建保存请求体的文件
+    HTTP_CODE finish_upload();          // 请求体接收完毕, 保存上传的文件
+    HTTP_CODE forward_request();        // 把请求转发给上游服务器, 读取它的响应头
+    void build_upstream_request(ArenaString* request) const; // 转发给上游服务器的请求头
+    static bool parse_upstream_head(const char* head, int len, UpstreamHead* result); // 解析上游的响应头
+    bool not_modified() const;          // 根据 If-None-Match / If-Modified-Since 判断客户端缓存的文件是否仍然有效
+    int parse_range();                  // 解析 Range 到 m_ranges, 返回区间数量, 0 表示返回整个文件, -1 表示无法满足
+    bool etag_matches(const char* value, int len) const; // 逗号分隔的 ETag 列表中是否有当前文件的 ETag (弱比较)
+    bool accepts_gzip() const;          // Accept-Encoding 是否允许 gzip
+    void unmap();                       // 释放对缓存文件的引用
+    void log_access(uint64_t start);    // 为刚生成的响应写一行访问日志, start 是开始解析请求的时间
+    void resume(int events);            // 工作线程把连接交还给事件循环
+
+    // 下面这组函数被 process_write 调用, 用来填充 HTTP 响应头
+    // 固定的文本来自 http_response.h 中编译期生成的表, 只有数字需要在运行时转换
+    bool reserve_write(int len);        // 保证写缓冲区还有 len 字节的空间
+    bool add_text(const char* text, int len);
+    bool add_number(long long value);
+    bool add_status_line(int status);
+    bool add_headers(off_t content_length); // Content-Length, Date, Connection 和空行
+    bool add_content_length(off_t content_length);
+    bool add_date();
+    bool add_linger();
+    bool add_blank_line();
+    bool add_error(int status, const char* extra = NULL, int extra_len = 0); // 完整的错误响应, extra 是额外的头部字段
+    bool add_content_range(off_t first, off_t last);
+    bool add_file(int header_start);    // 文件响应: 整个文件, 一个区间或者 multipart/byteranges
+    bool add_route_response(int header_start); // 调用路由的处理函数, 把它填写的响应放进写缓冲区
+    bool add_proxy_response(int header_start); // 上游的响应头, 响应体交给 m_relay
+    void add_iov(char* base, size_t len); // 把一个内存块追加到这一批响应中
 };
 
-#endif
\ No newline at end of file
+#endif
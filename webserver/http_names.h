@@ -0,0 +1,110 @@
+#ifndef HTTPNAMES_H
+#define HTTPNAMES_H
+
+#include <strings.h>
+
+#include "http_response.h"
+
+// 请求方法和常用头部字段名的查找表, 在编译期生成完美哈希:
+// 编译期依次尝试种子, 直到表中所有名字的哈希值 (不区分大小写) 落在不同的槽中, 找不到时编译失败
+// 运行时只计算一次哈希, 再和这个槽中唯一的候选比较一次, 查找的代价和表中名字的数量无关
+
+// 不区分大小写的 FNV-1a, 种子混进初始值
+constexpr unsigned name_hash(const char* name, int len, unsigned seed) {
+    unsigned h = 2166136261u ^ (seed * 2654435761u);
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = name[i];
+        if (c >= 'A' && c <= 'Z') {
+            c |= 0x20;
+        }
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+// N 个名字的完美哈希表, SIZE 是槽的数量 (2 的幂)
+template <int N, int SIZE>
+struct PerfectHash {
+    const char* names[N];
+    int lens[N];
+    unsigned seed;
+    signed char slots[SIZE];   // 槽中名字的编号, -1 表示空槽
+
+    // name 在表中的编号, 不在表中时返回 -1
+    int find(const char* name, int len) const {
+        int id = slots[name_hash(name, len, seed) & (SIZE - 1)];
+        if (id < 0 || lens[id] != len || strncasecmp(names[id], name, len) != 0) {
+            return -1;
+        }
+        return id;
+    }
+};
+
+template <int SIZE, int N>
+constexpr PerfectHash<N, SIZE> make_perfect_hash(const char* const (&names)[N]) {
+    static_assert((SIZE & (SIZE - 1)) == 0 && SIZE >= N, "SIZE must be a power of two not less than N");
+    PerfectHash<N, SIZE> table = {};
+    for (int i = 0; i < N; ++i) {
+        table.names[i] = names[i];
+        table.lens[i] = static_length(names[i]);
+    }
+    for (unsigned seed = 0; seed < 100000; ++seed) {
+        for (int i = 0; i < SIZE; ++i) {
+            table.slots[i] = -1;
+        }
+        bool perfect = true;
+        for (int i = 0; i < N && perfect; ++i) {
+            unsigned slot = name_hash(names[i], table.lens[i], seed) & (SIZE - 1);
+            if (table.slots[slot] >= 0) {
+                perfect = false;
+            }
+            table.slots[slot] = i;
+        }
+        if (perfect) {
+            table.seed = seed;
+            return table;
+        }
+    }
+    // 常量求值走到这里时编译失败: 需要更多的槽
+    throw "no perfect hash seed for these names";
+}
+
+// 请求方法, 顺序和 http_conn::METHOD 相同
+static constexpr const char* http_method_names[] = {
+    "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"
+};
+static const int HTTP_METHOD_COUNT = sizeof(http_method_names) / sizeof(http_method_names[0]);
+static constexpr PerfectHash<HTTP_METHOD_COUNT, 16> http_methods = make_perfect_hash<16>(http_method_names);
+
+// 服务器自己处理的头部字段 (包括反向代理转发时要去掉的逐跳字段), 解析请求头时记录在头部索引中, 之后按编号查找, 不再比较字符串
+enum HttpHeaderId {
+    HEADER_OTHER = -1,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_CONTENT_TYPE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_USER_AGENT,
+    HEADER_TE,
+    HEADER_UPGRADE,
+    HEADER_PROXY_CONNECTION,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_COUNT
+};
+
+static constexpr const char* http_header_names[HEADER_COUNT] = {
+    "Host", "Connection", "Keep-Alive", "Content-Length", "Transfer-Encoding", "Expect", "Content-Type",
+    "Accept", "Accept-Encoding", "If-None-Match", "If-Modified-Since", "Range", "If-Range", "User-Agent",
+    "TE", "Upgrade", "Proxy-Connection", "X-Forwarded-For"
+};
+static constexpr PerfectHash<HEADER_COUNT, 64> http_headers = make_perfect_hash<64>(http_header_names);
+
+#endif
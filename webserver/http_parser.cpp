@@ -0,0 +1,163 @@
+#include "http_parser.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86 1
+#endif
+
+// -------------------------------------------------------------------
+//  逐字节的实现
+// -------------------------------------------------------------------
+
+static const char* find_byte_scalar(const char* begin, const char* end, char c) {
+    for (const char* p = begin; p < end; ++p) {
+        if (*p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static const char* find_any_scalar(const char* begin, const char* end, const char* set, int set_len) {
+    for (const char* p = begin; p < end; ++p) {
+        if (memchr(set, *p, set_len)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef HTTP_PARSER_X86
+
+// -------------------------------------------------------------------
+//  SSE2: 一次比较 16 字节, x86-64 上总是可用
+// -------------------------------------------------------------------
+
+__attribute__((target("sse2")))
+static const char* find_byte_sse2(const char* begin, const char* end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const char* p = begin;
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+// -------------------------------------------------------------------
+//  SSE4.2: PCMPESTRI 一条指令就能在 16 字节中查找一个字符集合
+// -------------------------------------------------------------------
+
+__attribute__((target("sse4.2")))
+static const char* find_any_sse42(const char* begin, const char* end, const char* set, int set_len) {
+    char buf[16] = {0};
+    memcpy(buf, set, set_len > 16 ? 16 : set_len);
+    const __m128i needles = _mm_loadu_si128((const __m128i*)buf);
+    const char* p = begin;
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int idx = _mm_cmpestri(needles, set_len, chunk, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16) {
+            return p + idx;
+        }
+    }
+    return find_any_scalar(p, end, set, set_len);
+}
+
+// -------------------------------------------------------------------
+//  AVX2: 一次比较 32 字节
+// -------------------------------------------------------------------
+
+__attribute__((target("avx2")))
+static const char* find_byte_avx2(const char* begin, const char* end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const char* p = begin;
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* find_any_avx2(const char* begin, const char* end, const char* set, int set_len) {
+    // 集合中的字符很少 (通常是 1 到 3 个), 对每个字符比较一次再合并结果
+    const char* p = begin;
+    if (set_len <= 4) {
+        __m256i needles[4];
+        for (int i = 0; i < set_len; ++i) {
+            needles[i] = _mm256_set1_epi8(set[i]);
+        }
+        for (; end - p >= 32; p += 32) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+            __m256i hit = _mm256_cmpeq_epi8(chunk, needles[0]);
+            for (int i = 1; i < set_len; ++i) {
+                hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needles[i]));
+            }
+            unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+    }
+    return find_any_sse42(p, end, set, set_len);
+}
+
+#endif // HTTP_PARSER_X86
+
+// -------------------------------------------------------------------
+//  运行时选择实现
+// -------------------------------------------------------------------
+
+typedef const char* (*FindByteFunc)(const char*, const char*, char);
+typedef const char* (*FindAnyFunc)(const char*, const char*, const char*, int);
+
+struct ParserDispatch {
+    FindByteFunc find_byte;
+    FindAnyFunc find_any;
+    const char* isa;
+
+    ParserDispatch(): find_byte(find_byte_scalar), find_any(find_any_scalar), isa("scalar") {
+#ifdef HTTP_PARSER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            find_byte = find_byte_avx2;
+            find_any = find_any_avx2;
+            isa = "avx2";
+        } else if (__builtin_cpu_supports("sse4.2")) {
+            find_byte = find_byte_sse2;
+            find_any = find_any_sse42;
+            isa = "sse4.2";
+        } else if (__builtin_cpu_supports("sse2")) {
+            find_byte = find_byte_sse2;
+            isa = "sse2";
+        }
+#endif
+    }
+};
+
+static const ParserDispatch& dispatch() {
+    static ParserDispatch instance;
+    return instance;
+}
+
+const char* find_byte(const char* begin, const char* end, char c) {
+    return dispatch().find_byte(begin, end, c);
+}
+
+const char* find_any(const char* begin, const char* end, const char* set, int set_len) {
+    return dispatch().find_any(begin, end, set, set_len);
+}
+
+const char* http_parser_isa() {
+    return dispatch().isa;
+}
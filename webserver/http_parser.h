@@ -0,0 +1,32 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+// HTTP 报文扫描的基础函数
+// 在 x86 上一次比较 16 字节 (SSE2 / SSE4.2) 或 32 字节 (AVX2), 运行时根据 CPU 支持的指令集选择实现
+// 其他平台或者不支持的 CPU 使用逐字节的实现
+
+// 读缓冲区中的一段数据, off 是相对于当前请求起始位置的偏移量
+// 读缓冲区被整理 (请求被移动到缓冲区开头) 之后仍然有效
+struct HttpSlice {
+    int off;
+    int len;
+};
+
+// 头部字段的索引: 字段名和字段值在读缓冲区中的位置, 不需要修改读缓冲区
+// id 是字段名在 http_headers (http_names.h) 中的编号, 不在表中的字段为 HEADER_OTHER
+struct HttpHeader {
+    HttpSlice name;
+    HttpSlice value;
+    int id;
+};
+
+// 在 [begin, end) 中查找第一个等于 c 的字节, 没有找到返回 end
+const char* find_byte(const char* begin, const char* end, char c);
+
+// 在 [begin, end) 中查找第一个属于 set 的字节 (set 中最多 16 个字符), 没有找到返回 end
+const char* find_any(const char* begin, const char* end, const char* set, int set_len);
+
+// 当前使用的实现的名字: "avx2", "sse4.2", "sse2" 或者 "scalar"
+const char* http_parser_isa();
+
+#endif
@@ -0,0 +1,93 @@
+#include "http_response.h"
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <atomic>
+
+// 所有线程共享的 Date 字段, 用顺序锁保护:
+// 写者把 date_seq 改为奇数之后才修改内容, 改完再加一; 读者拷贝前后 date_seq 相同且为偶数时拷贝有效
+static std::atomic<unsigned> date_seq(0);
+static std::atomic<time_t> date_second(0);
+static char date_text[HTTP_DATE_LEN];
+
+static void format_date(char* buf, time_t now) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(buf, HTTP_DATE_LEN + 1, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+void http_date(char* buf) {
+    time_t now = time(NULL);
+    unsigned seq = date_seq.load(std::memory_order_acquire);
+    if (!(seq & 1) && date_second.load(std::memory_order_relaxed) == now) {
+        memcpy(buf, date_text, HTTP_DATE_LEN);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (date_seq.load(std::memory_order_relaxed) == seq) {
+            return;
+        }
+    } else if (!(seq & 1) && date_seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+        // 这一秒第一个到达的线程负责重新生成
+        std::atomic_thread_fence(std::memory_order_release);
+        char text[HTTP_DATE_LEN + 1];
+        format_date(text, now);
+        memcpy(date_text, text, HTTP_DATE_LEN);
+        date_second.store(now, std::memory_order_relaxed);
+        date_seq.store(seq + 2, std::memory_order_release);
+        memcpy(buf, text, HTTP_DATE_LEN);
+        return;
+    }
+
+    // 另一个线程正在更新, 自己格式化一次, 不等待
+    char text[HTTP_DATE_LEN + 1];
+    format_date(text, now);
+    memcpy(buf, text, HTTP_DATE_LEN);
+}
+
+struct MimeType {
+    const char* extension;
+    const char* type;
+    bool compressible;
+};
+
+static const MimeType mime_types[] = {
+    { "html", "text/html; charset=utf-8", true },
+    { "htm", "text/html; charset=utf-8", true },
+    { "css", "text/css; charset=utf-8", true },
+    { "js", "application/javascript; charset=utf-8", true },
+    { "mjs", "application/javascript; charset=utf-8", true },
+    { "json", "application/json", true },
+    { "xml", "application/xml", true },
+    { "txt", "text/plain; charset=utf-8", true },
+    { "csv", "text/csv; charset=utf-8", true },
+    { "md", "text/markdown; charset=utf-8", true },
+    { "svg", "image/svg+xml", true },
+    { "wasm", "application/wasm", true },
+    { "ico", "image/x-icon", true },
+    { "png", "image/png", false },
+    { "jpg", "image/jpeg", false },
+    { "jpeg", "image/jpeg", false },
+    { "gif", "image/gif", false },
+    { "webp", "image/webp", false },
+    { "woff", "font/woff", false },
+    { "woff2", "font/woff2", false },
+    { "mp4", "video/mp4", false },
+    { "pdf", "application/pdf", false },
+    { "gz", "application/gzip", false },
+    { "zip", "application/zip", false },
+};
+
+const char* mime_type(const char* path, bool* compressible) {
+    *compressible = false;
+    const char* dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return NULL;
+    }
+    for (const MimeType& mime : mime_types) {
+        if (strcasecmp(dot + 1, mime.extension) == 0) {
+            *compressible = mime.compressible;
+            return mime.type;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,113 @@
+#ifndef HTTPRESPONSE_H
+#define HTTPRESPONSE_H
+
+#include <stddef.h>
+
+// 响应中固定不变的部分在编译期生成: 状态行, 错误页面的响应头和页面内容
+// 运行时只需要 memcpy, 再补上 Content-Length, Date 和 Connection 这些动态字段, 不再调用 snprintf
+
+// 编译期拼接的定长字符串, 超过 CAPACITY 时编译失败 (常量求值中的越界访问)
+struct StaticText {
+    static const int CAPACITY = 256;
+    char data[CAPACITY];
+    int size;
+
+    constexpr StaticText(): data(), size(0) {}
+
+    constexpr StaticText& append(const char* text) {
+        while (*text) {
+            data[size++] = *text++;
+        }
+        return *this;
+    }
+
+    constexpr StaticText& append_number(long long value) {
+        char digits[20] = {};
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        while (n > 0) {
+            data[size++] = digits[--n];
+        }
+        return *this;
+    }
+};
+
+constexpr int static_length(const char* text) {
+    int len = 0;
+    while (text[len]) {
+        ++len;
+    }
+    return len;
+}
+
+// 一个状态码的所有固定文本
+struct HttpStatus {
+    int code;
+    const char* body;      // 错误页面的内容, 成功的状态没有页面
+    int body_len;
+    StaticText line;       // "HTTP/1.1 404 Not Found\r\n"
+    StaticText error_head; // 状态行 + Content-Length, 错误页面的响应中只需要再补上 Date 和 Connection
+};
+
+constexpr HttpStatus make_status(int code, const char* title, const char* body) {
+    HttpStatus status = { code, body, body ? static_length(body) : 0, StaticText(), StaticText() };
+    status.line.append("HTTP/1.1 ").append_number(code).append(" ").append(title).append("\r\n");
+    status.error_head = status.line;
+    if (body) {
+        status.error_head.append("Content-Length: ").append_number(status.body_len).append("\r\n");
+    }
+    return status;
+}
+
+static constexpr HttpStatus http_statuses[] = {
+    make_status(200, "OK", NULL),
+    make_status(201, "Created", NULL),
+    make_status(206, "Partial Content", NULL),
+    make_status(304, "Not Modified", NULL),
+    make_status(400, "Bad Request", "Your request has bad syntax or is inherently impossible to satisfy.\n"),
+    make_status(403, "Forbidden", "You do not have permission to get file from this server.\n"),
+    make_status(404, "Not Found", "The requested file was not found on this server.\n"),
+    make_status(405, "Method Not Allowed", "The request method is not supported for the requested resource.\n"),
+    make_status(413, "Payload Too Large", "The request is larger than the server is willing to process.\n"),
+    make_status(416, "Range Not Satisfiable", "The requested range is not satisfiable.\n"),
+    make_status(431, "Request Header Fields Too Large", "The request line and headers are larger than the server is willing to process.\n"),
+    make_status(500, "Internal Error", "There was an unusual problem serving the requested file.\n"),
+    make_status(501, "Not Implemented", "The request uses a transfer encoding the server does not support.\n"),
+    make_status(502, "Bad Gateway", "The upstream server did not return a valid response.\n"),
+    make_status(503, "Service Unavailable", "Server is too busy.\n"),
+    make_status(504, "Gateway Timeout", "The upstream server did not respond in time.\n"),
+};
+static const int HTTP_STATUS_COUNT = sizeof(http_statuses) / sizeof(http_statuses[0]);
+
+// 查找状态码对应的表项, 表中没有的状态码当作 500
+constexpr const HttpStatus& http_status(int code) {
+    int i = 0;
+    while (i < HTTP_STATUS_COUNT && http_statuses[i].code != code) {
+        ++i;
+    }
+    return i < HTTP_STATUS_COUNT ? http_statuses[i] : http_status(500);
+}
+
+// 过载时由事件循环直接发送的完整响应, 不带 Date, 客户端应该在 Retry-After 秒之后重试
+constexpr StaticText make_overload_response() {
+    StaticText text = http_status(503).error_head;
+    text.append("Retry-After: 1\r\nConnection: close\r\n\r\n").append(http_status(503).body);
+    return text;
+}
+static constexpr StaticText overload_response = make_overload_response();
+
+// 根据文件的扩展名得到 Content-Type, 未知的类型返回 NULL (响应中不带 Content-Type)
+// compressible 表示这种类型是否值得压缩 (文本类型, 图片和视频本身已经压缩过了)
+const char* mime_type(const char* path, bool* compressible);
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" 的长度
+static const int HTTP_DATE_LEN = 37;
+
+// 把当前时间的 Date 头部字段写到 buf 中 (HTTP_DATE_LEN 字节, 不以 '\0' 结尾)
+// 格式化好的字符串每秒只生成一次, 由所有线程共享
+void http_date(char* buf);
+
+#endif
@@ -59,4 +59,6 @@ Sem::~Sem() { sem_destroy(&m_sem); }
 
 bool Sem::wait() { return sem_wait(&m_sem) == 0; }
 
+bool Sem::timedwait(struct timespec t) { return sem_timedwait(&m_sem, &t) == 0; }
+
 bool Sem::post() { return sem_post(&m_sem) == 0; }
\ No newline at end of file
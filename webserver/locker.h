@@ -41,6 +41,7 @@ public:
  Sem(int num);
  ~Sem();
  bool wait(); // 等待信号量
+ bool timedwait(struct timespec t); // 等待信号量, t 是超时的绝对时间 (CLOCK_REALTIME), 超时返回 false
  bool post(); // 增加信号量
 
 private:
@@ -0,0 +1,355 @@
+#include "log.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// 当前线程的缓冲区和线程号
+static thread_local void* t_buffer = NULL;
+static thread_local int t_tid = 0;
+
+Logger* Logger::get_instance() {
+    static Logger logger;
+    return &logger;
+}
+
+Logger::Logger():
+    m_level(LOG_LEVEL_INFO), m_block(false), m_max_file_size(0), m_keep_files(0),
+    m_dropped(0), m_running(false) {
+    // 还没有调用 init 时服务器日志同步地写到标准错误
+    m_fds[LOG_SINK_SERVER] = STDERR_FILENO;
+    m_fds[LOG_SINK_ACCESS] = -1;
+    m_sizes[LOG_SINK_SERVER] = m_sizes[LOG_SINK_ACCESS] = 0;
+}
+
+Logger::~Logger() {
+    stop();
+    for (int i = 0; i < LOG_SINK_COUNT; ++i) {
+        if (m_fds[i] > STDERR_FILENO) {
+            close(m_fds[i]);
+        }
+    }
+    for (size_t i = 0; i < m_buffers.size(); ++i) {
+        delete m_buffers[i];
+    }
+}
+
+bool Logger::parse_level(const char* name, LOG_LEVEL* level) {
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; ++i) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = (LOG_LEVEL)i;
+            return true;
+        }
+    }
+    if (strcasecmp(name, "off") == 0) {
+        *level = LOG_LEVEL_OFF;
+        return true;
+    }
+    return false;
+}
+
+bool Logger::init(const char* server_path, const char* access_path, LOG_LEVEL level,
+                  size_t max_file_size, int keep_files, bool block) {
+    m_level = level;
+    m_block = block;
+    m_max_file_size = max_file_size;
+    m_keep_files = keep_files < 0 ? 0 : keep_files;
+
+    if (server_path && strcmp(server_path, "-") != 0) {
+        m_paths[LOG_SINK_SERVER] = server_path;
+        if (!open_sink(LOG_SINK_SERVER)) {
+            return false;
+        }
+    }
+    if (access_path) {
+        m_paths[LOG_SINK_ACCESS] = access_path;
+        if (!open_sink(LOG_SINK_ACCESS)) {
+            return false;
+        }
+    }
+
+    m_running.store(true);
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        m_running.store(false);
+        return false;
+    }
+    return true;
+}
+
+void Logger::stop() {
+    if (!m_running.exchange(false)) {
+        return;
+    }
+    m_wakeup.post();
+    pthread_join(m_thread, NULL);
+    // 后台线程结束之后可能还有线程写进了缓冲区
+    flush();
+}
+
+bool Logger::open_sink(int sink) {
+    int fd = open(m_paths[sink].c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(m_paths[sink].c_str());
+        return false;
+    }
+    struct stat st;
+    m_sizes[sink] = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    if (m_fds[sink] > STDERR_FILENO) {
+        close(m_fds[sink]);
+    }
+    m_fds[sink] = fd;
+    return true;
+}
+
+// 轮转: name.(n-1) -> name.n, ..., name -> name.1, 然后重新创建 name
+void Logger::rotate(int sink) {
+    const std::string& path = m_paths[sink];
+    char from[512];
+    char to[512];
+    for (int i = m_keep_files - 1; i >= 1; --i) {
+        snprintf(from, sizeof(from), "%s.%d", path.c_str(), i);
+        snprintf(to, sizeof(to), "%s.%d", path.c_str(), i + 1);
+        rename(from, to);
+    }
+    if (m_keep_files > 0) {
+        snprintf(to, sizeof(to), "%s.1", path.c_str());
+        rename(path.c_str(), to);
+    } else {
+        unlink(path.c_str());
+    }
+    open_sink(sink);
+}
+
+void* Logger::worker(void* arg) {
+    Logger* logger = (Logger*)arg;
+    logger->run();
+    return logger;
+}
+
+void Logger::run() {
+    while (m_running.load(std::memory_order_relaxed)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        m_wakeup.timedwait(deadline);
+
+        // 一直写到所有缓冲区都空了再睡眠
+        while (flush()) {
+        }
+    }
+}
+
+Logger::ThreadBuffer* Logger::local_buffer() {
+    if (!t_buffer) {
+        ThreadBuffer* buffer = new ThreadBuffer;
+        m_locker.lock();
+        m_buffers.push_back(buffer);
+        m_locker.unlock();
+        t_buffer = buffer;
+    }
+    return (ThreadBuffer*)t_buffer;
+}
+
+// 把一行日志拷贝到当前线程的环形缓冲区中, 写到末尾时绕回开头
+void Logger::append(LOG_SINK sink, const char* line, int len) {
+    if (!m_running.load(std::memory_order_relaxed)) {
+        // 后台线程没有运行, 直接写到文件中
+        if (m_fds[sink] != -1) {
+            ssize_t ret = ::write(m_fds[sink], line, len);
+            (void)ret;
+        }
+        return;
+    }
+
+    Ring& ring = local_buffer()->rings[sink];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    while (head - tail + len > (uint64_t)RING_SIZE) {
+        if (!m_block || !m_running.load(std::memory_order_relaxed)) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            m_wakeup.post();
+            return;
+        }
+        // 阻塞策略: 叫醒后台线程, 等它腾出空间
+        m_wakeup.post();
+        usleep(100);
+        tail = ring.tail.load(std::memory_order_acquire);
+    }
+
+    size_t pos = head & (RING_SIZE - 1);
+    size_t first = RING_SIZE - pos;
+    if (first >= (size_t)len) {
+        memcpy(ring.data + pos, line, len);
+    } else {
+        memcpy(ring.data + pos, line, first);
+        memcpy(ring.data, line + first, len - first);
+    }
+    // release: 后台线程看到新的 head 时一定能看到拷贝进去的数据
+    ring.head.store(head + len, std::memory_order_release);
+
+    // 刚超过一半时叫醒后台线程, 不用等到下一次定时刷新
+    uint64_t used = head - tail;
+    if (used < (uint64_t)RING_SIZE / 2 && used + len >= (uint64_t)RING_SIZE / 2) {
+        m_wakeup.post();
+    }
+}
+
+// 用 writev 写出一批 iovec, 处理部分写入
+void Logger::write_sink(int sink, struct iovec* iov, int count, size_t bytes) {
+    int fd = m_fds[sink];
+    int index = 0;
+    while (index < count) {
+        ssize_t n = writev(fd, iov + index, count - index);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // 写日志失败时只能放弃这一批
+        }
+        while (index < count && (size_t)n >= iov[index].iov_len) {
+            n -= iov[index].iov_len;
+            ++index;
+        }
+        if (n > 0) {
+            iov[index].iov_base = (char*)iov[index].iov_base + n;
+            iov[index].iov_len -= n;
+        }
+    }
+
+    m_sizes[sink] += bytes;
+    if (m_max_file_size > 0 && !m_paths[sink].empty() && m_sizes[sink] >= m_max_file_size) {
+        rotate(sink);
+    }
+}
+
+bool Logger::flush() {
+    static const int MAX_IOV = 64;
+    struct iovec iov[MAX_IOV];
+    Ring* rings[MAX_IOV];
+    uint64_t heads[MAX_IOV];
+    bool wrote = false;
+
+    m_locker.lock();
+    for (int sink = 0; sink < LOG_SINK_COUNT; ++sink) {
+        int count = 0;      // iovec 的数量
+        int ring_count = 0; // 这一批涉及的环形缓冲区数量
+        size_t bytes = 0;
+        for (size_t i = 0; i <= m_buffers.size(); ++i) {
+            // 每个缓冲区最多需要两个 iovec, 放不下了就先写出去
+            if (i == m_buffers.size() || count + 2 > MAX_IOV) {
+                if (count > 0 && m_fds[sink] != -1) {
+                    write_sink(sink, iov, count, bytes);
+                }
+                for (int r = 0; r < ring_count; ++r) {
+                    rings[r]->tail.store(heads[r], std::memory_order_release);
+                }
+                wrote = wrote || count > 0;
+                count = ring_count = 0;
+                bytes = 0;
+                if (i == m_buffers.size()) {
+                    break;
+                }
+            }
+
+            Ring& ring = m_buffers[i]->rings[sink];
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            if (head == tail) {
+                continue;
+            }
+            size_t pos = tail & (RING_SIZE - 1);
+            size_t len = head - tail;
+            size_t first = RING_SIZE - pos;
+            if (first >= len) {
+                iov[count].iov_base = ring.data + pos;
+                iov[count].iov_len = len;
+                ++count;
+            } else {
+                iov[count].iov_base = ring.data + pos;
+                iov[count].iov_len = first;
+                iov[count + 1].iov_base = ring.data;
+                iov[count + 1].iov_len = len - first;
+                count += 2;
+            }
+            bytes += len;
+            rings[ring_count] = &ring;
+            heads[ring_count] = head;
+            ++ring_count;
+        }
+    }
+    m_locker.unlock();
+    return wrote;
+}
+
+// 时间前缀, 同一秒内复用格式化好的日期和时间
+int Logger::format_time(char* buf, int size) {
+    static thread_local time_t t_last = 0;
+    static thread_local char t_prefix[32];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != t_last) {
+        struct tm tm;
+        localtime_r(&now.tv_sec, &tm);
+        strftime(t_prefix, sizeof(t_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+        t_last = now.tv_sec;
+    }
+    return snprintf(buf, size, "%s.%03ld", t_prefix, now.tv_nsec / 1000000);
+}
+
+void Logger::log(LOG_LEVEL level, const char* format, ...) {
+    if (!t_tid) {
+        t_tid = syscall(SYS_gettid);
+    }
+    char line[MAX_LINE];
+    int len = format_time(line, MAX_LINE);
+    len += snprintf(line + len, MAX_LINE - len, " %-5s [%d] ", level_names[level], t_tid);
+
+    va_list arg_list;
+    va_start(arg_list, format);
+    int n = vsnprintf(line + len, MAX_LINE - len, format, arg_list);
+    va_end(arg_list);
+    if (n < 0) {
+        return;
+    }
+    // 太长的行被截断, 保留换行符的位置
+    len += n;
+    if (len > MAX_LINE - 1) {
+        len = MAX_LINE - 1;
+    }
+    line[len++] = '\n';
+    append(LOG_SINK_SERVER, line, len);
+}
+
+void Logger::access(const char* format, ...) {
+    char line[MAX_LINE];
+    int len = format_time(line, MAX_LINE);
+    line[len++] = ' ';
+
+    va_list arg_list;
+    va_start(arg_list, format);
+    int n = vsnprintf(line + len, MAX_LINE - len, format, arg_list);
+    va_end(arg_list);
+    if (n < 0) {
+        return;
+    }
+    len += n;
+    if (len > MAX_LINE - 1) {
+        len = MAX_LINE - 1;
+    }
+    line[len++] = '\n';
+    append(LOG_SINK_ACCESS, line, len);
+}
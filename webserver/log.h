@@ -0,0 +1,113 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "locker.h"
+#include "workqueue.h"
+
+// 异步日志
+//
+// 每个线程有一个自己的环形缓冲区 (单生产者单消费者, 无锁), 每个日志目标 (服务器日志和访问日志) 各一个
+// 写日志的线程只把格式化好的一行文本拷贝进自己的环形缓冲区, 不加锁, 不做系统调用
+// 后台线程定期 (或者某个缓冲区超过一半时被叫醒) 把所有缓冲区中的数据用 writev 成批写到文件中
+// 环形缓冲区中只有完整的文本行, 所以后台线程可以直接把它们作为 iovec 写出去, 不需要再拷贝
+//
+// 缓冲区满了时按 m_block 的设置处理: 丢弃这一行 (计数), 或者等待后台线程腾出空间
+// 文件超过 m_max_file_size 时轮转: name -> name.1 -> name.2 ... 最多保留 m_keep_files 个旧文件
+
+enum LOG_LEVEL {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+};
+
+// 日志目标
+enum LOG_SINK {
+    LOG_SINK_SERVER = 0,  // 服务器日志, 有级别
+    LOG_SINK_ACCESS,      // 访问日志, 每个请求一行
+    LOG_SINK_COUNT
+};
+
+class Logger {
+public:
+ static const int RING_SIZE = 64 * 1024;   // 每个线程每个日志目标的环形缓冲区大小 (2 的幂)
+ static const int MAX_LINE = 2048;         // 一行日志的最大长度, 超过时截断
+ static const int FLUSH_INTERVAL_MS = 200; // 后台线程的最长刷新间隔
+
+ static Logger* get_instance();
+
+ // 设置日志文件并启动后台线程, 需要在其他线程开始写日志之前调用
+ // server_path 为 NULL 或者 "-" 时写到标准错误, access_path 为 NULL 时不记录访问日志
+ bool init(const char* server_path, const char* access_path, LOG_LEVEL level,
+           size_t max_file_size, int keep_files, bool block);
+ // 写完所有缓冲区中的日志并结束后台线程
+ void stop();
+
+ bool enabled(LOG_LEVEL level) const { return level >= m_level; }
+ bool access_enabled() const { return m_fds[LOG_SINK_ACCESS] != -1; }
+ void log(LOG_LEVEL level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+ void access(const char* format, ...) __attribute__((format(printf, 2, 3)));
+ unsigned long dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+ static bool parse_level(const char* name, LOG_LEVEL* level);
+
+private:
+ // 一个线程的环形缓冲区, 只有这个线程写入 (head), 只有后台线程读出 (tail)
+ // 位置单调递增, 对 RING_SIZE 取模得到在 data 中的下标
+ struct Ring {
+     alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head; // 生产者写到的位置
+     alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail; // 消费者读到的位置
+     char data[RING_SIZE];
+     Ring(): head(0), tail(0) {}
+ };
+ struct ThreadBuffer {
+     Ring rings[LOG_SINK_COUNT];
+ };
+
+ Logger();
+ ~Logger();
+
+ static void* worker(void* arg);
+ void run();
+ ThreadBuffer* local_buffer();                       // 当前线程的缓冲区, 第一次调用时创建并登记
+ void append(LOG_SINK sink, const char* line, int len);
+ bool flush();                                       // 把所有缓冲区中的数据写出去, 返回是否写了数据
+ void write_sink(int sink, struct iovec* iov, int count, size_t bytes);
+ void rotate(int sink);
+ bool open_sink(int sink);
+ static int format_time(char* buf, int size);        // "2024-01-02 03:04:05.678"
+
+private:
+ LOG_LEVEL m_level;
+ bool m_block;                         // 缓冲区满了时等待还是丢弃
+ size_t m_max_file_size;               // 超过这个大小就轮转, 0 表示不轮转
+ int m_keep_files;                     // 轮转时保留的旧文件数量
+ std::string m_paths[LOG_SINK_COUNT];  // 日志文件路径, 空字符串表示标准错误
+ int m_fds[LOG_SINK_COUNT];
+ size_t m_sizes[LOG_SINK_COUNT];       // 当前文件已经写入的字节数
+
+ std::vector<ThreadBuffer*> m_buffers; // 所有线程的缓冲区, 线程退出之后也保留, 由后台线程写完
+ Locker m_locker;                      // 保护 m_buffers
+ Sem m_wakeup;                         // 缓冲区超过一半时叫醒后台线程
+ std::atomic<unsigned long> m_dropped; // 因为缓冲区满了被丢弃的行数
+ std::atomic<bool> m_running;
+ pthread_t m_thread;
+};
+
+#define LOG_DEBUG(format, ...) \
+    do { if (Logger::get_instance()->enabled(LOG_LEVEL_DEBUG)) Logger::get_instance()->log(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__); } while (0)
+#define LOG_INFO(format, ...) \
+    do { if (Logger::get_instance()->enabled(LOG_LEVEL_INFO)) Logger::get_instance()->log(LOG_LEVEL_INFO, format, ##__VA_ARGS__); } while (0)
+#define LOG_WARN(format, ...) \
+    do { if (Logger::get_instance()->enabled(LOG_LEVEL_WARN)) Logger::get_instance()->log(LOG_LEVEL_WARN, format, ##__VA_ARGS__); } while (0)
+#define LOG_ERROR(format, ...) \
+    do { if (Logger::get_instance()->enabled(LOG_LEVEL_ERROR)) Logger::get_instance()->log(LOG_LEVEL_ERROR, format, ##__VA_ARGS__); } while (0)
+
+#endif
@@ -9,13 +9,23 @@
 #include <signal.h>
 #include <libgen.h>
 #include <sys/epoll.h>
+#include <vector>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65535 // 最大文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // 最大监听的事件对象
+#include "file_cache.h"
+#include "gzip_cache.h"
+#include "arena.h"
+#include "affinity.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "coro_reactor.h"
+#include "supervisor.h"
+#include "router.h"
+#include "proxy.h"
+#include "metrics.h"
+#include "log.h"
 
 // 添加信号捕捉
 void addsig(int sig, void(handler)(int)) { 
@@ -26,126 +36,400 @@ void addsig(int sig, void(handler)(int)) {
     sigaction(sig, &sa, NULL);
 }
 
-// 添加文件描述符到 epoll 中
-extern void addfd(int epollfd, int fd, bool one_shot);
-// 从 epoll 中删除文件描述符
-extern void removefd(int epollfd, int fd);
-// 修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
-
 // argv[0]: 程序名字
 int main(int argc, char* argv[]) {
 
-    if (argc <= 1) {
-      printf("please follow the format: %s port_number\n", basename(argv[0]));
+    // 可选参数:
+    // -r doc_root: 网站根目录
+    // -m mmap|sendfile|auto: 文件体的发送方式
+    // -t bytes: auto 模式下使用 sendfile 的文件大小阈值
+    // -c entries: 文件缓存最多缓存的文件数量
+    // -b mbytes: 文件缓存最多映射的字节数 (MB)
+    // -z mbytes: gzip 版本的缓存最多使用的字节数 (MB), 0 表示关闭 gzip
+    // -n loops: 事件循环的数量, 默认每个 CPU 核心一个
+    // -k seconds: 保持连接时空闲连接的超时时间
+    // -H seconds: 接收一个完整请求的超时时间
+    // -I seconds: 发送响应没有进展的超时时间, 也是反向代理发送请求和等待上游响应头的超时时间
+    // -M path: 输出运行时指标的路径, 默认 /metrics, 空字符串表示关闭 (注册在路由表中)
+    // -X pattern=[rr|least|hash@]host:port,...: 反向代理, 匹配路由模式 pattern (例如 "/api/*path") 的请求转发给这组上游服务器,
+    //     按轮询 (默认), 最少连接或者客户端地址的一致性哈希选择服务器, 可以出现多次; 转发的请求体最大 64KB
+    // -U dir: 允许用 POST / PUT 上传文件, 保存到这个目录下和 URL 相同的路径, 默认不允许上传
+    // -S mbytes: 请求体的最大长度 (MB)
+    // -L file: 服务器日志文件, 默认 (或者 "-") 写到标准错误
+    // -l debug|info|warn|error|off: 服务器日志的级别
+    // -A file: 访问日志文件, 默认不记录
+    // -R mbytes: 日志文件超过这个大小 (MB) 就轮转, 保留 5 个旧文件, 0 表示不轮转
+    // -P drop|block: 日志缓冲区满了时丢弃还是等待
+    // -e auto|epoll|uring|coro: 事件循环的实现, auto 在内核支持时使用 io_uring, 否则使用 epoll
+    //     coro 是每个连接一个协程的 epoll 事件循环, 需要用 C++20 编译
+    // -q backlog: 监听 socket 的全连接队列长度
+    // -a count: 监听 socket 每次可读时最多接受的连接数 (epoll 事件循环)
+    // -Q requests: 线程池队列最多等待处理的请求数, 超过时回复 503 并暂停接受新连接
+    // -w workers: 线程池的工作线程数量, 默认 8 个 (-x 时每个 CPU 一个)
+    // -C cpus: 把事件循环和工作线程依次绑定到这些 CPU 上, 例如 "0-3,8-11", 它们的内存也就分配在本地的 NUMA 节点上
+    // -x: 按 CPU 分配连接 (需要 -C), 每个 CPU 一个事件循环和一个工作线程, 在哪个 CPU 上收到的连接就交给这个 CPU 上的事件循环,
+    //     网卡的 RSS 队列中断和 XPS 也按同样的 CPU 配置时, 一个连接从收包到发包都在同一个 CPU 上
+    //     (使用工作窃取队列编译时, 工作线程也优先处理同一个 CPU 上的事件循环提交的连接)
+    // -D seconds: 平滑退出 (SIGTERM / SIGINT, 或者 SIGHUP reload 之后的旧进程) 时等待正在处理的请求的最长时间
+    // -T: 所有请求都交给线程池处理, 默认缓存命中和 304 这类请求直接在事件循环的线程中处理
+    int opt;
+    int reactor_number = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cache_entries = 512;
+    size_t cache_mbytes = 64;
+    size_t gzip_mbytes = 32;
+    int max_requests = 10000;
+    const char* log_path = NULL;
+    const char* access_path = NULL;
+    LOG_LEVEL log_level = LOG_LEVEL_INFO;
+    size_t log_rotate_mbytes = 64;
+    bool log_block = false;
+    const char* backend = "auto";
+    int worker_number = 0;
+    std::vector<int> cpus;
+    bool steer = false;
+    int drain_timeout = 30;
+    const char* metrics_path = "/metrics";
+    std::vector<const char*> proxies;
+    while ((opt = getopt(argc, argv, "r:m:t:c:b:z:n:k:H:I:M:X:U:S:L:l:A:R:P:e:q:a:Q:w:C:xD:T")) != -1) {
+      switch (opt) {
+        case 'r':
+          http_conn::m_doc_root = optarg;
+          break;
+        case 'm':
+          if (strcmp(optarg, "mmap") == 0) {
+            http_conn::m_send_mode = http_conn::SEND_MMAP;
+          } else if (strcmp(optarg, "sendfile") == 0) {
+            http_conn::m_send_mode = http_conn::SEND_SENDFILE;
+          } else {
+            http_conn::m_send_mode = http_conn::SEND_AUTO;
+          }
+          break;
+        case 't':
+          http_conn::m_sendfile_threshold = atol(optarg);
+          break;
+        case 'c':
+          cache_entries = atol(optarg);
+          break;
+        case 'b':
+          cache_mbytes = atol(optarg);
+          break;
+        case 'z':
+          gzip_mbytes = atol(optarg);
+          break;
+        case 'n':
+          reactor_number = atoi(optarg);
+          break;
+        case 'k':
+          http_conn::m_keep_alive_max_timeout = atoi(optarg);
+          break;
+        case 'H':
+          http_conn::m_header_timeout = atoi(optarg);
+          break;
+        case 'I':
+          http_conn::m_idle_timeout = atoi(optarg);
+          break;
+        case 'M':
+          metrics_path = optarg;
+          break;
+        case 'X':
+          proxies.push_back(optarg);
+          break;
+        case 'U':
+          http_conn::m_upload_dir = optarg;
+          break;
+        case 'S':
+          http_conn::m_max_body = atoll(optarg) * 1024 * 1024;
+          break;
+        case 'L':
+          log_path = optarg;
+          break;
+        case 'l':
+          if (!Logger::parse_level(optarg, &log_level)) {
+            printf("unknown log level %s\n", optarg);
+            exit(-1);
+          }
+          break;
+        case 'A':
+          access_path = optarg;
+          break;
+        case 'R':
+          log_rotate_mbytes = atol(optarg);
+          break;
+        case 'P':
+          log_block = strcmp(optarg, "block") == 0;
+          break;
+        case 'e':
+          backend = optarg;
+          break;
+        case 'q':
+          Reactor::m_backlog = atoi(optarg);
+          break;
+        case 'a':
+          Reactor::m_accept_batch = atoi(optarg);
+          break;
+        case 'Q':
+          max_requests = atoi(optarg);
+          break;
+        case 'w':
+          worker_number = atoi(optarg);
+          break;
+        case 'C':
+          if (!parse_cpu_list(optarg, &cpus)) {
+            printf("invalid cpu list %s\n", optarg);
+            exit(-1);
+          }
+          break;
+        case 'x':
+          steer = true;
+          break;
+        case 'D':
+          drain_timeout = atoi(optarg);
+          break;
+        case 'T':
+          Reactor::m_run_to_completion = false;
+          break;
+        default:
+          break;
+      }
+    }
+
+    if (optind >= argc) {
+      printf("please follow the format: %s port_number [-r doc_root] [-m mmap|sendfile|auto] [-t sendfile_threshold] [-c cache_entries] [-b cache_mbytes] [-z gzip_cache_mbytes] [-n reactor_number] [-k keep_alive_timeout] [-H header_timeout] [-I idle_timeout] [-M metrics_path] [-X pattern=[policy@]host:port,...] [-U upload_dir] [-S max_body_mbytes] [-L log_file] [-l log_level] [-A access_log] [-R rotate_mbytes] [-P drop|block] [-e auto|epoll|uring|coro] [-q backlog] [-a accept_batch] [-Q max_requests] [-w workers] [-C cpu_list] [-x] [-D drain_seconds] [-T]\n", basename(argv[0]));
       exit(-1);
     }
 
-    int port = atoi(argv[1]);       // 获取端口号
+    int port = atoi(argv[optind]);  // 获取端口号
+    if (steer) {
+      if (cpus.empty()) {
+        printf("-x needs a cpu list (-C)\n");
+        exit(-1);
+      }
+      // 每个 CPU 一个事件循环和一个工作线程, 第 i 个事件循环和第 i 个工作线程在同一个 CPU 上
+      reactor_number = cpus.size();
+      worker_number = cpus.size();
+    }
+    if (reactor_number <= 0) {
+      reactor_number = 1;
+    }
+    if (worker_number <= 0) {
+      worker_number = 8;
+    }
+    if (Reactor::m_accept_batch <= 0) {
+      Reactor::m_accept_batch = 1;
+    }
     addsig(SIGPIPE, SIG_IGN); // 对于 SIGPIE 信号, 直接进行忽略
+    // SIGTERM, SIGINT 和 SIGHUP 只由控制线程处理, 必须在创建任何线程之前屏蔽
+    Supervisor::block_signals();
+    Supervisor* supervisor = Supervisor::get_instance();
+
+    // 启动异步日志, 之后各个线程的日志都先写进自己的缓冲区
+    if (!Logger::get_instance()->init(log_path, access_path, log_level, log_rotate_mbytes * 1024 * 1024, 5, log_block)) {
+      exit(-1);
+    }
+
+    // 初始化所有连接共享的文件缓存
+    // sendfile 模式下文件体不会通过映射发送, 文件缓存就不需要 mmap
+    FileCache::get_instance()->init(cache_entries, cache_mbytes * 1024 * 1024, http_conn::m_send_mode != http_conn::SEND_SENDFILE);
+    GzipCache::get_instance()->init(cache_entries, gzip_mbytes * 1024 * 1024);
 
     // 创建并初始化线程池
     // 模拟 proactor 的模式, 主线程负责数据的读写, 然后让子线程负责业务逻辑 (被封装成任务类)
-    Threadpool<http_conn> *pool = NULL;
+    ConnPool *pool = NULL;
     try {
-       pool = new Threadpool<http_conn>;
+       pool = new ConnPool(worker_number, max_requests, cpus);
     } catch(...) {
        exit(-1);
     }
 
-    // 创建一个数组用于保存所有的客户端信息
-    http_conn *users = new http_conn[MAX_FD];
+    // 其他模块已经维护好的状态在输出指标时才读取
+    MetricsRegistry* metrics = MetricsRegistry::get_instance();
+    metrics->add_callback("webserver_connections", "Open client connections.", "gauge", "",
+                       [] { return (double)http_conn::m_user_count.load(std::memory_order_relaxed); });
+    metrics->add_callback("webserver_log_dropped_total", "Log lines dropped because a log buffer was full.", "counter", "",
+                       [] { return (double)Logger::get_instance()->dropped(); });
+    metrics->add_callback("webserver_worker_threads", "Worker threads in the thread pool.", "gauge", "",
+                       [pool] { return (double)pool->thread_number(); });
+    metrics->add_callback("webserver_queue_depth", "Requests waiting in the thread pool queue.", "gauge", "",
+                       [pool] { return (double)pool->queue_size(); });
+    metrics->add_callback("webserver_arena_reserved_bytes", "Bytes held by the per-thread scratch arenas.", "gauge", "",
+                       [] { return (double)Arena::total_reserved(); });
+    metrics->add_callback("webserver_arena_high_water_bytes", "Most scratch arena bytes used by a single task.", "gauge", "",
+                       [] { return (double)Arena::max_high_water(); });
+    metrics->add_callback("webserver_arena_blocks_total", "Blocks the scratch arenas allocated with malloc.", "counter", "",
+                       [] { return (double)Arena::total_blocks(); });
+#ifdef USE_STEALING_QUEUE
+    // 工作窃取队列中每个工作线程的统计信息
+    for (int i = 0; i < pool->thread_number(); ++i) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+      metrics->add_callback("webserver_worker_queue_depth", "Requests waiting in a worker's deque.", "gauge", labels,
+                         [pool, i] { return (double)pool->worker_stats(i).depth; });
+    }
+    for (int i = 0; i < pool->thread_number(); ++i) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+      metrics->add_callback("webserver_worker_executed_total", "Requests executed by a worker, including stolen ones.", "counter", labels,
+                         [pool, i] { return (double)pool->worker_stats(i).executed; });
+    }
+    for (int i = 0; i < pool->thread_number(); ++i) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "worker=\"%d\"", i);
+      metrics->add_callback("webserver_worker_stolen_total", "Requests a worker stole from other workers' deques.", "counter", labels,
+                         [pool, i] { return (double)pool->worker_stats(i).stolen; });
+    }
+#endif
 
-    int listen_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (listen_fd == -1) {
-      perror("Socket");
+    // 内置的处理函数注册在路由表中, 之后路由表只读, 没有匹配任何路由的请求按静态文件处理
+    Router* router = Router::get_instance();
+    if (metrics_path[0] && !router->add(http_conn::GET, metrics_path, serve_metrics, NULL)) {
+      printf("invalid metrics path %s\n", metrics_path);
       exit(-1);
     }
 
-    // 设置端口复用 (要在绑定之前去设置)
-    int reuse = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    // 绑定
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    int ret = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
-    if (ret == -1) {
-      perror("Bind");
+    // 选择事件循环的实现
+    bool use_uring = false;
+    bool use_coro = false;
+    if (strcmp(backend, "coro") == 0) {
+#ifdef HAVE_COROUTINES
+      use_coro = true;
+#else
+      printf("coroutine event loops need a C++20 build\n");
       exit(-1);
+#endif
+    } else if (strcmp(backend, "uring") == 0) {
+      if (!UringReactor::supported()) {
+        printf("io_uring is not supported by this kernel\n");
+        exit(-1);
+      }
+      use_uring = true;
+    } else if (strcmp(backend, "auto") == 0) {
+      use_uring = UringReactor::supported();
     }
+    LOG_INFO("using %s event loops", use_coro ? "coroutine" : use_uring ? "io_uring" : "epoll");
 
-    // 监听
-    listen(listen_fd, 5);
-
-    // 创建 epoll 对象, 事件数组, 添加文件描述符
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-
-    // 将监听的文件描述符添加到 epoll 对象中
-    addfd(epollfd, listen_fd, false);
-    http_conn::m_epollfd = epollfd;
-
-    while (true) {
-      int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-      if ((num < 0) && (errno != EINTR)) { // 产生信号中断
-        printf("Epoll Failure...\n");
-        break;
+    // 由旧进程 reload 启动时接过它的监听 socket, 每个监听 socket 一个事件循环,
+    // 并且先把旧进程缓存中的热点文件加载进来, 避免切换之后所有请求都从磁盘读取
+    std::vector<int> listeners;
+    if (supervisor->inherited()) {
+      std::vector<std::string> hot_paths;
+      if (!supervisor->receive_handoff(&listeners, &hot_paths)) {
+        exit(-1);
       }
+      if ((int)listeners.size() != reactor_number) {
+        LOG_WARN("inherited %d listeners, running %d event loops instead of %d",
+                 (int)listeners.size(), (int)listeners.size(), reactor_number);
+      }
+      reactor_number = listeners.size();
+      for (size_t i = 0; i < hot_paths.size(); ++i) {
+        int err;
+        FileCache::get_instance()->acquire(hot_paths[i].c_str(), &err);
+      }
+      LOG_INFO("inherited %d listeners and warmed %d files from the old process", reactor_number, (int)hot_paths.size());
+    }
 
-      // 循环遍历事件数组
-      for (int i =0; i < num; ++i) {
-        int sockfd = events[i].data.fd;
-        if (sockfd == listen_fd) {
-
-          // 有客户端连接进来
-          struct sockaddr_in client_address;
-          socklen_t client_addrlen = sizeof(client_address);
-          int conn_fd = accept(listen_fd, (struct sockaddr*)&client_address, &client_addrlen);
-
-          if (http_conn::m_user_count >= MAX_FD) {
-            // 目前连接数满了
-            // 给客户端写一个信息：服务器正忙（之后写）
-            close(conn_fd);
-            continue;
-          }
-
-          // 给新的客户端初始化，放到数组中
-          users[conn_fd].init(conn_fd, client_address);
-
-        } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-
-          // 队伍异常断开或者错误等事件, 需要关闭连接
-          users[sockfd].close_conn();
-
-        } else if (events[i].events & EPOLLIN) {
-
-          // 读事件: 一次性把所有的事件都读出来
-          if (users[sockfd].read()) {
-            // 把业务逻辑交给线程池中的线程去执行
-            pool->append(users + sockfd);
-          } else { // 读取失败
-            users[sockfd].close_conn();
-          }
-
-        } else if (events[i].events & EPOLLOUT) {
+    // 反向代理的路由, 上游的连接池按事件循环分片, 所以要在确定了事件循环的数量之后创建
+    std::vector<std::pair<std::string, Backend*> > upstreams;  // (指标的标签, 服务器)
+    for (size_t i = 0; i < proxies.size(); ++i) {
+      const char* eq = strchr(proxies[i], '=');
+      std::string pattern = eq ? std::string(proxies[i], eq - proxies[i]) : std::string();
+      std::string error;
+      UpstreamGroup* group = eq ? UpstreamGroup::parse(eq + 1, reactor_number, &error) : NULL;
+      if (!group) {
+        printf("invalid proxy %s: %s\n", proxies[i], eq ? error.c_str() : "expected pattern=servers");
+        exit(-1);
+      }
+      static const int proxy_methods[] = { http_conn::GET, http_conn::HEAD, http_conn::POST, http_conn::PUT,
+                                           http_conn::DELETE, http_conn::OPTIONS };
+      for (size_t j = 0; j < sizeof(proxy_methods) / sizeof(proxy_methods[0]); ++j) {
+        if (!router->add_proxy(proxy_methods[j], pattern.c_str(), group)) {
+          printf("invalid proxy pattern %s\n", pattern.c_str());
+          exit(-1);
+        }
+      }
+      for (int j = 0; j < group->size(); ++j) {
+        upstreams.push_back(std::make_pair("route=\"" + pattern + "\",upstream=\"" + group->backend(j)->name() + "\"",
+                                           group->backend(j)));
+      }
+      LOG_INFO("proxying %s to %d upstream server(s) (%s)", pattern.c_str(), group->size(), group->policy_name());
+    }
+    // 同名的指标要连续注册, 输出时才只有一个 HELP 和 TYPE
+    for (size_t i = 0; i < upstreams.size(); ++i) {
+      Backend* server = upstreams[i].second;
+      metrics->add_callback("webserver_upstream_up", "Whether passive health checks consider an upstream server usable.", "gauge",
+                         upstreams[i].first, [server] { return server->available(metrics_now()) ? 1.0 : 0.0; });
+    }
+    for (size_t i = 0; i < upstreams.size(); ++i) {
+      Backend* server = upstreams[i].second;
+      metrics->add_callback("webserver_upstream_active_connections", "Upstream connections in use by requests.", "gauge",
+                         upstreams[i].first, [server] { return (double)server->active(); });
+    }
+    for (size_t i = 0; i < upstreams.size(); ++i) {
+      Backend* server = upstreams[i].second;
+      metrics->add_callback("webserver_upstream_idle_connections", "Keep-alive upstream connections waiting in the pools.", "gauge",
+                         upstreams[i].first, [server] { return (double)server->idle(); });
+    }
 
-          // 一次性写完所有的数据
-          if (!users[sockfd].write()) {
-            users[sockfd].close_conn();
-          }
+    // 创建事件循环, 每个事件循环有自己的 epoll 对象 (或者 io_uring) 和监听 socket
+    // 多于一个事件循环时通过 SO_REUSEPORT 让内核把新连接分散到各个事件循环
+    std::vector<Reactor*> reactors;
+    for (int i = 0; i < reactor_number; ++i) {
+      Reactor *reactor = NULL;
+      if (use_uring) {
+        reactor = new UringReactor(i, port, pool);
+#ifdef HAVE_COROUTINES
+      } else if (use_coro) {
+        reactor = new CoroReactor(i, port, pool);
+#endif
+      } else {
+        reactor = new Reactor(i, port, pool);
+      }
+      if (!listeners.empty()) {
+        reactor->adopt_listener(listeners[i]);
+      }
+      if (!cpus.empty()) {
+        // 主线程先切换到事件循环的 CPU 上再初始化它, 初始化时写入的内存就分配在事件循环所在的 NUMA 节点上
+        int cpu = cpus[i % cpus.size()];
+        reactor->set_cpu(cpu);
+        pin_thread(cpu);
+      }
+      if (!reactor->init(reactor_number > 1)) {
+        exit(-1);
+      }
+      reactors.push_back(reactor);
+    }
+    if (steer && reactor_number > 1 && !reactors[0]->steer_by_cpu(cpus)) {
+      exit(-1);
+    }
 
-        }
+    // 新进程准备好了, 旧进程可以开始退出; 之后由控制线程处理退出和 reload 的信号
+    supervisor->handoff_ready();
+    if (!supervisor->start(argv, reactors, drain_timeout)) {
+      perror("Supervisor");
+      exit(-1);
+    }
 
+    // 第 0 个事件循环运行在主线程中, 其余的各自运行在一个新的线程中
+    for (int i = 1; i < reactor_number; ++i) {
+      if (!reactors[i]->start()) {
+        perror("Reactor");
+        exit(-1);
       }
+    }
+    reactors[0]->run();
+
+    // 所有事件循环都退出之后 (平滑退出时所有连接都已经关闭), 结束控制线程, 再等待工作线程处理完手上的任务
+    for (int i = 0; i < reactor_number; ++i) {
+      reactors[i]->join();
+    }
+    supervisor->stop();
+    pool->stop();
+    LOG_INFO("all event loops and workers have stopped");
 
+    for (int i = 0; i < reactor_number; ++i) {
+      delete reactors[i];
     }
-    close(epollfd);
-    close(listen_fd);
-    delete[] users;
     delete pool;
+    Logger::get_instance()->stop();
 
     return 0;
 }
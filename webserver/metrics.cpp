@@ -0,0 +1,251 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "router.h"
+
+thread_local int metrics_tls_shard = -1;
+static std::atomic<int> metrics_next_shard(0);
+
+// 线程第一次记录指标时分配分片, 之后一直使用这个分片
+int metrics_assign_shard() {
+    metrics_tls_shard = metrics_next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_MAX_SHARDS;
+    return metrics_tls_shard;
+}
+
+Metric::Metric(const char* name, const char* help, const char* type, const char* labels):
+    m_name(name), m_help(help), m_type(type), m_labels(labels) {
+    MetricsRegistry::get_instance()->add(this);
+}
+
+void Metric::render_line(std::string& out, const char* suffix, const char* extra, const char* value) const {
+    out += m_name;
+    out += suffix;
+    bool has_labels = m_labels && m_labels[0];
+    bool has_extra = extra && extra[0];
+    if (has_labels || has_extra) {
+        out += '{';
+        if (has_labels) {
+            out += m_labels;
+        }
+        if (has_labels && has_extra) {
+            out += ',';
+        }
+        if (has_extra) {
+            out += extra;
+        }
+        out += '}';
+    }
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+Counter::Counter(const char* name, const char* help, const char* labels):
+    Metric(name, help, "counter", labels) {
+
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_MAX_SHARDS; ++i) {
+        total += m_shards[i].value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void Counter::render(std::string& out) const {
+    char value[32];
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)this->value());
+    render_line(out, "", NULL, value);
+}
+
+Gauge::Gauge(const char* name, const char* help, const char* labels):
+    Metric(name, help, "gauge", labels) {
+
+}
+
+int64_t Gauge::value() const {
+    int64_t total = 0;
+    for (int i = 0; i < METRICS_MAX_SHARDS; ++i) {
+        total += m_shards[i].value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void Gauge::render(std::string& out) const {
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", (long long)this->value());
+    render_line(out, "", NULL, value);
+}
+
+CallbackMetric::CallbackMetric(const char* name, const char* help, const char* type, const char* labels,
+                               std::function<double()> func):
+    Metric(name, help, type, labels), m_func(func) {
+
+}
+
+void CallbackMetric::render(std::string& out) const {
+    char value[32];
+    snprintf(value, sizeof(value), "%.17g", m_func());
+    render_line(out, "", NULL, value);
+}
+
+LatencyHistogram::Shard::Shard(): sum(0) {
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+LatencyHistogram::LatencyHistogram(const char* name, const char* help, const char* labels):
+    Metric(name, help, "histogram", labels) {
+
+}
+
+// Prometheus 的桶是累积的: 每个桶的值是所有 <= 上界的观测数量
+void LatencyHistogram::render(std::string& out) const {
+    uint64_t buckets[BUCKETS] = {0};
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_MAX_SHARDS; ++i) {
+        for (int b = 0; b < BUCKETS; ++b) {
+            buckets[b] += m_shards[i].buckets[b].load(std::memory_order_relaxed);
+        }
+        sum += m_shards[i].sum.load(std::memory_order_relaxed);
+    }
+
+    char le[32];
+    char value[32];
+    uint64_t count = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+        count += buckets[b];
+        if (b == BUCKETS - 1) {
+            snprintf(le, sizeof(le), "le=\"+Inf\"");
+        } else {
+            snprintf(le, sizeof(le), "le=\"%g\"", (double)(1ULL << b) / 1e6);
+        }
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)count);
+        render_line(out, "_bucket", le, value);
+    }
+    snprintf(value, sizeof(value), "%.9f", sum / 1e9);
+    render_line(out, "_sum", NULL, value);
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)count);
+    render_line(out, "_count", NULL, value);
+}
+
+MetricsRegistry* MetricsRegistry::get_instance() {
+    // 函数内的静态对象在第一次调用时构造, 不依赖全局对象的初始化顺序
+    static MetricsRegistry registry;
+    return &registry;
+}
+
+MetricsRegistry::~MetricsRegistry() {
+    for (size_t i = 0; i < m_owned.size(); ++i) {
+        delete m_owned[i];
+    }
+    for (size_t i = 0; i < m_strings.size(); ++i) {
+        delete m_strings[i];
+    }
+}
+
+void MetricsRegistry::add(Metric* metric) {
+    m_locker.lock();
+    m_metrics.push_back(metric);
+    m_locker.unlock();
+}
+
+void MetricsRegistry::add_callback(const std::string& name, const std::string& help, const char* type,
+                                   const std::string& labels, std::function<double()> func) {
+    std::string* strings[3] = { new std::string(name), new std::string(help), new std::string(labels) };
+    m_locker.lock();
+    for (int i = 0; i < 3; ++i) {
+        m_strings.push_back(strings[i]);
+    }
+    m_locker.unlock();
+
+    // 构造函数会再次加锁把自己注册进来
+    Metric* metric = new CallbackMetric(strings[0]->c_str(), strings[1]->c_str(), type, strings[2]->c_str(), func);
+    m_locker.lock();
+    m_owned.push_back(metric);
+    m_locker.unlock();
+}
+
+std::string MetricsRegistry::render() {
+    std::string out;
+    out.reserve(8192);
+    m_locker.lock();
+    const char* last = NULL;
+    for (size_t i = 0; i < m_metrics.size(); ++i) {
+        Metric* metric = m_metrics[i];
+        if (!last || strcmp(last, metric->name()) != 0) {
+            out += "# HELP ";
+            out += metric->name();
+            out += ' ';
+            out += metric->help();
+            out += "\n# TYPE ";
+            out += metric->name();
+            out += ' ';
+            out += metric->type();
+            out += '\n';
+            last = metric->name();
+        }
+        metric->render(out);
+    }
+    m_locker.unlock();
+    return out;
+}
+
+Counter metric_accepts("webserver_accepts_total", "Accepted TCP connections.");
+Counter metric_accept_rejected("webserver_accept_rejected_total", "Connections closed right after accept because the server was full.");
+Counter metric_requests_shed("webserver_requests_shed_total", "Requests answered with 503 because the thread pool queue was full.");
+Counter metric_accept_pauses("webserver_accept_pauses_total", "Times an event loop stopped accepting because the server was saturated.");
+Counter metric_bytes_in("webserver_bytes_received_total", "Bytes read from clients.");
+Counter metric_bytes_out("webserver_bytes_sent_total", "Bytes written to clients, including sendfile.");
+Counter metric_requests("webserver_requests_total", "HTTP requests parsed.");
+Counter metric_gzip_responses("webserver_gzip_responses_total", "File requests answered from the gzip variant of the file.");
+Counter metric_inline_requests("webserver_inline_requests_total", "HTTP requests handled on the event loop thread without a thread pool hop.");
+Counter metric_gzip_compressions("webserver_gzip_compressions_total", "Files compressed on the fly into the gzip cache.");
+LatencyHistogram metric_parse_time("webserver_parse_duration_seconds", "Time spent parsing a request and resolving its target.");
+LatencyHistogram metric_queue_wait("webserver_queue_wait_seconds", "Time a connection waited in the thread pool queue.");
+LatencyHistogram metric_task_time("webserver_task_duration_seconds", "Time a worker thread spent processing a connection.");
+Counter metric_upstream_requests("webserver_upstream_requests_total", "Requests forwarded to upstream servers.");
+Counter metric_upstream_connects("webserver_upstream_connects_total", "New connections opened to upstream servers (the rest reused a pooled one).");
+Counter metric_upstream_errors("webserver_upstream_errors_total", "Failed upstream exchanges (connect, send or response errors).");
+
+// 响应的状态码, 最后一个统计其他所有的状态码
+static const int response_codes[] = { 200, 201, 206, 304, 400, 403, 404, 405, 413, 416, 431, 500, 501, 502, 503, 504 };
+static const int RESPONSE_CODE_COUNT = sizeof(response_codes) / sizeof(response_codes[0]);
+static Counter metric_responses[RESPONSE_CODE_COUNT + 1] = {
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"200\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"201\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"206\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"304\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"400\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"403\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"404\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"405\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"413\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"416\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"431\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"500\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"501\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"502\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"503\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"504\""),
+    Counter("webserver_responses_total", "HTTP responses by status code.", "code=\"other\""),
+};
+
+void metrics_count_response(int status) {
+    int i = 0;
+    while (i < RESPONSE_CODE_COUNT && response_codes[i] != status) {
+        ++i;
+    }
+    metric_responses[i].add();
+}
+
+void serve_metrics(const RouteRequest&, RouteResponse* response, void*) {
+    std::string body = MetricsRegistry::get_instance()->render();
+    response->content_type = "text/plain; version=0.0.4";
+    response->headers = "Cache-Control: no-cache\r\n";
+    response->body.assign(body.data(), body.size());
+}
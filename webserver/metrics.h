@@ -0,0 +1,198 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "locker.h"
+#include "workqueue.h"
+
+// 运行时指标: 计数器, 仪表和延迟直方图, 以 Prometheus 文本格式输出
+//
+// 每个指标按线程分片, 每个线程第一次记录时分到一个自己的分片 (独占一个缓存行)
+// 记录只是对自己分片的一次 relaxed 原子加, 不加锁, 也不会和其他线程争抢缓存行
+// 读取时才把所有分片加起来, 所以读到的是一个近似的快照, 对监控来说足够了
+//
+// 指标对象在构造时注册到 MetricsRegistry 中, 必须是全局 (或者至少和进程一样长寿) 的对象
+
+#define METRICS_MAX_SHARDS 64 // 超过这个数量的线程会共享分片, 原子加保证结果仍然正确
+
+// 当前线程使用的分片编号
+extern thread_local int metrics_tls_shard;
+int metrics_assign_shard();
+
+inline int metrics_shard() {
+    int shard = metrics_tls_shard;
+    if (shard < 0) {
+        shard = metrics_assign_shard();
+    }
+    return shard;
+}
+
+// 单调时钟的纳秒数, 用来计算耗时
+inline uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 所有指标的基类, 负责注册和输出
+class Metric {
+public:
+ // name 是指标名, labels 是不带大括号的标签, 例如 "code=\"200\"", 可以为 NULL
+ // 同名不同标签的指标需要连续定义, 输出时共享一组 HELP / TYPE 行
+ Metric(const char* name, const char* help, const char* type, const char* labels);
+ virtual ~Metric() {}
+ virtual void render(std::string& out) const = 0;
+
+ const char* name() const { return m_name; }
+ const char* help() const { return m_help; }
+ const char* type() const { return m_type; }
+
+protected:
+ // 输出一行 "name{labels,extra} value"
+ void render_line(std::string& out, const char* suffix, const char* extra, const char* value) const;
+
+private:
+ const char* m_name;
+ const char* m_help;
+ const char* m_type;
+ const char* m_labels;
+};
+
+// 只增不减的计数器
+class Counter : public Metric {
+public:
+ Counter(const char* name, const char* help, const char* labels = NULL);
+ void add(uint64_t n = 1) {
+     m_shards[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+ }
+ uint64_t value() const;
+ virtual void render(std::string& out) const;
+
+private:
+ struct alignas(CACHE_LINE_SIZE) Shard {
+     std::atomic<uint64_t> value;
+     Shard(): value(0) {}
+ };
+ Shard m_shards[METRICS_MAX_SHARDS];
+};
+
+// 可增可减的仪表, 同样按线程分片, 一个线程加一个线程减也没有问题
+class Gauge : public Metric {
+public:
+ Gauge(const char* name, const char* help, const char* labels = NULL);
+ void add(int64_t n = 1) {
+     m_shards[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+ }
+ void sub(int64_t n = 1) { add(-n); }
+ int64_t value() const;
+ virtual void render(std::string& out) const;
+
+private:
+ struct alignas(CACHE_LINE_SIZE) Shard {
+     std::atomic<int64_t> value;
+     Shard(): value(0) {}
+ };
+ Shard m_shards[METRICS_MAX_SHARDS];
+};
+
+// 读取时才计算值的指标, 用来输出其他模块已经维护好的状态 (例如连接数, 工作线程的队列长度)
+// type 是 "gauge" 或者 "counter"
+class CallbackMetric : public Metric {
+public:
+ CallbackMetric(const char* name, const char* help, const char* type, const char* labels, std::function<double()> func);
+ virtual void render(std::string& out) const;
+
+private:
+ std::function<double()> m_func;
+};
+
+// 延迟直方图, 记录的单位是纳秒, 输出时换算成秒
+// 桶的上界是 1us, 2us, 4us ... 2^(BUCKETS-2) us (约 8 秒), 最后一个桶是 +Inf
+class LatencyHistogram : public Metric {
+public:
+ static const int BUCKETS = 25;
+
+ LatencyHistogram(const char* name, const char* help, const char* labels = NULL);
+ void observe(uint64_t ns) {
+     Shard& shard = m_shards[metrics_shard()];
+     shard.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+     shard.sum.fetch_add(ns, std::memory_order_relaxed);
+ }
+ virtual void render(std::string& out) const;
+
+private:
+ // 向上取整到 2 的幂次 (微秒), 超过最大的上界就放进 +Inf 桶
+ static int bucket_of(uint64_t ns) {
+     uint64_t us = (ns + 999) / 1000;
+     if (us <= 1) {
+         return 0;
+     }
+     int bucket = 64 - __builtin_clzll(us - 1);
+     return bucket < BUCKETS - 1 ? bucket : BUCKETS - 1;
+ }
+
+ struct alignas(CACHE_LINE_SIZE) Shard {
+     std::atomic<uint64_t> buckets[BUCKETS];
+     std::atomic<uint64_t> sum;
+     Shard();
+ };
+ Shard m_shards[METRICS_MAX_SHARDS];
+};
+
+// 所有指标的注册表, 进程内只有一个
+// 注册和输出时加锁, 记录指标的热路径不经过这里
+class MetricsRegistry {
+public:
+ static MetricsRegistry* get_instance();
+
+ void add(Metric* metric);
+ // 注册一个由注册表持有的 CallbackMetric, 用于运行时才知道数量的指标, name / help / labels 会被复制
+ void add_callback(const std::string& name, const std::string& help, const char* type, const std::string& labels,
+                   std::function<double()> func);
+ // 按 Prometheus 文本格式 (version 0.0.4) 输出所有指标
+ std::string render();
+
+private:
+ MetricsRegistry() {}
+ ~MetricsRegistry();
+
+private:
+ std::vector<Metric*> m_metrics;       // 注册顺序
+ std::vector<Metric*> m_owned;         // add_callback 创建的指标
+ std::vector<std::string*> m_strings;  // add_callback 复制的字符串
+ Locker m_locker;
+};
+
+// 服务器的指标, 定义在 metrics.cpp 中
+extern Counter metric_accepts;               // 接受的连接数
+extern Counter metric_accept_rejected;       // 因为连接数满了被拒绝的连接数
+extern Counter metric_requests_shed;         // 因为线程池的队列满了回复 503 的请求数
+extern Counter metric_accept_pauses;         // 事件循环因为过载暂停接受新连接的次数
+extern Counter metric_bytes_in;              // 从客户端读取的字节数
+extern Counter metric_bytes_out;             // 发送给客户端的字节数 (包括 sendfile)
+extern Counter metric_requests;              // 解析完成的请求数
+extern Counter metric_gzip_responses;        // 使用 gzip 版本回复的文件请求数
+extern Counter metric_inline_requests;       // 在事件循环的线程中直接处理的请求数
+extern Counter metric_gzip_compressions;     // 工作线程压缩文件的次数
+extern LatencyHistogram metric_parse_time;   // 解析一个请求 (直到找到目标文件) 的耗时
+extern LatencyHistogram metric_queue_wait;   // 连接在线程池队列中等待的时间
+extern LatencyHistogram metric_task_time;    // 工作线程处理一次连接的耗时
+extern Counter metric_upstream_requests;     // 转发给上游服务器的请求数
+extern Counter metric_upstream_connects;     // 新建的上游连接数, 其余的请求复用了连接池中的连接
+extern Counter metric_upstream_errors;       // 和上游服务器交换失败的次数 (连接, 发送或者响应出错)
+
+// 按状态码统计响应数量
+void metrics_count_response(int status);
+
+// 输出运行时指标的路由处理函数 (Router), 按 Prometheus 文本格式生成
+struct RouteRequest;
+struct RouteResponse;
+void serve_metrics(const RouteRequest& request, RouteResponse* response, void* arg);
+
+#endif
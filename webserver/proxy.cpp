@@ -0,0 +1,575 @@
+#include "proxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+#include "metrics.h"
+#include "log.h"
+
+// 一次 splice 从上游搬进管道的最大字节数 (管道默认的容量)
+static const size_t SPLICE_LEN = 64 * 1024;
+
+// 32 位整数的混合函数 (MurmurHash3 的 fmix32), 让相邻的客户端地址在哈希环上分散开
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t fnv1a(const char* data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return h;
+}
+
+// 等待 fd 上的 events, 直到 deadline (metrics_now() 的纳秒数), 超时返回 -ETIMEDOUT
+static int wait_fd(int fd, short events, uint64_t deadline) {
+    while (true) {
+        uint64_t now = metrics_now();
+        if (now >= deadline) {
+            return -ETIMEDOUT;
+        }
+        struct pollfd pfd = { fd, events, 0 };
+        int ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+        if (ret > 0) {
+            // 挂断和出错也算就绪, 之后的读写会报告错误
+            return 0;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+Backend::Backend(const sockaddr_in& addr, const std::string& name, int loops):
+    m_addr(addr), m_name(name), m_pools(new Pool[loops]), m_loops(loops), m_active(0), m_fails(0), m_down_until(0) {
+
+}
+
+Backend::~Backend() {
+    for (int i = 0; i < m_loops; ++i) {
+        for (size_t j = 0; j < m_pools[i].idle.size(); ++j) {
+            close(m_pools[i].idle[j]);
+        }
+    }
+    delete[] m_pools;
+}
+
+int Backend::idle() const {
+    int count = 0;
+    for (int i = 0; i < m_loops; ++i) {
+        m_pools[i].locker.lock();
+        count += m_pools[i].idle.size();
+        m_pools[i].locker.unlock();
+    }
+    return count;
+}
+
+// 非阻塞地连接, 最多等待 CONNECT_TIMEOUT_MS, 连接保持非阻塞
+int Backend::connect_to() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // 请求头和响应头都是一次写完的小块数据, 不需要等待合并
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&m_addr, sizeof(m_addr)) == -1) {
+        int err = errno;
+        if (err == EINPROGRESS) {
+            socklen_t len = sizeof(err);
+            int ret = wait_fd(fd, POLLOUT, metrics_now() + CONNECT_TIMEOUT_MS * 1000000ULL);
+            if (ret < 0) {
+                err = -ret;
+            } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+                err = errno;
+            }
+        }
+        if (err != 0) {
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+    metric_upstream_connects.add();
+    return fd;
+}
+
+// 连接池后进先出: 最近用过的连接最不可能已经被上游的空闲超时关闭
+int Backend::acquire(int loop, bool* reused) {
+    Pool& pool = m_pools[loop % m_loops];
+    m_active.fetch_add(1, std::memory_order_relaxed);
+    while (true) {
+        pool.locker.lock();
+        if (pool.idle.empty()) {
+            pool.locker.unlock();
+            break;
+        }
+        int fd = pool.idle.back();
+        pool.idle.pop_back();
+        pool.locker.unlock();
+
+        // 空闲期间上游关闭了连接 (或者发来了不该有的数据) 时不能再用
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = false;
+    int fd = connect_to();
+    if (fd == -1) {
+        m_active.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return fd;
+}
+
+void Backend::release(int loop, int fd, bool reuse) {
+    m_active.fetch_sub(1, std::memory_order_relaxed);
+    if (reuse) {
+        Pool& pool = m_pools[loop % m_loops];
+        pool.locker.lock();
+        if ((int)pool.idle.size() < MAX_IDLE) {
+            pool.idle.push_back(fd);
+            pool.locker.unlock();
+            return;
+        }
+        pool.locker.unlock();
+    }
+    close(fd);
+}
+
+// 只有把失败次数加到 MAX_FAILS 的那个线程摘除服务器, 摘除之后重新计数
+void Backend::report(bool ok) {
+    if (ok) {
+        if (m_fails.load(std::memory_order_relaxed) != 0) {
+            m_fails.store(0, std::memory_order_relaxed);
+        }
+        return;
+    }
+    if (m_fails.fetch_add(1, std::memory_order_relaxed) + 1 == MAX_FAILS) {
+        m_down_until.store(metrics_now() + FAIL_TIMEOUT * 1000000000ULL, std::memory_order_relaxed);
+        m_fails.store(0, std::memory_order_relaxed);
+        LOG_WARN("upstream %s failed %d times in a row, marked down for %d seconds", m_name.c_str(), MAX_FAILS, FAIL_TIMEOUT);
+    }
+}
+
+UpstreamGroup::UpstreamGroup(POLICY policy): m_policy(policy), m_next(0) {
+
+}
+
+UpstreamGroup::~UpstreamGroup() {
+    for (size_t i = 0; i < m_backends.size(); ++i) {
+        delete m_backends[i];
+    }
+}
+
+// "host:port", host 可以是 IPv4 地址或者主机名 (启动时解析一次)
+static bool resolve(const std::string& server, sockaddr_in* addr) {
+    size_t colon = server.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    std::string host = server.substr(0, colon);
+    const char* port = server.c_str() + colon + 1;
+    char* end;
+    long value = strtol(port, &end, 10);
+    if (!*port || *end || value <= 0 || value > 65535) {
+        return false;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0) {
+        return false;
+    }
+    *addr = *(sockaddr_in*)result->ai_addr;
+    addr->sin_port = htons(value);
+    freeaddrinfo(result);
+    return true;
+}
+
+UpstreamGroup* UpstreamGroup::parse(const char* spec, int loops, std::string* error) {
+    POLICY policy = ROUND_ROBIN;
+    const char* list = spec;
+    const char* at = strchr(spec, '@');
+    if (at) {
+        std::string name(spec, at - spec);
+        if (name == "rr") {
+            policy = ROUND_ROBIN;
+        } else if (name == "least") {
+            policy = LEAST_CONN;
+        } else if (name == "hash") {
+            policy = HASH;
+        } else {
+            *error = "unknown balancing policy \"" + name + "\"";
+            return NULL;
+        }
+        list = at + 1;
+    }
+
+    UpstreamGroup* group = new UpstreamGroup(policy);
+    std::string servers(list);
+    size_t start = 0;
+    while (true) {
+        size_t comma = servers.find(',', start);
+        std::string server = servers.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        sockaddr_in addr;
+        if (!resolve(server, &addr)) {
+            *error = "invalid upstream server \"" + server + "\"";
+            delete group;
+            return NULL;
+        }
+        if (group->m_backends.size() == (size_t)MAX_BACKENDS) {
+            *error = "too many upstream servers";
+            delete group;
+            return NULL;
+        }
+        group->m_backends.push_back(new Backend(addr, server, loops));
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+
+    if (policy == HASH) {
+        // 每台服务器在环上放 VIRTUAL_NODES 个点, 增减服务器时只有它附近的客户端换到别的服务器
+        for (size_t i = 0; i < group->m_backends.size(); ++i) {
+            const std::string& name = group->m_backends[i]->name();
+            for (int v = 0; v < VIRTUAL_NODES; ++v) {
+                std::string point = name + "#" + std::to_string(v);
+                group->m_ring.push_back(std::make_pair(mix32(fnv1a(point.data(), point.size())), (int)i));
+            }
+        }
+        std::sort(group->m_ring.begin(), group->m_ring.end());
+    }
+    return group;
+}
+
+const char* UpstreamGroup::policy_name() const {
+    switch (m_policy) {
+        case LEAST_CONN:
+            return "least";
+        case HASH:
+            return "hash";
+        default:
+            return "rr";
+    }
+}
+
+int UpstreamGroup::pick(uint32_t key, unsigned exclude) {
+    uint64_t now = metrics_now();
+    if (m_policy == HASH) {
+        // 从 key 在环上的位置顺时针找到第一台可选的服务器
+        std::vector<std::pair<uint32_t, int> >::const_iterator it =
+            std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(mix32(key), -1));
+        size_t pos = it - m_ring.begin();
+        for (size_t i = 0; i < m_ring.size(); ++i) {
+            int index = m_ring[(pos + i) % m_ring.size()].second;
+            if (!(exclude & (1u << index)) && m_backends[index]->available(now)) {
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    // 轮询取第一台可选的服务器; 最少连接从轮询的位置开始比较, 连接数相同时也能分散开
+    int count = m_backends.size();
+    unsigned start = m_next.fetch_add(1, std::memory_order_relaxed);
+    int best = -1;
+    for (int i = 0; i < count; ++i) {
+        int index = (start + i) % count;
+        Backend* backend = m_backends[index];
+        if ((exclude & (1u << index)) || !backend->available(now)) {
+            continue;
+        }
+        if (m_policy == ROUND_ROBIN) {
+            return index;
+        }
+        if (best == -1 || backend->active() < m_backends[best]->active()) {
+            best = index;
+        }
+    }
+    return best;
+}
+
+int upstream_send(int fd, struct iovec* iov, int count, int timeout_ms) {
+    uint64_t deadline = metrics_now() + timeout_ms * 1000000ULL;
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -errno;
+            }
+            int ret = wait_fd(fd, POLLOUT, deadline);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// 先偷看 (MSG_PEEK) 再只取走响应头的部分, 响应体留在 socket 中, 之后由 splice 直接转发
+int upstream_read_head(int fd, char* buf, int cap, int timeout_ms) {
+    uint64_t deadline = metrics_now() + timeout_ms * 1000000ULL;
+    int len = 0;
+    while (true) {
+        ssize_t n = recv(fd, buf + len, cap - len, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0) {
+            return len == 0 ? 0 : -EPROTO;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                int ret = wait_fd(fd, POLLIN, deadline);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+            // 复用的连接已经被上游重置, 和关闭一样让调用者重试
+            return errno == ECONNRESET && len == 0 ? 0 : -errno;
+        }
+        // 结尾的空行可能跨过上一次取走的部分
+        int from = len > 3 ? len - 3 : 0;
+        const char* end = (const char*)memmem(buf + from, len + n - from, "\r\n\r\n", 4);
+        int take = end ? end + 4 - (buf + len) : n;
+        if (recv(fd, buf + len, take, MSG_DONTWAIT) != take) {
+            return -EIO;
+        }
+        len += take;
+        if (end) {
+            return len;
+        }
+        if (len == cap) {
+            return -E2BIG;
+        }
+    }
+}
+
+UpstreamRelay::UpstreamRelay(): m_backend(NULL), m_loop(0), m_fd(-1), m_reuse(false), m_state(STATE_DONE),
+    m_chunked(false), m_remaining(0), m_pipe_bytes(0), m_watch_epollfd(-1), m_line_len(0) {
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+UpstreamRelay::~UpstreamRelay() {
+    abort();
+}
+
+void UpstreamRelay::start(Backend* backend, int loop, int fd, MODE mode, off_t length, bool reuse) {
+    m_backend = backend;
+    m_loop = loop;
+    m_fd = fd;
+    m_reuse = reuse && mode != RELAY_CLOSE;
+    m_chunked = mode == RELAY_CHUNKED;
+    m_state = mode == RELAY_LENGTH ? STATE_DATA : (mode == RELAY_CLOSE ? STATE_CLOSE : STATE_CHUNK_SIZE);
+    m_remaining = length;
+    m_line_len = 0;
+}
+
+int UpstreamRelay::pump(int client_fd) {
+    if (m_pipe[0] == -1 && pipe2(m_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        m_pipe[0] = m_pipe[1] = -1;
+        return -1;
+    }
+    while (true) {
+        if (m_pipe_bytes > 0) {
+            // 管道 -> 客户端, 页面只是在两个 socket 之间转移
+            ssize_t n = splice(m_pipe[0], NULL, client_fd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? (int)EPOLLOUT : -1;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            m_pipe_bytes -= n;
+            metric_bytes_out.add(n);
+            continue;
+        }
+        if (m_state == STATE_DONE) {
+            finish(m_reuse);
+            return 0;
+        }
+        int wait = fill();
+        if (wait != 0) {
+            return wait;
+        }
+    }
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+int UpstreamRelay::fill() {
+    if (m_state == STATE_DATA || m_state == STATE_CLOSE) {
+        // 上游 -> 管道
+        size_t len = (m_state == STATE_CLOSE || m_remaining > (off_t)SPLICE_LEN) ? SPLICE_LEN : m_remaining;
+        ssize_t n = splice(m_fd, NULL, m_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? (int)EPOLLIN : -1;
+        }
+        if (n == 0) {
+            // 上游关闭了连接: 到关闭为止的响应体正常结束, 其他的响应体没有收完
+            if (m_state != STATE_CLOSE) {
+                return -1;
+            }
+            m_state = STATE_DONE;
+            return 0;
+        }
+        m_pipe_bytes += n;
+        if (m_state == STATE_DATA && (m_remaining -= n) == 0) {
+            m_state = m_chunked ? STATE_CHUNK_SIZE : STATE_DONE;
+        }
+        return 0;
+    }
+
+    // chunk 大小所在的行或者一个尾部字段, 原样写进 (空的) 管道, 和 chunk 的数据保持顺序
+    int ret = read_line();
+    if (ret != 0) {
+        return ret;
+    }
+    if (::write(m_pipe[1], m_line, m_line_len) != m_line_len) {
+        return -1;
+    }
+    m_pipe_bytes += m_line_len;
+    if (m_state == STATE_TRAILER) {
+        if (m_line_len == 2) {
+            m_state = STATE_DONE;
+        }
+    } else {
+        // 十六进制的大小, 之后可能有 ";扩展"
+        off_t size = 0;
+        int digits = 0;
+        int value;
+        while (digits < m_line_len && (value = hex_digit(m_line[digits])) >= 0) {
+            if (++digits > 15) {
+                return -1;
+            }
+            size = size * 16 + value;
+        }
+        if (digits == 0) {
+            return -1;
+        }
+        if (size == 0) {
+            m_state = STATE_TRAILER;
+        } else {
+            // chunk 的数据和它之后的 "\r\n" 一起转发
+            m_remaining = size + 2;
+            m_state = STATE_DATA;
+        }
+    }
+    m_line_len = 0;
+    return 0;
+}
+
+// 每次只取走到 '\n' 为止的数据; 一行分几次到达时先取走已经到达的部分, 不会因为 socket 一直可读而空转
+int UpstreamRelay::read_line() {
+    while (true) {
+        ssize_t n = recv(m_fd, m_line + m_line_len, MAX_LINE - m_line_len, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? (int)EPOLLIN : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        const char* nl = (const char*)memchr(m_line + m_line_len, '\n', n);
+        int take = nl ? nl + 1 - (m_line + m_line_len) : n;
+        if (recv(m_fd, m_line + m_line_len, take, MSG_DONTWAIT) != take) {
+            return -1;
+        }
+        m_line_len += take;
+        if (nl) {
+            return m_line_len >= 2 && m_line[m_line_len - 2] == '\r' ? 0 : -1;
+        }
+        if (m_line_len == MAX_LINE) {
+            return -1;
+        }
+    }
+}
+
+bool UpstreamRelay::watch(int epollfd, int client_fd) {
+    epoll_event event;
+    event.data.u64 = 0;
+    event.data.fd = upstream_event_tag(client_fd);
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    if (m_watch_epollfd == epollfd) {
+        return epoll_ctl(epollfd, EPOLL_CTL_MOD, m_fd, &event) == 0;
+    }
+    unwatch();
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, m_fd, &event) == -1) {
+        return false;
+    }
+    m_watch_epollfd = epollfd;
+    return true;
+}
+
+void UpstreamRelay::unwatch() {
+    if (m_watch_epollfd != -1) {
+        epoll_ctl(m_watch_epollfd, EPOLL_CTL_DEL, m_fd, NULL);
+        m_watch_epollfd = -1;
+    }
+}
+
+void UpstreamRelay::shutdown() {
+    if (m_fd != -1) {
+        ::shutdown(m_fd, SHUT_RDWR);
+    }
+}
+
+// 放回连接池之前先从 epoll 中删除, 否则之后使用它的连接收到的事件会被送到这个客户端
+void UpstreamRelay::finish(bool reuse) {
+    unwatch();
+    m_backend->release(m_loop, m_fd, reuse);
+    m_fd = -1;
+    m_state = STATE_DONE;
+}
+
+void UpstreamRelay::abort() {
+    if (m_fd != -1) {
+        finish(false);
+    }
+    if (m_pipe[0] != -1) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+        m_pipe[0] = m_pipe[1] = -1;
+    }
+    m_pipe_bytes = 0;
+}
@@ -0,0 +1,178 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "locker.h"
+#include "workqueue.h"
+
+// 反向代理: 匹配了代理路由的请求被转发给一组上游服务器 (UpstreamGroup), 上游的响应再转发给客户端
+//
+// 1. 和上游的连接保持 keep-alive, 用完之后放回连接池, 连接池按事件循环分片, 同一个事件循环的请求复用同一组连接
+// 2. 每个请求按组的策略选择一台上游服务器: 轮询, 最少连接, 或者按客户端地址的一致性哈希
+// 3. 被动健康检查: 连续失败 MAX_FAILS 次的服务器被摘除 FAIL_TIMEOUT 秒, 之后再重新尝试
+// 4. 请求头和上游的响应头由工作线程同步地交换 (带超时), 响应体由事件循环转发 (UpstreamRelay):
+//    上游 socket -> 管道 -> 客户端 socket 都用 splice, 数据不经过用户空间
+
+// 一台上游服务器
+class Backend {
+public:
+ static const int MAX_IDLE = 32;             // 每个事件循环的连接池最多保留的空闲连接
+ static const int MAX_FAILS = 3;             // 连续失败这么多次之后暂时摘除
+ static const int FAIL_TIMEOUT = 10;         // 摘除的时间 (秒)
+ static const int CONNECT_TIMEOUT_MS = 3000; // 建立连接的超时时间
+
+ Backend(const sockaddr_in& addr, const std::string& name, int loops);
+ ~Backend();
+
+ const std::string& name() const { return m_name; }
+ int active() const { return m_active.load(std::memory_order_relaxed); } // 正在使用的连接数
+ int idle() const;                                // 连接池中的空闲连接数
+ bool available(uint64_t now) const { return now >= m_down_until.load(std::memory_order_relaxed); }
+
+ // 取得一个连接: 优先复用事件循环 loop 的连接池中的连接 (*reused 为 true), 没有时新建, 失败返回 -1
+ int acquire(int loop, bool* reused);
+ // 交还连接, reuse 为 false 或者连接池满了时关闭它
+ void release(int loop, int fd, bool reuse);
+ // 被动健康检查: 记录一次交换的结果
+ void report(bool ok);
+
+private:
+ Backend(const Backend&);
+ Backend& operator=(const Backend&);
+ int connect_to();
+
+ struct alignas(CACHE_LINE_SIZE) Pool {
+     Locker locker;
+     std::vector<int> idle;
+ };
+
+ sockaddr_in m_addr;
+ std::string m_name;                    // "host:port"
+ Pool* m_pools;                         // 以事件循环的编号为下标
+ int m_loops;
+ std::atomic<int> m_active;
+ std::atomic<int> m_fails;              // 连续失败的次数
+ std::atomic<uint64_t> m_down_until;    // 摘除到这个时间 (metrics_now() 的纳秒数) 为止
+};
+
+// 一组上游服务器和选择它们的策略
+class UpstreamGroup {
+public:
+ enum POLICY {
+     ROUND_ROBIN = 0,   // 轮询
+     LEAST_CONN,        // 正在使用的连接最少的服务器
+     HASH               // 按客户端地址的一致性哈希, 同一个客户端总是落在同一台服务器上 (除非它被摘除)
+ };
+ static const int MAX_BACKENDS = 32;     // exclude 掩码的位数
+ static const int VIRTUAL_NODES = 160;   // 一致性哈希中每台服务器的虚拟节点数
+
+ // 解析 "[rr|least|hash@]host:port,host:port,...", 失败时返回 NULL, 原因写在 *error 中
+ // loops 是事件循环的数量, 决定连接池的分片数
+ static UpstreamGroup* parse(const char* spec, int loops, std::string* error);
+ ~UpstreamGroup();
+
+ // 选择一台没有被摘除的服务器, exclude 是这个请求已经失败过的服务器 (编号的位掩码), 没有可选的时返回 -1
+ // key 只在一致性哈希中使用
+ int pick(uint32_t key, unsigned exclude);
+ Backend* backend(int index) const { return m_backends[index]; }
+ int size() const { return m_backends.size(); }
+ const char* policy_name() const;
+
+private:
+ UpstreamGroup(POLICY policy);
+
+ POLICY m_policy;
+ std::vector<Backend*> m_backends;
+ std::atomic<unsigned> m_next;                     // 轮询的位置
+ std::vector<std::pair<uint32_t, int> > m_ring;    // 一致性哈希环: (哈希值, 服务器编号), 按哈希值排序
+};
+
+// 在 timeout_ms 毫秒之内把 iov 中的数据全部发送到非阻塞的 fd, 成功返回 0, 超时返回 -ETIMEDOUT, 出错返回 -errno
+int upstream_send(int fd, struct iovec* iov, int count, int timeout_ms);
+// 在 timeout_ms 毫秒之内读取一个完整的响应头 (到空行为止, 包括空行), 之后的数据留在 socket 中
+// 返回响应头的长度; 还没有收到任何数据时对方就关闭了连接返回 0; 超时返回 -ETIMEDOUT, 响应头超过 cap 或者出错返回 -errno
+int upstream_read_head(int fd, char* buf, int cap, int timeout_ms);
+
+// 把上游响应的响应体转发给客户端, 由连接所属的事件循环驱动, 不会阻塞
+// 管道中的数据先全部发送给客户端, 管道空了才从上游继续读取, 所以管道中的数据总是同一段响应体
+// chunked 的响应体原样转发, 只有 chunk 大小所在的行和尾部字段经过用户空间 (用来知道响应在哪里结束)
+class UpstreamRelay {
+public:
+ // 响应体的长度
+ enum MODE {
+     RELAY_LENGTH = 0,  // Content-Length
+     RELAY_CHUNKED,     // Transfer-Encoding: chunked
+     RELAY_CLOSE        // 到上游关闭连接为止, 这样的连接不能复用
+ };
+ static const int MAX_LINE = 256;    // chunk 大小所在的行和尾部字段的最大长度
+
+ UpstreamRelay();
+ ~UpstreamRelay();
+
+ // 开始转发, 连接 fd 属于事件循环 loop 的连接池, length 只在 RELAY_LENGTH 时使用 (必须大于 0)
+ // 转发完之后 reuse 为 true 的连接放回连接池
+ void start(Backend* backend, int loop, int fd, MODE mode, off_t length, bool reuse);
+ bool active() const { return m_fd != -1; }
+ int fd() const { return m_fd; }
+
+ // 尽量转发, 返回 0 表示转发完毕 (上游的连接已经交还), EPOLLIN 表示需要等待上游可读,
+ // EPOLLOUT 表示需要等待客户端可写, -1 表示出错 (调用者关闭客户端的连接, 再调用 abort)
+ int pump(int client_fd);
+ // 等待上游可读: 在 epollfd 上注册一次 (EPOLLONESHOT) 上游连接的读事件,
+ // 事件的 data.fd 是 upstream_event_tag(client_fd), 事件循环由它找到客户端的连接, 注册失败时返回 false
+ bool watch(int epollfd, int client_fd);
+ // 上游连接是否注册在 epollfd 上, 只由调用 watch 的事件循环线程修改, 用来过滤已经过时的事件
+ bool watching(int epollfd) const { return m_fd != -1 && m_watch_epollfd == epollfd; }
+ // 关闭上游连接的读写, 正在等待它的事件循环会马上收到挂断
+ void shutdown();
+ // 放弃转发, 关闭上游连接和管道
+ void abort();
+
+private:
+ enum STATE {
+     STATE_DATA = 0,     // 还剩 m_remaining 字节的响应体或者 chunk 数据 (包括 chunk 之后的 "\r\n")
+     STATE_CLOSE,        // 转发到上游关闭连接
+     STATE_CHUNK_SIZE,   // 等待 chunk 大小所在的行
+     STATE_TRAILER,      // 最后一个 chunk 之后的尾部字段, 直到空行
+     STATE_DONE
+ };
+
+ int fill();          // 管道空了, 从上游读取下一段, 返回 0 或者 pump 的等待事件
+ int read_line();     // 读取 chunk 的一行到 m_line, 返回 0 表示读完了一行, 否则和 fill 相同
+ void unwatch();
+ void finish(bool reuse);
+
+ Backend* m_backend;
+ int m_loop;
+ int m_fd;
+ bool m_reuse;
+ STATE m_state;
+ bool m_chunked;
+ off_t m_remaining;
+ int m_pipe[2];            // 第一次转发时创建, 同一个客户端连接上的响应一直使用它
+ int m_pipe_bytes;         // 管道中还没有发送给客户端的字节数
+ int m_watch_epollfd;      // 上游连接注册在哪个 epoll 对象上, -1 表示没有注册
+ char m_line[MAX_LINE];
+ int m_line_len;
+};
+
+// 上游的响应头中决定怎样转发响应体的信息, 由 http_conn 解析
+struct UpstreamHead {
+    int status;
+    bool keep_alive;            // 转发完之后上游连接能否复用
+    UpstreamRelay::MODE mode;
+    off_t length;               // RELAY_LENGTH 时响应体的长度
+};
+
+// 等待上游连接的事件的 data.fd, 是负数, 不会和任何 socket 混淆
+inline int upstream_event_tag(int client_fd) { return -client_fd - 1; }
+inline int upstream_event_client(int tag) { return -tag - 1; }
+
+#endif
@@ -0,0 +1,455 @@
+#include "reactor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "affinity.h"
+
+// 添加文件描述符到 epoll 中
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void modfd(int epollfd, int fd, int ev);
+
+int Reactor::m_backlog = 1024;
+int Reactor::m_accept_batch = 64;
+bool Reactor::m_run_to_completion = true;
+
+Reactor::Reactor(int id, int port, ConnPool* pool):
+    m_id(id),
+    m_port(port),
+    m_listenfd(-1),
+    m_epollfd(-1),
+    m_events(NULL),
+    m_users(new http_conn*[MAX_FD]()),
+    m_pool(pool),
+    m_started(false),
+    m_accept_paused(false),
+    m_cpu(-1),
+    m_deadline(0),
+    m_accept_stopped(false),
+    m_drained(false) {
+
+}
+
+Reactor::~Reactor() {
+    if (m_epollfd != -1) {
+        close(m_epollfd);
+    }
+    if (m_listenfd != -1) {
+        close(m_listenfd);
+    }
+    delete[] m_events;
+    for (int i = 0; i < MAX_FD; ++i) {
+      delete m_users[i];
+    }
+    delete[] m_users;
+}
+
+bool Reactor::create_listener(bool reuse_port) {
+    if (m_listenfd != -1) {
+      // 从旧进程接过来的监听 socket, 已经绑定并且在监听了
+      return true;
+    }
+    m_listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (m_listenfd == -1) {
+      perror("Socket");
+      return false;
+    }
+
+    // 设置端口复用 (要在绑定之前去设置)
+    int reuse = 1;
+    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port) {
+      // 每个事件循环都有自己的监听 socket, 由内核在它们之间做负载均衡
+      if (setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        perror("SO_REUSEPORT");
+        return false;
+      }
+    }
+
+    // 绑定
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(m_port);
+    int ret = bind(m_listenfd, (struct sockaddr *)&address, sizeof(address));
+    if (ret == -1) {
+      perror("Bind");
+      return false;
+    }
+
+    // 监听, backlog 超过 net.core.somaxconn 时会被内核截断
+    if (listen(m_listenfd, m_backlog) == -1) {
+      perror("Listen");
+      return false;
+    }
+    return true;
+}
+
+bool Reactor::init(bool reuse_port) {
+    if (!create_listener(reuse_port)) {
+      return false;
+    }
+
+    // 创建 epoll 对象, 事件数组, 添加文件描述符
+    m_events = new epoll_event[MAX_EVENT_NUMBER];
+    m_epollfd = epoll_create(5);
+    if (m_epollfd == -1) {
+      perror("Epoll");
+      return false;
+    }
+
+    // 将监听的文件描述符添加到 epoll 对象中
+    addfd(m_epollfd, m_listenfd, false);
+
+    // 时间轮的 timerfd 也由这个 epoll 对象监听
+    if (m_wheel.init() == -1) {
+      perror("Timerfd");
+      return false;
+    }
+    addfd(m_epollfd, m_wheel.fd(), false);
+    return true;
+}
+
+bool Reactor::start() {
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void Reactor::join() {
+    if (m_started) {
+        pthread_join(m_thread, NULL);
+        m_started = false;
+    }
+}
+
+void Reactor::pin() {
+    if (m_cpu < 0) {
+        return;
+    }
+    if (!pin_thread(m_cpu)) {
+        LOG_WARN("failed to pin reactor %d to cpu %d", m_id, m_cpu);
+    }
+}
+
+// 连接对象在这个 socket 第一次被使用时才创建, 之后一直复用
+// 对象由事件循环自己的线程分配, 绑定了 CPU 时就在本地的 NUMA 节点上
+http_conn* Reactor::conn_object(int sockfd) {
+    http_conn* conn = m_users[sockfd];
+    if (!conn) {
+        conn = new http_conn;
+        m_users[sockfd] = conn;
+    }
+    return conn;
+}
+
+// 经典 BPF 程序: 读出当前 CPU 的编号, 依次和 cpus 比较, 返回匹配的下标
+// 返回值大于等于组中 socket 的数量时内核退回到按哈希选择
+bool Reactor::steer_by_cpu(const std::vector<int>& cpus) {
+    std::vector<struct sock_filter> code;
+    struct sock_filter load_cpu = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned)(SKF_AD_OFF + SKF_AD_CPU));
+    code.push_back(load_cpu);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        struct sock_filter match = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)cpus[i], 0, 1);
+        struct sock_filter ret = BPF_STMT(BPF_RET | BPF_K, (unsigned)i);
+        code.push_back(match);
+        code.push_back(ret);
+    }
+    struct sock_filter fallback = BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    code.push_back(fallback);
+
+    struct sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = code.data();
+    if (setsockopt(m_listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
+
+void* Reactor::worker(void* arg) {
+    Reactor *reactor = (Reactor *)arg;
+    reactor->run();
+    return reactor;
+}
+
+// 监听 socket 是水平触发的, 一次最多接受 m_accept_batch 个连接, 剩下的下一轮 epoll_wait 再处理
+void Reactor::handle_accept() {
+    for (int i = 0; i < m_accept_batch; ++i) {
+      // 有客户端连接进来
+      struct sockaddr_in client_address;
+      socklen_t client_addrlen = sizeof(client_address);
+      int conn_fd = accept(m_listenfd, (struct sockaddr*)&client_address, &client_addrlen);
+      if (conn_fd < 0) {
+        return;
+      }
+      metric_accepts.add();
+
+      if (conn_fd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
+        // 目前连接数满了, 告诉客户端服务器正忙, 并且暂停接受新连接
+        metric_accept_rejected.add();
+        http_conn::send_overload(conn_fd);
+        close(conn_fd);
+        pause_accept();
+        return;
+      }
+
+      add_conn(conn_fd, client_address);
+    }
+}
+
+void Reactor::add_conn(int sockfd, const sockaddr_in& addr) {
+    // 给新的客户端初始化，放到数组中, 之后这个连接的事件都注册在这个事件循环的 epoll 对象上
+    conn_object(sockfd)->init(sockfd, addr, m_epollfd, m_id);
+
+    // 客户端必须在 m_header_timeout 秒之内发送完第一个请求
+    m_wheel.add(m_users[sockfd]->timer(), http_conn::m_header_timeout * 1000);
+}
+
+void Reactor::dispatch(int sockfd) {
+    // 快速路径: 在当前线程中处理, 生成的响应马上发送, 发送完之后继续处理后面的流水线请求
+    while (m_run_to_completion) {
+      int events = m_users[sockfd]->process_inline();
+      if (events == 0) {
+        break;
+      }
+      if (events == EPOLLIN) {
+        // 请求还不完整 (或者出错之后关闭了 socket 的读写), 等待下一个读事件
+        modfd(m_epollfd, sockfd, EPOLLIN);
+        return;
+      }
+      if (!flush(sockfd)) {
+        return;
+      }
+    }
+
+    // 工作线程重新注册事件之前, 到期的定时器不会关闭这个连接
+    m_users[sockfd]->m_busy.store(true, std::memory_order_relaxed);
+    if (!m_pool->append(m_users[sockfd], m_id)) {
+      // 请求队列满了, 回复 503 而不是让连接一直等到超时
+      m_users[sockfd]->m_busy.store(false, std::memory_order_relaxed);
+      shed(sockfd);
+    }
+}
+
+// 留出一些余量, 避免在满和不满之间来回切换
+bool Reactor::can_resume_accept() const {
+    return m_pool->queue_size() * 2 < m_pool->max_requests() && http_conn::m_user_count < MAX_FD - m_accept_batch;
+}
+
+// 暂停期间新连接留在内核的全连接队列中, 队列也满了之后客户端的 SYN 会被忽略并重传
+void Reactor::pause_accept() {
+    if (m_accept_paused) {
+      return;
+    }
+    m_accept_paused = true;
+    metric_accept_pauses.add();
+    watch_listener(false);
+    LOG_WARN("reactor %d is saturated, stop accepting new connections", m_id);
+}
+
+void Reactor::resume_accept() {
+    if (!m_accept_paused) {
+      return;
+    }
+    m_accept_paused = false;
+    watch_listener(true);
+    LOG_INFO("reactor %d resumes accepting new connections", m_id);
+}
+
+void Reactor::watch_listener(bool enable) {
+    if (enable) {
+      addfd(m_epollfd, m_listenfd, false);
+    } else {
+      epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, NULL);
+    }
+}
+
+void Reactor::shed(int sockfd) {
+    metric_requests_shed.add();
+    http_conn::send_overload(sockfd);
+    close_conn(sockfd);
+    pause_accept();
+}
+
+void Reactor::close_conn(int sockfd) {
+    m_wheel.del(m_users[sockfd]->timer());
+    m_users[sockfd]->close_conn();
+}
+
+void Reactor::on_timeout(TimerNode* node, void* arg) {
+    Reactor *reactor = (Reactor *)arg;
+    http_conn *conn = (http_conn *)node->data;
+    if (conn->m_busy.load(std::memory_order_acquire)) {
+      // 连接正在被工作线程处理, 稍后再检查
+      reactor->m_wheel.add(node, 1000);
+      return;
+    }
+    // 超时: 请求头太慢, 响应发送停滞, 或者保持连接时空闲太久
+    conn->close_conn();
+}
+
+int64_t Reactor::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void Reactor::stop(int64_t deadline) {
+    m_deadline.store(deadline > 0 ? deadline : 1, std::memory_order_relaxed);
+}
+
+bool Reactor::upstream_ready(int sockfd) const {
+    http_conn* conn = m_users[sockfd];
+    // 不能用 m_busy 判断: 工作线程交还连接时先重新注册事件再清除 m_busy, 这之间事件循环可能已经开始转发并等待上游了
+    return conn && conn->watching_upstream(m_epollfd);
+}
+
+bool Reactor::quiescent(int sockfd) const {
+    http_conn* conn = m_users[sockfd];
+    return conn->idle() && !conn->response_pending() && !conn->has_pending();
+}
+
+struct DrainState {
+    Reactor* reactor;
+    bool expired;    // 是否已经过了期限
+    int remaining;   // 还没有关闭的连接数
+};
+
+// 每个打开的连接都有一个定时器在时间轮中, 所以遍历时间轮就是遍历这个事件循环上所有的连接
+// 空闲的连接不马上关闭: 客户端可能已经发出了下一个请求 (或者刚建立的连接的第一个请求), 马上关闭会让它失败,
+// 所以只是把定时器提前到 DRAIN_IDLE_MS 之后, 在这之前到达的请求照常处理, 响应带着 Connection: close
+// 在工作线程中的连接要等工作线程交还之后才能关闭, 过了期限也一样
+void Reactor::on_drain(TimerNode* node, void* arg) {
+    DrainState* state = (DrainState*)arg;
+    Reactor* reactor = state->reactor;
+    http_conn* conn = (http_conn*)node->data;
+    int sockfd = conn->sockfd();
+    if (!conn->m_busy.load(std::memory_order_acquire)) {
+      if (state->expired) {
+        reactor->close_conn(sockfd);
+      } else if (reactor->quiescent(sockfd)) {
+        reactor->m_wheel.shorten(node, DRAIN_IDLE_MS);
+      }
+    }
+    if (conn->sockfd() != -1) {
+      ++state->remaining;
+    }
+}
+
+// 监听 socket 只是不再等待, 直到析构时才关闭: 这一轮中可能还有它的事件或者完成项没有处理
+void Reactor::drain() {
+    if (!m_accept_stopped) {
+      // 第一次调用: 停止接受新连接, 暂停标记保证它不会被恢复
+      m_accept_stopped = true;
+      m_accept_paused = true;
+      watch_listener(false);
+      LOG_INFO("reactor %d stops accepting new connections", m_id);
+    }
+    DrainState state = { this, now_ms() >= m_deadline.load(std::memory_order_relaxed), 0 };
+    m_wheel.for_each(on_drain, &state);
+    if (state.remaining == 0 && !accept_pending()) {
+      m_drained = true;
+      LOG_INFO("reactor %d has closed all connections", m_id);
+    }
+}
+
+bool Reactor::flush(int sockfd) {
+    // 一次性写完所有的数据
+    if (!m_users[sockfd]->write()) {
+      close_conn(sockfd);
+    } else if (m_users[sockfd]->response_pending()) {
+      // 发送缓冲区满了, 每次有进展就刷新定时器
+      m_wheel.add(m_users[sockfd]->timer(), http_conn::m_idle_timeout * 1000);
+    } else if (m_users[sockfd]->has_pending()) {
+      m_wheel.add(m_users[sockfd]->timer(), http_conn::m_header_timeout * 1000);
+      return true;
+    } else {
+      // 响应发送完毕, 保持连接等待下一个请求
+      m_wheel.add(m_users[sockfd]->timer(), m_users[sockfd]->keep_alive_timeout() * 1000);
+    }
+    return false;
+}
+
+void Reactor::run() {
+    pin();
+    while (!m_drained) {
+      int num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+      if ((num < 0) && (errno != EINTR)) { // 产生信号中断
+        LOG_ERROR("epoll_wait failed in reactor %d: %s", m_id, strerror(errno));
+        break;
+      }
+
+      // 循环遍历事件数组
+      for (int i = 0; i < num; ++i) {
+        int sockfd = m_events[i].data.fd;
+        if (sockfd < 0) {
+
+          // 反向代理的上游连接可读, 继续转发它的响应体
+          // 连接可能在这一轮中已经关闭了, socket 甚至已经被新的连接使用, 只处理确实在等待上游的连接
+          sockfd = upstream_event_client(sockfd);
+          if (upstream_ready(sockfd) && flush(sockfd)) {
+            dispatch(sockfd);
+          }
+
+        } else if (sockfd == m_listenfd) {
+
+          handle_accept();
+
+        } else if (sockfd == m_wheel.fd()) {
+
+          // 时间轮前进, 关闭所有超时的连接
+          m_wheel.advance(on_timeout, this);
+          if (m_deadline.load(std::memory_order_relaxed) != 0) {
+            drain();
+          } else if (m_accept_paused && can_resume_accept()) {
+            resume_accept();
+          }
+
+        } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+
+          // 队伍异常断开或者错误等事件, 需要关闭连接
+          close_conn(sockfd);
+
+        } else if (m_events[i].events & EPOLLIN) {
+
+          // 读事件: 一次性把所有的事件都读出来
+          bool idle = m_users[sockfd]->idle();
+          if (m_users[sockfd]->read()) {
+            if (idle) {
+              // 新请求的第一个字节到达, 整个请求必须在 m_header_timeout 秒之内收完
+              // 之后的读事件不会刷新这个定时器, 慢慢发送请求头的客户端会被关闭
+              m_wheel.add(m_users[sockfd]->timer(), http_conn::m_header_timeout * 1000);
+            } else if (m_users[sockfd]->receiving_body()) {
+              // 请求体可能很大, 和发送响应一样每次有进展就刷新定时器
+              m_wheel.add(m_users[sockfd]->timer(), http_conn::m_idle_timeout * 1000);
+            }
+            // 把业务逻辑交给线程池中的线程去执行, 同一个事件循环的请求优先交给同一个工作线程
+            dispatch(sockfd);
+          } else { // 读取失败
+            close_conn(sockfd);
+          }
+
+        } else if (m_events[i].events & EPOLLOUT) {
+
+          if (flush(sockfd)) {
+            // 读缓冲区中还有流水线请求, 继续处理
+            dispatch(sockfd);
+          }
+
+        }
+
+      }
+
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <vector>
+
+#include "threadpool.h"
+#include "http_conn.h"
+#include "timer_wheel.h"
+
+#define MAX_FD 65535 // 最大文件描述符个数
+#define MAX_EVENT_NUMBER 10000 // 最大监听的事件对象
+
+// 处理 HTTP 连接的线程池, 默认使用无锁环形队列
+// 编译时定义 USE_LIST_QUEUE (make QUEUE=list) 可以换回原来的互斥锁 + std::list 队列, 用来做性能对比
+// 定义 USE_STEALING_QUEUE (make QUEUE=stealing) 则使用每个工作线程一个队列的工作窃取调度
+#if defined(USE_LIST_QUEUE)
+typedef Threadpool<http_conn, ListQueue<http_conn> > ConnPool;
+#elif defined(USE_STEALING_QUEUE)
+typedef Threadpool<http_conn, StealingQueue<http_conn> > ConnPool;
+#else
+typedef Threadpool<http_conn, RingQueue<http_conn> > ConnPool;
+#endif
+
+// 事件循环: 每个 Reactor 拥有自己的 epoll 对象和监听 socket
+// 多个 Reactor 的监听 socket 通过 SO_REUSEPORT 绑定到同一个端口, 由内核把新连接分散到各个 Reactor
+// 连接一旦被某个 Reactor 接受, 之后所有的读写事件都由这个 Reactor 处理
+// 每个 Reactor 还有一个由 timerfd 驱动的时间轮, 负责这个 Reactor 上所有连接的超时
+//
+// 快速路径 (m_run_to_completion): 请求到达时事件循环先在自己的线程中处理, 文件缓存命中和 304 这类不需要
+// 系统调用的请求直接生成响应并马上发送, 省掉两次线程切换和一次 epoll 等待; 遇到慢操作 (打开文件, 压缩, 请求体, 指标)
+// 时才把连接交给线程池, 由工作线程从这个请求重新开始处理
+//
+// 准入控制: 线程池的队列满了或者连接数满了时, 多出来的连接直接收到一个 503 并被关闭,
+// 同时暂停接受新连接, 让它们留在内核的全连接队列 (backlog) 中, 等到队列降到一半以下再恢复
+//
+// 绑定 CPU 时事件循环的线程在 run() 开始时绑定到 m_cpu 上, 连接对象也在本地的 NUMA 节点上分配
+// 按 CPU 分配连接时 (steer_by_cpu), 内核把网卡在哪个 CPU 上收到的连接交给绑定在这个 CPU 上的事件循环,
+// 配合网卡的 RSS (接收队列的中断绑定到对应的 CPU) 和 XPS (发送队列按 CPU 选择),
+// 一个连接的收包, 事件循环和发包都在同一个 CPU 上
+//
+// 平滑退出 (stop): 停止接受新连接, 空闲的连接短暂等待之后关闭, 正在处理的请求处理完之后带着 Connection: close 关闭连接,
+// 到了期限还没有结束的连接直接关闭, 所有连接都关闭之后 run() 返回
+// reload 时监听 socket 已经交给了新进程, 内核队列中的新连接由新进程接受
+class Reactor {
+public:
+ static int m_backlog;        // listen 的 backlog
+ static int m_accept_batch;   // 监听 socket 每次可读时最多接受的连接数, 避免新连接饿死已有的连接
+ static bool m_run_to_completion; // 是否先在事件循环的线程中处理请求, 关闭之后所有请求都交给线程池
+ static const int DRAIN_IDLE_MS = 1000; // 平滑退出时空闲的连接最多再等待下一个请求的时间
+
+ Reactor(int id, int port, ConnPool* pool);
+ virtual ~Reactor();
+ virtual bool init(bool reuse_port); // 创建监听 socket 和 epoll 对象
+ virtual void run();                 // 在当前线程中运行事件循环
+ bool start();                       // 创建一个新的线程运行事件循环
+ void set_cpu(int cpu) { m_cpu = cpu; } // 在 init() 之前调用, run() 开始时把线程绑定到这个 CPU 上
+ // 给监听 socket 所在的 SO_REUSEPORT 组加上按 CPU 选择 socket 的 BPF 程序:
+ // 在 cpus[i] 上收到的连接交给第 i 个加入组的 socket (第 i 个事件循环), 其他 CPU 上的连接仍然按哈希分配
+ bool steer_by_cpu(const std::vector<int>& cpus);
+ void join();                        // 等待 start() 创建的线程结束
+ // 在 init() 之前调用: 使用从旧进程接过来的监听 socket, 不再创建新的
+ void adopt_listener(int fd) { m_listenfd = fd; }
+ int listener() const { return m_listenfd; }
+ // 开始平滑退出, 到 deadline (now_ms() 的时间) 时关闭所有剩下的连接
+ // 可以在任何线程中调用, 事件循环在下一个 tick 开始关闭连接
+ void stop(int64_t deadline);
+ static int64_t now_ms();            // CLOCK_MONOTONIC 的毫秒数
+
+protected:
+ bool create_listener(bool reuse_port); // 创建, 绑定并监听 m_listenfd
+ bool can_resume_accept() const;        // 暂停之后负载是否已经降到可以恢复接受新连接
+ void pause_accept();                   // 暂停接受新连接
+ void resume_accept();                  // 恢复接受新连接
+ virtual void watch_listener(bool enable); // 开始或者停止等待监听 socket 上的新连接
+ virtual void close_conn(int sockfd);   // 删除连接的定时器并关闭连接
+ void shed(int sockfd);                 // 回复 503 并关闭一个已经建立的连接
+ void pin();                            // 把当前线程绑定到 m_cpu 上, 在 run() 的开头调用
+ http_conn* conn_object(int sockfd);    // 取得 (必要时创建) 这个 socket 的连接对象
+ void drain();                          // 平滑退出时每个 tick 调用一次, 关闭可以关闭的连接, 全部关闭之后设置 m_drained
+ virtual bool quiescent(int sockfd) const; // 连接上是否没有正在接收的请求, 也没有没发送完的响应
+ bool upstream_ready(int sockfd) const;  // 收到上游连接的事件时, 这个连接是否确实在这个事件循环上等待上游
+ virtual bool accept_pending() const { return false; } // 停止等待监听 socket 之后是否还可能接受到新连接
+ void handle_accept();       // 接受新的连接
+ virtual void add_conn(int sockfd, const sockaddr_in& addr); // 初始化刚接受的连接, 开始等待它的第一个请求
+
+private:
+ static void *worker(void *arg);
+ static void on_timeout(TimerNode* node, void* arg); // 时间轮的到期回调
+ static void on_drain(TimerNode* node, void* arg);   // 平滑退出时对每个连接调用
+ void dispatch(int sockfd);  // 处理读缓冲区中的请求, 快速路径处理不了时交给线程池
+ bool flush(int sockfd);     // 发送响应并设置定时器, 连接关闭或者还没有发送完时返回 false, 还有流水线请求时返回 true
+
+protected:
+ int m_id;                      // 事件循环的编号
+ int m_port;                    // 监听的端口
+ int m_listenfd;                // 监听的 socket
+ int m_epollfd;                 // 这个事件循环的 epoll 对象
+ epoll_event* m_events;         // epoll_wait 使用的事件数组
+ // 这个事件循环的客户端数组, 以 socket 为下标, 第一次使用时才创建
+ // 每个事件循环各有一份: socket 关闭之后这个编号可能马上被另一个事件循环接受的连接使用, 共享的对象会同时有两个主人
+ http_conn** m_users;
+ ConnPool* m_pool;            // 所有事件循环共享的线程池
+ TimerWheel m_wheel;            // 这个事件循环上所有连接的超时定时器
+ pthread_t m_thread;            // start() 创建的线程
+ bool m_started;                // 是否通过 start() 在新的线程中运行
+ bool m_accept_paused;          // 是否因为过载暂停了接受新连接
+ int m_cpu;                     // 事件循环绑定的 CPU, -1 表示不绑定
+ std::atomic<int64_t> m_deadline; // 平滑退出的期限, 0 表示没有在退出
+ bool m_accept_stopped;         // 平滑退出时已经停止接受新连接
+ bool m_drained;                // 平滑退出时所有连接都已经关闭, 事件循环结束
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include "router.h"
+
+#include <string.h>
+#include <strings.h>
+
+bool RouteRequest::header(HttpHeaderId id, const char** value, int* len) const {
+    for (int i = 0; i < header_count; ++i) {
+        if (headers[i].id == id) {
+            *value = base + headers[i].value.off;
+            *len = headers[i].value.len;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RouteRequest::header(const char* name, const char** value, int* len) const {
+    int name_len = strlen(name);
+    int id = http_headers.find(name, name_len);
+    if (id >= 0) {
+        return header((HttpHeaderId)id, value, len);
+    }
+    for (int i = 0; i < header_count; ++i) {
+        const HttpHeader& h = headers[i];
+        if (h.name.len == name_len && strncasecmp(base + h.name.off, name, name_len) == 0) {
+            *value = base + h.value.off;
+            *len = h.value.len;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RouteRequest::param(const char* name, const char** value, int* len) const {
+    for (int i = 0; i < param_count; ++i) {
+        if (strcmp(params[i].name, name) == 0) {
+            *value = params[i].value;
+            *len = params[i].len;
+            return true;
+        }
+    }
+    return false;
+}
+
+Router::Node::Node(): param(NULL), wildcard(NULL), allowed(0) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        routes[i] = NULL;
+    }
+}
+
+Router::Node::~Node() {
+    for (size_t i = 0; i < children.size(); ++i) {
+        delete children[i];
+    }
+    delete param;
+    delete wildcard;
+    for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        delete routes[i];
+    }
+}
+
+Router::Router(): m_root(new Node) {
+
+}
+
+Router::~Router() {
+    delete m_root;
+}
+
+Router* Router::get_instance() {
+    static Router router;
+    return &router;
+}
+
+bool Router::add(int method, const char* pattern, RouteHandler handler, void* arg, bool fast) {
+    Route* route = insert(method, pattern);
+    if (!route) {
+        return false;
+    }
+    route->handler = handler;
+    route->arg = arg;
+    route->fast = fast;
+    return true;
+}
+
+bool Router::add_proxy(int method, const char* pattern, UpstreamGroup* upstream) {
+    Route* route = insert(method, pattern);
+    if (!route) {
+        return false;
+    }
+    route->upstream = upstream;
+    return true;
+}
+
+Route* Router::insert(int method, const char* pattern) {
+    if (method < 0 || method >= HTTP_METHOD_COUNT || !pattern || pattern[0] != '/') {
+        return NULL;
+    }
+    Node* node = m_root;
+    const char* s = pattern;
+    int params = 0;
+    while (*s) {
+        if (*s == ':' || *s == '*') {
+            // 参数必须是完整的一段, ":name" 到 '/' 为止, "*name" 到模式的最后
+            const char* name = s + 1;
+            const char* name_end = *s == ':' ? name + strcspn(name, "/") : name + strlen(name);
+            if (s[-1] != '/' || name_end == name || memchr(name, '/', name_end - name) ||
+                ++params > RouteRequest::MAX_PARAMS) {
+                return NULL;
+            }
+            Node*& child = *s == ':' ? node->param : node->wildcard;
+            if (!child) {
+                child = new Node;
+                child->name.assign(name, name_end - name);
+            } else if (child->name.compare(0, std::string::npos, name, name_end - name) != 0) {
+                return NULL;
+            }
+            node = child;
+            s = name_end;
+            continue;
+        }
+
+        // 静态的部分到下一个参数为止, 和已有的子节点有共同前缀时沿着它向下走
+        const char* static_end = s + strcspn(s, ":*");
+        size_t index = node->indices.find(*s);
+        if (index == std::string::npos) {
+            Node* child = new Node;
+            child->prefix.assign(s, static_end - s);
+            node->indices += *s;
+            node->children.push_back(child);
+            node = child;
+            s = static_end;
+            continue;
+        }
+        Node* child = node->children[index];
+        size_t common = 0;
+        while (common < child->prefix.size() && s + common < static_end && child->prefix[common] == s[common]) {
+            ++common;
+        }
+        if (common < child->prefix.size()) {
+            // 只有一部分前缀相同: 把子节点拆成两个, 原来的内容都移到下面的节点中
+            Node* tail = new Node;
+            tail->prefix = child->prefix.substr(common);
+            tail->indices.swap(child->indices);
+            tail->children.swap(child->children);
+            tail->param = child->param;
+            tail->wildcard = child->wildcard;
+            tail->allowed = child->allowed;
+            for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+                tail->routes[i] = child->routes[i];
+                child->routes[i] = NULL;
+            }
+            child->prefix.resize(common);
+            child->indices.assign(1, tail->prefix[0]);
+            child->children.push_back(tail);
+            child->param = NULL;
+            child->wildcard = NULL;
+            child->allowed = 0;
+        }
+        node = child;
+        s += common;
+    }
+
+    if (node->routes[method]) {
+        return NULL;
+    }
+    Route* route = new Route;
+    route->handler = NULL;
+    route->arg = NULL;
+    route->fast = false;
+    route->upstream = NULL;
+    node->routes[method] = route;
+    node->allowed |= 1 << method;
+    return route;
+}
+
+const Route* Router::match(int method, const char* path, int len, RouteRequest* request, int* allowed) const {
+    Match m = { method, request, 0, 0, NULL };
+    match_node(m_root, path, path + len, &m);
+    if (request) {
+        request->param_count = m.route ? m.count : 0;
+    }
+    *allowed = m.allowed;
+    return m.route;
+}
+
+// 在 node 之下匹配路径剩下的部分 [p, end), 依次尝试静态子节点, 参数和 *
+bool Router::match_node(const Node* node, const char* p, const char* end, Match* m) const {
+    if (p == end && match_end(node, m)) {
+        return true;
+    }
+    if (p < end) {
+        size_t index = node->indices.find(*p);
+        if (index != std::string::npos) {
+            const Node* child = node->children[index];
+            size_t len = child->prefix.size();
+            if ((size_t)(end - p) >= len && memcmp(p, child->prefix.data(), len) == 0 &&
+                match_node(child, p + len, end, m)) {
+                return true;
+            }
+        }
+        if (node->param) {
+            const char* segment_end = find_byte(p, end, '/');
+            if (segment_end > p) {
+                int count = m->count;
+                capture(m, node->param, p, segment_end - p);
+                if (match_node(node->param, segment_end, end, m)) {
+                    return true;
+                }
+                m->count = count;
+            }
+        }
+    }
+    if (node->wildcard) {
+        int count = m->count;
+        capture(m, node->wildcard, p, end - p);
+        if (match_end(node->wildcard, m)) {
+            return true;
+        }
+        m->count = count;
+    }
+    return false;
+}
+
+// 路径在 node 结束: 有这个方法的路由就匹配成功, 否则记下这个路径允许的方法
+bool Router::match_end(const Node* node, Match* m) const {
+    if (node->routes[m->method]) {
+        m->route = node->routes[m->method];
+        return true;
+    }
+    m->allowed |= node->allowed;
+    return false;
+}
+
+// add() 保证一条路由的参数不超过 MAX_PARAMS 个
+void Router::capture(Match* m, const Node* node, const char* value, int len) const {
+    if (m->request) {
+        RouteParam& param = m->request->params[m->count];
+        param.name = node->name.c_str();
+        param.value = value;
+        param.len = len;
+    }
+    ++m->count;
+}
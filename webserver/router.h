@@ -0,0 +1,136 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "http_parser.h"
+#include "http_names.h"
+
+// 内置的请求处理函数 (例如 /metrics) 和反向代理的路由表, 没有匹配到任何路由的请求仍然按静态文件处理
+//
+// 路径模式是以 '/' 开头的字符串, 其中的一段可以是参数:
+// "/users/:id" 匹配 "/users/42" (id = "42"), 参数匹配一整段, 不能为空, 不包含 '/'
+// "/static/*path" 匹配 "/static/" 之后的所有内容 (可以为空), 只能出现在模式的最后
+// 路由保存在基数树 (radix trie) 中, 共同前缀只比较一次; 同一个位置上静态的段优先于参数, 参数优先于 *,
+// 优先的分支最后没有匹配时回溯尝试下一种
+// 路径按请求中的原样匹配 (不解码 %XX), 参数的值也是原样的
+//
+// 路由只在启动时 (创建事件循环和工作线程之前) 注册, 之后只读, 所以查找不需要加锁
+
+// 一个参数的名字和值, 值指向请求的读缓冲区, 不以 '\0' 结尾
+struct RouteParam {
+    const char* name;
+    const char* value;
+    int len;
+};
+
+// 处理函数看到的请求, 所有的指针都指向读缓冲区 (或者连接保存的请求体), 只在调用处理函数期间有效
+struct RouteRequest {
+    static const int MAX_PARAMS = 8;
+
+    int method;              // http_conn::METHOD
+    const char* path;        // 不含查询字符串, 没有解码
+    int path_len;
+    const char* query;       // '?' 之后的查询字符串, 没有时长度为 0
+    int query_len;
+    RouteParam params[MAX_PARAMS];
+    int param_count;
+    const char* body;        // 完整的请求体 (已经解码了 chunked)
+    int body_len;
+
+    const HttpHeader* headers; // 连接的头部索引
+    int header_count;
+    const char* base;          // 头部索引中的偏移量相对的位置 (请求的第一个字节)
+
+    // 查找头部字段, 常用的字段按 http_headers 中的编号查找, 不比较字符串
+    bool header(HttpHeaderId id, const char** value, int* len) const;
+    bool header(const char* name, const char** value, int* len) const;
+    // 查找名为 name 的参数
+    bool param(const char* name, const char** value, int* len) const;
+};
+
+// 从当前线程的 arena 分配的字符串, 处理完这个任务之后就失效了
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+// 处理函数填写的响应, 连接把它和 Content-Length, Date, Connection 一起放进写缓冲区
+struct RouteResponse {
+    int status;                // 必须是 http_statuses 中的状态码, 默认 200
+    const char* content_type;  // NULL 表示不带 Content-Type
+    ArenaString headers;       // 额外的头部字段, 每个字段以 "\r\n" 结尾
+    ArenaString body;
+
+    RouteResponse(): status(200), content_type("text/plain") {}
+};
+
+typedef void (*RouteHandler)(const RouteRequest& request, RouteResponse* response, void* arg);
+
+class UpstreamGroup;
+
+// 一个方法和路径模式对应的处理函数
+// fast 表示处理函数不会阻塞, 也足够快, 可以在事件循环的线程中直接调用 (快速路径), 否则总是交给线程池
+// upstream 不为 NULL 时是反向代理的路由: 请求被转发给这组上游服务器, 没有处理函数
+struct Route {
+    RouteHandler handler;
+    void* arg;
+    bool fast;
+    UpstreamGroup* upstream;
+};
+
+class Router {
+public:
+ static const off_t MAX_BODY = 64 * 1024;   // 交给处理函数的请求体保存在内存中, 超过这个长度时回复 413
+
+ static Router* get_instance();
+
+ // 注册路由, 模式的语法错误, 参数超过 RouteRequest::MAX_PARAMS 个,
+ // 或者和已有的路由冲突 (同一个位置上名字不同的参数, 同一个方法注册两次) 时返回 false
+ bool add(int method, const char* pattern, RouteHandler handler, void* arg, bool fast = false);
+ // 注册反向代理的路由, 匹配的请求转发给 upstream, 错误和 add 相同
+ bool add_proxy(int method, const char* pattern, UpstreamGroup* upstream);
+
+ // 查找 method 和 path 对应的路由, 参数填在 request->params 中 (request 为 NULL 时不需要参数)
+ // 没有找到时返回 NULL, 这时 *allowed 是路径匹配但方法不同的路由的方法 (1 << method 的位掩码), 0 表示路径不匹配任何路由
+ const Route* match(int method, const char* path, int len, RouteRequest* request, int* allowed) const;
+
+private:
+ Router();
+ ~Router();
+ Router(const Router&);
+ Router& operator=(const Router&);
+
+ // 基数树的节点, 到达一个节点时它的 prefix 已经匹配完了
+ struct Node {
+     std::string prefix;           // 静态的部分, 参数和 * 节点为空
+     std::string indices;          // 静态子节点 prefix 的第一个字节, 和 children 一一对应
+     std::vector<Node*> children;  // 静态子节点, 它们的 prefix 的第一个字节各不相同
+     Node* param;                  // ":name" 子节点
+     Node* wildcard;               // "*name" 子节点, 总是叶子
+     std::string name;             // 参数和 * 节点的名字
+     Route* routes[HTTP_METHOD_COUNT]; // 在这个节点结束的路由, 以方法为下标
+     int allowed;                  // routes 中有路由的方法的位掩码
+
+     Node();
+     ~Node();
+ };
+
+ struct Match {
+     int method;
+     RouteRequest* request;
+     int count;        // 已经捕获的参数数量
+     int allowed;
+     const Route* route;
+ };
+
+ Route* insert(int method, const char* pattern);   // 为 method 和 pattern 创建一个空的路由
+ bool match_node(const Node* node, const char* p, const char* end, Match* m) const;
+ bool match_end(const Node* node, Match* m) const;
+ void capture(Match* m, const Node* node, const char* value, int len) const;
+
+private:
+ Node* m_root;
+};
+
+#endif
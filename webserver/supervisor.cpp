@@ -0,0 +1,333 @@
+#include "supervisor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "file_cache.h"
+#include "http_conn.h"
+#include "log.h"
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+extern char** environ;
+
+const char* Supervisor::HANDOFF_ENV = "WEBSERVER_HANDOFF_FD";
+
+// 最多交给新进程预热的文件数量
+static const size_t HOT_PATHS = 1024;
+
+static void control_signals(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGHUP);
+}
+
+Supervisor* Supervisor::get_instance() {
+    static Supervisor instance;
+    return &instance;
+}
+
+// 由旧进程启动时环境变量中有交接用的 Unix socket, 取出之后就删掉, 不再传给之后 reload 启动的进程
+Supervisor::Supervisor(): m_handoff_fd(-1), m_argv(NULL), m_drain_timeout(30), m_draining(false),
+    m_exit(false), m_started(false) {
+    control_signals(&m_signals);
+    const char* handoff = getenv(HANDOFF_ENV);
+    if (handoff) {
+        m_handoff_fd = atoi(handoff);
+        unsetenv(HANDOFF_ENV);
+    }
+}
+
+Supervisor::~Supervisor() {
+    if (m_handoff_fd != -1) {
+        close(m_handoff_fd);
+    }
+}
+
+void Supervisor::block_signals() {
+    sigset_t set;
+    control_signals(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+bool Supervisor::receive_handoff(std::vector<int>* listeners, std::vector<std::string>* paths) {
+    // 旧进程出了问题时不要一直等下去
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    setsockopt(m_handoff_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // 第一条消息: 监听 socket 的数量, 监听 socket 本身在控制信息中
+    uint32_t count = 0;
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct iovec iov = { &count, sizeof(count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(m_handoff_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n != (ssize_t)sizeof(count)) {
+        LOG_ERROR("failed to receive listeners from the old process: %s", n < 0 ? strerror(errno) : "short message");
+        return false;
+    }
+
+    listeners->clear();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < fds; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            listeners->push_back(fd);
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) || count == 0 || listeners->size() != count) {
+        LOG_ERROR("expected %u listeners from the old process, got %d", count, (int)listeners->size());
+        for (size_t i = 0; i < listeners->size(); ++i) {
+            close((*listeners)[i]);
+        }
+        listeners->clear();
+        return false;
+    }
+
+    // 之后是热点文件的路径, 每行一个, 旧进程写完之后关闭写端
+    std::string data;
+    char buf[4096];
+    while ((n = read(m_handoff_fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    if (n < 0) {
+        LOG_ERROR("failed to receive hot files from the old process: %s", strerror(errno));
+        return false;
+    }
+    paths->clear();
+    size_t start = 0;
+    size_t end;
+    while ((end = data.find('\n', start)) != std::string::npos) {
+        paths->push_back(data.substr(start, end - start));
+        start = end + 1;
+    }
+    return true;
+}
+
+void Supervisor::handoff_ready() {
+    if (m_handoff_fd == -1) {
+        return;
+    }
+    char ready = 1;
+    if (write(m_handoff_fd, &ready, 1) != 1) {
+        LOG_WARN("failed to notify the old process: %s", strerror(errno));
+    }
+    close(m_handoff_fd);
+    m_handoff_fd = -1;
+}
+
+bool Supervisor::start(char** argv, const std::vector<Reactor*>& reactors, int drain_timeout) {
+    m_argv = argv;
+    m_reactors = reactors;
+    m_drain_timeout = drain_timeout;
+    if (pthread_create(&m_thread, NULL, worker, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+// 控制线程屏蔽了所有控制信号, 发给它的 SIGTERM 一直挂起, 直到被 sigwait 取走
+void Supervisor::stop() {
+    if (!m_started) {
+        return;
+    }
+    m_exit = true;
+    pthread_kill(m_thread, SIGTERM);
+    pthread_join(m_thread, NULL);
+    m_started = false;
+}
+
+void* Supervisor::worker(void* arg) {
+    Supervisor* supervisor = (Supervisor*)arg;
+    supervisor->run();
+    return supervisor;
+}
+
+void Supervisor::run() {
+    while (true) {
+        int sig = 0;
+        if (sigwait(&m_signals, &sig) != 0) {
+            continue;
+        }
+        if (m_exit) {
+            return;
+        }
+
+        const char* name = sig == SIGHUP ? "SIGHUP" : (sig == SIGINT ? "SIGINT" : "SIGTERM");
+        if (sig == SIGHUP) {
+            if (m_draining) {
+                LOG_WARN("received SIGHUP while shutting down, ignored");
+                continue;
+            }
+            LOG_INFO("received SIGHUP, starting a new process");
+            reload();
+        } else if (!m_draining) {
+            LOG_INFO("received %s, draining connections for up to %d seconds", name, m_drain_timeout);
+            drain(Reactor::now_ms() + m_drain_timeout * 1000LL);
+        } else {
+            // 退出期间再次收到退出信号: 不再等待, 马上关闭所有连接
+            LOG_WARN("received %s again, closing all connections", name);
+            drain(Reactor::now_ms());
+        }
+    }
+}
+
+void Supervisor::drain(int64_t deadline) {
+    m_draining = true;
+    http_conn::m_draining.store(true, std::memory_order_relaxed);
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        m_reactors[i]->stop(deadline);
+    }
+}
+
+void Supervisor::reload() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        LOG_ERROR("reload failed, socketpair: %s", strerror(errno));
+        return;
+    }
+    pid_t pid = spawn(sv[1]);
+    close(sv[1]);
+    if (pid == -1) {
+        LOG_ERROR("reload failed, fork: %s", strerror(errno));
+        close(sv[0]);
+        return;
+    }
+
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    bool ok = send_handoff(sv[0]) && wait_ready(sv[0]);
+    close(sv[0]);
+    if (!ok) {
+        // 新进程没有接管监听 socket, 旧进程继续提供服务
+        LOG_ERROR("reload failed, process %d did not start, keep serving", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    LOG_INFO("process %d took over the listeners, draining connections for up to %d seconds", (int)pid, m_drain_timeout);
+    drain(Reactor::now_ms() + m_drain_timeout * 1000LL);
+}
+
+// fork 之后子进程中只有当前线程, 其他线程持有的锁 (包括 malloc 的锁) 永远不会释放,
+// 所以 exec 需要的所有参数都在 fork 之前准备好, 子进程只调用异步信号安全的函数
+pid_t Supervisor::spawn(int handoff_fd) {
+    // 以路径启动时 exec 这个路径, 部署时替换的新版本就会生效; 否则 exec 当前进程的可执行文件
+    const char* path = strchr(m_argv[0], '/') ? m_argv[0] : "/proc/self/exe";
+    char handoff[64];
+    snprintf(handoff, sizeof(handoff), "%s=%d", HANDOFF_ENV, handoff_fd);
+    std::vector<char*> envp;
+    size_t prefix = strlen(HANDOFF_ENV);
+    for (char** env = environ; *env; ++env) {
+        if (strncmp(*env, HANDOFF_ENV, prefix) != 0 || (*env)[prefix] != '=') {
+            envp.push_back(*env);
+        }
+    }
+    envp.push_back(handoff);
+    envp.push_back(NULL);
+    int max_fd = sysconf(_SC_OPEN_MAX);
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    // 子进程: 继承来的文件描述符 (监听 socket, 连接, epoll, io_uring, 缓存的文件) 在 exec 时全部关闭,
+    // 只留下标准输入输出和交接用的 Unix socket; 内核不支持 close_range 时逐个设置
+    if (syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) != 0) {
+        for (int fd = 3; fd < max_fd; ++fd) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    fcntl(handoff_fd, F_SETFD, 0);
+    execve(path, m_argv, envp.data());
+    _exit(127);
+}
+
+bool Supervisor::send_handoff(int sock) {
+    std::vector<int> fds;
+    for (size_t i = 0; i < m_reactors.size(); ++i) {
+        if (m_reactors[i]->listener() != -1) {
+            fds.push_back(m_reactors[i]->listener());
+        }
+    }
+    if (fds.empty() || fds.size() > (size_t)MAX_LISTENERS) {
+        LOG_ERROR("cannot hand off %d listeners", (int)fds.size());
+        return false;
+    }
+
+    // 第一条消息: 监听 socket 的数量, 同时在控制信息中带上监听 socket
+    uint32_t count = fds.size();
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+    struct iovec iov = { &count, sizeof(count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds.data(), count * sizeof(int));
+    if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(count)) {
+        LOG_ERROR("failed to send listeners to the new process: %s", strerror(errno));
+        return false;
+    }
+
+    // 热点文件的路径, 每行一个, 最近使用的在前面
+    std::vector<std::string> paths = FileCache::get_instance()->hot_paths(HOT_PATHS);
+    std::string data;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (paths[i].find('\n') == std::string::npos) {
+            data += paths[i];
+            data += '\n';
+        }
+    }
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = write(sock, data.data() + sent, data.size() - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("failed to send hot files to the new process: %s", strerror(errno));
+            return false;
+        }
+        sent += n;
+    }
+    shutdown(sock, SHUT_WR);
+    return true;
+}
+
+// 新进程退出 (exec 失败或者初始化失败) 时读到 EOF, 超时也算失败
+bool Supervisor::wait_ready(int sock) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, HANDOFF_TIMEOUT * 1000);
+    } while (ret < 0 && errno == EINTR);
+    char ready = 0;
+    return ret > 0 && read(sock, &ready, 1) == 1;
+}
@@ -0,0 +1,71 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "reactor.h"
+
+// 进程级的控制: 信号处理, 平滑退出和不中断服务的 reload
+//
+// 所有线程都屏蔽 SIGTERM, SIGINT 和 SIGHUP, 只由一个控制线程通过 sigwait 同步地处理它们,
+// 所以处理信号时可以正常地加锁, 写日志, 调用任何函数
+// SIGTERM / SIGINT: 平滑退出, 事件循环不再接受新连接, 正在处理的请求在期限之内处理完, 之后 main 等待工作线程结束
+//                   退出期间再收到一次就不再等待, 马上关闭所有连接
+// SIGHUP: reload, fork 并 exec 可执行文件 (部署时已经替换成新版本), 通过 Unix socket 用 SCM_RIGHTS
+//         把所有监听 socket 交给新进程, 再把文件缓存中的热点文件路径发过去让新进程预热;
+//         新进程初始化完成之后回复一个字节, 旧进程才开始平滑退出, 任何一步失败都继续由旧进程提供服务
+// 监听 socket 一直是打开的, 内核队列中的新连接不会被丢弃, 只是改由新进程接受
+class Supervisor {
+public:
+ static const int MAX_LISTENERS = 253;      // 一次 SCM_RIGHTS 最多传递的文件描述符数量 (SCM_MAX_FD)
+ static const int HANDOFF_TIMEOUT = 10;     // 等待新进程完成初始化的最长时间 (秒)
+ static const char* HANDOFF_ENV;            // 新进程通过这个环境变量得到交接用的 Unix socket
+
+ static Supervisor* get_instance();
+
+ // 在创建任何线程之前调用, 之后创建的线程都继承这个信号掩码
+ static void block_signals();
+
+ // 当前进程是否是由旧进程 reload 启动的
+ bool inherited() const { return m_handoff_fd != -1; }
+ // 新进程: 接收旧进程的监听 socket (每个事件循环一个) 和热点文件的路径
+ bool receive_handoff(std::vector<int>* listeners, std::vector<std::string>* paths);
+ // 新进程: 所有事件循环都初始化好了, 通知旧进程开始退出; 不是 reload 启动的进程什么都不做
+ void handoff_ready();
+
+ // 启动控制线程, argv 是 main 的参数, reload 时原样传给新进程
+ bool start(char** argv, const std::vector<Reactor*>& reactors, int drain_timeout);
+ // 所有事件循环都结束之后调用, 结束控制线程
+ void stop();
+
+private:
+ Supervisor();
+ ~Supervisor();
+
+ static void* worker(void* arg);
+ void run();
+ void drain(int64_t deadline);   // 让所有事件循环开始平滑退出
+ void reload();
+ // reload 的各个步骤, 失败时返回 false
+ pid_t spawn(int handoff_fd);    // fork 并 exec 新进程, handoff_fd 是新进程那一端的 Unix socket
+ bool send_handoff(int sock);    // 把监听 socket 和热点文件发给新进程
+ bool wait_ready(int sock);      // 等待新进程初始化完成
+
+private:
+ sigset_t m_signals;             // 控制线程处理的信号
+ int m_handoff_fd;               // 新进程中和旧进程交接用的 Unix socket, 其他情况为 -1
+ char** m_argv;
+ std::vector<Reactor*> m_reactors;
+ int m_drain_timeout;            // 平滑退出的期限 (秒)
+ bool m_draining;                // 已经开始平滑退出, 只在控制线程中访问
+ std::atomic<bool> m_exit;       // 让控制线程退出
+ pthread_t m_thread;
+ bool m_started;
+};
+
+#endif
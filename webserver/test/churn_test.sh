@@ -0,0 +1,80 @@
+#!/bin/bash
+# 多个事件循环同时接受和关闭大量的连接: 短连接和保持连接的压测交替进行,
+# 之后服务器必须还在运行, 所有连接都已经关闭 (webserver_connections 只剩查询指标的这一个), 没有停在 CLOSE_WAIT 的 socket
+#
+# 用法: test/churn_test.sh [server] [http_bench], 默认使用 make 生成的 ./server 和 ./http_bench
+# 环境变量: PORT (默认 19006), BACKENDS (默认 "epoll uring coro"), ROUNDS (默认 4), SECONDS_PER_ROUND (默认 2)
+
+cd "$(dirname "$0")/.."
+SERVER=${1:-./server}
+BENCH=${2:-./http_bench}
+PORT=${PORT:-19006}
+BACKENDS=${BACKENDS:-"epoll uring coro"}
+ROUNDS=${ROUNDS:-4}
+SECONDS_PER_ROUND=${SECONDS_PER_ROUND:-2}
+
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+echo "<h1>hello</h1>" > "$ROOT/index.html"
+head -c 100000 /dev/zero > "$ROOT/mid.bin"
+
+# 通过 /dev/tcp 读取指标, 输出 webserver_connections 的值
+connections() {
+    exec 3<>/dev/tcp/127.0.0.1/$PORT || return 1
+    printf 'GET /metrics HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n' >&3
+    awk '$1 == "webserver_connections" { print $2 }' <&3
+    exec 3<&-
+}
+
+failed=0
+for backend in $BACKENDS; do
+    "$SERVER" $PORT -r "$ROOT" -e $backend -n 2 -l warn > "$ROOT/server.log" 2>&1 &
+    pid=$!
+    sleep 0.5
+    if ! kill -0 $pid 2> /dev/null; then
+        # 内核不支持 io_uring, 或者没有用 C++20 编译 (协程事件循环)
+        echo "SKIP $backend: $(head -1 "$ROOT/server.log")"
+        continue
+    fi
+
+    result=ok
+    for ((i = 0; i < ROUNDS; ++i)); do
+        mode=""
+        if ((i % 2 == 0)); then
+            mode=-K
+        fi
+        "$BENCH" -p $PORT -c 200 -t 2 -d $SECONDS_PER_ROUND -u "/index.html:4,/mid.bin:1" $mode > /dev/null 2>&1
+        if ! kill -0 $pid 2> /dev/null; then
+            wait $pid
+            result="server exited with status $? in round $i"
+            break
+        fi
+    done
+
+    if [ "$result" = ok ]; then
+        # 压测工具退出之后客户端的 socket 都关闭了, 服务器应该很快关闭它们
+        for ((i = 0; i < 20; ++i)); do
+            count=$(connections)
+            if [ "$count" = 1 ]; then
+                break
+            fi
+            sleep 0.2
+        done
+        stuck=$(ss -tn state close-wait "( sport = :$PORT )" 2> /dev/null | tail -n +2 | wc -l)
+        if [ "$count" != 1 ]; then
+            result="webserver_connections is $count after the clients closed"
+        elif [ "$stuck" != 0 ]; then
+            result="$stuck sockets stuck in CLOSE_WAIT"
+        fi
+        kill -9 $pid
+        wait $pid 2> /dev/null
+    fi
+
+    if [ "$result" = ok ]; then
+        echo "PASS $backend"
+    else
+        echo "FAIL $backend: $result"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,130 @@
+#!/bin/bash
+# 条件请求和 Range: 在同一个 keep-alive 连接上依次发送请求, 检查状态码, Content-Length 和响应体的每个字节
+# 304 (If-None-Match, If-Modified-Since), 206 (单个区间, 后缀区间, 多个区间), If-Range 匹配和不匹配, 416,
+# 每个请求再用 HEAD 发送一次: 状态码和 Content-Length 和 GET 一样, 但是没有响应体, 否则下一个响应的开头就对不上了
+#
+# 用法: test/http_test.sh [server], 默认使用 make 生成的 ./server
+# 环境变量: PORT (默认 19011), BACKENDS (默认 "epoll uring coro")
+
+cd "$(dirname "$0")/.."
+SERVER=${1:-./server}
+PORT=${PORT:-19011}
+BACKENDS=${BACKENDS:-"epoll uring coro"}
+
+if ! command -v python3 > /dev/null; then
+    echo "SKIP http: python3 is required"
+    exit 0
+fi
+
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+for ((i = 0; i < 10; ++i)); do
+    printf '0123456789'
+done > "$ROOT/a.txt"
+
+# 客户端: 出错时输出原因并以 1 退出
+cat > "$ROOT/client.py" << 'EOF'
+import socket, sys
+
+port = int(sys.argv[1])
+data = open(sys.argv[2], 'rb').read()
+size = len(data)
+sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+reader = sock.makefile('rb')
+
+def request(method, headers):
+    lines = ['%s /a.txt HTTP/1.1' % method, 'Host: test'] + ['%s: %s' % h for h in headers]
+    sock.sendall(('\r\n'.join(lines) + '\r\n\r\n').encode())
+    status_line = reader.readline()
+    if not status_line.startswith(b'HTTP/1.1 '):
+        sys.exit('%s %s: bad status line %r' % (method, headers, status_line[:60]))
+    fields = {}
+    while True:
+        line = reader.readline()
+        if line in (b'\r\n', b''):
+            break
+        name, value = line.decode().split(':', 1)
+        fields[name.strip().lower()] = value.strip()
+    length = int(fields.get('content-length', '0'))
+    body = reader.read(length) if method == 'GET' else b''
+    return int(status_line.split()[1]), fields, length, body
+
+def check(name, headers, status, body=None, content_range=None):
+    for method in ('GET', 'HEAD'):
+        got_status, fields, length, got_body = request(method, headers)
+        what = '%s %s' % (method, name)
+        if got_status != status:
+            sys.exit('%s: status %d, expected %d' % (what, got_status, status))
+        if body is not None and length != len(body):
+            sys.exit('%s: Content-Length %d, expected %d' % (what, length, len(body)))
+        if method == 'GET' and body is not None and got_body != body:
+            sys.exit('%s: wrong body %r' % (what, got_body[:60]))
+        if content_range and fields.get('content-range') != content_range:
+            sys.exit('%s: Content-Range %r, expected %r' % (what, fields.get('content-range'), content_range))
+    return fields
+
+def multipart(boundary, ranges):
+    body = b''
+    for first, last in ranges:
+        body += b'\r\n--%s\r\nContent-Type: text/plain; charset=utf-8\r\nContent-Range: bytes %d-%d/%d\r\n\r\n' % (
+            boundary, first, last, size) + data[first:last + 1]
+    return body + b'\r\n--%s--\r\n' % boundary
+
+fields = check('whole file', [], 200, data)
+etag = fields['etag']
+modified = fields['last-modified']
+
+check('If-None-Match', [('If-None-Match', etag)], 304, b'')
+check('If-None-Match list', [('If-None-Match', '"other", ' + etag)], 304, b'')
+check('If-Modified-Since', [('If-Modified-Since', modified)], 304, b'')
+check('If-None-Match mismatch', [('If-None-Match', '"other"')], 200, data)
+
+check('single range', [('Range', 'bytes=10-19')], 206, data[10:20], 'bytes 10-19/%d' % size)
+check('open range', [('Range', 'bytes=95-')], 206, data[95:], 'bytes 95-99/%d' % size)
+check('suffix range', [('Range', 'bytes=-5')], 206, data[-5:], 'bytes 95-99/%d' % size)
+
+fields = check('multiple ranges', [('Range', 'bytes=0-1,5-9')], 206)
+content_type = fields.get('content-type', '')
+if not content_type.startswith('multipart/byteranges; boundary='):
+    sys.exit('multiple ranges: Content-Type %r' % content_type)
+boundary = content_type.split('=', 1)[1].encode()
+check('multiple ranges', [('Range', 'bytes=0-1,5-9')], 206, multipart(boundary, [(0, 1), (5, 9)]))
+
+check('If-Range match', [('Range', 'bytes=0-4'), ('If-Range', etag)], 206, data[0:5], 'bytes 0-4/%d' % size)
+check('If-Range mismatch', [('Range', 'bytes=0-4'), ('If-Range', '"other"')], 200, data)
+check('If-Range date', [('Range', 'bytes=0-4'), ('If-Range', modified)], 206, data[0:5])
+
+check('unsatisfiable range', [('Range', 'bytes=200-')], 416, None, 'bytes */%d' % size)
+
+# 最后再取一次整个文件, 确认前面的响应都没有多出字节
+check('whole file again', [], 200, data)
+EOF
+
+failed=0
+for backend in $BACKENDS; do
+    "$SERVER" $PORT -r "$ROOT" -e $backend -l warn > "$ROOT/server.log" 2>&1 &
+    pid=$!
+    sleep 0.5
+    if ! kill -0 $pid 2> /dev/null && grep -q "Address already in use" "$ROOT/server.log"; then
+        # 上一个事件循环的监听 socket 可能还没有完全释放 (io_uring 异步地关闭文件)
+        sleep 1
+        "$SERVER" $PORT -r "$ROOT" -e $backend -l warn > "$ROOT/server.log" 2>&1 &
+        pid=$!
+        sleep 0.5
+    fi
+    if ! kill -0 $pid 2> /dev/null; then
+        # 内核不支持 io_uring, 或者没有用 C++20 编译 (协程事件循环)
+        echo "SKIP $backend: $(head -1 "$ROOT/server.log")"
+        continue
+    fi
+
+    if result=$(python3 "$ROOT/client.py" $PORT "$ROOT/a.txt" 2>&1); then
+        echo "PASS http $backend"
+    else
+        echo "FAIL http $backend: $result"
+        failed=1
+    fi
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+done
+exit $failed
@@ -0,0 +1,183 @@
+#!/bin/bash
+# 反向代理: 在回环地址上启动两个上游服务器 (python3), 检查三种负载均衡策略,
+# 上游服务器不可用时的故障转移 (连续失败 3 次之后摘除), 以及 chunked 响应体的转发
+#
+# 用法: test/proxy_test.sh [server], 默认使用 make 生成的 ./server
+# 环境变量: PORT (默认 19007, 上游服务器使用 PORT+1 和 PORT+2, PORT+3 上没有服务器), BACKENDS (默认 "epoll uring coro")
+
+cd "$(dirname "$0")/.."
+SERVER=${1:-./server}
+PORT=${PORT:-19007}
+BACKENDS=${BACKENDS:-"epoll uring coro"}
+UP1=$((PORT + 1))
+UP2=$((PORT + 2))
+DEAD=$((PORT + 3))
+
+if ! command -v python3 > /dev/null || ! command -v curl > /dev/null; then
+    echo "SKIP proxy: python3 and curl are required"
+    exit 0
+fi
+
+ROOT=$(mktemp -d)
+upstreams=""
+trap 'kill -9 $upstreams 2> /dev/null; rm -rf "$ROOT"' EXIT
+
+# 上游服务器: 普通的请求回复自己的端口号; 路径中有 /slow 时过 2 秒才回复, 用来占住一个连接;
+# 有 /chunk 时用 chunked 编码 (带扩展和 trailer) 回复 chunk.bin 的内容
+cat > "$ROOT/upstream.py" << 'EOF'
+import socket, sys, threading, time
+port = int(sys.argv[1])
+data = open(sys.argv[2], 'rb').read()
+
+def handle(conn):
+    f = conn.makefile('rb')
+    try:
+        while True:
+            line = f.readline()
+            if not line:
+                return
+            path = line.split()[1].decode()
+            length = 0
+            while True:
+                header = f.readline()
+                if header in (b'\r\n', b''):
+                    break
+                name, value = header.split(b':', 1)
+                if name.strip().lower() == b'content-length':
+                    length = int(value)
+            f.read(length)
+            if '/chunk' in path:
+                conn.sendall(b'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n')
+                for i in range(0, len(data), 7000):
+                    part = data[i:i + 7000]
+                    conn.sendall(b'%x;ext=1\r\n' % len(part) + part + b'\r\n')
+                conn.sendall(b'0\r\nX-Trailer: 1\r\n\r\n')
+                continue
+            if '/slow' in path:
+                time.sleep(2)
+            body = b'%d\n' % port
+            conn.sendall(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n' % len(body) + body)
+    except Exception:
+        pass
+    finally:
+        conn.close()
+
+server = socket.socket()
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(('127.0.0.1', port))
+server.listen(128)
+while True:
+    conn, _ = server.accept()
+    threading.Thread(target=handle, args=(conn,), daemon=True).start()
+EOF
+
+head -c 300000 /dev/urandom > "$ROOT/chunk.bin"
+for up in $UP1 $UP2; do
+    python3 "$ROOT/upstream.py" $up "$ROOT/chunk.bin" &
+    upstreams="$upstreams $!"
+    disown
+done
+sleep 0.5
+
+# 依次发送 count 个请求, 输出回复的端口号
+fetch() {
+    local path=$1 count=$2
+    for ((j = 0; j < count; ++j)); do
+        curl -s -m 5 "http://127.0.0.1:$PORT$path"
+    done
+}
+
+# 输出某个指标的值
+metric() {
+    curl -s -m 5 "http://127.0.0.1:$PORT/metrics" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# 用事件循环 $backend 启动服务器, 进程号保存在 pid 中
+start_server() {
+    "$SERVER" $PORT -r "$ROOT" -e $backend -n 1 -l error -M /metrics \
+        -X "/rr/*p=127.0.0.1:$UP1,127.0.0.1:$UP2" \
+        -X "/least/*p=least@127.0.0.1:$UP1,127.0.0.1:$UP2" \
+        -X "/hash/*p=hash@127.0.0.1:$UP1,127.0.0.1:$UP2" \
+        -X "/fail/*p=127.0.0.1:$DEAD,127.0.0.1:$UP1" \
+        -X "/chunk/*p=127.0.0.1:$UP2" > "$ROOT/server.log" 2>&1 &
+    pid=$!
+    sleep 0.5
+}
+
+failed=0
+for backend in $BACKENDS; do
+    start_server
+    if ! kill -0 $pid 2> /dev/null && grep -q "Address already in use" "$ROOT/server.log"; then
+        # 上一个事件循环的监听 socket 可能还没有完全释放 (io_uring 异步地关闭文件)
+        sleep 1
+        start_server
+    fi
+    if ! kill -0 $pid 2> /dev/null; then
+        # 内核不支持 io_uring, 或者没有用 C++20 编译 (协程事件循环)
+        echo "SKIP $backend: $(head -1 "$ROOT/server.log")"
+        continue
+    fi
+
+    result=ok
+    # 轮询: 两台服务器各一半
+    rr=$(fetch /rr/x 8 | sort | uniq -c | awk '{ print $1 }' | tr '\n' ' ')
+    if [ "$rr" != "4 4 " ]; then
+        result="round robin split 8 requests as: $rr"
+    fi
+
+    # 最少连接: 一台服务器被 /slow 占住时, 其他请求都交给另一台
+    if [ "$result" = ok ]; then
+        curl -s -m 5 -o "$ROOT/slow.out" "http://127.0.0.1:$PORT/least/slow" &
+        slow=$!
+        sleep 0.5
+        least=$(fetch /least/x 4 | sort -u | tr '\n' ' ')
+        wait $slow
+        busy=$(cat "$ROOT/slow.out")
+        if [ -z "$busy" ] || [ "$least" != "$((UP1 + UP2 - busy)) " ]; then
+            result="least connections sent requests to \"$least\" while $busy was busy"
+        fi
+    fi
+
+    # 一致性哈希: 同一个客户端总是落在同一台服务器上
+    if [ "$result" = ok ]; then
+        hash=$(fetch /hash/x 6 | sort -u | wc -l)
+        if [ "$hash" != 1 ]; then
+            result="hash spread one client over $hash upstream servers"
+        fi
+    fi
+
+    # 故障转移: 每个请求都由可用的服务器回复, 不可用的服务器失败 3 次之后被摘除, 不再尝试
+    if [ "$result" = ok ]; then
+        errors=$(metric webserver_upstream_errors_total)
+        answers=$(fetch /fail/x 10 | sort | uniq -c | awk '{ print $1, $2 }')
+        errors=$(($(metric webserver_upstream_errors_total) - errors))
+        up=$(metric "webserver_upstream_up{route=\"/fail/*p\",upstream=\"127.0.0.1:$DEAD\"}")
+        if [ "$answers" != "10 $UP1" ]; then
+            result="failover answers: $answers"
+        elif [ "$errors" != 3 ] || [ "$up" != 0 ]; then
+            result="dead upstream failed $errors times, up=$up"
+        fi
+    fi
+
+    # chunked 响应体: 客户端收到的内容和上游发送的完全一样, 之后连接还能继续使用
+    if [ "$result" = ok ]; then
+        curl -s -m 5 -o "$ROOT/chunk.out" "http://127.0.0.1:$PORT/chunk/a" -o "$ROOT/chunk2.out" "http://127.0.0.1:$PORT/chunk/b"
+        if ! cmp -s "$ROOT/chunk.out" "$ROOT/chunk.bin" || ! cmp -s "$ROOT/chunk2.out" "$ROOT/chunk.bin"; then
+            result="chunked relay corrupted the response body"
+        fi
+    fi
+
+    if ! kill -0 $pid 2> /dev/null; then
+        result="server exited"
+    fi
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+
+    if [ "$result" = ok ]; then
+        echo "PASS proxy $backend"
+    else
+        echo "FAIL proxy $backend: $result"
+        failed=1
+    fi
+done
+exit $failed
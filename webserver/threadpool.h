@@ -2,22 +2,38 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
 #include <exception>
-#include <cstdio>
+#include <atomic>
+#include <vector>
 
 #include "locker.h"
+#include "workqueue.h"
+#include "arena.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "log.h"
 
 // 模版类的定义和实现需要放在一个文件中
 
 // 线程池类, 定位成模版类是为了代码的复用, 模版参数就是任务类
-template <typename T>
+// 第二个模版参数是请求队列的实现 (见 workqueue.h), 默认是互斥锁 + 信号量保护的 std::list
+// 任务类需要有 process() 函数和 uint64_t m_enqueue_time 成员, 后者用来统计在队列中等待的时间
+// process() 可以从 Arena::local() 分配临时内存, 每个任务处理完之后工作线程会清空自己的 arena
+template <typename T, typename Queue = ListQueue<T> >
 class Threadpool {
 public:
- Threadpool(int thread_number = 8, int max_request = 10000);
+ // cpus 不为空时, 第 i 个工作线程绑定到 cpus[i % cpus.size()] 上
+ Threadpool(int thread_number = 8, int max_request = 10000, const std::vector<int>& cpus = std::vector<int>());
  ~Threadpool();
- bool append(T* request);
- void run();
+ bool append(T* request, int hint = 0); // hint 是提交者的编号, 工作窃取队列用它选择首选的工作线程
+ void run(int id);
+ int thread_number() const { return m_thread_number; }
+ int max_requests() const { return m_max_requests; }
+ int queue_size() { return m_workqueue.size(); } // 队列中等待处理的请求数量, 近似值
+ WorkerStats worker_stats(int id) const { return m_workqueue.stats(id); } // 只有 StealingQueue 支持
+ // 停止所有工作线程并等待它们结束, 正在处理的请求会先处理完, 队列中剩下的请求不再处理
+ // 调用之前应该先让事件循环停止提交新的请求
+ void stop();
 
 private:
  // 需要设置为静态函数, 因为函数传入thread只能有一个参数, 如果是成员函数的话就会有两个参数 (this, arg)
@@ -27,18 +43,21 @@ private:
  int m_thread_number;           // 线程池的数量
  pthread_t* m_threads;          // 线程池数组的大小
  int m_max_requests;            // 请求队列中最多被允许的等待处理的请求数量
- std::list<T*> m_workqueue;     // 供所有线程共享的请求队列
- Locker m_queue_locker;         // 请求队列的互斥锁
- Sem m_queue_stat;              // 信号量用来判断是否有任务需要处理
- bool m_stop;                   // 是否结束线程
+ Queue m_workqueue;             // 供所有线程共享的请求队列
+ std::atomic<bool> m_stop;      // 是否结束线程
+ std::atomic<int> m_next_id;    // 分配给下一个启动的工作线程的编号
+ std::vector<int> m_cpus;       // 工作线程绑定的 CPU, 为空表示不绑定
 };
 
-template <typename T>
-Threadpool<T>::Threadpool(int thread_number, int max_request): 
+template <typename T, typename Queue>
+Threadpool<T, Queue>::Threadpool(int thread_number, int max_request, const std::vector<int>& cpus): 
     m_thread_number(thread_number), 
+    m_threads(NULL),
     m_max_requests(max_request), 
-    m_stop(false), 
-    m_threads(NULL) {
+    m_workqueue(thread_number, max_request),
+    m_stop(false),
+    m_next_id(0),
+    m_cpus(cpus) {
         if ((thread_number <= 0) || (max_request <= 0)) {
             throw std::exception();
         }
@@ -49,69 +68,77 @@ Threadpool<T>::Threadpool(int thread_number, int max_request):
             throw std::exception();
         }
 
-        // 创建 thread_number 个线程, 并将他们设置为线程分离
+        // 创建 thread_number 个线程, stop() 时等待它们结束
         for (int i = 0; i < thread_number; ++i) {
-            printf("create the %d-th thread\n", i);
+            LOG_INFO("create the %d-th thread", i);
 
             // 最后一个参数是 threadpool, 因为 worker 作为静态函数是不能访问对象的成员的
             // 所以可以把 this 作为 worker 的参数传进去
             if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-              delete[] m_threads;
-              throw std::exception();
-            }
-
-            if (pthread_detach(m_threads[i])) {
-              delete[] m_threads;
+              m_thread_number = i;
+              stop();
               throw std::exception();
             }
         }
 }
 
-template <typename T>
-Threadpool<T>::~Threadpool() {
-    delete[] m_threads;
-    m_stop = true;
+template <typename T, typename Queue>
+Threadpool<T, Queue>::~Threadpool() {
+    stop();
 }
 
-template <typename T>
-bool Threadpool<T>::append(T* request) {
-    m_queue_locker.lock();
-    if (m_workqueue.size() > m_max_requests) {
-        m_queue_locker.unlock();
-        return false;
+template <typename T, typename Queue>
+void Threadpool<T, Queue>::stop() {
+    if (!m_threads) {
+        return;
+    }
+    m_stop = true;
+    // 睡眠中的线程被叫醒之后取不到请求, 回到循环开头看到 m_stop 就退出
+    m_workqueue.wake_all();
+    for (int i = 0; i < m_thread_number; ++i) {
+        pthread_join(m_threads[i], NULL);
     }
+    delete[] m_threads;
+    m_threads = NULL;
+}
 
-    m_workqueue.push_back(request);
-    m_queue_locker.unlock();
-    m_queue_stat.post(); // 信号通知有新的请求进去队列
-    return true; 
+template <typename T, typename Queue>
+bool Threadpool<T, Queue>::append(T* request, int hint) {
+    // 队列自己负责 m_max_requests 的限制, 队列满时返回 false
+    request->m_enqueue_time = metrics_now();
+    return m_workqueue.push(request, hint);
 }
 
-template <typename T>
-void* Threadpool<T>::worker(void* arg) {
+template <typename T, typename Queue>
+void* Threadpool<T, Queue>::worker(void* arg) {
     Threadpool *pool = (Threadpool *)arg;
-    pool->run();
+    pool->run(pool->m_next_id++);
     return pool;
 }
 
-template <typename T>
-void Threadpool<T>::run() {
-    while (!m_stop) {
-        m_queue_stat.wait(); // sem 表示消息队列中如果没有任务, 就会阻塞在这里, 防止循环空转
-        m_queue_locker.lock();
-        if (m_workqueue.empty()) { // 这里的判断优点多余, 但是可以用来 unlock()
-            m_queue_locker.unlock();
-            continue;
+template <typename T, typename Queue>
+void Threadpool<T, Queue>::run(int id) {
+    // 先绑定 CPU 再分配线程自己的数据, 这样它们都在本地的 NUMA 节点上
+    if (!m_cpus.empty()) {
+        int cpu = m_cpus[id % m_cpus.size()];
+        if (!pin_thread(cpu)) {
+            LOG_WARN("failed to pin worker %d to cpu %d", id, cpu);
         }
-
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queue_locker.unlock();
+    }
+    Arena* arena = Arena::local();
+    while (!m_stop) {
+        // 没有请求时阻塞在队列中, 防止循环空转
+        T* request = m_workqueue.pop(id);
         if (!request) {
             continue;
         }
 
+        uint64_t start = metrics_now();
+        metric_queue_wait.observe(start - request->m_enqueue_time);
         request->process();
+        // 任务中从 arena 分配的临时内存到这里就都不再使用了
+        arena->reset();
+        metric_task_time.observe(metrics_now() - start);
     }
 }
 
@@ -0,0 +1,150 @@
+#include "timer_wheel.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+// 把 node 插入到哨兵结点 head 的前面, 也就是链表的尾部
+static void list_add_tail(TimerNode* head, TimerNode* node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_del(TimerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+TimerWheel::TimerWheel(int tick_ms): m_tick_ms(tick_ms), m_timerfd(-1), m_now(0) {
+    for (int i = 0; i < WHEEL0_SIZE; ++i) {
+        m_wheel0[i].prev = m_wheel0[i].next = &m_wheel0[i];
+    }
+    for (int i = 0; i < WHEEL1_SIZE; ++i) {
+        m_wheel1[i].prev = m_wheel1[i].next = &m_wheel1[i];
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    if (m_timerfd != -1) {
+        close(m_timerfd);
+    }
+}
+
+int TimerWheel::init() {
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerfd == -1) {
+        return -1;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = m_tick_ms / 1000;
+    spec.it_interval.tv_nsec = (m_tick_ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(m_timerfd, 0, &spec, NULL) == -1) {
+        close(m_timerfd);
+        m_timerfd = -1;
+        return -1;
+    }
+    return m_timerfd;
+}
+
+void TimerWheel::add(TimerNode* node, int timeout_ms) {
+    if (node->linked()) {
+        list_del(node);
+    }
+    unsigned long ticks = (timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    node->expire = m_now + ticks;
+    link(node);
+}
+
+void TimerWheel::shorten(TimerNode* node, int timeout_ms) {
+    unsigned long ticks = (timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    if (node->linked() && node->expire > m_now + ticks) {
+        add(node, timeout_ms);
+    }
+}
+
+void TimerWheel::del(TimerNode* node) {
+    if (node->linked()) {
+        list_del(node);
+    }
+}
+
+void TimerWheel::link(TimerNode* node) {
+    unsigned long delta = node->expire - m_now;
+    if (node->expire < m_now) {
+        // 已经过期的结点 (只会在重新分配时出现), 放到下一个 tick 处理
+        node->expire = m_now + 1;
+        delta = 1;
+    }
+    if (delta < (unsigned long)WHEEL0_SIZE) {
+        list_add_tail(&m_wheel0[node->expire & (WHEEL0_SIZE - 1)], node);
+        return;
+    }
+    // 超过时间轮能表示的最大时间的定时器, 截断到最大时间
+    unsigned long max_delta = (unsigned long)WHEEL0_SIZE * (WHEEL1_SIZE - 1);
+    if (delta > max_delta) {
+        node->expire = m_now + max_delta;
+    }
+    list_add_tail(&m_wheel1[(node->expire >> WHEEL0_BITS) & (WHEEL1_SIZE - 1)], node);
+}
+
+void TimerWheel::tick(TimerCallback cb, void* arg) {
+    ++m_now;
+
+    // 第 0 级转完一圈, 把第 1 级当前槽中的结点重新分配到第 0 级
+    if ((m_now & (WHEEL0_SIZE - 1)) == 0) {
+        TimerNode* head = &m_wheel1[(m_now >> WHEEL0_BITS) & (WHEEL1_SIZE - 1)];
+        while (head->next != head) {
+            TimerNode* node = head->next;
+            list_del(node);
+            link(node);
+        }
+    }
+
+    // 处理第 0 级当前槽中所有到期的结点
+    // 回调中可能会重新添加或者删除定时器, 所以每次都从链表头重新取
+    TimerNode* head = &m_wheel0[m_now & (WHEEL0_SIZE - 1)];
+    while (head->next != head) {
+        TimerNode* node = head->next;
+        list_del(node);
+        cb(node, arg);
+    }
+}
+
+void TimerWheel::for_each(TimerCallback cb, void* arg) {
+    TimerNode* heads[WHEEL0_SIZE + WHEEL1_SIZE];
+    for (int i = 0; i < WHEEL0_SIZE; ++i) {
+        heads[i] = &m_wheel0[i];
+    }
+    for (int i = 0; i < WHEEL1_SIZE; ++i) {
+        heads[WHEEL0_SIZE + i] = &m_wheel1[i];
+    }
+    for (int i = 0; i < WHEEL0_SIZE + WHEEL1_SIZE; ++i) {
+        // 先取出下一个结点, 回调可能会把当前结点从链表中删除或者移到别的槽
+        // (移到还没有遍历的槽时会被再访问一次)
+        TimerNode* node = heads[i]->next;
+        while (node != heads[i]) {
+            TimerNode* next = node->next;
+            cb(node, arg);
+            node = next;
+        }
+    }
+}
+
+void TimerWheel::advance(TimerCallback cb, void* arg) {
+    uint64_t expirations = 0;
+    if (::read(m_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    // 事件循环繁忙时 timerfd 可能已经触发了多次, 每一次都要让时间前进一个 tick
+    for (uint64_t i = 0; i < expirations; ++i) {
+        tick(cb, arg);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+
+// 定时器结点, 嵌入到需要超时的对象中 (例如 http_conn), 不需要额外分配内存
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;
+    unsigned long expire;  // 到期的时间 (以 tick 为单位)
+    void* data;            // 定时器的拥有者
+
+    TimerNode(): prev(NULL), next(NULL), expire(0), data(NULL) {}
+    bool linked() const { return prev != NULL; }
+};
+
+// 到期回调, arg 是调用 advance() 时传入的参数
+typedef void (*TimerCallback)(TimerNode* node, void* arg);
+
+// 两级的分层时间轮, 由 timerfd 驱动, 每个事件循环一个, 只在事件循环的线程中使用
+// 第 0 级有 256 个槽, 每个槽一个 tick; 第 1 级有 64 个槽, 每个槽 256 个 tick
+// 第 0 级转完一圈时把第 1 级对应槽中的结点重新分配到第 0 级
+// 添加, 刷新和删除定时器都只是双向链表的操作, 时间复杂度 O(1)
+class TimerWheel {
+public:
+ static const int WHEEL0_BITS = 8;
+ static const int WHEEL1_BITS = 6;
+ static const int WHEEL0_SIZE = 1 << WHEEL0_BITS;
+ static const int WHEEL1_SIZE = 1 << WHEEL1_BITS;
+
+ explicit TimerWheel(int tick_ms = 100);
+ ~TimerWheel();
+
+ int init();                                   // 创建并启动 timerfd, 返回它的文件描述符, 失败返回 -1
+ int fd() const { return m_timerfd; }
+ void add(TimerNode* node, int timeout_ms);    // 添加定时器, 如果已经存在则刷新它的到期时间
+ void shorten(TimerNode* node, int timeout_ms); // 已经存在的定时器如果晚于 timeout_ms 之后到期, 就提前到 timeout_ms 之后
+ void del(TimerNode* node);                    // 删除定时器, 不存在时什么都不做
+ void advance(TimerCallback cb, void* arg);    // timerfd 可读时调用, 对所有到期的定时器调用 cb
+ void for_each(TimerCallback cb, void* arg);   // 对所有的定时器调用 cb, 回调中可以删除或者重新添加当前的定时器
+
+private:
+ void link(TimerNode* node);                   // 按照到期时间把结点放进对应的槽
+ void tick(TimerCallback cb, void* arg);       // 时间前进一个 tick
+
+private:
+ int m_tick_ms;                  // 一个 tick 的毫秒数
+ int m_timerfd;                  // 驱动时间轮的 timerfd
+ unsigned long m_now;            // 当前的时间 (tick)
+ TimerNode m_wheel0[WHEEL0_SIZE]; // 每个槽是一个带哨兵结点的环形双向链表
+ TimerNode m_wheel1[WHEEL1_SIZE];
+};
+
+#endif
@@ -0,0 +1,322 @@
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IoUring::IoUring():
+    m_ring_fd(-1),
+    m_sq_head(NULL), m_sq_tail(NULL), m_sq_mask(NULL), m_sq_array(NULL), m_sqes(NULL),
+    m_sq_local_tail(0), m_sq_entries(0),
+    m_cq_head(NULL), m_cq_tail(NULL), m_cq_mask(NULL), m_cqes(NULL),
+    m_sq_ring(MAP_FAILED), m_cq_ring(MAP_FAILED), m_sq_ring_size(0), m_cq_ring_size(0), m_sqes_size(0),
+    m_buf_ring(NULL), m_buf_ring_size(0), m_buffers(NULL), m_buffer_count(0), m_buffer_size(0), m_buf_tail(0),
+    m_buf_group(0), m_legacy_buffers(false), m_probe(NULL) {
+
+}
+
+IoUring::~IoUring() {
+    if (m_buf_ring) {
+        munmap(m_buf_ring, m_buf_ring_size);
+    }
+    if (m_buffers) {
+        munmap(m_buffers, (size_t)m_buffer_count * m_buffer_size);
+    }
+    if (m_sqes) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if (m_sq_ring != MAP_FAILED) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if (m_ring_fd != -1) {
+        close(m_ring_fd);
+    }
+    free(m_probe);
+}
+
+bool IoUring::init(unsigned entries, unsigned cq_factor) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * cq_factor;
+    m_ring_fd = sys_io_uring_setup(entries, &params);
+    if (m_ring_fd < 0 && errno == EINVAL) {
+        // 较老的内核不支持 COOP_TASKRUN
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * cq_factor;
+        m_ring_fd = sys_io_uring_setup(entries, &params);
+    }
+    if (m_ring_fd < 0) {
+        m_ring_fd = -1;
+        return false;
+    }
+
+    // 映射提交队列, 完成队列和提交项数组, 新的内核中两个队列共享一次映射
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && m_cq_ring_size > m_sq_ring_size) {
+        m_sq_ring_size = m_cq_ring_size;
+    }
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        return false;
+    }
+    if (single_mmap) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ring == MAP_FAILED) {
+            return false;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      m_ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    m_sqes = (struct io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sq_ring;
+    m_sq_head = (unsigned*)(sq + params.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + params.sq_off.array);
+    m_sq_entries = params.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+
+    char* cq = (char*)m_cq_ring;
+    m_cq_head = (unsigned*)(cq + params.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // 查询内核支持的操作
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    m_probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if (m_probe && sys_io_uring_register(m_ring_fd, IORING_REGISTER_PROBE, m_probe, 256) < 0) {
+        free(m_probe);
+        m_probe = NULL;
+    }
+    return true;
+}
+
+bool IoUring::supports(int op) const {
+    if (!m_probe || op > m_probe->last_op) {
+        return false;
+    }
+    return m_probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+}
+
+bool IoUring::set_worker_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sys_io_uring_register(m_ring_fd, IORING_REGISTER_IOWQ_AFF, &set, sizeof(set)) == 0;
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sq_local_tail - head >= m_sq_entries) {
+        // 提交队列满了, 先把已经准备好的交给内核
+        submit(0);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sq_local_tail - head >= m_sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = m_sq_local_tail & *m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    ++m_sq_local_tail;
+    return sqe;
+}
+
+int IoUring::submit(unsigned wait_nr) {
+    unsigned tail = *m_sq_tail;
+    unsigned to_submit = m_sq_local_tail - tail;
+    // release: 内核看到新的 tail 时一定能看到填好的提交项
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int ret = sys_io_uring_enter(m_ring_fd, to_submit, wait_nr, flags);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        return ret < 0 ? -errno : ret;
+    }
+}
+
+struct io_uring_cqe* IoUring::peek_cqe() {
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &m_cqes[head & *m_cq_mask];
+}
+
+void IoUring::cqe_seen() {
+    __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::setup_buffers(int group, unsigned count, unsigned size) {
+    void* buffers = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        return false;
+    }
+    m_buffers = (char*)buffers;
+    m_buffer_count = count;
+    m_buffer_size = size;
+    m_buf_group = group;
+
+    if (register_buffer_ring(count)) {
+        m_buf_tail = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            recycle_buffer(i);
+        }
+        publish_buffers();
+        if (check_buffers()) {
+            return true;
+        }
+        // 有些内核上缓冲区环可以注册但是挑选不到缓冲区, 注销之后改用 IORING_OP_PROVIDE_BUFFERS
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = group;
+        sys_io_uring_register(m_ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(m_buf_ring, m_buf_ring_size);
+        m_buf_ring = NULL;
+    }
+
+    m_legacy_buffers = true;
+    for (unsigned i = 0; i < count; ++i) {
+        recycle_buffer(i);
+    }
+    publish_buffers();
+    return check_buffers();
+}
+
+bool IoUring::register_buffer_ring(unsigned count) {
+    m_buf_ring_size = count * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    m_buf_ring = (struct io_uring_buf_ring*)ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)m_buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = m_buf_group;
+    if (sys_io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(m_buf_ring, m_buf_ring_size);
+        m_buf_ring = NULL;
+        return false;
+    }
+    return true;
+}
+
+// 只在 setup_buffers 中调用, 这时还没有其他操作在进行
+bool IoUring::check_buffers() {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return false;
+    }
+    bool ok = false;
+    struct io_uring_sqe* sqe;
+    if (write(fds[1], "x", 1) == 1 && (sqe = get_sqe()) != NULL) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = m_buf_group;
+        sqe->len = m_buffer_size;
+        sqe->off = (uint64_t)-1;
+        submit(1);
+        // 提供缓冲区的操作失败时也会产生完成项, 跳过它们
+        struct io_uring_cqe* cqe;
+        while ((cqe = peek_cqe()) != NULL) {
+            if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                ok = true;
+            }
+            cqe_seen();
+        }
+        publish_buffers();
+        submit(0);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+void IoUring::recycle_buffer(int bid) {
+    if (m_legacy_buffers) {
+        m_returned.push_back(bid);
+        return;
+    }
+    // 不能用 m_buf_ring->bufs: 内核头文件的柔性数组在 C++ 中前面多了一个空结构体, bufs 的偏移量是 8 而不是 0
+    // 缓冲区环的第一项就从环的起始地址开始 (环的 tail 和第一项的保留字段重叠)
+    struct io_uring_buf* bufs = (struct io_uring_buf*)m_buf_ring;
+    struct io_uring_buf* buf = &bufs[m_buf_tail & (m_buffer_count - 1)];
+    buf->addr = (unsigned long)buffer(bid);
+    buf->len = m_buffer_size;
+    buf->bid = bid;
+    ++m_buf_tail;
+}
+
+void IoUring::publish_buffers() {
+    if (!m_legacy_buffers) {
+        __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+        return;
+    }
+    // 编号连续的缓冲区合并成一个提交项, 成功时不产生完成项
+    size_t i = 0;
+    while (i < m_returned.size()) {
+        size_t j = i + 1;
+        while (j < m_returned.size() && m_returned[j] == m_returned[j - 1] + 1) {
+            ++j;
+        }
+        struct io_uring_sqe* sqe = get_sqe();
+        if (!sqe) {
+            break;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = j - i;
+        sqe->addr = (unsigned long)buffer(m_returned[i]);
+        sqe->len = m_buffer_size;
+        sqe->off = m_returned[i];
+        sqe->buf_group = m_buf_group;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = 0;
+        i = j;
+    }
+    m_returned.erase(m_returned.begin(), m_returned.begin() + i);
+}
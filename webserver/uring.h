@@ -0,0 +1,88 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <vector>
+
+// io_uring 的一个很薄的封装, 直接使用 io_uring_setup / io_uring_enter / io_uring_register 系统调用, 不依赖 liburing
+// 只在创建它的事件循环的线程中使用, 不是线程安全的
+//
+// 提交队列 (SQ) 和完成队列 (CQ) 都是和内核共享的环形缓冲区:
+// 我们写 SQ 的 tail, 内核写 SQ 的 head; 内核写 CQ 的 tail, 我们写 CQ 的 head
+// 对共享位置的读写使用 acquire / release 原子操作
+class IoUring {
+public:
+ IoUring();
+ ~IoUring();
+
+ // 创建 io_uring, entries 是提交队列的大小, 完成队列是它的 cq_factor 倍
+ bool init(unsigned entries, unsigned cq_factor);
+ int fd() const { return m_ring_fd; }
+
+ // 取得一个空闲的提交项, 已经清零; 提交队列满了时先提交已有的再取, 仍然失败返回 NULL
+ struct io_uring_sqe* get_sqe();
+ // 把准备好的提交项交给内核, 并等待至少 wait_nr 个完成项, 返回提交的数量或者 -errno
+ int submit(unsigned wait_nr = 0);
+
+ // 取得下一个完成项, 没有时返回 NULL; 处理完之后调用 cqe_seen()
+ struct io_uring_cqe* peek_cqe();
+ void cqe_seen();
+
+ // 注册一个提供给内核的缓冲区环 (provided buffer ring), count 必须是 2 的幂
+ // 多次接收 (multishot recv) 时内核从这里挑选缓冲区, 用完之后需要用 recycle_buffer 还回来
+ // 缓冲区环不可用时退回到用 IORING_OP_PROVIDE_BUFFERS 提供缓冲区, 对使用者没有区别
+ bool setup_buffers(int group, unsigned count, unsigned size);
+ char* buffer(int bid) const { return m_buffers + (size_t)bid * m_buffer_size; }
+ void recycle_buffer(int bid);   // 放回缓冲区环, 调用 publish_buffers() 之后内核才能看到
+ void publish_buffers();
+
+ // 检查内核是否支持某个操作
+ bool supports(int op) const;
+ // 把内核替这个 io_uring 执行阻塞操作的 io-wq 线程绑定到 cpu 上
+ bool set_worker_cpu(int cpu);
+
+private:
+ int m_ring_fd;
+
+ // 提交队列
+ unsigned* m_sq_head;
+ unsigned* m_sq_tail;
+ unsigned* m_sq_mask;
+ unsigned* m_sq_array;
+ struct io_uring_sqe* m_sqes;
+ unsigned m_sq_local_tail;     // 已经准备好但还没有提交的位置
+ unsigned m_sq_entries;
+
+ // 完成队列
+ unsigned* m_cq_head;
+ unsigned* m_cq_tail;
+ unsigned* m_cq_mask;
+ struct io_uring_cqe* m_cqes;
+
+ void* m_sq_ring;
+ void* m_cq_ring;
+ size_t m_sq_ring_size;
+ size_t m_cq_ring_size;
+ size_t m_sqes_size;
+
+ // 缓冲区环
+ struct io_uring_buf_ring* m_buf_ring;
+ size_t m_buf_ring_size;
+ char* m_buffers;
+ unsigned m_buffer_count;
+ unsigned m_buffer_size;
+ unsigned short m_buf_tail;    // 还没有发布的缓冲区环尾部
+
+ int m_buf_group;
+ bool m_legacy_buffers;        // 使用 IORING_OP_PROVIDE_BUFFERS 而不是缓冲区环
+ std::vector<unsigned short> m_returned; // 等待重新提供给内核的缓冲区
+
+ struct io_uring_probe* m_probe;
+
+ bool register_buffer_ring(unsigned count);
+ bool check_buffers();         // 用一个管道检查内核能否从缓冲区环中挑选缓冲区
+};
+
+#endif
@@ -0,0 +1,698 @@
+#include "uring_reactor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+
+#include "log.h"
+#include "metrics.h"
+
+UringReactor::UringReactor(int id, int port, ConnPool* pool):
+    Reactor(id, port, pool),
+    m_states(NULL),
+    m_eventfd(-1),
+    m_eventfd_value(0),
+    m_accept_armed(false),
+    m_wakeup_pending(false) {
+
+}
+
+UringReactor::~UringReactor() {
+    if (m_states) {
+        for (int i = 0; i < MAX_FD; ++i) {
+            if (m_states[i]) {
+                if (m_states[i]->pipe[0] != -1) {
+                    close(m_states[i]->pipe[0]);
+                    close(m_states[i]->pipe[1]);
+                }
+                delete m_states[i];
+            }
+        }
+        delete[] m_states;
+    }
+    if (m_eventfd != -1) {
+        close(m_eventfd);
+    }
+}
+
+// 多次接收需要 6.0, 缓冲区环和多次接受需要 5.19
+bool UringReactor::supported() {
+    struct utsname name;
+    int major = 0, minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+        return false;
+    }
+
+    IoUring ring;
+    if (!ring.init(8, 2)) {
+        return false;
+    }
+    int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+                  IORING_OP_POLL_ADD, IORING_OP_READ };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+        if (!ring.supports(ops[i])) {
+            return false;
+        }
+    }
+    return ring.setup_buffers(BUFFER_GROUP, 8, BUFFER_SIZE);
+}
+
+bool UringReactor::init(bool reuse_port) {
+    if (!create_listener(reuse_port)) {
+      return false;
+    }
+
+    if (!m_ring.init(RING_ENTRIES, 4)) {
+      perror("io_uring_setup");
+      return false;
+    }
+    if (!m_ring.setup_buffers(BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE)) {
+      perror("IORING_REGISTER_PBUF_RING");
+      return false;
+    }
+
+    // 时间轮的 timerfd 和叫醒事件循环的 eventfd 也通过 io_uring 等待
+    if (m_wheel.init() == -1) {
+      perror("Timerfd");
+      return false;
+    }
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd == -1) {
+      perror("Eventfd");
+      return false;
+    }
+
+    m_states = new ConnState*[MAX_FD]();
+    return true;
+}
+
+struct io_uring_sqe* UringReactor::get_sqe() {
+    struct io_uring_sqe* sqe = m_ring.get_sqe();
+    while (!sqe) {
+        // 提交队列满了并且内核暂时不接受新的提交项, 先等一个完成项
+        m_ring.submit(1);
+        sqe = m_ring.get_sqe();
+    }
+    return sqe;
+}
+
+void UringReactor::arm_accept() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = encode(OP_ACCEPT, 0, 0);
+    m_accept_armed = true;
+}
+
+void UringReactor::arm_recv(int fd) {
+    ConnState* st = m_states[fd];
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = encode(OP_RECV, fd, st->gen);
+    st->recv_armed = true;
+}
+
+void UringReactor::pause_recv(int fd) {
+    ConnState* st = m_states[fd];
+    if (!st->recv_armed || st->recv_paused) {
+        return;
+    }
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = encode(OP_RECV, fd, st->gen);
+    sqe->user_data = 0;
+    st->recv_paused = true;
+}
+
+void UringReactor::resume_recv(int fd) {
+    ConnState* st = m_states[fd];
+    if (!st->recv_armed && !st->closing && st->stash.empty()) {
+        arm_recv(fd);
+    }
+}
+
+int UringReactor::drain_stash(int fd) {
+    ConnState* st = m_states[fd];
+    if (st->stash.empty()) {
+        return 0;
+    }
+    int n = m_users[fd]->append_input(st->stash.data(), st->stash.size());
+    st->stash.erase(0, n);
+    if (st->stash.empty()) {
+        std::string().swap(st->stash);
+    }
+    return n;
+}
+
+void UringReactor::arm_timer() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_wheel.fd();
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = encode(OP_TIMER, 0, 0);
+}
+
+void UringReactor::arm_wakeup() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_eventfd;
+    sqe->addr = (unsigned long)&m_eventfd_value;
+    sqe->len = sizeof(m_eventfd_value);
+    sqe->user_data = encode(OP_WAKEUP, 0, 0);
+}
+
+// 由工作线程调用: 把连接放进交还队列, 事件循环没有被叫醒过时写 eventfd 叫醒它
+void UringReactor::resume(http_conn* conn, int events) {
+    Resumed resumed = { conn, events };
+    m_resumed_locker.lock();
+    m_resumed.push_back(resumed);
+    m_resumed_locker.unlock();
+    if (!m_wakeup_pending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t ret = write(m_eventfd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void UringReactor::run() {
+    pin();
+    arm_accept();
+    arm_timer();
+    arm_wakeup();
+    // io-wq 线程属于提交操作的线程, 这个线程提交过之后才能设置它们绑定的 CPU
+    m_ring.submit(0);
+    if (m_cpu >= 0 && !m_ring.set_worker_cpu(m_cpu)) {
+        LOG_WARN("failed to pin io-wq workers of reactor %d to cpu %d", m_id, m_cpu);
+    }
+
+    while (!m_drained) {
+      // 提交上一轮产生的所有提交项, 同时等待至少一个完成项
+      int ret = m_ring.submit(1);
+      if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+        LOG_ERROR("io_uring_enter failed in reactor %d: %s", m_id, strerror(-ret));
+        break;
+      }
+
+      struct io_uring_cqe* cqe;
+      while ((cqe = m_ring.peek_cqe()) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        m_ring.cqe_seen();
+        handle_cqe(user_data, res, flags);
+      }
+      // 这一轮用完的接收缓冲区一起还给内核
+      m_ring.publish_buffers();
+    }
+}
+
+void UringReactor::handle_cqe(uint64_t user_data, int res, unsigned flags) {
+    int op = user_data & 0xff;
+    int fd = (user_data >> 8) & 0xffffff;
+    uint32_t gen = user_data >> 32;
+    bool more = flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case OP_ACCEPT: {
+            handle_accept(res);
+            if (!more) {
+                // 多次接受因为错误或者暂停接受新连接而结束, 没有暂停时重新提交
+                m_accept_armed = false;
+                if (!m_accept_paused) {
+                    arm_accept();
+                }
+            }
+            break;
+        }
+        case OP_TIMER: {
+            // 时间轮前进, 关闭所有超时的连接
+            m_wheel.advance(on_timeout, this);
+            if (m_deadline.load(std::memory_order_relaxed) != 0) {
+                drain();
+            } else if (m_accept_paused && can_resume_accept()) {
+                resume_accept();
+            }
+            if (!more) {
+                arm_timer();
+            }
+            break;
+        }
+        case OP_WAKEUP: {
+            arm_wakeup();
+            handle_resumed();
+            break;
+        }
+        case OP_RECV: {
+            ConnState* st = m_states[fd];
+            if (!st || !st->open || st->gen != gen) {
+                // 已经关闭的连接上残留的完成项, 只需要归还缓冲区
+                if (flags & IORING_CQE_F_BUFFER) {
+                    m_ring.recycle_buffer(flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                break;
+            }
+            if (!more) {
+                st->recv_armed = false;
+                st->recv_paused = false;
+            }
+            handle_recv(fd, res, flags);
+            break;
+        }
+        case OP_SEND:
+        case OP_SPLICE_IN:
+        case OP_SPLICE_OUT:
+        case OP_POLL_OUT:
+        case OP_POLL_UPSTREAM: {
+            // 有发送在进行时连接不会真正关闭, 代数一定是一致的
+            handle_send(fd, op, res);
+            break;
+        }
+        default:
+            // 重新提供缓冲区失败的完成项和取消操作的完成项, user_data 为 0
+            break;
+    }
+}
+
+void UringReactor::handle_accept(int res) {
+    if (res < 0) {
+      // 暂停或者停止接受新连接时取消了多次接受, 它的最后一个完成项是 ECANCELED
+      if (res != -ECANCELED) {
+        LOG_WARN("accept failed in reactor %d: %s", m_id, strerror(-res));
+      }
+      return;
+    }
+    int conn_fd = res;
+    metric_accepts.add();
+
+    if (conn_fd >= MAX_FD || http_conn::m_user_count >= MAX_FD) {
+      // 目前连接数满了, 告诉客户端服务器正忙, 并且暂停接受新连接
+      metric_accept_rejected.add();
+      http_conn::send_overload(conn_fd);
+      close(conn_fd);
+      pause_accept();
+      return;
+    }
+
+    struct sockaddr_in client_address;
+    socklen_t client_addrlen = sizeof(client_address);
+    memset(&client_address, 0, sizeof(client_address));
+    getpeername(conn_fd, (struct sockaddr*)&client_address, &client_addrlen);
+
+    // 连接的状态在这个 socket 第一次被使用时才创建, 之后一直复用
+    http_conn* conn = conn_object(conn_fd);
+    if (!m_states[conn_fd]) {
+      m_states[conn_fd] = new ConnState;
+    }
+    ConnState* st = m_states[conn_fd];
+    st->open = true;
+    st->closing = false;
+    st->poll_out = false;
+    st->inflight = 0;
+    st->pipe_bytes = 0;
+    st->recv_paused = false;
+
+    conn->init(conn_fd, client_address, this, m_id);
+
+    // 客户端必须在 m_header_timeout 秒之内发送完第一个请求
+    m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+    arm_recv(conn_fd);
+}
+
+void UringReactor::handle_recv(int fd, int res, unsigned flags) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+
+    if (res <= 0) {
+      if (res == -ENOBUFS) {
+        // 缓冲区环暂时用完了, 这一轮的缓冲区归还之后重新提交 (有暂存的数据时等它们追加完)
+        resume_recv(fd);
+        return;
+      }
+      if (res == -ECANCELED) {
+        // pause_recv 取消的多次接收
+        resume_recv(fd);
+        return;
+      }
+      // 对方关闭连接或者出错
+      close_conn(fd);
+      return;
+    }
+
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    const char* data = m_ring.buffer(bid);
+    if (st->closing) {
+      // 等待关闭的连接, 数据直接丢弃
+    } else if (conn->m_busy.load(std::memory_order_acquire) || !st->stash.empty()) {
+      // 工作线程正在解析读缓冲区, 或者之前暂存的数据还没有追加, 数据先放在这里, 之后按顺序追加
+      st->stash.append(data, res);
+      if (st->stash.size() >= (size_t)Buffer::MAX_SIZE) {
+        pause_recv(fd);
+      }
+    } else {
+      bool idle = conn->idle();
+      bool body = conn->receiving_body();
+      int n = conn->append_input(data, res);
+      if (n < res) {
+        // 读缓冲区满了, 剩下的数据等工作线程处理完读缓冲区之后再追加
+        st->stash.assign(data + n, res - n);
+      }
+      if (st->inflight == 0 && !conn->response_pending()) {
+        if (idle) {
+          // 新请求的第一个字节到达, 整个请求必须在 m_header_timeout 秒之内收完
+          m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+        } else if (body) {
+          // 请求体可能很大, 每次有进展就刷新定时器
+          m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+        }
+        dispatch(fd);
+      }
+      // 响应还在发送时收到的数据留在读缓冲区中, 发送完之后再处理
+    }
+    m_ring.recycle_buffer(bid);
+    resume_recv(fd);
+}
+
+// 提交这一批响应中下一段数据的发送: 先是 writev 部分 (sendmsg), 然后是 sendfile 部分 (splice)
+void UringReactor::start_send(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+
+    struct iovec* iov = NULL;
+    int iov_count = conn->send_iov(&iov);
+    int file_fd = -1;
+    off_t offset = 0;
+    off_t len = 0;
+    bool file = st->pipe_bytes == 0 && iov_count == 0 && conn->file_pending(&file_fd, &offset, &len);
+    if (iov_count == 0 && st->pipe_bytes == 0 && !file) {
+        if (conn->relaying()) {
+            relay(fd);
+        } else {
+            send_done(fd);
+        }
+        return;
+    }
+
+    if (st->poll_out) {
+        // 上一次发送返回了 EAGAIN, 先等待 socket 可写, 再执行后面链接的发送
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = encode(OP_POLL_OUT, fd, st->gen);
+        ++st->inflight;
+        st->poll_out = false;
+    }
+
+    if (iov_count > 0) {
+        memset(&st->msg, 0, sizeof(st->msg));
+        st->msg.msg_iov = iov;
+        st->msg.msg_iovlen = iov_count;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)&st->msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = encode(OP_SEND, fd, st->gen);
+        ++st->inflight;
+        return;
+    }
+
+    if (st->pipe[0] == -1) {
+        if (pipe2(st->pipe, O_CLOEXEC) == -1) {
+            st->pipe[0] = st->pipe[1] = -1;
+            close_conn(fd);
+            return;
+        }
+        // 管道越大, 每一轮 splice 搬运的数据越多
+        fcntl(st->pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+    }
+
+    off_t chunk = st->pipe_bytes;
+    if (file) {
+        // 文件 -> 管道, 成功之后才会执行链接在后面的 管道 -> socket
+        int pipe_size = fcntl(st->pipe[1], F_GETPIPE_SZ);
+        chunk = len < pipe_size ? len : pipe_size;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = st->pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = file_fd;
+        sqe->splice_off_in = offset;
+        sqe->len = chunk;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = encode(OP_SPLICE_IN, fd, st->gen);
+        ++st->inflight;
+    }
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = st->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->user_data = encode(OP_SPLICE_OUT, fd, st->gen);
+    ++st->inflight;
+}
+
+void UringReactor::relay(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    int wait = conn->relay();
+    if (wait < 0) {
+        close_conn(fd);
+        return;
+    }
+    if (wait == 0) {
+        send_done(fd);
+        return;
+    }
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    if (wait == EPOLLOUT) {
+        sqe->fd = fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = encode(OP_POLL_OUT, fd, st->gen);
+    } else {
+        sqe->fd = conn->upstream_fd();
+        sqe->poll32_events = POLLIN | POLLRDHUP;
+        sqe->user_data = encode(OP_POLL_UPSTREAM, fd, st->gen);
+    }
+    ++st->inflight;
+}
+
+void UringReactor::handle_send(int fd, int op, int res) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    --st->inflight;
+
+    bool failed = false;
+    if (res == -EAGAIN) {
+        // 发送缓冲区满了, 没有发送任何数据, 下一次发送之前先等待可写
+        st->poll_out = true;
+    } else if (res == -ECANCELED) {
+        // 链接在前面的操作没有完全成功, 这个操作被取消了, 下一轮重新提交
+    } else if (op == OP_POLL_OUT || op == OP_POLL_UPSTREAM) {
+        failed = res < 0;
+    } else if (res <= 0) {
+        // 出错, 或者文件在发送过程中被截断了
+        failed = true;
+    } else if (op == OP_SEND) {
+        conn->consume_sent(res);
+    } else if (op == OP_SPLICE_IN) {
+        conn->consume_file(res);
+        st->pipe_bytes += res;
+    } else {
+        st->pipe_bytes -= res;
+    }
+
+    if (failed && !st->closing) {
+        st->closing = true;
+        shutdown(fd, SHUT_RDWR);
+    }
+    if (st->inflight > 0) {
+        // 还在等待同一批链接的其他操作
+        return;
+    }
+    if (st->closing) {
+        close_conn(fd);
+        return;
+    }
+    if (op != OP_POLL_OUT && res > 0) {
+        // 每次有进展就刷新定时器
+        m_wheel.add(conn->timer(), http_conn::m_idle_timeout * 1000);
+    }
+    start_send(fd);
+}
+
+// 这一批响应发送完毕
+void UringReactor::send_done(int fd) {
+    http_conn* conn = m_users[fd];
+    if (!conn->finish_write()) {
+      close_conn(fd);
+      return;
+    }
+    // 发送期间暂存的数据
+    drain_stash(fd);
+    if (conn->has_pending() || !conn->idle()) {
+      // 读缓冲区中还有流水线请求, 或者发送期间收到了新的请求, 继续交给线程池处理
+      m_wheel.add(conn->timer(), http_conn::m_header_timeout * 1000);
+      dispatch(fd);
+    } else {
+      // 保持连接等待下一个请求
+      m_wheel.add(conn->timer(), conn->keep_alive_timeout() * 1000);
+    }
+    resume_recv(fd);
+}
+
+void UringReactor::handle_resumed() {
+    // 先清除标记再取队列, 之后交还的连接一定会再写一次 eventfd
+    m_wakeup_pending.exchange(false);
+    m_resumed_locker.lock();
+    m_resumed.swap(m_resumed_swap);
+    m_resumed_locker.unlock();
+
+    for (size_t i = 0; i < m_resumed_swap.size(); ++i) {
+      m_resumed_swap[i].conn->m_busy.store(false, std::memory_order_release);
+      resumed(m_resumed_swap[i].conn, m_resumed_swap[i].events);
+    }
+    m_resumed_swap.clear();
+}
+
+void UringReactor::resumed(http_conn* conn, int events) {
+    int fd = conn->sockfd();
+    ConnState* st = m_states[fd];
+    if (st->closing) {
+      close_conn(fd);
+      return;
+    }
+
+    // 工作线程处理期间收到的数据, 或者读缓冲区满了之后暂存的数据
+    bool stashed = !st->stash.empty();
+    if (stashed && drain_stash(fd) == 0 && !(events & EPOLLOUT)) {
+      // 处理完之后读缓冲区仍然放不下任何数据, 请求太大
+      close_conn(fd);
+      return;
+    }
+
+    if (events & EPOLLOUT) {
+      // 响应已经准备好
+      start_send(fd);
+    } else if (stashed) {
+      // 请求还不完整, 但是又收到了新的数据
+      dispatch(fd);
+    } else {
+      // 继续接收请求; shutdown 了 socket 时会马上收到 EOF 并关闭连接
+      resume_recv(fd);
+    }
+}
+
+void UringReactor::dispatch(int fd) {
+    if (m_run_to_completion) {
+      // 快速路径: 在当前线程中处理完就和工作线程交还的连接一样继续, 只是不需要经过 eventfd
+      int events = m_users[fd]->process_inline();
+      if (events != 0) {
+        resumed(m_users[fd], events);
+        return;
+      }
+    }
+
+    // 事件循环处理交还的连接时才清除 m_busy, 在这之前到期的定时器不会关闭这个连接
+    m_users[fd]->m_busy.store(true, std::memory_order_relaxed);
+    if (!m_pool->append(m_users[fd], m_id)) {
+      // 请求队列满了, 回复 503 而不是让连接一直等到超时
+      m_users[fd]->m_busy.store(false, std::memory_order_relaxed);
+      shed(fd);
+    }
+}
+
+// 多次接受没有对应的暂停操作, 只能取消它; 取消之后它的最后一个完成项会把 m_accept_armed 清除
+// 已经在完成队列中的新连接仍然会被正常处理
+void UringReactor::watch_listener(bool enable) {
+    if (enable) {
+        if (!m_accept_armed) {
+            arm_accept();
+        }
+        return;
+    }
+    if (m_accept_armed) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = encode(OP_ACCEPT, 0, 0);
+        sqe->user_data = 0;
+    }
+}
+
+// 关闭连接: 有发送在进行时, 或者连接还在线程池中时, 先 shutdown, 等它们结束之后再关闭
+// shutdown 同时让多次接收马上结束, 否则内核持有的引用会让 close 之后连接仍然打开
+void UringReactor::close_conn(int fd) {
+    ConnState* st = m_states[fd];
+    http_conn* conn = m_users[fd];
+    if (!st || !st->open) {
+      return;
+    }
+    if (st->inflight > 0 || conn->m_busy.load(std::memory_order_acquire)) {
+      if (!st->closing) {
+        st->closing = true;
+        shutdown(fd, SHUT_RDWR);
+        // 等待上游连接的 poll 不会因为客户端的 socket 关闭而结束
+        conn->cancel_relay();
+      }
+      return;
+    }
+
+    m_wheel.del(conn->timer());
+    if (st->recv_armed) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    conn->close_conn();
+
+    // 之后这个 socket 上残留的完成项都会因为代数不一致被丢弃
+    st->open = false;
+    st->recv_armed = false;
+    st->recv_paused = false;
+    st->closing = false;
+    st->poll_out = false;
+    ++st->gen;
+    std::string().swap(st->stash);
+    if (st->pipe[0] != -1) {
+      close(st->pipe[0]);
+      close(st->pipe[1]);
+      st->pipe[0] = st->pipe[1] = -1;
+    }
+    st->pipe_bytes = 0;
+}
+
+bool UringReactor::quiescent(int fd) const {
+    ConnState* st = m_states[fd];
+    return Reactor::quiescent(fd) && !st->closing && st->inflight == 0 && st->stash.empty();
+}
+
+void UringReactor::on_timeout(TimerNode* node, void* arg) {
+    UringReactor *reactor = (UringReactor *)arg;
+    http_conn *conn = (http_conn *)node->data;
+    if (conn->m_busy.load(std::memory_order_acquire)) {
+      // 连接正在被工作线程处理, 稍后再检查
+      reactor->m_wheel.add(node, 1000);
+      return;
+    }
+    // 超时: 请求头太慢, 响应发送停滞, 或者保持连接时空闲太久
+    reactor->close_conn(conn->sockfd());
+}
@@ -0,0 +1,123 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "reactor.h"
+#include "uring.h"
+#include "buffer.h"
+#include "locker.h"
+
+// 基于 io_uring 的事件循环, 和 Reactor 一样拥有自己的监听 socket 和时间轮, 连接的请求仍然交给线程池处理
+//
+// 和 epoll 事件循环的区别:
+// 1. 监听 socket 上只提交一次多次接受 (multishot accept), 每个新连接产生一个完成项
+// 2. 每个连接只提交一次多次接收 (multishot recv), 数据直接写进内核从缓冲区环中挑选的缓冲区,
+//    不需要 epoll_wait -> recv 直到 EAGAIN -> epoll_ctl 重新注册 EPOLLONESHOT 这一串系统调用
+// 3. 响应头和 mmap 的文件体用 sendmsg 发送, sendfile 模式的文件体用 splice (文件 -> 管道 -> socket) 发送
+//    反向代理的响应体由连接自己用非阻塞的 splice 转发, 只用 poll 等待上游或者客户端就绪
+// 4. 一轮中产生的所有提交项在下一次 io_uring_enter 时一起提交, 同时等待新的完成项
+// 工作线程处理完请求之后把连接放进 m_resumed 并通过 eventfd 叫醒事件循环, 由事件循环继续收发
+class UringReactor : public Reactor, public ConnLoop {
+public:
+ static const unsigned RING_ENTRIES = 4096;  // 提交队列的大小, 完成队列是它的 4 倍
+ static const unsigned BUFFER_COUNT = 1024;  // 缓冲区环中的缓冲区数量
+ static const unsigned BUFFER_SIZE = 4096;   // 每个缓冲区的大小
+ static const int BUFFER_GROUP = 0;
+
+ UringReactor(int id, int port, ConnPool* pool);
+ virtual ~UringReactor();
+ virtual bool init(bool reuse_port);
+ virtual void run();
+ virtual void resume(http_conn* conn, int events);  // 由工作线程调用
+
+ // 当前的内核是否支持这个事件循环需要的所有功能 (多次接受, 多次接收, 缓冲区环, splice)
+ static bool supported();
+
+private:
+ // 提交项的类型, 和文件描述符以及连接的代数一起编码在 user_data 中
+ enum OP {
+     OP_ACCEPT = 1,
+     OP_RECV,
+     OP_SEND,
+     OP_SPLICE_IN,   // 文件 -> 管道
+     OP_SPLICE_OUT,  // 管道 -> socket
+     OP_POLL_OUT,    // 发送返回 EAGAIN 之后等待 socket 可写
+     OP_POLL_UPSTREAM, // 等待反向代理的上游连接可读
+     OP_TIMER,
+     OP_WAKEUP
+ };
+
+ // 每个 socket 在这个事件循环中的状态, 以 socket 为下标
+ // 连接关闭之后 gen 加一, 已经提交的操作的完成项带着旧的 gen, 到达时直接丢弃
+ struct ConnState {
+     uint32_t gen;
+     bool open;
+     bool recv_armed;     // 多次接收是否还在进行
+     bool recv_paused;    // 暂存的数据太多, 已经提交了取消多次接收的请求
+     bool closing;        // 等待进行中的发送结束 (或者工作线程交还连接) 之后关闭
+     bool poll_out;       // 下一次发送之前先等待 socket 可写
+     int inflight;        // 进行中的发送和 splice 的数量
+     int pipe[2];         // splice 使用的管道, 第一次需要时创建
+     off_t pipe_bytes;    // 已经进入管道还没有发送到 socket 的字节数
+     struct msghdr msg;   // sendmsg 使用, 必须在操作完成之前保持有效
+     // 连接在线程池中时, 或者读缓冲区放不下时收到的数据, 之后再按顺序追加到连接的读缓冲区
+     // 超过 Buffer::MAX_SIZE 时暂停接收, 上传很大的请求体时内存不会一直增长
+     std::string stash;
+
+     ConnState(): gen(0), open(false), recv_armed(false), recv_paused(false), closing(false), poll_out(false),
+                  inflight(0), pipe_bytes(0) { pipe[0] = pipe[1] = -1; }
+ };
+
+ static uint64_t encode(OP op, int fd, uint32_t gen) {
+     return ((uint64_t)gen << 32) | ((uint64_t)fd << 8) | op;
+ }
+ static void on_timeout(TimerNode* node, void* arg);
+
+ struct io_uring_sqe* get_sqe();
+ void arm_accept();
+ void arm_recv(int fd);
+ void pause_recv(int fd);                 // 取消多次接收, 暂存的数据处理完之后由 resume_recv 重新提交
+ void resume_recv(int fd);                // 没有暂存的数据并且多次接收已经结束时重新提交
+ int drain_stash(int fd);                 // 把暂存的数据尽量追加到读缓冲区, 返回追加的字节数
+ void arm_timer();
+ void arm_wakeup();
+ void start_send(int fd);                 // 提交这一批响应中下一段数据的发送
+ void relay(int fd);                      // 转发反向代理的响应体, 某一端没有就绪时提交 poll 等待
+ void handle_cqe(uint64_t user_data, int res, unsigned flags);
+ void handle_accept(int res);
+ void handle_recv(int fd, int res, unsigned flags);
+ void handle_send(int fd, int op, int res);
+ void handle_resumed();                   // 处理工作线程交还的连接
+ void resumed(http_conn* conn, int events); // 处理完请求的连接: 发送响应或者继续接收, events 和 http_conn::resume 的参数相同
+ void send_done(int fd);                  // 这一批响应发送完毕
+ void dispatch(int fd);                   // 处理读缓冲区中的请求, 快速路径处理不了时交给线程池
+ virtual void close_conn(int fd);
+ virtual bool quiescent(int fd) const;    // 平滑退出时判断连接是否空闲, 还要求没有进行中的发送和暂存的数据
+ // 取消多次接受之后, 它的最后一个完成项到达之前仍然可能有新连接的完成项
+ virtual bool accept_pending() const { return m_accept_armed; }
+ virtual void watch_listener(bool enable); // 取消或者重新提交多次接受
+
+private:
+ IoUring m_ring;
+ ConnState** m_states;           // 第一次使用某个 socket 时才创建它的状态
+ int m_eventfd;                   // 工作线程用来叫醒事件循环
+ uint64_t m_eventfd_value;        // 读 eventfd 的缓冲区
+ bool m_accept_armed;
+
+ // 工作线程交还的连接
+ struct Resumed {
+     http_conn* conn;
+     int events;
+ };
+ std::vector<Resumed> m_resumed;
+ std::vector<Resumed> m_resumed_swap;
+ Locker m_resumed_locker;
+ std::atomic<bool> m_wakeup_pending;  // 已经写过 eventfd, 事件循环还没有处理
+};
+
+#endif
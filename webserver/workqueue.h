@@ -0,0 +1,391 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <list>
+#include <deque>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "locker.h"
+
+// 线程池请求队列的几种实现, 作为 Threadpool 的模版参数使用
+// 每种队列都需要提供下面的接口:
+//   Queue(int thread_number, int max_request)
+//   bool push(T* request, int hint)  请求数量超过 max_request 时返回 false, hint 是提交者 (事件循环) 的编号
+//   T* pop(int worker)               worker 是工作线程的编号, 没有请求时阻塞, 被唤醒但没有取到请求时返回 NULL
+//   int size()                       队列中等待处理的请求数量, 只用于准入控制和统计, 可以是近似值
+//   void wake_all()                  叫醒所有睡眠的工作线程 (线程池停止时使用), 被叫醒的 pop 可以返回 NULL
+
+#define CACHE_LINE_SIZE 64
+
+// 忙等时提示 CPU 当前处于自旋状态, 降低功耗并且让出流水线给同一个核心上的另一个超线程
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// 原来的实现: 互斥锁保护的 std::list, 信号量通知工作线程
+// 每个请求都要分配一个链表结点, 并且所有线程都在同一把锁上竞争
+template <typename T>
+class ListQueue {
+public:
+ ListQueue(int thread_number, int max_request): m_thread_number(thread_number), m_max_requests(max_request) {}
+
+ bool push(T* request, int) {
+     m_queue_locker.lock();
+     if ((int)m_workqueue.size() >= m_max_requests) {
+         m_queue_locker.unlock();
+         return false;
+     }
+
+     m_workqueue.push_back(request);
+     m_queue_locker.unlock();
+     m_queue_stat.post(); // 信号通知有新的请求进去队列
+     return true;
+ }
+
+ T* pop(int) {
+     m_queue_stat.wait(); // sem 表示消息队列中如果没有任务, 就会阻塞在这里, 防止循环空转
+     m_queue_locker.lock();
+     if (m_workqueue.empty()) {
+         m_queue_locker.unlock();
+         return NULL;
+     }
+
+     T* request = m_workqueue.front();
+     m_workqueue.pop_front();
+     m_queue_locker.unlock();
+     return request;
+ }
+
+ int size() {
+     m_queue_locker.lock();
+     int size = (int)m_workqueue.size();
+     m_queue_locker.unlock();
+     return size;
+ }
+
+ void wake_all() {
+     for (int i = 0; i < m_thread_number; ++i) {
+         m_queue_stat.post();
+     }
+ }
+
+private:
+ int m_thread_number;           // 工作线程的数量, wake_all() 叫醒这么多次
+ int m_max_requests;            // 请求队列中最多被允许的等待处理的请求数量
+ std::list<T*> m_workqueue;     // 供所有线程共享的请求队列
+ Locker m_queue_locker;         // 请求队列的互斥锁
+ Sem m_queue_stat;              // 信号量用来判断是否有任务需要处理
+};
+
+// 有界的无锁多生产者多消费者环形队列 (Dmitry Vyukov 的算法)
+// 每个槽位带一个序号, 生产者和消费者各自用 CAS 抢占位置, 入队和出队都不需要加锁, 也不需要分配内存
+// 槽位的数量是 max_request 向上取整到 2 的幂, 但队列中最多只放 max_request 个请求, 超过时 push 直接失败
+// 工作线程取不到请求时先自旋一小段时间, 仍然没有请求才在信号量上睡眠
+template <typename T>
+class RingQueue {
+public:
+ static const int SPIN_COUNT = 128; // 睡眠之前自旋尝试的次数
+
+ RingQueue(int thread_number, int max_request):
+     m_thread_number(thread_number), m_max_requests(max_request), m_enqueue_pos(0), m_dequeue_pos(0), m_sleepers(0) {
+     m_capacity = 2;
+     while (m_capacity < (size_t)max_request) {
+         m_capacity <<= 1;
+     }
+     m_mask = m_capacity - 1;
+     m_cells = new Cell[m_capacity];
+     for (size_t i = 0; i < m_capacity; ++i) {
+         m_cells[i].sequence.store(i, std::memory_order_relaxed);
+     }
+ }
+
+ ~RingQueue() {
+     delete[] m_cells;
+ }
+
+ bool push(T* request, int) {
+     if (!try_push(request)) {
+         return false;
+     }
+     // 和 pop() 中对 m_sleepers 的修改配对, 保证不会丢失唤醒
+     std::atomic_thread_fence(std::memory_order_seq_cst);
+     if (m_sleepers.load(std::memory_order_relaxed) > 0) {
+         m_queue_stat.post();
+     }
+     return true;
+ }
+
+ T* pop(int) {
+     T* request = NULL;
+     for (int i = 0; i < SPIN_COUNT; ++i) {
+         if (try_pop(request)) {
+             return request;
+         }
+         cpu_relax();
+     }
+
+     // 先登记自己将要睡眠, 再检查一次队列, 避免生产者在这两步之间入队却没有唤醒任何人
+     m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+     if (try_pop(request)) {
+         m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+         return request;
+     }
+     m_queue_stat.wait();
+     m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+     if (try_pop(request)) {
+         return request;
+     }
+     return NULL;
+ }
+
+ int size() {
+     // 两个位置不是同时读出的, 出队的位置可能已经超过读到的入队位置
+     size_t dequeue = m_dequeue_pos.load(std::memory_order_relaxed);
+     size_t enqueue = m_enqueue_pos.load(std::memory_order_relaxed);
+     return enqueue > dequeue ? (int)(enqueue - dequeue) : 0;
+ }
+
+ void wake_all() {
+     for (int i = 0; i < m_thread_number; ++i) {
+         m_queue_stat.post();
+     }
+ }
+
+private:
+ struct alignas(CACHE_LINE_SIZE) Cell {
+     std::atomic<size_t> sequence; // 槽位的序号, 用来判断这个槽位当前可以被写还是可以被读
+     T* data;
+ };
+
+ bool try_push(T* request) {
+     size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+     while (true) {
+         Cell* cell = &m_cells[pos & m_mask];
+         size_t seq = cell->sequence.load(std::memory_order_acquire);
+         intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+         if (diff == 0) {
+             // 槽位空闲, 但队列中已经有 max_request 个请求时也算满了
+             if ((intptr_t)(pos - m_dequeue_pos.load(std::memory_order_acquire)) >= m_max_requests) {
+                 return false;
+             }
+             // 尝试占用这个槽位
+             if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                 cell->data = request;
+                 cell->sequence.store(pos + 1, std::memory_order_release);
+                 return true;
+             }
+         } else if (diff < 0) {
+             // 槽位中的请求还没有被取走, 队列满了
+             return false;
+         } else {
+             pos = m_enqueue_pos.load(std::memory_order_relaxed);
+         }
+     }
+ }
+
+ bool try_pop(T*& request) {
+     size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+     while (true) {
+         Cell* cell = &m_cells[pos & m_mask];
+         size_t seq = cell->sequence.load(std::memory_order_acquire);
+         intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+         if (diff == 0) {
+             if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                 request = cell->data;
+                 // 槽位可以被下一轮的生产者使用
+                 cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+                 return true;
+             }
+         } else if (diff < 0) {
+             // 队列为空
+             return false;
+         } else {
+             pos = m_dequeue_pos.load(std::memory_order_relaxed);
+         }
+     }
+ }
+
+private:
+ int m_thread_number;           // 工作线程的数量, wake_all() 叫醒这么多次
+ int m_max_requests;            // 队列中最多等待处理的请求数量
+ Cell* m_cells;                                            // 环形数组, 每个槽位独占一个缓存行
+ size_t m_capacity;                                        // 槽位的数量, 2 的幂
+ size_t m_mask;                                            // m_capacity - 1
+ alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueue_pos; // 生产者的位置
+ alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeue_pos; // 消费者的位置
+ alignas(CACHE_LINE_SIZE) std::atomic<int> m_sleepers;       // 正在信号量上睡眠的工作线程数量
+ Sem m_queue_stat;                                           // 工作线程没有请求可取时在这里睡眠
+};
+
+// 工作窃取队列中每个工作线程的统计信息
+struct WorkerStats {
+    unsigned long executed;  // 取出执行的请求数量 (包括窃取来的)
+    unsigned long stolen;    // 从其他工作线程的队列中窃取的请求数量
+    int depth;               // 当前队列中等待的请求数量
+};
+
+// 工作窃取队列: 每个工作线程拥有一个自己的双端队列
+// 同一个事件循环提交的请求总是放进同一个 (首选的) 工作线程的队列, 让 http_conn 对象尽量留在同一个核心的缓存中
+// 工作线程先从自己队列的头部取请求, 自己的队列空了再从其他线程队列的尾部窃取, 突发的请求不会堆在一个队列上
+// 每个队列有自己的锁, 只有首选它的事件循环和偶尔的窃取者会竞争, 不再有全局的锁
+template <typename T>
+class StealingQueue {
+public:
+ static const int SPIN_COUNT = 64; // 睡眠之前自旋尝试的次数
+
+ StealingQueue(int thread_number, int max_request):
+     m_thread_number(thread_number), m_max_requests(max_request), m_size(0), m_sleepers(0) {
+     m_workers = new Worker[thread_number];
+ }
+
+ ~StealingQueue() {
+     delete[] m_workers;
+ }
+
+ bool push(T* request, int hint) {
+     // 先占用一个名额, 超过 max_request 就放弃, 不需要全局的锁
+     if (m_size.fetch_add(1, std::memory_order_relaxed) >= m_max_requests) {
+         m_size.fetch_sub(1, std::memory_order_relaxed);
+         return false;
+     }
+
+     Worker& worker = m_workers[(hint < 0 ? 0 : hint) % m_thread_number];
+     worker.locker.lock();
+     worker.tasks.push_back(request);
+     worker.depth.store((int)worker.tasks.size(), std::memory_order_relaxed);
+     worker.locker.unlock();
+
+     // 和 pop() 中对 sleeping 的修改配对, 保证不会丢失唤醒
+     std::atomic_thread_fence(std::memory_order_seq_cst);
+     if (worker.sleeping.load(std::memory_order_relaxed)) {
+         worker.stat.post();
+     } else if (m_sleepers.load(std::memory_order_relaxed) > 0) {
+         // 首选的工作线程正在忙, 叫醒一个空闲的线程来窃取
+         wake_one();
+     }
+     return true;
+ }
+
+ T* pop(int id) {
+     Worker& self = m_workers[id];
+     T* request = NULL;
+     for (int i = 0; i < SPIN_COUNT; ++i) {
+         if ((request = take(id)) != NULL) {
+             return request;
+         }
+         cpu_relax();
+     }
+
+     // 先登记自己将要睡眠, 再检查一次所有的队列, 避免丢失唤醒
+     self.sleeping.store(true, std::memory_order_relaxed);
+     m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+     request = take(id);
+     if (!request) {
+         self.stat.wait();
+         request = take(id);
+     }
+     self.sleeping.store(false, std::memory_order_relaxed);
+     m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+     return request;
+ }
+
+ int size() {
+     return m_size.load(std::memory_order_relaxed);
+ }
+
+ void wake_all() {
+     for (int i = 0; i < m_thread_number; ++i) {
+         m_workers[i].stat.post();
+     }
+ }
+
+ WorkerStats stats(int id) const {
+     WorkerStats s;
+     s.executed = m_workers[id].executed.load(std::memory_order_relaxed);
+     s.stolen = m_workers[id].stolen.load(std::memory_order_relaxed);
+     s.depth = m_workers[id].depth.load(std::memory_order_relaxed);
+     return s;
+ }
+
+private:
+ struct alignas(CACHE_LINE_SIZE) Worker {
+     Locker locker;                      // 保护 tasks
+     std::deque<T*> tasks;               // 这个工作线程的请求队列
+     std::atomic<int> depth;             // tasks 的长度, 窃取者不加锁就可以跳过空队列
+     std::atomic<bool> sleeping;         // 工作线程是否在 stat 上睡眠
+     std::atomic<unsigned long> executed;
+     std::atomic<unsigned long> stolen;
+     Sem stat;                           // 工作线程没有请求可取时在这里睡眠
+
+     Worker(): depth(0), sleeping(false), executed(0), stolen(0) {}
+ };
+
+ // 从自己的队列头部取一个请求, 没有的话从其他队列的尾部窃取
+ T* take(int id) {
+     Worker& self = m_workers[id];
+     T* request = pop_from(self, true);
+     if (request) {
+         self.executed.fetch_add(1, std::memory_order_relaxed);
+         return request;
+     }
+
+     for (int i = 1; i < m_thread_number; ++i) {
+         Worker& victim = m_workers[(id + i) % m_thread_number];
+         if (victim.depth.load(std::memory_order_relaxed) == 0) {
+             continue;
+         }
+         request = pop_from(victim, false);
+         if (request) {
+             self.executed.fetch_add(1, std::memory_order_relaxed);
+             self.stolen.fetch_add(1, std::memory_order_relaxed);
+             return request;
+         }
+     }
+     return NULL;
+ }
+
+ T* pop_from(Worker& worker, bool front) {
+     worker.locker.lock();
+     if (worker.tasks.empty()) {
+         worker.locker.unlock();
+         return NULL;
+     }
+     T* request = NULL;
+     if (front) {
+         request = worker.tasks.front();
+         worker.tasks.pop_front();
+     } else {
+         request = worker.tasks.back();
+         worker.tasks.pop_back();
+     }
+     worker.depth.store((int)worker.tasks.size(), std::memory_order_relaxed);
+     worker.locker.unlock();
+     m_size.fetch_sub(1, std::memory_order_relaxed);
+     return request;
+ }
+
+ // 叫醒一个正在睡眠的工作线程
+ void wake_one() {
+     for (int i = 0; i < m_thread_number; ++i) {
+         if (m_workers[i].sleeping.load(std::memory_order_relaxed)) {
+             m_workers[i].stat.post();
+             return;
+         }
+     }
+ }
+
+private:
+ int m_thread_number;                                   // 工作线程的数量, 也就是队列的数量
+ int m_max_requests;                                    // 所有队列中最多等待处理的请求数量
+ Worker* m_workers;                                     // 每个工作线程一个队列
+ alignas(CACHE_LINE_SIZE) std::atomic<int> m_size;      // 所有队列中的请求总数
+ alignas(CACHE_LINE_SIZE) std::atomic<int> m_sleepers;  // 正在睡眠的工作线程数量
+};
+
+#endif